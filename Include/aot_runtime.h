@@ -0,0 +1,113 @@
+#ifndef AOT_RUNTIME_H
+#define AOT_RUNTIME_H
+
+#include <stdint.h>
+
+#include "heap.h"
+#include "output.h"
+
+/*
+ * The runtime that C files from the `aot` tool are linked with (together with
+ * heap.c). It provides the program's main(), which runs the class's main()
+ * as aot_main(), and the integer operations with Java's semantics, which
+ * differ from C's on overflow and out-of-range shifts.
+ *
+ * Arrays are garbage collected. Compiled code keeps its references in the
+ * frames of a shadow stack (see aot_frame_t), which the heap's root scanner
+ * walks, while its ints stay in C variables.
+ */
+
+/** The heap every array of a compiled program is allocated in */
+extern heap_t *aot_heap;
+
+/**
+ * The frame of a running function that has array references: the slots its
+ * references are kept in, which are all roots. Each such function pushes its
+ * frame onto `aot_frames` when it starts and pops it before it returns.
+ */
+typedef struct aot_frame {
+    /** The frame of the function below it on the shadow stack, or NULL */
+    struct aot_frame *caller;
+    /** The frame's reference slots, NULL_REF if they hold no array */
+    int32_t *refs;
+    /** The number of `refs` */
+    uint32_t count;
+} aot_frame_t;
+
+/** The innermost frame of the shadow stack, or NULL */
+extern aot_frame_t *aot_frames;
+
+/**
+ * The compiled class's main() method, defined by the generated file.
+ */
+void aot_main(void);
+
+/**
+ * Reports an instruction MiniJVM doesn't support, when it is reached, and exits.
+ *
+ * @param opcode the instruction's opcode
+ * @param pc the instruction's offset in the method's bytecode
+ * @param method the method's name
+ */
+void __attribute__((noreturn)) aot_unsupported(int opcode, int pc, const char *method);
+
+/**
+ * Allocates an array of `count` zeroed ints, or reports a
+ * NegativeArraySizeException and exits if `count` is negative.
+ */
+int32_t aot_new_array(int32_t count);
+
+/** Gets a pointer to an array's length, which its elements follow */
+static inline int32_t *aot_array(int32_t ref) {
+    return heap_get(aot_heap, ref);
+}
+
+/**
+ * Gets a pointer to an element of an array, or reports an
+ * ArrayIndexOutOfBoundsException and exits if there is no such element.
+ */
+static inline int32_t *aot_element(int32_t ref, int32_t index) {
+    int32_t *array = aot_array(ref);
+    heap_check_index(array, index);
+    return &array[index + 1];
+}
+
+static inline int32_t aot_add(int32_t a, int32_t b) {
+    return (int32_t) ((uint32_t) a + (uint32_t) b);
+}
+
+static inline int32_t aot_sub(int32_t a, int32_t b) {
+    return (int32_t) ((uint32_t) a - (uint32_t) b);
+}
+
+static inline int32_t aot_mul(int32_t a, int32_t b) {
+    return (int32_t) ((uint32_t) a * (uint32_t) b);
+}
+
+static inline int32_t aot_neg(int32_t a) {
+    return (int32_t) -(uint32_t) a;
+}
+
+// INT32_MIN / -1 overflows back to INT32_MIN in Java, and its remainder is 0
+static inline int32_t aot_div(int32_t a, int32_t b) {
+    return b == -1 ? aot_neg(a) : a / b;
+}
+
+static inline int32_t aot_rem(int32_t a, int32_t b) {
+    return b == -1 ? 0 : a % b;
+}
+
+// Java shifts only use the low 5 bits of the shift amount
+static inline int32_t aot_shl(int32_t a, int32_t b) {
+    return (int32_t) ((uint32_t) a << (b & 0x1f));
+}
+
+static inline int32_t aot_shr(int32_t a, int32_t b) {
+    return a >> (b & 0x1f);
+}
+
+static inline int32_t aot_ushr(int32_t a, int32_t b) {
+    return (int32_t) ((uint32_t) a >> (b & 0x1f));
+}
+
+#endif /* AOT_RUNTIME_H */
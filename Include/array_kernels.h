@@ -0,0 +1,66 @@
+#ifndef ARRAY_KERNELS_H
+#define ARRAY_KERNELS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The loops the optimizer replaces with array loop operations (op_fill to
+ * op_mismatch, see optimize.h) run here, over a whole range of elements at
+ * once. Each function takes arrays as heap_get() returns them (the length,
+ * followed by the elements), runs from `index` up to `end` and throws the
+ * same ArrayIndexOutOfBoundsException, at the same index, as the loop it
+ * replaces. It must only be called if `index < end`, since a loop that doesn't
+ * run never dereferences its arrays.
+ *
+ * The elements in bounds are processed by kernels chosen for the host CPU by
+ * array_kernels_init(): AVX2 or SSE2 on x86-64, NEON on AArch64, or plain
+ * loops elsewhere. Every set of kernels gives the same results.
+ */
+
+/**
+ * Chooses the kernels the array loops run with. Until this is called, they run
+ * the plain loops.
+ *
+ * @param simd whether to use the host's vector instructions, if it has any
+ * @return the name of the chosen kernels, e.g. "avx2" or "scalar"
+ */
+const char *array_kernels_init(bool simd);
+
+/**
+ * Runs `for (; index < end; index++) array[index] = value;`.
+ *
+ * @return the index the loop ends with, which is `end`
+ */
+int32_t array_fill(int32_t *array, int32_t index, int32_t end, int32_t value);
+
+/**
+ * Runs `for (; index < end; index++) to[index] = from[index];`.
+ *
+ * @return the index the loop ends with, which is `end`
+ */
+int32_t array_copy(int32_t *to, const int32_t *from, int32_t index, int32_t end);
+
+/**
+ * Runs `for (; index < end; index++) *sum += array[index];`, wrapping on overflow.
+ *
+ * @return the index the loop ends with, which is `end`
+ */
+int32_t array_sum(const int32_t *array, int32_t index, int32_t end, int32_t *sum);
+
+/**
+ * Runs `for (; index < end; index++) { *sum += array[index]; array[index] = *sum; }`,
+ * wrapping on overflow.
+ *
+ * @return the index the loop ends with, which is `end`
+ */
+int32_t array_prefix_sum(int32_t *array, int32_t index, int32_t end, int32_t *sum);
+
+/**
+ * Runs `for (; index < end && a[index] == b[index]; index++) {}`.
+ *
+ * @return the index the loop ends with: the first one the arrays differ at, or `end`
+ */
+int32_t array_mismatch(const int32_t *a, const int32_t *b, int32_t index, int32_t end);
+
+#endif /* ARRAY_KERNELS_H */
@@ -0,0 +1,44 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "minijvm.h"
+
+/*
+ * The batch runner behind `jvm --batch=<job file>`, which runs a list of jobs on a pool
+ * of worker threads. A job runs a class's main(), or one of its static
+ * methods that take and return ints (see jvm_invoke()) and prints what it
+ * returns. A job file has one job per line:
+ *
+ *     tests/Collatz.class
+ *     Foo.class fib(I)I 20
+ *
+ * Blank lines and lines starting with '#' are skipped.
+ *
+ * Each class is loaded once and shared by all the workers. Its JIT counters,
+ * compiled code and memo tables belong to each worker's context (see
+ * minijvm.h), so each worker compiles and memoizes the classes it runs on its
+ * own. Each worker has a context of its own, whose heap is emptied
+ * after every job. The jobs are dealt out to the workers' work-stealing
+ * deques (see deque.h) up front; a worker runs the jobs in its own deque and
+ * then steals from the others, so workers that drew short jobs take over the
+ * rest of the long ones. Each worker prints to a temporary file, and what
+ * each job printed is copied to standard output in the order of the job file
+ * once they have all run, so the output is the same as running the jobs one
+ * after another. Exceptions are still reported on stderr as they are thrown.
+ */
+
+/**
+ * Runs the jobs in a job file.
+ *
+ * @param job_file the path of the job file
+ * @param class_options how to prepare the classes
+ * @param context_options how each worker's context runs the jobs; the output
+ *   file descriptor is ignored
+ * @param workers the number of worker threads
+ * @return the exit status: 0 if every job ran to the end, and 1 if any job, or
+ *   the job file, failed
+ */
+int run_batch(const char *job_file, const jvm_class_options_t *class_options,
+              const jvm_context_options_t *context_options, u4 workers);
+
+#endif /* BATCH_H */
@@ -11,6 +11,8 @@
  */
 
 #include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 /* Integer type aliases used in the JVM documentation.
  * You may use these aliases or the corresponding inttypes.h types. */
@@ -75,6 +77,25 @@ typedef struct {
     char *descriptor;
     /** The method's bytecode (see the comments for `code_t`) */
     code_t code;
+    /** The method's pre-decoded instruction stream (see decode.h) */
+    struct insn *insns;
+    /** The number of instructions in `insns` */
+    u4 insn_count;
+    /** The reference maps of the method's safepoints, sorted by instruction (see refmap.h) */
+    struct refmap *refmaps;
+    /** The number of reference maps in `refmaps` */
+    u4 refmap_count;
+    /**
+     * Why the method failed verification, or NULL if it passed. Its instruction
+     * stream is then a trap that throws a java.lang.VerifyError (see reject_method())
+     */
+    const char *verify_error;
+    /** The offset of the instruction that failed verification */
+    u4 verify_error_pc;
+    /** How hot the method has to get to be compiled, or NULL if it can't be (see jit.h) */
+    struct jit_method *jit;
+    /** The shape of the method's memo tables, or NULL if it isn't memoized (see memo.h) */
+    struct memo_table *memo;
 } method_t;
 
 /**
@@ -113,16 +134,37 @@ typedef struct {
 typedef struct {
     /** The type of constant, which determines how to interpret `info` */
     cp_tag_t tag;
+    /**
+     * The value of an integer constant, stored inline so loading it doesn't
+     * chase a pointer. It fits in the padding before `info`.
+     */
+    CONSTANT_Integer_info integer;
     /**
      * A pointer to the constant's value.
      * `tag` determines what type of value `info` points to.
-     * For example, an integer constant's `info` points to a CONSTANT_Integer_info struct.
+     * For example, an integer constant's `info` points to its own `integer`.
      */
     void *info;
 } cp_info;
 
+/**
+ * A Methodref constant resolved to the method it calls.
+ * These are filled in once when the class is linked, so calling a method
+ * doesn't need to look anything up in the constant pool.
+ */
+typedef struct resolved_method {
+    /** The called method, or NULL if it is not a method of this class */
+    method_t *method;
+    /** The number of (integer) parameters the method takes */
+    u2 num_params;
+    /** The method's `code.max_locals` */
+    u2 max_locals;
+    /** The method's `code.max_stack` */
+    u2 max_stack;
+} resolved_method_t;
+
 /** A class file, consisting of an array of constants and an array of methods */
-typedef struct {
+typedef struct class_file {
     /**
      * The class's array of constants.
      * Note that this array is 0-indexed, but the bytecode refers to 1-indexed constants.
@@ -134,6 +176,27 @@ typedef struct {
      * The array is "null-terminated": `methods[length].name == NULL`.
      */
     method_t *methods;
+    /**
+     * The resolved Methodref constants, indexed by (1-indexed) constant pool index.
+     * Entries for constants that aren't Methodrefs are zeroed.
+     */
+    resolved_method_t *resolved_methods;
+    /**
+     * The contents of the class file. The Utf8 constants and the methods'
+     * bytecode point into it rather than being copied out.
+     */
+    u1 *image;
+    /** The number of bytes in `image` */
+    size_t image_size;
+    /** Whether `image` is a mapping of the file, rather than a copy read into memory */
+    bool image_mapped;
+    /**
+     * The memory everything else belonging to the class is allocated from,
+     * including this structure (see class_alloc())
+     */
+    struct class_arena *arena;
+    /** A number no other class loaded by the process has, set by jvm_load_class() */
+    uint64_t id;
 } class_file_t;
 
 #endif /* CLASS_FILE_H */
@@ -0,0 +1,65 @@
+#ifndef CLASS_STATE_H
+#define CLASS_STATE_H
+
+#include "class_file.h"
+#include "decode.h"
+#include "jit.h"
+#include "memo.h"
+
+/*
+ * What running a class changes, which is kept out of the class so that a
+ * loaded class is never written to and any number of threads can share it.
+ * Every context (see minijvm.h) has a state for each class it runs, which it
+ * keeps across its runs: for each method, the JIT's counters and native code
+ * and the entries of its memo table. A method the JIT can compile also gets a
+ * copy of its instruction stream, so tiering up can thread the compiled
+ * instructions to the native code without touching the class's stream; every
+ * frame of the method in the context runs the copy. A context's heaps all have
+ * the same encoding of references, so each method is compiled at most once.
+ */
+
+/** A method's part of a class state */
+typedef struct method_state {
+    /** The instruction stream the method runs: the class's, or the state's own copy */
+    insn_t *insns;
+    /** The JIT's counters and code, or NULL if the method can't be compiled */
+    jit_state_t *jit;
+    /** The entries of the method's memo table, or NULL if it isn't memoized */
+    memo_entry_t *memo;
+} method_state_t;
+
+/** The state of a class in one context */
+typedef struct class_state {
+    class_file_t *class;
+    /** The class's `id`, so a state is never mistaken for that of a later class at the
+        same address */
+    uint64_t class_id;
+    /** One for each of the class's methods, in the same order */
+    method_state_t *methods;
+    u4 method_count;
+    /** The next state in the context's list */
+    struct class_state *next;
+} class_state_t;
+
+/**
+ * Creates a class's state for a context, with none of its methods compiled and
+ * empty memo tables.
+ *
+ * @param class a class loaded with jvm_load_class()
+ * @return the state, allocated on the heap
+ */
+class_state_t *class_state_create(class_file_t *class);
+
+/**
+ * Releases a state and the native code compiled in it, which must not be run
+ * afterward. The class needn't be loaded any more.
+ */
+void class_state_free(class_state_t *state);
+
+/**
+ * Finds a class's state in a list of states, creating it at the head of the
+ * list if the class has none.
+ */
+class_state_t *class_state_find(class_state_t **states, class_file_t *class);
+
+#endif /* CLASS_STATE_H */
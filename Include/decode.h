@@ -0,0 +1,403 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdbool.h>
+
+#include "class_file.h"
+
+/**
+ * Operations of the pre-decoded instruction stream.
+ * Several JVM instructions decode to the same operation with their operands
+ * widened into the instruction, e.g. iconst_2, bipush, sipush and ldc all
+ * become op_iconst, and iload_1 becomes op_iload with local index 1.
+ * getstatic and nop have no effect in MiniJVM, so they are not decoded at all.
+ */
+typedef enum {
+    /** An instruction MiniJVM can't run; `a` is the JVM opcode */
+    op_unsupported,
+    /** Push the constant `a` */
+    op_iconst,
+    /** Push local `a` */
+    op_iload,
+    /** Push local `a`, which holds a reference */
+    op_aload,
+    /** Pop into local `a` */
+    op_istore,
+    /** Pop a reference into local `a` */
+    op_astore,
+    op_iaload,
+    op_iastore,
+    op_dup,
+    op_iadd,
+    op_isub,
+    op_imul,
+    op_idiv,
+    op_irem,
+    op_ineg,
+    op_ishl,
+    op_ishr,
+    op_iushr,
+    op_iand,
+    op_ior,
+    op_ixor,
+    /** Add the constant `b` to local `a` */
+    op_iinc,
+    /* Conditional branches to instruction `a` */
+    op_ifeq,
+    op_ifne,
+    op_iflt,
+    op_ifge,
+    op_ifgt,
+    op_ifle,
+    op_if_icmpeq,
+    op_if_icmpne,
+    op_if_icmplt,
+    op_if_icmpge,
+    op_if_icmpgt,
+    op_if_icmple,
+    /** Jump to instruction `a` */
+    op_goto,
+    /** Pop a key and jump to its case in the dense `table` (see switch_table_t) */
+    op_tableswitch,
+    /** Pop a key and jump to its case in the sorted `table` */
+    op_lookupswitch,
+    op_ireturn,
+    op_areturn,
+    op_return,
+    /** System.out.println(int), the only virtual method MiniJVM supports */
+    op_print,
+    /** Call `callee`; `a` is the index of its Methodref constant */
+    op_invokestatic,
+    /** An op_invokestatic of a memoized method (see memo.h) */
+    op_invokestatic_memo,
+    op_newarray,
+    op_arraylength,
+    /*
+     * Superinstructions, which fuse.h substitutes for common sequences.
+     * Each one replaces the first instruction of its sequence and skips the
+     * rest, which stay in the stream. The name lists the fused operations.
+     */
+    /** Branch to instruction `c` if local `a` compares to local `b` */
+    op_iload_iload_if_icmpeq,
+    op_iload_iload_if_icmpne,
+    op_iload_iload_if_icmplt,
+    op_iload_iload_if_icmpge,
+    op_iload_iload_if_icmpgt,
+    op_iload_iload_if_icmple,
+    /** Branch to instruction `c` if local `a` >= the length of local `b`'s array */
+    op_iload_aload_arraylength_if_icmpge,
+    /** Add the constant `b` to local `a` and jump to instruction `c` */
+    op_iinc_goto,
+    /** Store local `a` plus the constant `b` in local `c` */
+    op_iload_iconst_iadd_istore,
+    /** Push element local `b` of local `a`'s array */
+    op_aload_iload_iaload,
+    /** Push the length of local `a`'s array */
+    op_aload_arraylength,
+    /*
+     * Register operations, which optimize.h translates methods into. They name
+     * the frame's slots as registers: local `n` is register `n`, and operand
+     * stack slot `d` is register `max_locals + FRAME_GAP_SLOTS + d`. Unless
+     * noted, `a` is the destination register, `b` the first source register,
+     * and `c` the second source register, or a constant for the _const forms.
+     * op_iinc and op_goto work the same way in both forms.
+     */
+    op_move,
+    /** Store the constant `b` in register `a` */
+    op_move_const,
+    op_add,
+    op_add_const,
+    op_sub,
+    /** Store the constant `c` minus register `b` in register `a` */
+    op_sub_from_const,
+    op_mul,
+    op_mul_const,
+    op_div,
+    op_rem,
+    /** Divide register `b` by 2 to the power of `c`, rounding toward zero */
+    op_div_pow2,
+    /** Store the remainder of dividing register `b` by 2 to the power of `c` */
+    op_rem_pow2,
+    /**
+     * Divide by the constant `c` using the magic number `b` and the shift and
+     * flags in `aux` (see magic_divide()). `a` packs the destination register
+     * into its low 16 bits and the source register into its high 16 bits.
+     */
+    op_div_magic,
+    /** Store the remainder of a division like op_div_magic's */
+    op_rem_magic,
+    op_neg,
+    op_and,
+    op_and_const,
+    op_or,
+    op_or_const,
+    op_xor,
+    op_xor_const,
+    op_shl,
+    op_shl_const,
+    op_shr,
+    op_shr_const,
+    op_ushr,
+    op_ushr_const,
+    /**
+     * Load element register `c` of register `b`'s array, throwing an
+     * ArrayIndexOutOfBoundsException if there is no such element
+     */
+    op_load_element,
+    /** Store register `c` into element register `b` of register `a`'s array, or throw */
+    op_store_element,
+    /* The same, for accesses the optimizer proved are in bounds */
+    op_load_element_unchecked,
+    op_store_element_unchecked,
+    /** Load the length of register `b`'s array */
+    op_array_length,
+    /** Allocate an array of register `b` elements */
+    op_new_array,
+    /*
+     * Array loops (see optimize.h), which run `for (; i < n; i++)` over a whole
+     * range of elements at once (see array_kernels.h). `a` packs register `i`
+     * into its low 16 bits and register `x` into its high 16 bits, `b` is
+     * register `y`, and `c` is register `n`, or with ARRAY_LOOP_CONSTANT_BOUND
+     * in `aux` the constant `n`.
+     */
+    /** `x[i] = y` */
+    op_fill,
+    /** `x[i] = y[i]` */
+    op_copy,
+    /** `x += y[i]` */
+    op_sum,
+    /** `x += y[i]; y[i] = x` */
+    op_prefix_sum,
+    /** Stop at the first `i` with `x[i] != y[i]` */
+    op_mismatch,
+    /* Conditional branches to instruction `a` comparing register `b` to register `c` */
+    op_br_eq,
+    op_br_ne,
+    op_br_lt,
+    op_br_ge,
+    op_br_gt,
+    op_br_le,
+    /* Conditional branches to instruction `a` comparing register `b` to the constant `c` */
+    op_br_eq_const,
+    op_br_ne_const,
+    op_br_lt_const,
+    op_br_ge_const,
+    op_br_gt_const,
+    op_br_le_const,
+    /* Jumps to the case of register `a` in `table`, like op_tableswitch and op_lookupswitch */
+    op_br_table,
+    op_br_lookup,
+    /** Return register `a` */
+    op_return_value,
+    /** Print register `a` */
+    op_print_value,
+    /**
+     * Call `callee` with the arguments in the registers from `a` on.
+     * A returned value replaces them, in register `a`.
+     */
+    op_call,
+    /** An op_call of a memoized method (see memo.h) */
+    op_call_memo,
+    NUM_OPS
+} op_t;
+
+/** The name of each operation, e.g. "iload" for op_iload */
+extern const char *const OP_NAMES[NUM_OPS];
+
+/**
+ * The cases of a tableswitch or lookupswitch. A tableswitch's keys are the
+ * consecutive ints from `low` on, so a key's case is found by subtracting
+ * `low`, and a lookupswitch's are in `keys`, sorted, so it is found by binary
+ * search. A lookupswitch whose keys are dense enough is decoded as a
+ * tableswitch whose missing keys go to the default.
+ */
+typedef struct switch_table {
+    /** The number of cases */
+    u4 count;
+    /** The key of a tableswitch's first case */
+    int32_t low;
+    /** The keys of a lookupswitch's cases, in increasing order, or NULL for a tableswitch */
+    int32_t *keys;
+    /** The instruction each case jumps to, followed by the default's */
+    int32_t *targets;
+} switch_table_t;
+
+/** A pre-decoded instruction */
+typedef struct insn {
+    /**
+     * The address of the interpreter code that runs this instruction.
+     * This is filled in by the interpreter (see thread_class()).
+     */
+    const void *handler;
+    /** The operation to perform (an op_t) */
+    u1 op;
+    /** A small extra operand, as described for each op_t */
+    u1 aux;
+    /** The bytecode offset the instruction was decoded from */
+    u2 pc;
+    /**
+     * The operands, as described for each op_t.
+     * Branch targets are indices into the method's instruction stream.
+     */
+    int32_t a;
+    union {
+        struct {
+            int32_t b;
+            int32_t c;
+        };
+        /** The resolved call target of an op_invokestatic */
+        const resolved_method_t *callee;
+        /** The cases of a switch, which belong to the class */
+        switch_table_t *table;
+    };
+} insn_t;
+
+/**
+ * Gets whether an operation is a conditional branch to instruction `a`.
+ */
+static inline bool op_is_branch(u2 op) {
+    return (op_ifeq <= op && op <= op_if_icmple) || (op_br_eq <= op && op <= op_br_le_const);
+}
+
+/**
+ * Gets whether an operation jumps to one of the cases in its `table`.
+ */
+static inline bool op_is_switch(u2 op) {
+    return op == op_tableswitch || op == op_lookupswitch || op == op_br_table ||
+           op == op_br_lookup;
+}
+
+/**
+ * Gets whether control can fall through from a stack operation to the next instruction.
+ */
+static inline bool op_falls_through(u2 op) {
+    return op != op_goto && op != op_ireturn && op != op_areturn && op != op_return &&
+           op != op_unsupported && !op_is_switch(op);
+}
+
+/**
+ * Gets the number of instructions a branch, goto or switch can jump to,
+ * besides falling through to the next one. Superinstructions don't count.
+ */
+static inline u4 insn_target_count(const insn_t *insn) {
+    if (op_is_switch(insn->op)) {
+        return insn->table->count + 1;
+    }
+    return op_is_branch(insn->op) || insn->op == op_goto;
+}
+
+/**
+ * Gets one of the instructions a branch, goto or switch can jump to.
+ *
+ * @param insn the instruction
+ * @param i which target, less than insn_target_count()
+ */
+static inline u4 insn_target(const insn_t *insn, u4 i) {
+    return op_is_switch(insn->op) ? insn->table->targets[i] : insn->a;
+}
+
+/**
+ * Finds the case a key selects in a tableswitch's table.
+ *
+ * @return the index of the case's target, which is the default's if no case matches
+ */
+static inline u4 tableswitch_case(const switch_table_t *table, int32_t key) {
+    // Keys below `low` wrap around to large indices
+    uint32_t index = (uint32_t) key - (uint32_t) table->low;
+    return index < table->count ? index : table->count;
+}
+
+/**
+ * Finds the case a key selects in a lookupswitch's table, by binary search.
+ *
+ * @return the index of the case's target, which is the default's if no case matches
+ */
+static inline u4 lookupswitch_case(const switch_table_t *table, int32_t key) {
+    u4 low = 0;
+    u4 high = table->count;
+    while (low < high) {
+        u4 mid = low + (high - low) / 2;
+        if (table->keys[mid] < key) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low < table->count && table->keys[low] == key ? low : table->count;
+}
+
+/**
+ * Finds the instruction a switch jumps to for a key.
+ */
+static inline u4 switch_target(const switch_table_t *table, int32_t key) {
+    u4 index =
+        table->keys == NULL ? tableswitch_case(table, key) : lookupswitch_case(table, key);
+    return table->targets[index];
+}
+
+/**
+ * Gets how a stack instruction changes the operand stack.
+ *
+ * @param insn the instruction
+ * @param pops set to the number of values the instruction pops
+ * @param pushes set to the number of values it pushes after popping
+ */
+void stack_effect(const insn_t *insn, u4 *pops, u4 *pushes);
+
+/**
+ * Computes the operand stack depth before each instruction of a verified
+ * stream of stack instructions.
+ *
+ * @param insns the instructions
+ * @param count the number of instructions
+ * @return the depths, with -1 for unreachable instructions, allocated with malloc()
+ */
+int32_t *compute_depths(const insn_t *insns, u4 count);
+
+/**
+ * Reports that a method failed verification, as a java.lang.VerifyError, and
+ * ends the program (see exception_exit()).
+ *
+ * @param method the method
+ * @param pc the offset of the offending instruction in the method's bytecode
+ * @param message what is wrong with it
+ */
+void __attribute__((noreturn)) verify_error(const method_t *method, u4 pc,
+                                            const char *message);
+
+/**
+ * Records that a method failed verification, and replaces its instruction
+ * stream with an op_unsupported trap that reports the error with
+ * verify_error() when the method is invoked. Methods are verified when they
+ * are loaded (by decode_method() and compute_refmaps()), so nothing checks the
+ * bytecode while it runs, but as in the JVM, a method that fails only throws
+ * a VerifyError if the program calls it.
+ *
+ * @param method the method
+ * @param class the class file the method belongs to, which owns the trap
+ * @param pc the offset of the offending instruction in the method's bytecode
+ * @param message what is wrong with it
+ */
+void reject_method(method_t *method, const class_file_t *class, u4 pc, const char *message);
+
+/**
+ * Translates a method's bytecode into its pre-decoded instruction stream
+ * (`method->insns`). Decoding stops at the first instruction MiniJVM doesn't
+ * support, which becomes an op_unsupported that aborts when it is executed.
+ * Every branch has to target the start of an instruction in the method, or
+ * the method fails verification (see reject_method()).
+ *
+ * @param method the method to decode
+ * @param class the class file the method belongs to
+ */
+void decode_method(method_t *method, const class_file_t *class);
+
+/**
+ * Decodes every method of a class file.
+ *
+ * @param class the parsed class file
+ */
+void decode_class(class_file_t *class);
+
+#endif /* DECODE_H */
@@ -0,0 +1,64 @@
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A lock-free work-stealing deque (Chase and Lev's). Its owner pushes and
+ * pops items at the bottom, like a stack, and any other thread can steal the
+ * oldest item from the top. The owner only synchronizes with thieves when
+ * they compete for the last item, so it pays almost nothing when nobody steals.
+ * The deque holds a fixed number of items.
+ */
+typedef struct work_deque {
+    /** The index of the oldest item, which thieves take */
+    _Atomic int64_t top;
+    /** The index after the newest item, which only the owner moves */
+    _Atomic int64_t bottom;
+    /** The capacity minus 1, to mask indices with; the capacity is a power of two */
+    int64_t mask;
+    /** The ring buffer of items */
+    _Atomic(void *) *items;
+} work_deque_t;
+
+/**
+ * Creates an empty deque.
+ *
+ * @param deque the deque to initialize
+ * @param capacity the most items it can hold at once
+ */
+void deque_init(work_deque_t *deque, size_t capacity);
+
+/**
+ * Frees a deque's items buffer. No thread may use the deque afterward.
+ */
+void deque_free(work_deque_t *deque);
+
+/**
+ * Adds an item at the bottom of a deque. Only the owner may push.
+ *
+ * @param item the item, which must not be NULL
+ * @return false if the deque is full
+ */
+bool deque_push(work_deque_t *deque, void *item);
+
+/**
+ * Takes the newest item from the bottom of a deque. Only the owner may pop.
+ *
+ * @return the item, or NULL if the deque is empty
+ */
+void *deque_pop(work_deque_t *deque);
+
+/**
+ * Takes the oldest item from the top of another thread's deque.
+ *
+ * @param contended set to whether the steal lost a race with another thread
+ *   for an item, in which case the deque may not be empty and it is worth trying again
+ * @return the item, or NULL if there is none or the race was lost
+ */
+void *deque_steal(work_deque_t *deque, bool *contended);
+
+#endif /* DEQUE_H */
@@ -0,0 +1,29 @@
+#ifndef EXCEPTION_H
+#define EXCEPTION_H
+
+#include <setjmp.h>
+
+/*
+ * Java exceptions end the program that throws them. The code that throws one
+ * reports it on stderr, after output_flush() so the output stays in order,
+ * and then calls exception_exit(). That exits the process, unless the thread
+ * has an exception target: an embedder that runs many programs in one process
+ * (see minijvm.h) sets one around each run, and the exception jumps back to
+ * it instead, leaving the process and any other runs going.
+ */
+
+/**
+ * Ends the program after a Java exception has been reported: jumps to the
+ * thread's exception target with longjmp(), or exits with status 1 if it has none.
+ */
+void __attribute__((noreturn)) exception_exit(void);
+
+/**
+ * Sets where exception_exit() jumps to on this thread.
+ *
+ * @param target the target, filled in by setjmp(), or NULL to exit instead
+ * @return the previous target, to restore once the run is over
+ */
+jmp_buf *exception_set_target(jmp_buf *target);
+
+#endif /* EXCEPTION_H */
@@ -0,0 +1,30 @@
+#ifndef FUSE_H
+#define FUSE_H
+
+#include "class_file.h"
+
+/**
+ * Replaces common sequences of instructions in a method's decoded stream with
+ * superinstructions (see op_t), which do the work of the whole sequence in
+ * one dispatch and keep their operands in locals instead of on the operand
+ * stack. A sequence is only fused if no branch lands inside it.
+ *
+ * The stream keeps its length and every instruction keeps its index: a
+ * superinstruction overwrites the first instruction of its sequence, and
+ * skips over the others when it runs. So branch targets, return addresses
+ * and reference maps stay valid. That also means this must run after
+ * compute_refmaps(), which doesn't understand superinstructions, and before
+ * thread_class().
+ *
+ * @param method the decoded method
+ */
+void fuse_method(method_t *method);
+
+/**
+ * Fuses the instruction streams of every method of a decoded class.
+ *
+ * @param class the decoded class file
+ */
+void fuse_class(class_file_t *class);
+
+#endif /* FUSE_H */
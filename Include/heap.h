@@ -2,12 +2,72 @@
 #define HEAP_H
 
 #include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 /**
- * Represents the array of pointers to heap-allocated int32_t arrays.
+ * Represents the table of pointers to heap-allocated int32_t arrays.
  */
 typedef struct heap heap_t;
 
+/**
+ * The start of every heap_t: what heap_get() needs to turn a reference into a
+ * pointer, which it reads inline.
+ */
+typedef struct {
+    /** The array each handle refers to, indexed by handle */
+    int32_t **ptr;
+    /**
+     * With compressed references, the address each reference is an offset
+     * from, in units of HEAP_REF_SCALE bytes; NULL if references are handles
+     */
+    char *base;
+} heap_refs_t;
+
+/** The number of bytes a compressed reference counts in */
+#define HEAP_REF_SCALE 8
+
+/**
+ * Marks the references the program can still reach by calling heap_mark() on
+ * each of them. The heap calls this at the start of every garbage collection.
+ *
+ * @param context The context passed to heap_set_root_scanner().
+ * @param heap The heap being collected.
+ */
+typedef void (*heap_root_scanner_t)(void *context, heap_t *heap);
+
+/** Statistics about a heap's allocations and garbage collections */
+typedef struct {
+    /** The number of major (whole-heap) garbage collections run */
+    uint64_t collections;
+    /** The number of minor (nursery) garbage collections run */
+    uint64_t minor_collections;
+    /** The total time spent collecting, in nanoseconds */
+    uint64_t gc_nanoseconds;
+    /** The number of arrays allocated */
+    uint64_t arrays_allocated;
+    /** The number of bytes allocated for array bodies */
+    uint64_t bytes_allocated;
+    /** The number of arrays the collector freed */
+    uint64_t arrays_freed;
+    /** The number of bytes the collector freed */
+    uint64_t bytes_freed;
+    /** The number of arrays moved from the nursery to the old space */
+    uint64_t arrays_promoted;
+    /** The number of bytes of arrays moved from the nursery to the old space */
+    uint64_t bytes_promoted;
+    /** The number of bytes of array bodies currently allocated */
+    size_t used_bytes;
+    /** The largest `used_bytes` has been */
+    size_t peak_bytes;
+} heap_stats_t;
+
+/** The default limit on the bytes of array bodies a heap holds (256 MiB) */
+#define DEFAULT_HEAP_LIMIT ((size_t) 256 << 20)
+
+/** The reference that refers to no array; heap_add() and heap_new_array() never return it */
+#define NULL_REF 0
+
 /**
  * Initializes a heap. The capacity of this heap is initially zero.
  */
@@ -22,13 +82,128 @@ heap_t *heap_init();
  */
 int32_t heap_add(heap_t *heap, int32_t *ptr);
 
+/**
+ * Allocate a zeroed int32_t array on the heap and get a reference to it.
+ * Element 0 of the array holds its length, followed by the `count` elements.
+ * This is much cheaper than allocating the array yourself and calling heap_add(),
+ * since small arrays are carved out of a shared arena.
+ *
+ * @param count The number of elements, which must not be negative.
+ * @returns A "reference" to the new array.
+ */
+int32_t heap_new_array(heap_t *heap, int32_t count);
+
+/**
+ * Makes the heap hand out compressed references: instead of an index into the
+ * handle table, each reference is the offset of its array from the base of a
+ * single reserved arena, divided by HEAP_REF_SCALE, so heap_get() is an add.
+ * The arena is reserved for twice the heap limit (at most 16 GiB), so the limit
+ * must be set first, and no arrays may have been allocated yet.
+ * Arrays never move with compressed references, so there is no nursery and
+ * every collection is a major one.
+ *
+ * @return false if the arena couldn't be reserved, leaving references as handles
+ */
+bool heap_compress_refs(heap_t *heap);
+
+/**
+ * Gets whether the heap hands out compressed references (see heap_compress_refs()).
+ */
+bool heap_compressed_refs(const heap_t *heap);
+
 /**
  * Retrieve a pointer from the heap.
  *
  * @param ref A "reference".
  * @returns A pointer to an int32_t array from the heap.
  */
-int32_t *heap_get(heap_t *heap, int32_t ref);
+static inline int32_t *heap_get(heap_t *heap, int32_t ref) {
+    const heap_refs_t *refs = (const heap_refs_t *) heap;
+    if (refs->base != NULL) {
+        return (int32_t *) (refs->base + (size_t) (uint32_t) ref * HEAP_REF_SCALE);
+    }
+    return refs->ptr[ref];
+}
+
+/**
+ * Gets what code that looks up references without calling heap_get() needs:
+ * the handle table, which maps each reference to the pointer heap_get()
+ * returns, or with compressed references, the base they are offsets from.
+ * It is only valid until the next allocation.
+ */
+const void *heap_ref_base(const heap_t *heap);
+
+/**
+ * Reports a java.lang.ArrayIndexOutOfBoundsException and ends the program
+ * (see exception_exit()).
+ *
+ * @param index The index that was accessed.
+ * @param length The length of the array.
+ */
+void __attribute__((noreturn)) heap_index_out_of_bounds(int32_t index, int32_t length);
+
+/**
+ * Checks that an index is in bounds of an array from heap_get() (whose
+ * element 0 is its length), throwing an ArrayIndexOutOfBoundsException if it isn't.
+ * Comparing the index as unsigned catches negative indices too.
+ */
+static inline void heap_check_index(const int32_t *array, int32_t index) {
+    if ((uint32_t) index >= (uint32_t) array[0]) {
+        heap_index_out_of_bounds(index, array[0]);
+    }
+}
+
+/**
+ * Enables garbage collection by telling the heap how to find its roots.
+ * Without a root scanner, the heap never frees or moves anything before
+ * heap_free(). With one, small arrays are allocated in a nursery (unless
+ * references are compressed) and may move during a collection, so pointers
+ * from heap_get() are only valid until the next allocation.
+ *
+ * @param scanner The function that marks the reachable references.
+ * @param context The value to pass to `scanner`.
+ */
+void heap_set_root_scanner(heap_t *heap, heap_root_scanner_t scanner, void *context);
+
+/**
+ * Sets the maximum number of bytes of array bodies the heap may hold.
+ * An allocation that doesn't fit even after a garbage collection reports an
+ * OutOfMemoryError. Collections run before the heap reaches the limit,
+ * whenever its size has doubled since the previous collection.
+ *
+ * @param limit The limit in bytes.
+ */
+void heap_set_limit(heap_t *heap, size_t limit);
+
+/**
+ * Marks a reference as reachable during a garbage collection.
+ * Values that aren't references to live arrays (like NULL_REF) are ignored.
+ *
+ * @param ref A "reference" found by the root scanner.
+ */
+void heap_mark(heap_t *heap, int32_t ref);
+
+/**
+ * Runs a mark-sweep garbage collection, freeing every array allocated by
+ * heap_new_array() that the root scanner doesn't mark, and moving the
+ * surviving arrays in the nursery to the old space.
+ * Arrays added with heap_add() are never collected.
+ * Does nothing if no root scanner is set.
+ */
+void heap_collect(heap_t *heap);
+
+/**
+ * Runs a minor garbage collection, which only collects the nursery: the
+ * arrays in it that the root scanner marks are copied to the old space,
+ * and the nursery is emptied. Runs automatically when the nursery fills up.
+ * Does nothing if no root scanner is set.
+ */
+void heap_collect_minor(heap_t *heap);
+
+/**
+ * Gets the heap's allocation and garbage collection statistics.
+ */
+heap_stats_t heap_get_stats(const heap_t *heap);
 
 /**
  * Frees elements of the heap-allocated int32_t arrays.
@@ -0,0 +1,79 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "class_file.h"
+
+/*
+ * A cache of class images: classes as they come out of decoding, verification,
+ * inlining, optimization and fusion, saved so a later run can map them instead
+ * of repeating all of that. An image holds the class's constants, methods,
+ * resolved call sites, reference maps, switch tables and instruction streams,
+ * along with a copy of the class file their strings and bytecode point into.
+ * Its pointers are stored as offsets from the start of the image, and the
+ * image lists where they are, so loading it is mapping the file and adding
+ * the address it was mapped at to each of them.
+ *
+ * Images are named after their key: the hash of the class file's contents and
+ * the options the class was prepared with. An image is only used if its header
+ * matches the key and the layout of this build (the format version, the sizes
+ * of the structures and the operations), so a changed class file, a different
+ * build or a damaged image is simply rebuilt. Images are written to a
+ * temporary file that is renamed into place, so a reader never sees one half
+ * written.
+ */
+
+/** A pass_flags bit: optimize_class() ran */
+#define IMAGE_OPTIMIZED 0x1
+/** A pass_flags bit: fuse_class() ran */
+#define IMAGE_FUSED 0x2
+
+/** What an image has to match to stand for a class file prepared with some options */
+typedef struct image_key {
+    /** The FNV-1a hash of the class file */
+    uint64_t hash;
+    /** The number of bytes in the class file */
+    uint64_t size;
+    /** The number of levels of calls that were inlined, or 0 if none were */
+    u4 inline_depth;
+    /** Which of the optional passes ran (IMAGE_OPTIMIZED and IMAGE_FUSED) */
+    u4 pass_flags;
+} image_key_t;
+
+/**
+ * Computes the key of a class file for the options it will be prepared with.
+ *
+ * @param key set to the key
+ * @param path the path of the class file
+ * @param inline_depth the depth inline_class() runs with, or 0 if it doesn't
+ * @param pass_flags which of the optional passes run
+ * @return whether the class file could be read
+ */
+bool image_key_init(image_key_t *key, const char *path, u4 inline_depth, u4 pass_flags);
+
+/**
+ * Loads a class from its image in a cache, if there is a valid one.
+ * The class is ready for memoize_class(), jit_prepare_class() and
+ * thread_class(), and is freed with free_class() like a parsed one.
+ *
+ * @param dir the cache's directory
+ * @param key the key of the class file
+ * @return the class, or NULL if the cache has no valid image of it
+ */
+class_file_t *image_cache_load(const char *dir, const image_key_t *key);
+
+/**
+ * Saves an image of a class in a cache, replacing any image with its key.
+ * Must run after the passes the key names and before memoize_class(),
+ * jit_prepare_class() and thread_class(), whose results are specific to a run.
+ * The cache is only an optimization, so failing to write to it is ignored.
+ *
+ * @param dir the cache's directory, which must exist
+ * @param key the key of the class file the class was parsed from
+ * @param class the prepared class
+ */
+void image_cache_store(const char *dir, const image_key_t *key, const class_file_t *class);
+
+#endif /* IMAGE_CACHE_H */
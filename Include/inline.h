@@ -0,0 +1,34 @@
+#ifndef INLINE_H
+#define INLINE_H
+
+#include "class_file.h"
+
+/** The default number of levels of calls that are inlined into each other */
+#define DEFAULT_INLINE_DEPTH 3
+/** The most instructions a callee can have, with its own calls inlined, to be inlined */
+#define INLINE_BUDGET 32
+
+/**
+ * Replaces the calls to small static methods with copies of their
+ * instructions, so they cost no frame, dispatch or argument passing.
+ *
+ * A callee is inlined if it only takes ints, returns an int or nothing, and
+ * doesn't touch arrays, and if after its own calls are inlined (up to `depth`
+ * levels deep) it is at most INLINE_BUDGET instructions and makes no more
+ * calls. Inlined code is then never a safepoint, so the reference maps of the
+ * caller's remaining safepoints still describe its frame, and recursive
+ * methods are never inlined. The copy pops the arguments into locals of its
+ * own, which the caller's frame gains above its operand stack (by growing
+ * `code.max_stack`), and each return becomes a jump past the copy, leaving
+ * the returned value on the operand stack where the call would have.
+ *
+ * This works on the stack instructions, so it must run after
+ * compute_class_refmaps() has verified them and before optimize_class(),
+ * which then optimizes the inlined code along with the caller's.
+ *
+ * @param class the decoded and verified class file, which owns the new streams
+ * @param depth the number of levels of calls to inline, at least 1
+ */
+void inline_class(class_file_t *class, u4 depth);
+
+#endif /* INLINE_H */
@@ -0,0 +1,77 @@
+#ifndef INTERP_H
+#define INTERP_H
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "class_file.h"
+#include "class_state.h"
+#include "heap.h"
+#include "profile.h"
+#include "stack.h"
+
+/**
+ * Represents the return value of a Java method: either void or an int or a reference.
+ * For simplification, we represent a reference as an index into a heap-allocated array.
+ * (In a real JVM, methods could also return object references or other primitives.)
+ */
+typedef struct {
+    /** Whether this returned value is an int */
+    bool has_value;
+    /** The returned value (only valid if `has_value` is true) */
+    int32_t value;
+} optional_value_t;
+
+/**
+ * Prepares a decoded class to run on the threaded interpreter by pointing
+ * each instruction's `handler` at the interpreter code for its operation.
+ * Must be called after decode_class() and before interpret().
+ *
+ * @param class the decoded class file
+ */
+void thread_class(class_file_t *class);
+
+/**
+ * Runs a method's pre-decoded instruction stream until the method returns,
+ * using direct-threaded dispatch. If the stack's `preempt` flag is set while
+ * it runs, the run stops at the next backward branch or call instead, and
+ * the stack's `suspension` records where (see interpret_resume()).
+ *
+ * @param method the method to run
+ * @param locals the method's frame on the VM stack, starting with its local
+ *   variables. Except for parameters, the locals are uninitialized.
+ *   The frame must have room for frame_slots() slots.
+ * @param state the state of the method's class in the run's context, which the
+ *   run compiles and memoizes in (see class_state.h)
+ * @param heap an array of heap-allocated pointers, useful for references
+ * @param stack the VM stack holding the frame
+ * @return an optional int containing the method's return value
+ */
+optional_value_t interpret(method_t *method, int32_t *locals, class_state_t *state,
+                           heap_t *heap, vm_stack_t *stack);
+
+/**
+ * Continues the run that stopped on a VM stack, until the method it started
+ * with returns or the run stops again. The stack's `suspension.stopped` says
+ * which, and a run that stopped can continue on any thread.
+ *
+ * @param state the state the run started with
+ * @param heap the heap the run allocated its arrays on
+ * @param stack the VM stack the run stopped on
+ * @return an optional int containing the method's return value, if it returned
+ */
+optional_value_t interpret_resume(class_state_t *state, heap_t *heap, vm_stack_t *stack);
+
+/**
+ * Runs a method like interpret(), while recording how often each operation
+ * and pair of consecutive operations runs and how long each method takes.
+ * This is a separately compiled copy of the interpreter, so interpret()
+ * pays nothing for the profiler's existence. Doesn't need thread_class().
+ * It never stops at safepoint polls.
+ *
+ * @param profile the profile to add the counts and times to
+ */
+optional_value_t interpret_profiled(method_t *method, int32_t *locals, class_state_t *state,
+                                    heap_t *heap, vm_stack_t *stack, profile_t *profile);
+
+#endif /* INTERP_H */
@@ -0,0 +1,116 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "class_file.h"
+
+/**
+ * A method's native code. `entry` must be one of the method's `entries`:
+ * the code runs the method's instructions from there until it reaches one the
+ * interpreter has to run (a call, allocation, print, return, switch or array
+ * loop), and returns that instruction's index. A backward branch taken while
+ * `preempt` is set returns its target's index instead, so the interpreter can
+ * stop the run there.
+ *
+ * @param locals the method's frame on the VM stack
+ * @param refs the heap's handle table, or the base of its compressed references
+ *   (see heap_ref_base())
+ * @param entry where to start running
+ * @param preempt the run's preempt flag (see vm_stack_t)
+ */
+typedef u4 (*jit_code_t)(int32_t *locals, const void *refs, const void *entry,
+                         const atomic_bool *preempt);
+
+/**
+ * A method the template JIT can compile, and how hot it has to get. This is
+ * part of the class, and never changes once jit_prepare_class() sets it.
+ */
+typedef struct jit_method {
+    /** The number of calls that make the method hot */
+    u4 calls;
+    /** The number of backward branches that make the method hot */
+    u4 backedges;
+} jit_method_t;
+
+/**
+ * What the JIT changes about a method as it runs in one context (see
+ * class_state.h): the interpreter counts down its calls and backward branches,
+ * and then compiles it (see jit_compile_method()).
+ */
+typedef struct jit_state {
+    /** The compiled code, or NULL while the method is interpreted */
+    jit_code_t code;
+    /**
+     * The native address of each instruction of the method's stream, or NULL
+     * for the instructions that the interpreter runs
+     */
+    const void **entries;
+    /** The executable mapping holding the code */
+    void *mapping;
+    /** The size of `mapping` in bytes */
+    size_t mapping_size;
+    /** The number of calls left before the method is compiled */
+    u4 calls_left;
+    /** The number of backward branches left before the method is compiled */
+    u4 backedges_left;
+} jit_state_t;
+
+/**
+ * Gets whether the JIT can compile code for this host.
+ */
+bool jit_available(void);
+
+/** The default number of calls that make a method hot enough to compile */
+#define DEFAULT_JIT_CALLS 1000
+/** The default number of backward branches that make a method hot enough to compile */
+#define DEFAULT_JIT_BACKEDGES 10000
+
+/**
+ * Marks every method of a class that the JIT can compile for tiered
+ * execution: each one starts out interpreted, counting its calls and the
+ * backward branches it takes in each context, and is compiled once either
+ * count reaches its threshold. Methods that still have stack operations (e.g.
+ * with `--no-optimize`) can't be compiled and are always interpreted, as is
+ * everything on a host jit_available() isn't true for.
+ *
+ * @param class the optimized class file
+ * @param calls the number of calls that make a method hot, at least 1
+ * @param backedges the number of backward branches that make a method hot, at least 1
+ */
+void jit_prepare_class(class_file_t *class, u4 calls, u4 backedges);
+
+/**
+ * Starts a method's state in a context, with its counters at the thresholds
+ * and no code.
+ *
+ * @param method a method that jit_prepare_class() gave a `jit`
+ */
+void jit_init_state(jit_state_t *jit, const method_t *method);
+
+/**
+ * Compiles a prepared method's register operations (see optimize.h) into
+ * native code, one template per instruction, with every local and operand
+ * stack slot kept in the method's frame. The interpreter enters the code at
+ * any compiled instruction and gets control back at the instructions it runs
+ * itself, so the frame records, calls and safepoints all stay the
+ * interpreter's. That also lets a frame that is already running switch to the
+ * native code at its next instruction (on-stack replacement).
+ * Does nothing if the method is already compiled. A state's code is only run
+ * with the heaps of its context, which all have the same encoding of references.
+ *
+ * @param method a method that jit_prepare_class() gave a `jit`
+ * @param jit the method's state in the context that runs it
+ * @param compressed_refs whether the heap the code runs with has compressed
+ *   references (see heap_compress_refs())
+ */
+void jit_compile_method(const method_t *method, jit_state_t *jit, bool compressed_refs);
+
+/**
+ * Releases a method's native code, which must not be run afterward.
+ */
+void jit_free_state(jit_state_t *jit);
+
+#endif /* JIT_H */
@@ -67,6 +67,8 @@ typedef enum {
     i_if_icmpgt = 0xa3,
     i_if_icmple = 0xa4,
     i_goto = 0xa7,
+    i_tableswitch = 0xaa,
+    i_lookupswitch = 0xab,
     i_ireturn = 0xac,
     i_areturn = 0xb0,
     i_return = 0xb1,
@@ -0,0 +1,129 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "class_file.h"
+
+/*
+ * Memoization of pure methods. A method is pure if it takes at most
+ * MEMO_MAX_PARAMS ints, returns an int, and only computes with its
+ * parameters and locals and calls other pure methods: it never allocates,
+ * touches an array or prints. Its result only depends on its arguments, so a
+ * call to it (op_invokestatic_memo or op_call_memo) first looks its arguments
+ * up in the method's memo table, and only runs the method if no earlier call
+ * with the same arguments left its result there.
+ *
+ * The class only says which methods are memoized and how big their tables are;
+ * each context that runs the class has the tables' entries (see class_state.h),
+ * so the class is never written to, and a context's tables last across its runs.
+ *
+ * A table is a fixed number of entries, and each combination of arguments can
+ * only go in the one its hash picks, so a new result replaces whatever was
+ * there. A call that misses claims its entry as it starts and completes it
+ * with the value it returns, unless a call it made claimed the entry for other
+ * arguments in the meantime. The entry is found again through the caller's
+ * frame record (see frame_t), since the callee may overwrite its parameters.
+ */
+
+/** The most parameters a memoized method can have */
+#define MEMO_MAX_PARAMS 4
+/** The default number of entries in each memo table */
+#define DEFAULT_MEMO_ENTRIES 4096
+/** The most entries a memo table can have */
+#define MAX_MEMO_ENTRIES (1 << 24)
+
+/** A memo table entry: a method's arguments and the value it returned for them */
+typedef struct memo_entry {
+    /** The arguments, of which the method's parameter count are used */
+    int32_t args[MEMO_MAX_PARAMS];
+    /** The value the method returned, if `valid` */
+    int32_t value;
+    /** Whether `value` is the method's result for `args` */
+    bool valid;
+    /** The frame depth of the call that claimed the entry and hasn't returned, or 0 */
+    u4 pending;
+} memo_entry_t;
+
+/** The shape of a pure method's memo tables, whose entries are a power of two */
+typedef struct memo_table {
+    /** The number of entries minus 1, to mask hashes with */
+    u4 mask;
+    /** The number of parameters the method takes */
+    u2 num_params;
+} memo_table_t;
+
+/**
+ * Finds the entry a method's arguments go in.
+ *
+ * @param entries the entries of the method's table in the running context
+ * @param args the arguments, which are the first locals of the callee's frame
+ */
+static inline memo_entry_t *memo_find(const memo_table_t *table, memo_entry_t *entries,
+                                      const int32_t *args) {
+    uint32_t hash = table->num_params;
+    for (u2 i = 0; i < table->num_params; i++) {
+        hash = (hash ^ (uint32_t) args[i]) * 0x9e3779b1u;
+    }
+    hash ^= hash >> 15;
+    return &entries[hash & table->mask];
+}
+
+/**
+ * Gets whether an entry holds the result for a method's arguments.
+ */
+static inline bool memo_hit(const memo_table_t *table, const memo_entry_t *entry,
+                            const int32_t *args) {
+    for (u2 i = 0; i < table->num_params; i++) {
+        if (entry->args[i] != args[i]) {
+            return false;
+        }
+    }
+    return entry->valid;
+}
+
+/**
+ * Claims an entry for a call that is about to run the method.
+ *
+ * @param depth the frame depth the callee runs at
+ */
+static inline void memo_claim(const memo_table_t *table, memo_entry_t *entry,
+                              const int32_t *args, u4 depth) {
+    memcpy(entry->args, args, table->num_params * sizeof(int32_t));
+    entry->valid = false;
+    entry->pending = depth;
+}
+
+/**
+ * Stores the value a call returned in the entry it claimed, if it still has it.
+ *
+ * @param depth the frame depth the callee ran at
+ */
+static inline void memo_complete(memo_entry_t *entry, u4 depth, int32_t value) {
+    if (entry->pending == depth) {
+        entry->value = value;
+        entry->valid = true;
+        entry->pending = 0;
+    }
+}
+
+/**
+ * Finds the pure methods of a class that are worth memoizing, the ones that
+ * make calls or loop, and gives each one a memo table. Every call to them
+ * becomes a memoized call. Must run after the methods are decoded, optimized
+ * and fused, and before jit_prepare_class() and thread_class().
+ *
+ * @param class the decoded class file, which owns the tables' shapes
+ * @param entries the number of entries in each table, at most MAX_MEMO_ENTRIES,
+ *   rounded up to a power of two
+ */
+void memoize_class(class_file_t *class, u4 entries);
+
+/**
+ * Allocates the empty entries of a table for a context, to free() with it.
+ */
+memo_entry_t *memo_new_entries(const memo_table_t *table);
+
+#endif /* MEMO_H */
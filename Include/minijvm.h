@@ -0,0 +1,200 @@
+#ifndef MINIJVM_H
+#define MINIJVM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "class_file.h"
+
+/*
+ * The embedding API of libminijvm, for running many programs in one process.
+ *
+ * A class is loaded and prepared once with jvm_load_class(), and then run in
+ * any number of contexts. A context (jvm_context_t) owns what a run changes:
+ * a heap, a VM stack and an output sink, and the classes loaded into it with
+ * jvm_context_load_class(). jvm_invoke() runs one of a class's static methods
+ * that take and return ints in a context, as many times as needed, and
+ * jvm_context_reset() throws away every array the runs left on the heap. A
+ * Java exception ends the run that threw it (see exception.h), which is
+ * reported on stderr like the jvm reports it, and leaves the context usable.
+ *
+ * A run can be preempted: jvm_context_preempt(), called from any thread,
+ * makes it stop at its next backward branch or call, and jvm_resume()
+ * continues it later, on any thread (see scheduler.h). Compiled code polls
+ * for preemptions on its backward branches too.
+ *
+ * A class is never written to after it is loaded, so any number of contexts
+ * on any threads can share it. What running it changes, the JIT's counters
+ * and compiled code and the memo tables, is kept by each context that runs it
+ * (see class_state.h) until the context is freed, so each context compiles
+ * and memoizes the class on its own. A context must only be used by one
+ * thread at a time.
+ */
+
+/** How a class is prepared, which is the same for every context that runs it */
+typedef struct jvm_class_options {
+    /** Whether to translate methods into register operations (see optimize.h) */
+    bool optimize;
+    /** Whether to replace common sequences with superinstructions (see fuse.h) */
+    bool fuse;
+    /** How many levels of calls to inline, or 0 to inline nothing (see inline.h) */
+    u4 inline_depth;
+    /** The size of each memo table, or 0 to memoize nothing (see memo.h) */
+    u4 memo_entries;
+    /** Whether to compile hot methods to native code (see jit.h) */
+    bool jit;
+    /** How many calls make a method hot */
+    u4 jit_calls;
+    /** How many backward branches make a method hot */
+    u4 jit_backedges;
+    /** The directory of the image cache, or NULL not to use one (see image_cache.h) */
+    const char *image_cache;
+} jvm_class_options_t;
+
+/** How a context runs programs */
+typedef struct jvm_context_options {
+    /** The most bytes of arrays the heap holds (see heap_set_limit()) */
+    size_t heap_limit;
+    /** The most nested calls a run can make */
+    size_t max_depth;
+    /** Whether references are compressed pointers (see heap_compress_refs()) */
+    bool compressed_refs;
+    /** The file descriptor printed ints are written to, which stays the caller's */
+    int output_fd;
+    /** Whether each printed line is written right away (see output_set_unbuffered()) */
+    bool unbuffered;
+} jvm_context_options_t;
+
+/** What became of a run started by jvm_invoke() or jvm_run_main() */
+typedef enum {
+    /** The method returned */
+    JVM_OK,
+    /** The class has no such method, or it takes or returns something but ints */
+    JVM_NO_SUCH_METHOD,
+    /** The method threw an exception, which was reported on stderr */
+    JVM_EXCEPTION,
+    /** The run was preempted before the method returned (see jvm_resume()) */
+    JVM_STOPPED
+} jvm_status_t;
+
+/** A context that runs programs: a heap, a VM stack and an output sink */
+typedef struct jvm_context jvm_context_t;
+
+/**
+ * Sets up what the whole process shares: which array kernels run the array
+ * loops (see array_kernels.h). Call it once, before any context runs.
+ *
+ * @param simd whether the kernels may use vector instructions
+ */
+void jvm_init(bool simd);
+
+/**
+ * Gets the options the jvm prepares classes with when given none.
+ */
+jvm_class_options_t jvm_default_class_options(void);
+
+/**
+ * Gets the options the jvm runs programs with when given none.
+ */
+jvm_context_options_t jvm_default_context_options(void);
+
+/**
+ * Loads a class file and prepares it to run: decodes, verifies, inlines,
+ * optimizes, fuses, memoizes and threads it, as the options say.
+ *
+ * @param path the path of the class file
+ * @param options how to prepare the class
+ * @return the class, or NULL if the file can't be opened. A method that fails
+ *   verification still loads, and throws a java.lang.VerifyError when invoked.
+ */
+class_file_t *jvm_load_class(const char *path, const jvm_class_options_t *options);
+
+/**
+ * Frees a class loaded with jvm_load_class(), and its compiled code.
+ * No context may run it afterward.
+ */
+void jvm_free_class(class_file_t *class);
+
+/**
+ * Creates a context.
+ *
+ * @param options how the context runs programs
+ * @return the context, or NULL if its compressed references can't be set up
+ */
+jvm_context_t *jvm_context_create(const jvm_context_options_t *options);
+
+/**
+ * Frees a context, after writing out what its output has buffered.
+ */
+void jvm_context_free(jvm_context_t *context);
+
+/**
+ * Loads a class like jvm_load_class(), for only a context to run. The class
+ * belongs to the context and is freed with it.
+ */
+class_file_t *jvm_context_load_class(jvm_context_t *context, const char *path,
+                                     const jvm_class_options_t *options);
+
+/**
+ * Frees every array on a context's heap, so the next run starts with an empty
+ * one. A stopped run is dropped, and can't be resumed.
+ */
+void jvm_context_reset(jvm_context_t *context);
+
+/**
+ * Runs a static method that takes only ints and returns an int or nothing,
+ * like "(II)I", until it returns, throws or is preempted. What it prints is
+ * written to the context's output by the time this returns.
+ *
+ * @param context the context to run in
+ * @param class the method's class
+ * @param name the method's name
+ * @param descriptor the method's descriptor
+ * @param args the arguments, one per parameter
+ * @param result set to the returned int if the method returns one and `result`
+ *   isn't NULL
+ * @return whether the method returned
+ */
+jvm_status_t jvm_invoke(jvm_context_t *context, class_file_t *class, const char *name,
+                        const char *descriptor, const int32_t *args, int32_t *result);
+
+/**
+ * Runs a class's main() like the jvm does, with a null `args`, until it
+ * returns, throws or is preempted. What it prints is written to the context's output by the
+ * time this returns.
+ *
+ * @return whether main() returned
+ */
+jvm_status_t jvm_run_main(jvm_context_t *context, class_file_t *class);
+
+/**
+ * Makes the run in a context stop at its next safepoint poll: a backward
+ * branch or a call. It may be called from any thread, and costs the run
+ * nothing until it is. Called before a run or jvm_resume() starts, it stops it
+ * at its first poll; every run clears it when it stops or ends, so one that is
+ * called during a run never carries over to a later one. One that is called
+ * just after a run ends does, unless it is withdrawn with
+ * jvm_context_cancel_preempt().
+ */
+void jvm_context_preempt(jvm_context_t *context);
+
+/**
+ * Withdraws a preemption that hasn't stopped a run, for a caller that may have
+ * preempted a run just as it ended. Like jvm_context_preempt(), it may be
+ * called from any thread.
+ */
+void jvm_context_cancel_preempt(jvm_context_t *context);
+
+/**
+ * Continues the run that stopped in a context, until it returns, throws or is
+ * preempted again. A context with a stopped run can't start another run until
+ * the stopped one ends or the context is reset.
+ *
+ * @param result set to the returned int if the method returns one and `result`
+ *   isn't NULL
+ * @return whether the method returned
+ */
+jvm_status_t jvm_resume(jvm_context_t *context, int32_t *result);
+
+#endif /* MINIJVM_H */
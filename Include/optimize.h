@@ -0,0 +1,80 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include <stdint.h>
+
+#include "class_file.h"
+
+/** The bits of an op_div_magic's `aux` that hold its shift */
+#define MAGIC_SHIFT_MASK 0x1f
+/** Set in an op_div_magic's `aux` if the dividend is added after multiplying */
+#define MAGIC_ADD_DIVIDEND 0x20
+/** Set in an op_div_magic's `aux` if the dividend is subtracted after multiplying */
+#define MAGIC_SUBTRACT_DIVIDEND 0x40
+
+/** Set in an array loop's `aux` if its bound `c` is a constant rather than a register */
+#define ARRAY_LOOP_CONSTANT_BOUND 0x1
+
+/**
+ * Divides by a constant the way op_div_magic does: by multiplying by a "magic"
+ * fixed-point reciprocal of the divisor and shifting the high half of the
+ * product (Hacker's Delight, chapter 10). Like Java's idiv, this rounds toward zero.
+ *
+ * @param dividend the value to divide
+ * @param magic the divisor's magic number
+ * @param aux the shift and flags that go with the magic number
+ */
+static inline int32_t magic_divide(int32_t dividend, int32_t magic, u1 aux) {
+    int32_t quotient = (int32_t) (((int64_t) dividend * magic) >> 32);
+    if (aux & MAGIC_ADD_DIVIDEND) {
+        quotient = (int32_t) ((uint32_t) quotient + (uint32_t) dividend);
+    }
+    else if (aux & MAGIC_SUBTRACT_DIVIDEND) {
+        quotient = (int32_t) ((uint32_t) quotient - (uint32_t) dividend);
+    }
+    quotient >>= aux & MAGIC_SHIFT_MASK;
+    // Round negative quotients up to zero
+    return quotient + (int32_t) ((uint32_t) quotient >> 31);
+}
+
+/**
+ * Translates a method's decoded stream into register operations (see op_t),
+ * optimizing it on the way.
+ *
+ * Each frame slot becomes a register, so the frame layout, calls and the
+ * reference maps stay as they are. Every stack instruction becomes one
+ * register instruction using the stack depths at each instruction, which
+ * turns pushes and pops into moves. Within each basic block, the constants
+ * and copies registers hold are then propagated into the instructions that
+ * read them, which folds constant expressions and simplifies arithmetic:
+ * `imul` by a power of two becomes a shift, and `idiv` and `irem` by a
+ * constant use a multiplication (or a shift) instead of a division.
+ * Finally, a liveness analysis removes the moves and computations whose
+ * results are never read, most of which are the pushes that propagation made
+ * unnecessary, and the remaining instructions are packed into a new stream.
+ * An array access whose index the branches before it prove is in bounds
+ * (like `a[i]` in `for (i = 0; i < a.length; i++)`) becomes an unchecked one.
+ * Before that, loops that only fill an array with one value, copy one array
+ * into another, add up an array or its prefix sums, or look for the first
+ * element two arrays differ at become a single array loop operation (op_fill
+ * to op_mismatch), which runs them with vector instructions.
+ *
+ * The reference maps' instruction indices are updated to the new stream.
+ * Registers a reference map marks as references are kept alive at its
+ * safepoint, so a collection still finds the same references.
+ * This must run after compute_refmaps() and before thread_class(); methods
+ * with more registers than op_div_magic can encode are left as they are.
+ *
+ * @param method the decoded method
+ * @param class the class file the method belongs to, which owns the new stream
+ */
+void optimize_method(method_t *method, const class_file_t *class);
+
+/**
+ * Optimizes every method of a decoded class.
+ *
+ * @param class the decoded class file
+ */
+void optimize_class(class_file_t *class);
+
+#endif /* OPTIMIZE_H */
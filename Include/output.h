@@ -0,0 +1,65 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The program's standard output, which is all printed ints. They are
+ * converted to decimal by hand and collected in one large buffer that is only
+ * written out when it fills up, when output_flush() is called, or at exit.
+ * Anything that writes to stderr while the program runs (the exceptions) has
+ * to call output_flush() first, so the output stays in order.
+ *
+ * Each thread prints to the output it selected, which is the process's
+ * standard output unless it selected another. A program run by an embedder
+ * (see minijvm.h) prints to the output sink of its context instead.
+ */
+
+/** The size of the output buffer in bytes */
+#define OUTPUT_BUFFER_SIZE (64 << 10)
+
+/** An output sink, with a buffer of its own */
+typedef struct output output_t;
+
+/**
+ * Creates an output sink that writes to a file descriptor, buffered.
+ *
+ * @param fd the file descriptor, which stays the caller's to close
+ * @return the output, allocated on the heap
+ */
+output_t *output_init(int fd);
+
+/**
+ * Writes out what an output has buffered and frees it. If the calling thread
+ * had it selected, the thread goes back to printing to standard output.
+ */
+void output_free(output_t *output);
+
+/**
+ * Makes the calling thread print to an output, and flush and set it to
+ * unbuffered with the functions below.
+ *
+ * @param output the output, or NULL for the process's standard output
+ * @return the output the thread printed to before, to select again afterward
+ */
+output_t *output_select(output_t *output);
+
+/**
+ * Chooses whether each line printed to the thread's output is written with
+ * writev() as soon as it is ready rather than buffered, for when latency
+ * matters more than throughput. Flushes whatever is buffered.
+ */
+void output_set_unbuffered(bool unbuffered);
+
+/**
+ * Prints an int and a newline to the thread's output, like System.out.println(int).
+ */
+void output_int(int32_t value);
+
+/**
+ * Writes out everything buffered in the thread's output so far.
+ */
+void output_flush(void);
+
+#endif /* OUTPUT_H */
@@ -0,0 +1,116 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "class_file.h"
+#include "decode.h"
+
+/** What the profiler recorded about one method */
+typedef struct {
+    /** The number of times the method was called */
+    uint64_t calls;
+    /**
+     * The time spent in the method and the methods it called, in nanoseconds.
+     * Only outermost calls count, so recursion doesn't count any time twice.
+     */
+    uint64_t inclusive_nanoseconds;
+    /** The time spent in the method itself, in nanoseconds */
+    uint64_t exclusive_nanoseconds;
+    /** The number of calls to the method that haven't returned yet */
+    u4 active_calls;
+    /** The number of calls to the memoized method that found their result (see memo.h) */
+    uint64_t memo_hits;
+    /** The number of calls to the memoized method that had to run it */
+    uint64_t memo_misses;
+} method_profile_t;
+
+/** A call the profiler is timing */
+typedef struct {
+    /** The index of the called method in the class's methods */
+    u4 method;
+    /** When the call started, in nanoseconds */
+    uint64_t start;
+    /** The inclusive time of the calls it made, in nanoseconds */
+    uint64_t callee_nanoseconds;
+} profile_call_t;
+
+/**
+ * The counts and times the profiling interpreter (interpret_profiled()) records.
+ * The counters are public so the interpreter can bump them without a call.
+ */
+typedef struct {
+    /** The class being profiled */
+    const class_file_t *class;
+    /** The number of times each operation was executed */
+    uint64_t op_counts[NUM_OPS];
+    /**
+     * The number of times each operation was followed by the next instruction
+     * in the stream, indexed by the first operation and then the second.
+     * Taken branches, calls and returns don't count, so these are the pairs
+     * a superinstruction could replace.
+     */
+    uint64_t pair_counts[NUM_OPS][NUM_OPS];
+    /** The profile of each method, indexed like the class's methods */
+    method_profile_t *methods;
+    /** The calls being timed, outermost first */
+    profile_call_t *calls;
+    /** The number of calls being timed */
+    size_t call_depth;
+    /** The number of calls `calls` has room for */
+    size_t call_capacity;
+} profile_t;
+
+/**
+ * Creates an empty profile for a class.
+ *
+ * @param class the class file that will be profiled
+ */
+profile_t *profile_init(const class_file_t *class);
+
+/**
+ * Records that a method was called and starts timing the call.
+ *
+ * @param method the called method, which must belong to the profiled class
+ */
+void profile_enter(profile_t *profile, const method_t *method);
+
+/**
+ * Records that the most recently entered method returned.
+ */
+void profile_exit(profile_t *profile);
+
+/**
+ * Records whether a call to a memoized method found its result in the method's
+ * memo table. A call that doesn't is entered as well, like any other.
+ *
+ * @param method the called method, which must belong to the profiled class
+ * @param hit whether the call found its result
+ */
+void profile_memo(profile_t *profile, const method_t *method, bool hit);
+
+/**
+ * Prints a human-readable report, with the operations, operation pairs and
+ * methods sorted from the most to the least significant, and the hit rates of
+ * the memoized methods.
+ *
+ * @param out the stream to print to
+ */
+void profile_print(const profile_t *profile, FILE *out);
+
+/**
+ * Writes the whole profile as a JSON object with "ops", "pairs" and "methods"
+ * members, for building tooling (like the choice of superinstructions) on.
+ *
+ * @param out the stream to write to
+ */
+void profile_write_json(const profile_t *profile, FILE *out);
+
+/**
+ * Frees a profile.
+ */
+void profile_free(profile_t *profile);
+
+#endif /* PROFILE_H */
@@ -8,7 +8,7 @@
  * Finds the method with the given name and signature.
  * The descriptor is necessary because Java allows method overloading.
  * This only needs to be called directly to invoke main();
- * for the invokestatic instruction, use find_method_from_index().
+ * for the invokestatic instruction, use the class's resolved_methods.
  *
  * @param name the method name, e.g. "factorial"
  * @param descriptor the method descriptor string, e.g. "(I)I"
@@ -33,15 +33,57 @@ method_t *find_method_from_index(uint16_t index, const class_file_t *class);
  */
 uint16_t get_number_of_parameters(const method_t *method);
 
+/**
+ * Resolves each of a class's Methodref constants to the method it calls,
+ * filling in `class->resolved_methods`. get_class() does this automatically.
+ *
+ * @param class the parsed class file
+ * @param this_class the constant pool index of the class's own Class constant
+ */
+void link_class(class_file_t *class, u2 this_class);
+
 /**
  * Reads an entire class file.
  * The end of the parsed methods array is marked by a method with a NULL name.
+ * The returned class is already linked (see link_class()).
+ * The file is read into memory in one go, and the class's strings and bytecode
+ * point into that copy. Prefer load_class(), which avoids the copy.
  *
  * @param class_file the open file to read
  * @return the parsed class file, allocated on the heap
  */
 class_file_t *get_class(FILE *class_file);
 
+/**
+ * Loads a class file by mapping it into memory and parsing it in place, like
+ * get_class() but without copying the file. Files that can't be mapped are
+ * read with get_class().
+ *
+ * @param path the path of the class file
+ * @return the parsed class file, allocated on the heap, or NULL if the file
+ *   can't be opened
+ */
+class_file_t *load_class(const char *path);
+
+/**
+ * Allocates zeroed memory that belongs to a class and is freed with it by
+ * free_class(). The memory is suitably aligned for any type.
+ *
+ * @param class the parsed class file
+ * @param size the number of bytes to allocate
+ * @return the allocated memory
+ */
+void *class_alloc(const class_file_t *class, size_t size);
+
+/**
+ * Gives a class that wasn't parsed by this module, such as one mapped from a
+ * class image (see image_cache.h), an empty arena of its own to allocate from.
+ * The class itself then isn't in the arena, but in its `image`.
+ *
+ * @param class the class, whose `arena` is overwritten
+ */
+void class_init_arena(class_file_t *class);
+
 /**
  * Frees the memory used by a parsed class file.
  *
@@ -0,0 +1,68 @@
+#ifndef REFMAP_H
+#define REFMAP_H
+
+#include <stdbool.h>
+
+#include "class_file.h"
+
+/**
+ * A reference map: which slots of a frame hold array references when the
+ * frame is stopped at a safepoint. The safepoints are the instructions that
+ * can trigger a garbage collection: newarray, and invokestatic (for the frames
+ * of callers while their callees run).
+ *
+ * The map covers the frame's locals followed by its operand stack, which at an
+ * invokestatic no longer includes the arguments (they are the callee's locals).
+ */
+typedef struct refmap {
+    /** The index of the safepoint instruction in the method's instruction stream */
+    u4 insn;
+    /** The number of slots the map covers: `max_locals` plus the stack depth */
+    u4 slots;
+    /** The map's bits; slot `i` holds a reference if bit `i % 32` of `bits[i / 32]` is set */
+    const uint32_t *bits;
+} refmap_t;
+
+/**
+ * Verifies a decoded method and computes its reference maps (`method->refmaps`)
+ * by following the types of values through its locals and operand stack.
+ * A slot that holds an int on one path and a reference on another is dead at
+ * the merge point, so it isn't treated as a reference, and reading it fails
+ * verification.
+ *
+ * Every reachable instruction must find the operand stack at the same depth
+ * on every path, within `max_stack`, and its operands and locals (within
+ * `max_locals`) must have the types it expects. A method that breaks any of
+ * these rules is replaced with a trap that throws a java.lang.VerifyError
+ * when it is invoked (see reject_method()), so the interpreters and compilers
+ * can run the bytecode without checking anything.
+ *
+ * @param method the decoded method
+ * @param class the class file the method belongs to, which owns the maps
+ */
+void compute_refmaps(method_t *method, const class_file_t *class);
+
+/**
+ * Computes the reference maps of every method of a decoded class.
+ *
+ * @param class the decoded class file
+ */
+void compute_class_refmaps(class_file_t *class);
+
+/**
+ * Finds the reference map of a safepoint.
+ *
+ * @param method the method containing the safepoint
+ * @param insn the index of the safepoint instruction
+ * @return the reference map, or NULL if the instruction isn't a safepoint
+ */
+const refmap_t *find_refmap(const method_t *method, u4 insn);
+
+/**
+ * Gets whether a reference map marks a slot as holding a reference.
+ */
+static inline bool refmap_is_ref(const refmap_t *map, u4 slot) {
+    return (map->bits[slot / 32] >> (slot % 32)) & 1;
+}
+
+#endif /* REFMAP_H */
@@ -0,0 +1,81 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#include "minijvm.h"
+
+/*
+ * A scheduler that time-slices many guest programs over a few worker threads
+ * (M:N green threads), for running more programs at once than there are
+ * threads, and stopping runaway ones.
+ *
+ * A guest is a run in a context of its own (see minijvm.h). Runnable guests
+ * wait in one first-in, first-out queue, and each worker takes the guest at
+ * its head, runs it for a time slice and puts it back at the tail if it
+ * hasn't finished. A ticker thread sleeps until the earliest slice of a
+ * running guest is over and then preempts it with jvm_context_preempt(), so
+ * the run stops at its next safepoint poll; the interpreter pays nothing for
+ * preemption until a slice ends. A guest can also have a time budget: the
+ * total time it may spend running, after which it is stopped for good.
+ *
+ * Guests can share classes loaded without the JIT and memoization (see
+ * minijvm.h). Compiled code stops at its safepoint polls like interpreted code
+ * does, so guests run with the JIT keep to their slices and budgets too.
+ */
+
+/** The time a guest runs for before the next one gets a turn (10 ms) */
+#define DEFAULT_TIME_SLICE_NS ((uint64_t) 10 * 1000 * 1000)
+
+/** A scheduler, with its worker threads and run queue */
+typedef struct scheduler scheduler_t;
+
+/** A guest program run by a scheduler */
+typedef struct guest guest_t;
+
+/**
+ * Creates a scheduler and starts its threads.
+ *
+ * @param workers the number of worker threads to run guests on
+ * @param time_slice_ns how long each turn of a guest lasts, in nanoseconds
+ * @return the scheduler, which runs guests as soon as they are spawned
+ */
+scheduler_t *scheduler_create(u4 workers, uint64_t time_slice_ns);
+
+/**
+ * Adds a guest that runs a static method like jvm_invoke() does, or main()
+ * like jvm_run_main() does.
+ *
+ * @param scheduler the scheduler to run the guest
+ * @param context the context to run the guest in, which no one else may use
+ *   until the guest is joined
+ * @param class the method's class
+ * @param name the method's name, or NULL to run main()
+ * @param descriptor the method's descriptor, or NULL to run main()
+ * @param args the arguments, one per parameter, which are copied
+ * @param time_budget_ns the most time the guest may run for, in nanoseconds,
+ *   or 0 to let it run until it ends
+ * @return the guest, to join
+ */
+guest_t *scheduler_spawn(scheduler_t *scheduler, jvm_context_t *context, class_file_t *class,
+                         const char *name, const char *descriptor, const int32_t *args,
+                         uint64_t time_budget_ns);
+
+/**
+ * Waits for a guest to end, and frees it.
+ *
+ * @param result set to the returned int if the method returns one and `result`
+ *   isn't NULL
+ * @param run_time_ns set to how long the guest ran, in nanoseconds, if it isn't NULL
+ * @return how the guest's run ended: JVM_STOPPED means it used up its time
+ *   budget, and was dropped with jvm_context_reset()
+ */
+jvm_status_t scheduler_join(scheduler_t *scheduler, guest_t *guest, int32_t *result,
+                            uint64_t *run_time_ns);
+
+/**
+ * Stops the scheduler's threads and frees it. Every guest must have been joined.
+ */
+void scheduler_free(scheduler_t *scheduler);
+
+#endif /* SCHEDULER_H */
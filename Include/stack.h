@@ -0,0 +1,175 @@
+#ifndef STACK_H
+#define STACK_H
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "class_file.h"
+#include "heap.h"
+
+struct insn;
+
+/**
+ * The number of slots between a frame's locals and its operand stack.
+ * The interpreter keeps the top of the operand stack in a register and writes
+ * the old top back to its slot when it pushes, so a push onto an empty operand
+ * stack needs a slot to write the (meaningless) old top to.
+ */
+#define FRAME_GAP_SLOTS 1
+
+/**
+ * The record of an active Java method on the VM stack.
+ * Frame records are kept in their own array, in call order, so the
+ * interpreter never needs to recurse to call a method.
+ */
+typedef struct {
+    /** The method running in this frame */
+    method_t *method;
+    /** The method's state in the run's context, whose instruction stream the frame runs */
+    struct method_state *state;
+    /**
+     * The frame's first local; its operand stack starts at
+     * `locals + max_locals + FRAME_GAP_SLOTS`
+     */
+    int32_t *locals;
+    /**
+     * The instruction this frame resumes at when the method it called returns.
+     * The top frame also sets it before allocating, since that can start a
+     * garbage collection, so the instruction before `return_ip` is always the
+     * safepoint a stopped frame is at.
+     */
+    const struct insn *return_ip;
+    /**
+     * The memo table entry (see memo.h) that the value returned to `return_ip`
+     * completes, or NULL if the call waiting for it isn't memoized
+     */
+    struct memo_entry *memo;
+} frame_t;
+
+/**
+ * Gets the number of VM stack slots a frame takes up.
+ *
+ * @param max_locals the method's `code.max_locals`
+ * @param max_stack the method's `code.max_stack`
+ */
+static inline size_t frame_slots(u2 max_locals, u2 max_stack) {
+    return (size_t) max_locals + FRAME_GAP_SLOTS + max_stack;
+}
+
+/**
+ * Where a run stopped when the interpreter found a preemption pending at one
+ * of its safepoint polls (see interp.h). Everything else the run needs to
+ * continue is in the frames.
+ */
+typedef struct {
+    /** Whether the run stopped before its method returned */
+    bool stopped;
+    /** The depth of the run's first frame, whose return ends the run */
+    size_t entry_depth;
+    /** The instruction the top frame continues at */
+    const struct insn *ip;
+    /** The top of the top frame's operand stack, whose slot holds the top value */
+    int32_t *sp;
+} vm_suspension_t;
+
+/**
+ * The VM stack: one contiguous array of int32_t slots holding the locals and
+ * operand stacks of every active Java method, plus a record for each frame.
+ * A method's frame is its `max_locals` locals followed by its `max_stack`
+ * operand stack slots. When a method is called, its locals begin at the
+ * caller's operand stack slots holding the arguments, so passing arguments
+ * copies nothing.
+ *
+ * The slots are a reserved range of virtual memory that the operating system
+ * only backs with pages once they are touched, so the stack grows on demand
+ * without ever moving. The frame records grow as the call depth does.
+ */
+typedef struct {
+    /** The first slot of the stack */
+    int32_t *base;
+    /** One past the last slot a frame can use */
+    int32_t *limit;
+    /** The frame records, with the outermost frame first */
+    frame_t *frames;
+    /** The number of active frames */
+    size_t depth;
+    /** The number of frame records allocated */
+    size_t capacity;
+    /** The maximum number of active frames before a StackOverflowError */
+    size_t max_depth;
+    /**
+     * Set by any thread to make the run on this stack stop at its next
+     * safepoint poll, and cleared when it stops. The interpreter only loads it,
+     * with relaxed ordering, so polling costs one load and compare.
+     */
+    atomic_bool preempt;
+    /** Where the run on this stack stopped, if it did */
+    vm_suspension_t suspension;
+} vm_stack_t;
+
+/** The default number of slots reserved for a VM stack (64 MiB) */
+#define DEFAULT_STACK_SLOTS ((size_t) 1 << 24)
+/** The default maximum call depth */
+#define DEFAULT_MAX_DEPTH ((size_t) 1 << 20)
+
+/**
+ * Reserves a VM stack. Its slots are initially zero.
+ *
+ * @param slots the maximum number of slots the stack can hold
+ * @param max_depth the maximum number of frames that can be active at once
+ * @return the stack, allocated on the heap
+ */
+vm_stack_t *vm_stack_init(size_t slots, size_t max_depth);
+
+/**
+ * Gets whether a frame starting at `locals` with the given size fits in the stack.
+ */
+static inline bool vm_stack_fits(const vm_stack_t *stack, const int32_t *locals,
+                                 size_t frame_slots) {
+    return (size_t) (stack->limit - locals) >= frame_slots;
+}
+
+/**
+ * Makes room for at least one more frame record, growing the record array
+ * if it is full. This may move `stack->frames`.
+ *
+ * @param stack the VM stack
+ * @return false if the stack is already `max_depth` frames deep
+ */
+bool vm_stack_reserve_frame(vm_stack_t *stack);
+
+/**
+ * Drops every frame, such as the ones a run that ended with an exception left
+ * behind (see exception.h) or a stopped run that won't be continued, so the
+ * stack can run another method from its base.
+ */
+void vm_stack_reset(vm_stack_t *stack);
+
+/**
+ * Reports a StackOverflowError with a trace of the active frames and ends the
+ * program (see exception_exit()).
+ *
+ * @param stack the VM stack, whose `depth` frames are active
+ */
+void vm_stack_overflow(const vm_stack_t *stack) __attribute__((noreturn));
+
+/**
+ * Marks the references held by the active frames, using the reference map of
+ * the safepoint each frame is stopped at. This is the heap's root scanner
+ * (see heap_set_root_scanner()), with the VM stack as its context.
+ *
+ * @param stack the VM stack
+ * @param heap the heap being collected
+ */
+void vm_stack_scan_roots(void *stack, heap_t *heap);
+
+/**
+ * Releases a VM stack.
+ *
+ * @param stack the stack to free
+ */
+void vm_stack_free(vm_stack_t *stack);
+
+#endif /* STACK_H */
@@ -0,0 +1,24 @@
+/**
+ * Counts the ways to make large amounts out of British coins, modulo a prime,
+ * with a dynamic program over a new table for every amount.
+ */
+public class CoinSums {
+    private static int ways(int amount, int[] coins) {
+        int[] ways = new int[amount + 1];
+        ways[0] = 1;
+        for (int c = 0; c < coins.length; c++) {
+            int coin = coins[c];
+            for (int i = coin; i <= amount; i++) {
+                ways[i] = (ways[i] + ways[i - coin]) % 1000000007;
+            }
+        }
+        return ways[amount];
+    }
+
+    public static void main(String[] args) {
+        int[] coins = {1, 2, 5, 10, 20, 50, 100, 200};
+        for (int amount = 100000; amount <= 1000000; amount = amount + 100000) {
+            System.out.println(ways(amount, coins));
+        }
+    }
+}
@@ -0,0 +1,35 @@
+/**
+ * Finds the start below 100000 with the longest Collatz sequence, which is
+ * nothing but integer arithmetic and branches. Every sequence from below
+ * 100000 stays within an int.
+ */
+public class Collatz {
+    private static int sequenceLength(int n) {
+        int length = 1;
+        while (n != 1) {
+            if ((n & 1) == 0) {
+                n = n / 2;
+            } else {
+                n = 3 * n + 1;
+            }
+            length++;
+        }
+        return length;
+    }
+
+    public static void main(String[] args) {
+        for (int round = 0; round < 5; round++) {
+            int longest = 0;
+            int longestStart = 0;
+            for (int start = 1; start < 100000; start++) {
+                int length = sequenceLength(start);
+                if (length > longest) {
+                    longest = length;
+                    longestStart = start;
+                }
+            }
+            System.out.println(longestStart);
+            System.out.println(longest);
+        }
+    }
+}
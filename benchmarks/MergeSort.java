@@ -0,0 +1,63 @@
+/**
+ * Sorts arrays of pseudorandom ints with a merge sort that allocates a new
+ * array for every merge, so it exercises allocation and garbage collection as
+ * much as calls and array accesses.
+ */
+public class MergeSort {
+    private static void sort(int[] array, int from, int to) {
+        if (to - from < 2) {
+            return;
+        }
+        int middle = (from + to) / 2;
+        sort(array, from, middle);
+        sort(array, middle, to);
+        int[] merged = new int[to - from];
+        int i = from;
+        int j = middle;
+        int k = 0;
+        while (i < middle && j < to) {
+            if (array[i] <= array[j]) {
+                merged[k] = array[i];
+                i++;
+            } else {
+                merged[k] = array[j];
+                j++;
+            }
+            k++;
+        }
+        while (i < middle) {
+            merged[k] = array[i];
+            i++;
+            k++;
+        }
+        while (j < to) {
+            merged[k] = array[j];
+            j++;
+            k++;
+        }
+        for (k = 0; k < merged.length; k++) {
+            array[from + k] = merged[k];
+        }
+    }
+
+    public static void main(String[] args) {
+        int length = 200000;
+        int seed = 12345;
+        for (int round = 0; round < 10; round++) {
+            int[] array = new int[length];
+            for (int i = 0; i < length; i++) {
+                seed = seed * 1103515245 + 12345;
+                array[i] = seed >>> 8;
+            }
+            sort(array, 0, length);
+            int sorted = 1;
+            for (int i = 1; i < length; i++) {
+                if (array[i - 1] > array[i]) {
+                    sorted = 0;
+                }
+            }
+            System.out.println(sorted);
+            System.out.println(array[length / 2]);
+        }
+    }
+}
@@ -0,0 +1,25 @@
+/**
+ * Counts the primes below a million by trial division, which is dominated by
+ * division and a call per candidate.
+ */
+public class Primes {
+    private static int isPrime(int n) {
+        if (n < 2) {
+            return 0;
+        }
+        for (int divisor = 2; divisor * divisor <= n; divisor++) {
+            if (n % divisor == 0) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    public static void main(String[] args) {
+        int count = 0;
+        for (int n = 0; n < 1000000; n++) {
+            count += isPrime(n);
+        }
+        System.out.println(count);
+    }
+}
@@ -0,0 +1,26 @@
+/**
+ * Computes Fibonacci numbers and binomial coefficients by naive recursion,
+ * which is almost nothing but calls and returns.
+ */
+public class Recursion {
+    private static int fibonacci(int n) {
+        if (n < 2) {
+            return n;
+        }
+        return fibonacci(n - 1) + fibonacci(n - 2);
+    }
+
+    private static int choose(int n, int k) {
+        if (k == 0 || k == n) {
+            return 1;
+        }
+        return choose(n - 1, k - 1) + choose(n - 1, k);
+    }
+
+    public static void main(String[] args) {
+        for (int n = 25; n <= 32; n++) {
+            System.out.println(fibonacci(n));
+        }
+        System.out.println(choose(26, 13));
+    }
+}
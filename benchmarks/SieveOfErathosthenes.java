@@ -0,0 +1,25 @@
+/**
+ * Counts the primes up to two million with the sieve of Eratosthenes, a
+ * tight loop over a large array.
+ */
+public class SieveOfErathosthenes {
+    private static int countPrimes(int limit) {
+        int[] composite = new int[limit + 1];
+        int count = 0;
+        for (int i = 2; i <= limit; i++) {
+            if (composite[i] == 0) {
+                count++;
+                for (int j = i + i; j <= limit; j += i) {
+                    composite[j] = 1;
+                }
+            }
+        }
+        return count;
+    }
+
+    public static void main(String[] args) {
+        for (int round = 0; round < 10; round++) {
+            System.out.println(countPrimes(2000000));
+        }
+    }
+}
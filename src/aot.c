@@ -0,0 +1,953 @@
+#include <assert.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "class_file.h"
+#include "jvm.h"
+#include "read_class.h"
+
+/*
+ * The ahead-of-time compiler. It translates a class file into a C file with
+ * one function per static method, which is linked with the AOT runtime (see
+ * aot_runtime.h) into a program that runs the class's main() without loading
+ * or interpreting anything.
+ *
+ * The JVM requires every instruction to have the same operand stack depth on
+ * all paths reaching it, so the translation first works out each
+ * instruction's depth. Local `n` then becomes the C variable `ln` and operand
+ * stack slot `d` becomes `sd`, so every instruction is a plain assignment
+ * between variables, and branches are gotos to labels named after their
+ * targets' pcs. The C compiler does the rest: register allocation and
+ * optimization across the whole method.
+ *
+ * Array references are the exception, since the garbage collector has to find
+ * them. The analysis also follows which stack slots hold references, and each
+ * local and stack slot that ever holds one gets a slot in the function's
+ * `refs` array instead of a variable. A function with any pushes a frame
+ * pointing to its `refs` on the runtime's shadow stack (see aot_frame_t), which
+ * the root scanner walks, and pops it when it returns. Ints stay in variables,
+ * so they never touch memory. A reference slot keeps its array alive until it
+ * is overwritten or its function returns, even if the bytecode never reads
+ * it again.
+ */
+
+/** The name of the method that a program starts from */
+const char MAIN_METHOD[] = "main";
+/** The descriptor of the method that a program starts from */
+const char MAIN_DESCRIPTOR[] = "([Ljava/lang/String;)V";
+
+/** What a bytecode instruction does to the control flow and the operand stack */
+typedef struct {
+    /** The length of the instruction in bytes, or 0 if MiniJVM doesn't support it */
+    u4 length;
+    /** The number of values the instruction pops */
+    u4 pops;
+    /** The number of values the instruction pushes */
+    u4 pushes;
+    /** Whether the instruction branches to `target` */
+    bool branches;
+    /** Whether the instruction is a switch, which jumps to one of its cases */
+    bool switches;
+    /** The pc of the branch target */
+    u4 target;
+    /** Whether the next instruction can run after this one */
+    bool falls_through;
+} bytecode_info_t;
+
+/** What a method's translation needs to know about its bytecode */
+typedef struct {
+    /** The operand stack depth before each instruction, or -1 if it is unreachable */
+    int32_t *depths;
+    /**
+     * Whether each operand stack slot holds a reference before each instruction,
+     * `max_stack` slots per pc
+     */
+    bool *stack_refs;
+    /** Whether each pc is a branch target, and so needs a label */
+    bool *targets;
+    /** Whether each local is ever read as an int, and so needs a variable */
+    bool *locals_read;
+    /** Whether each local is ever read as a reference, and so needs a slot in `refs` */
+    bool *ref_locals_read;
+    /** Whether each stack slot ever holds an int, and so needs a variable */
+    bool *stack_ints;
+    /** The slot in `refs` of each local read as a reference, or -1 */
+    int32_t *local_ref_slots;
+    /** The slot in `refs` of each stack slot that ever holds a reference, or -1 */
+    int32_t *stack_ref_slots;
+    /** The number of slots in `refs`, or 0 if the function has no frame */
+    u4 ref_slot_count;
+    /** The greatest operand stack depth, so the number of stack variables */
+    u4 max_depth;
+} method_info_t;
+
+/** The C expression for a slot in `refs`, with room for any slot number */
+typedef struct {
+    char text[24];
+} ref_name_t;
+
+/**
+ * @brief Reads a big-endian u2 operand out of the bytecode.
+ */
+static u2 operand_u2(const u1 *bytecode) {
+    return (u2) bytecode[0] << 8 | bytecode[1];
+}
+
+/**
+ * @brief Reads a big-endian s4 operand out of the bytecode.
+ */
+static int32_t operand_s4(const u1 *bytecode) {
+    return (int32_t) ((uint32_t) bytecode[0] << 24 | (uint32_t) bytecode[1] << 16 |
+                      (uint32_t) bytecode[2] << 8 | bytecode[3]);
+}
+
+/**
+ * @brief Gets the operands of the switch at `pc`, which are padded to start at
+ * a multiple of 4 bytes from the start of the bytecode.
+ */
+static const u1 *switch_operands(const u1 *bytecode, u4 pc) {
+    return &bytecode[(pc + 4) & ~(u4) 3];
+}
+
+/**
+ * @brief Gets the number of cases of the switch at `pc`, not counting the default.
+ */
+static u4 switch_case_count(const u1 *bytecode, u4 pc) {
+    const u1 *operands = switch_operands(bytecode, pc);
+    if (bytecode[pc] == i_tableswitch) {
+        return (u4) operand_s4(&operands[8]) - (u4) operand_s4(&operands[4]) + 1;
+    }
+    return operand_s4(&operands[4]);
+}
+
+/**
+ * @brief Gets a case of the switch at `pc`.
+ *
+ * @param i Which case, where switch_case_count() is the default.
+ * @param key Set to the case's key, unless it is the default.
+ * @return The pc the case jumps to.
+ */
+static u4 switch_case(const u1 *bytecode, u4 pc, u4 i, int32_t *key) {
+    const u1 *operands = switch_operands(bytecode, pc);
+    if (i == switch_case_count(bytecode, pc)) {
+        return pc + operand_s4(operands);
+    }
+    if (bytecode[pc] == i_tableswitch) {
+        *key = (int32_t) ((u4) operand_s4(&operands[4]) + i);
+        return pc + operand_s4(&operands[12 + 4 * i]);
+    }
+    *key = operand_s4(&operands[8 + 8 * i]);
+    return pc + operand_s4(&operands[12 + 8 * i]);
+}
+
+/**
+ * @brief Gets whether a method returns a value, from the end of its descriptor.
+ */
+static bool returns_value(const method_t *method) {
+    return strchr(method->descriptor, ')')[1] != 'V';
+}
+
+/**
+ * @brief Gets whether a method returns an array reference.
+ */
+static bool returns_ref(const method_t *method) {
+    return strchr(method->descriptor, ')')[1] == '[';
+}
+
+/**
+ * @brief Gets whether each of a method's parameters is an array reference.
+ *
+ * @param refs Set for each parameter, with room for get_number_of_parameters().
+ */
+static void parameter_refs(const method_t *method, bool *refs) {
+    const char *c = strchr(method->descriptor, '(') + 1;
+    for (u2 i = 0; *c != ')'; i++, c++) {
+        refs[i] = *c == '[';
+        // An array's element type, or a class name up to its ';', is part of the parameter
+        while (*c == '[') {
+            c++;
+        }
+        if (*c == 'L') {
+            c = strchr(c, ';');
+        }
+    }
+}
+
+/**
+ * @brief Describes the instruction at `pc`.
+ *
+ * @param bytecode The method's bytecode.
+ * @param pc The offset of the instruction.
+ * @param class The class file the method belongs to, to look up called methods.
+ */
+static bytecode_info_t bytecode_info(const u1 *bytecode, u4 pc, const class_file_t *class) {
+    bytecode_info_t info = {.falls_through = true};
+    u1 opcode = bytecode[pc];
+    switch (opcode) {
+        case i_nop:
+        case i_getstatic:
+            info.length = opcode == i_nop ? 1 : 3;
+            break;
+        case i_iconst_m1:
+        case i_iconst_0:
+        case i_iconst_1:
+        case i_iconst_2:
+        case i_iconst_3:
+        case i_iconst_4:
+        case i_iconst_5:
+        case i_iload_0:
+        case i_iload_1:
+        case i_iload_2:
+        case i_iload_3:
+        case i_aload_0:
+        case i_aload_1:
+        case i_aload_2:
+        case i_aload_3:
+        case i_dup:
+            info.length = 1;
+            info.pushes = 1;
+            break;
+        case i_bipush:
+        case i_ldc:
+        case i_iload:
+        case i_aload:
+            info.length = 2;
+            info.pushes = 1;
+            break;
+        case i_sipush:
+            info.length = 3;
+            info.pushes = 1;
+            break;
+        case i_istore_0:
+        case i_istore_1:
+        case i_istore_2:
+        case i_istore_3:
+        case i_astore_0:
+        case i_astore_1:
+        case i_astore_2:
+        case i_astore_3:
+            info.length = 1;
+            info.pops = 1;
+            break;
+        case i_istore:
+        case i_astore:
+            info.length = 2;
+            info.pops = 1;
+            break;
+        case i_iaload:
+        case i_iadd:
+        case i_isub:
+        case i_imul:
+        case i_idiv:
+        case i_irem:
+        case i_ishl:
+        case i_ishr:
+        case i_iushr:
+        case i_iand:
+        case i_ior:
+        case i_ixor:
+            info.length = 1;
+            info.pops = 2;
+            info.pushes = 1;
+            break;
+        case i_iastore:
+            info.length = 1;
+            info.pops = 3;
+            break;
+        case i_ineg:
+        case i_arraylength:
+            info.length = 1;
+            info.pops = 1;
+            info.pushes = 1;
+            break;
+        case i_newarray:
+            info.length = 2;
+            info.pops = 1;
+            info.pushes = 1;
+            break;
+        case i_iinc:
+            info.length = 3;
+            break;
+        case i_ifeq:
+        case i_ifne:
+        case i_iflt:
+        case i_ifge:
+        case i_ifgt:
+        case i_ifle:
+        case i_if_icmpeq:
+        case i_if_icmpne:
+        case i_if_icmplt:
+        case i_if_icmpge:
+        case i_if_icmpgt:
+        case i_if_icmple:
+        case i_goto:
+            info.length = 3;
+            info.pops = opcode >= i_if_icmpeq && opcode <= i_if_icmple ? 2
+                        : opcode == i_goto                              ? 0
+                                                                        : 1;
+            info.branches = true;
+            info.target = pc + (int16_t) operand_u2(&bytecode[pc + 1]);
+            info.falls_through = opcode != i_goto;
+            break;
+        case i_tableswitch:
+        case i_lookupswitch: {
+            u4 operands = switch_operands(bytecode, pc) - bytecode;
+            u4 cases = switch_case_count(bytecode, pc);
+            info.length = operands - pc +
+                          (opcode == i_tableswitch ? 12 + 4 * cases : 8 + 8 * cases);
+            info.pops = 1;
+            info.switches = true;
+            info.falls_through = false;
+            break;
+        }
+        case i_ireturn:
+        case i_areturn:
+            info.length = 1;
+            info.pops = 1;
+            info.falls_through = false;
+            break;
+        case i_return:
+            info.length = 1;
+            info.falls_through = false;
+            break;
+        case i_invokevirtual:
+            // System.out.println(int), whose receiver getstatic didn't push
+            info.length = 3;
+            info.pops = 1;
+            break;
+        case i_invokestatic: {
+            const resolved_method_t *callee =
+                &class->resolved_methods[operand_u2(&bytecode[pc + 1])];
+            if (callee->method != NULL) {
+                info.length = 3;
+                info.pops = callee->num_params;
+                info.pushes = returns_value(callee->method);
+            }
+            break;
+        }
+    }
+    if (info.length == 0) {
+        // The program stops at unsupported instructions
+        info.falls_through = false;
+    }
+    return info;
+}
+
+/**
+ * @brief Gets the local an instruction loads, stores or increments, or -1.
+ */
+static int32_t local_index(const u1 *bytecode, u4 pc) {
+    u1 opcode = bytecode[pc];
+    switch (opcode) {
+        case i_iload:
+        case i_aload:
+        case i_istore:
+        case i_astore:
+        case i_iinc:
+            return bytecode[pc + 1];
+        case i_iload_0:
+        case i_iload_1:
+        case i_iload_2:
+        case i_iload_3:
+            return opcode - i_iload_0;
+        case i_aload_0:
+        case i_aload_1:
+        case i_aload_2:
+        case i_aload_3:
+            return opcode - i_aload_0;
+        case i_istore_0:
+        case i_istore_1:
+        case i_istore_2:
+        case i_istore_3:
+            return opcode - i_istore_0;
+        case i_astore_0:
+        case i_astore_1:
+        case i_astore_2:
+        case i_astore_3:
+            return opcode - i_astore_0;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * @brief Gets whether the value an instruction pushes is a reference.
+ *
+ * @param stack Whether each slot of the operand stack holds a reference before the instruction.
+ * @param depth The depth of the operand stack before the instruction.
+ */
+static bool pushes_ref(const u1 *bytecode, u4 pc, const class_file_t *class, const bool *stack,
+                       int32_t depth) {
+    switch (bytecode[pc]) {
+        case i_aload:
+        case i_aload_0:
+        case i_aload_1:
+        case i_aload_2:
+        case i_aload_3:
+        case i_newarray:
+            return true;
+        case i_dup:
+            return stack[depth - 1];
+        case i_invokestatic:
+            return returns_ref(class->resolved_methods[operand_u2(&bytecode[pc + 1])].method);
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Gives each local read as a reference and each stack slot that ever
+ * holds one a slot in the function's `refs`. The parameters are the first
+ * locals, so they get the first slots, and `refs` can be initialized with them.
+ */
+static void assign_ref_slots(const method_t *method, method_info_t *info) {
+    const code_t *code = &method->code;
+    for (u2 i = 0; i < code->max_locals; i++) {
+        bool ref = info->ref_locals_read[i];
+        info->local_ref_slots[i] = ref ? (int32_t) info->ref_slot_count++ : -1;
+    }
+    for (u4 d = 0; d < code->max_stack; d++) {
+        info->stack_ref_slots[d] = -1;
+    }
+    for (u4 pc = 0; pc < code->code_length; pc++) {
+        for (int32_t d = 0; d < info->depths[pc]; d++) {
+            bool ref = info->stack_refs[pc * code->max_stack + d];
+            if (ref && info->stack_ref_slots[d] < 0) {
+                info->stack_ref_slots[d] = info->ref_slot_count++;
+            }
+            info->stack_ints[d] |= !ref;
+        }
+    }
+}
+
+/**
+ * @brief Finds the operand stack depth at each reachable instruction of a method,
+ * which stack slots hold references there, which pcs are branch targets and
+ * which locals are read, and assigns the reference slots.
+ */
+static method_info_t analyze_method(const method_t *method, const class_file_t *class) {
+    const code_t *code = &method->code;
+    u4 max_stack = code->max_stack;
+    method_info_t info = {
+        .depths = malloc(sizeof(int32_t[code->code_length])),
+        .stack_refs = calloc((size_t) code->code_length * max_stack + 1, sizeof(bool)),
+        .targets = calloc(code->code_length, sizeof(bool)),
+        .locals_read = calloc(code->max_locals, sizeof(bool)),
+        .ref_locals_read = calloc(code->max_locals, sizeof(bool)),
+        .stack_ints = calloc(max_stack + 1, sizeof(bool)),
+        .local_ref_slots = malloc(sizeof(int32_t[code->max_locals + 1])),
+        .stack_ref_slots = malloc(sizeof(int32_t[max_stack + 1])),
+    };
+    u4 *worklist = malloc(sizeof(u4[code->code_length]));
+    bool *stack = malloc(sizeof(bool[max_stack + 1]));
+    assert(info.depths != NULL && info.stack_refs != NULL && info.targets != NULL &&
+           info.locals_read != NULL && info.ref_locals_read != NULL &&
+           info.stack_ints != NULL && info.local_ref_slots != NULL &&
+           info.stack_ref_slots != NULL && worklist != NULL && stack != NULL &&
+           "Failed to allocate method analysis");
+    for (u4 pc = 0; pc < code->code_length; pc++) {
+        info.depths[pc] = -1;
+    }
+
+    // The successors of an instruction get the depth it leaves the stack at
+    u4 pending = 0;
+    info.depths[0] = 0;
+    worklist[pending++] = 0;
+    while (pending > 0) {
+        u4 pc = worklist[--pending];
+        bytecode_info_t insn = bytecode_info(code->code, pc, class);
+        int32_t local = local_index(code->code, pc);
+        // Loads and iinc read a local, and stores are the instructions that pop one
+        if (local >= 0 && insn.pops == 0) {
+            bool ref = pushes_ref(code->code, pc, class, NULL, 0);
+            (ref ? info.ref_locals_read : info.locals_read)[local] = true;
+        }
+        int32_t depth = info.depths[pc] - insn.pops + insn.pushes;
+        assert(depth >= 0 && (u4) depth <= max_stack && "Operand stack out of bounds");
+        if ((u4) depth > info.max_depth) {
+            info.max_depth = depth;
+        }
+        // The successors' stack is this one's without what the instruction pops
+        const bool *before = &info.stack_refs[pc * max_stack];
+        memcpy(stack, before, max_stack * sizeof(bool));
+        if (insn.pushes > 0) {
+            stack[depth - 1] = pushes_ref(code->code, pc, class, before, info.depths[pc]);
+        }
+        // A switch's successors are its cases, and the default
+        u4 case_count = insn.switches ? switch_case_count(code->code, pc) + 1 : 0;
+        u4 successor_count = case_count + insn.falls_through + insn.branches;
+        for (u4 i = 0; i < successor_count; i++) {
+            // The targets come first, then the next instruction if control falls through
+            int32_t key;
+            bool jumps = i < case_count + insn.branches;
+            u4 next = i < case_count ? switch_case(code->code, pc, i, &key)
+                      : jumps        ? insn.target
+                                     : pc + insn.length;
+            if (jumps) {
+                info.targets[next] = true;
+            }
+            assert(next < code->code_length && "Control flow leaves the method");
+            bool *after = &info.stack_refs[next * max_stack];
+            if (info.depths[next] < 0) {
+                info.depths[next] = depth;
+                memcpy(after, stack, depth * sizeof(bool));
+                worklist[pending++] = next;
+            }
+            assert(info.depths[next] == depth && "Inconsistent operand stack depth");
+            assert(memcmp(after, stack, depth * sizeof(bool)) == 0 &&
+                   "Inconsistent operand stack types");
+        }
+    }
+    free(worklist);
+    free(stack);
+    assign_ref_slots(method, &info);
+    return info;
+}
+
+/**
+ * @brief Gets the C expression for the slot in `refs` of a local read as a reference.
+ */
+static ref_name_t ref_local(const method_info_t *info, u4 local) {
+    ref_name_t name;
+    assert(info->local_ref_slots[local] >= 0 && "Local isn't read as a reference");
+    snprintf(name.text, sizeof(name.text), "refs[%d]", info->local_ref_slots[local]);
+    return name;
+}
+
+/**
+ * @brief Gets the C expression for the slot in `refs` of a stack slot that holds a reference.
+ */
+static ref_name_t ref_stack(const method_info_t *info, int32_t slot) {
+    ref_name_t name;
+    assert(info->stack_ref_slots[slot] >= 0 && "Stack slot never holds a reference");
+    snprintf(name.text, sizeof(name.text), "refs[%d]", info->stack_ref_slots[slot]);
+    return name;
+}
+
+/**
+ * @brief Marks the methods a method calls, directly or indirectly, as reachable.
+ *
+ * @param reachable Whether each of the class's methods is reachable, updated.
+ */
+static void mark_reachable(const method_t *method, const class_file_t *class,
+                           bool *reachable) {
+    reachable[method - class->methods] = true;
+    const code_t *code = &method->code;
+    for (u4 pc = 0; pc < code->code_length;) {
+        bytecode_info_t insn = bytecode_info(code->code, pc, class);
+        if (insn.length == 0) {
+            break; // the rest of the bytecode can't be decoded
+        }
+        if (code->code[pc] == i_invokestatic) {
+            const method_t *callee =
+                class->resolved_methods[operand_u2(&code->code[pc + 1])].method;
+            if (!reachable[callee - class->methods]) {
+                mark_reachable(callee, class, reachable);
+            }
+        }
+        pc += insn.length;
+    }
+}
+
+/**
+ * @brief Writes the C name of a method's function, which is unique even if
+ * the method is overloaded.
+ */
+static void write_function_name(const method_t *method, const class_file_t *class,
+                                FILE *out) {
+    fprintf(out, "m%td_", method - class->methods);
+    for (const char *c = method->name; *c != '\0'; c++) {
+        fputc(isalnum((unsigned char) *c) ? *c : '_', out);
+    }
+}
+
+/**
+ * @brief Writes the signature of a method's function, without a trailing `;` or
+ * body. Int parameter `n` is `ln`, and reference parameter `n` is `an`.
+ */
+static void write_signature(const method_t *method, const class_file_t *class, FILE *out) {
+    fprintf(out, "static %s ", returns_value(method) ? "int32_t" : "void");
+    write_function_name(method, class, out);
+    fputc('(', out);
+    u2 params = get_number_of_parameters(method);
+    bool *refs = malloc(sizeof(bool[params + 1]));
+    assert(refs != NULL && "Failed to allocate parameter types");
+    parameter_refs(method, refs);
+    for (u2 i = 0; i < params; i++) {
+        fprintf(out, "%sint32_t %c%u", i == 0 ? "" : ", ", refs[i] ? 'a' : 'l', i);
+    }
+    fprintf(out, "%s)", params == 0 ? "void" : "");
+    free(refs);
+}
+
+/**
+ * @brief Writes a return, which pops the function's frame first if it has one.
+ *
+ * @param value The returned value, or NULL if the method returns nothing.
+ */
+static void write_return(const method_info_t *info, const char *value, FILE *out) {
+    if (info->ref_slot_count > 0) {
+        fputs("aot_frames = frame.caller;\n    ", out);
+    }
+    fprintf(out, "return%s%s;\n", value != NULL ? " " : "", value != NULL ? value : "");
+}
+
+/**
+ * @brief Writes the C statement an instruction translates to.
+ *
+ * @param info The method's analysis.
+ * @param pc The offset of the instruction.
+ */
+static void write_instruction(const method_t *method, const class_file_t *class,
+                              const method_info_t *info, u4 pc, FILE *out) {
+    // The C operators and helpers of the binary operations
+    static const char *const OPERATIONS[] = {
+        [i_iadd] = "aot_add", [i_isub] = "aot_sub", [i_imul] = "aot_mul",
+        [i_idiv] = "aot_div", [i_irem] = "aot_rem", [i_ishl] = "aot_shl",
+        [i_ishr] = "aot_shr", [i_iushr] = "aot_ushr"};
+    static const char *const BITWISE_OPERATORS[] = {
+        [i_iand] = "&", [i_ior] = "|", [i_ixor] = "^"};
+    static const char *const COMPARISONS[] = {"==", "!=", "<", ">=", ">", "<="};
+
+    const u1 *bytecode = method->code.code;
+    u1 opcode = bytecode[pc];
+    // The operand stack depth before the instruction
+    int32_t d = info->depths[pc];
+    bytecode_info_t insn = bytecode_info(bytecode, pc, class);
+    int32_t local = local_index(bytecode, pc);
+    fputs("    ", out);
+    switch (opcode) {
+        case i_nop:
+        case i_getstatic:
+            fputs(";\n", out);
+            break;
+        case i_iconst_m1:
+        case i_iconst_0:
+        case i_iconst_1:
+        case i_iconst_2:
+        case i_iconst_3:
+        case i_iconst_4:
+        case i_iconst_5:
+            fprintf(out, "s%d = %d;\n", d, opcode - i_iconst_0);
+            break;
+        case i_bipush:
+            fprintf(out, "s%d = %d;\n", d, (int8_t) bytecode[pc + 1]);
+            break;
+        case i_sipush:
+            fprintf(out, "s%d = %d;\n", d, (int16_t) operand_u2(&bytecode[pc + 1]));
+            break;
+        case i_ldc: {
+            const cp_info *constant = &class->constant_pool[bytecode[pc + 1] - 1];
+            if (constant->tag != CONSTANT_Integer) {
+                fprintf(out, "aot_unsupported(0x%02x, %u, \"%s\");\n", opcode, pc,
+                        method->name);
+                break;
+            }
+            int32_t value = constant->integer.bytes;
+            // -2147483648 isn't a valid literal, since 2147483648 doesn't fit in an int
+            if (value == INT32_MIN) {
+                fprintf(out, "s%d = INT32_MIN;\n", d);
+            }
+            else {
+                fprintf(out, "s%d = %d;\n", d, value);
+            }
+            break;
+        }
+        case i_iload:
+        case i_iload_0:
+        case i_iload_1:
+        case i_iload_2:
+        case i_iload_3:
+            fprintf(out, "s%d = l%d;\n", d, local);
+            break;
+        case i_aload:
+        case i_aload_0:
+        case i_aload_1:
+        case i_aload_2:
+        case i_aload_3:
+            fprintf(out, "%s = %s;\n", ref_stack(info, d).text, ref_local(info, local).text);
+            break;
+        case i_istore:
+        case i_istore_0:
+        case i_istore_1:
+        case i_istore_2:
+        case i_istore_3:
+            // Locals that are never read have no variables, and the value is dropped
+            if (info->locals_read[local]) {
+                fprintf(out, "l%d = s%d;\n", local, d - 1);
+            }
+            else {
+                fprintf(out, "(void) s%d;\n", d - 1);
+            }
+            break;
+        case i_astore:
+        case i_astore_0:
+        case i_astore_1:
+        case i_astore_2:
+        case i_astore_3:
+            if (info->ref_locals_read[local]) {
+                fprintf(out, "%s = %s;\n", ref_local(info, local).text,
+                        ref_stack(info, d - 1).text);
+            }
+            else {
+                fputs(";\n", out);
+            }
+            break;
+        case i_iinc:
+            fprintf(out, "l%d = aot_add(l%d, %d);\n", local, local,
+                    (int8_t) bytecode[pc + 2]);
+            break;
+        case i_dup:
+            if (info->stack_refs[pc * method->code.max_stack + d - 1]) {
+                fprintf(out, "%s = %s;\n", ref_stack(info, d).text,
+                        ref_stack(info, d - 1).text);
+            }
+            else {
+                fprintf(out, "s%d = s%d;\n", d, d - 1);
+            }
+            break;
+        case i_iaload:
+            fprintf(out, "s%d = *aot_element(%s, s%d);\n", d - 2, ref_stack(info, d - 2).text,
+                    d - 1);
+            break;
+        case i_iastore:
+            fprintf(out, "*aot_element(%s, s%d) = s%d;\n", ref_stack(info, d - 3).text, d - 2,
+                    d - 1);
+            break;
+        case i_arraylength:
+            fprintf(out, "s%d = aot_array(%s)[0];\n", d - 1, ref_stack(info, d - 1).text);
+            break;
+        case i_newarray:
+            // A collection during the allocation finds every reference in `refs`
+            fprintf(out, "%s = aot_new_array(s%d);\n", ref_stack(info, d - 1).text, d - 1);
+            break;
+        case i_iadd:
+        case i_isub:
+        case i_imul:
+        case i_idiv:
+        case i_irem:
+        case i_ishl:
+        case i_ishr:
+        case i_iushr:
+            fprintf(out, "s%d = %s(s%d, s%d);\n", d - 2, OPERATIONS[opcode], d - 2, d - 1);
+            break;
+        case i_iand:
+        case i_ior:
+        case i_ixor:
+            fprintf(out, "s%d %s= s%d;\n", d - 2, BITWISE_OPERATORS[opcode], d - 1);
+            break;
+        case i_ineg:
+            fprintf(out, "s%d = aot_neg(s%d);\n", d - 1, d - 1);
+            break;
+        case i_ifeq:
+        case i_ifne:
+        case i_iflt:
+        case i_ifge:
+        case i_ifgt:
+        case i_ifle:
+            fprintf(out, "if (s%d %s 0) goto L%u;\n", d - 1, COMPARISONS[opcode - i_ifeq],
+                    insn.target);
+            break;
+        case i_if_icmpeq:
+        case i_if_icmpne:
+        case i_if_icmplt:
+        case i_if_icmpge:
+        case i_if_icmpgt:
+        case i_if_icmple:
+            fprintf(out, "if (s%d %s s%d) goto L%u;\n", d - 2,
+                    COMPARISONS[opcode - i_if_icmpeq], d - 1, insn.target);
+            break;
+        case i_goto:
+            fprintf(out, "goto L%u;\n", insn.target);
+            break;
+        case i_tableswitch:
+        case i_lookupswitch: {
+            // The C compiler picks a jump table or a search for the cases
+            u4 cases = switch_case_count(bytecode, pc);
+            fprintf(out, "switch (s%d) {\n", d - 1);
+            for (u4 i = 0; i < cases; i++) {
+                int32_t key;
+                u4 target = switch_case(bytecode, pc, i, &key);
+                if (key == INT32_MIN) {
+                    fprintf(out, "        case INT32_MIN: goto L%u;\n", target);
+                }
+                else {
+                    fprintf(out, "        case %d: goto L%u;\n", key, target);
+                }
+            }
+            fprintf(out, "        default: goto L%u;\n    }\n",
+                    switch_case(bytecode, pc, cases, NULL));
+            break;
+        }
+        case i_ireturn: {
+            char value[24];
+            snprintf(value, sizeof(value), "s%d", d - 1);
+            write_return(info, value, out);
+            break;
+        }
+        case i_areturn:
+            write_return(info, ref_stack(info, d - 1).text, out);
+            break;
+        case i_return:
+            write_return(info, NULL, out);
+            break;
+        case i_invokevirtual:
+            fprintf(out, "output_int(s%d);\n", d - 1);
+            break;
+        default:
+            if (opcode == i_invokestatic && insn.length > 0) {
+                const method_t *callee =
+                    class->resolved_methods[operand_u2(&bytecode[pc + 1])].method;
+                // The arguments are the top values, with the first one deepest
+                int32_t first = d - insn.pops;
+                if (insn.pushes > 0 && returns_ref(callee)) {
+                    fprintf(out, "%s = ", ref_stack(info, first).text);
+                }
+                else if (insn.pushes > 0) {
+                    fprintf(out, "s%d = ", first);
+                }
+                write_function_name(callee, class, out);
+                fputc('(', out);
+                const bool *stack = &info->stack_refs[pc * method->code.max_stack];
+                for (int32_t i = first; i < d; i++) {
+                    fputs(i == first ? "" : ", ", out);
+                    if (stack[i]) {
+                        fputs(ref_stack(info, i).text, out);
+                    }
+                    else {
+                        fprintf(out, "s%d", i);
+                    }
+                }
+                fputs(");\n", out);
+            }
+            else {
+                fprintf(out, "aot_unsupported(0x%02x, %u, \"%s\");\n", opcode, pc,
+                        method->name);
+            }
+    }
+}
+
+/**
+ * @brief Writes a method's function.
+ */
+static void write_method(const method_t *method, const class_file_t *class, FILE *out) {
+    method_info_t info = analyze_method(method, class);
+    write_signature(method, class, out);
+    fputs(" {\n", out);
+    u2 params = get_number_of_parameters(method);
+    bool *param_refs = malloc(sizeof(bool[params + 1]));
+    assert(param_refs != NULL && "Failed to allocate parameter types");
+    parameter_refs(method, param_refs);
+    for (u2 i = params; i < method->code.max_locals; i++) {
+        if (info.locals_read[i]) {
+            fprintf(out, "    int32_t l%u = 0;\n", i);
+        }
+    }
+    for (u4 i = 0; i < info.max_depth; i++) {
+        if (info.stack_ints[i]) {
+            fprintf(out, "    int32_t s%u;\n", i);
+        }
+    }
+    for (u2 i = 0; i < params; i++) {
+        if (!(param_refs[i] ? info.ref_locals_read : info.locals_read)[i]) {
+            fprintf(out, "    (void) %c%u;\n", param_refs[i] ? 'a' : 'l', i);
+        }
+    }
+    if (info.ref_slot_count > 0) {
+        // The reference parameters that are read have the first slots
+        fprintf(out, "    int32_t refs[%u] = {", info.ref_slot_count);
+        bool first = true;
+        for (u2 i = 0; i < params; i++) {
+            if (param_refs[i] && info.ref_locals_read[i]) {
+                fprintf(out, "%sa%u", first ? "" : ", ", i);
+                first = false;
+            }
+        }
+        fprintf(out, "%s};\n", first ? "0" : "");
+        fprintf(out,
+                "    aot_frame_t frame = {.caller = aot_frames, .refs = refs, .count = %u};\n",
+                info.ref_slot_count);
+        fputs("    aot_frames = &frame;\n", out);
+    }
+    free(param_refs);
+    for (u4 pc = 0; pc < method->code.code_length; pc++) {
+        if (info.depths[pc] < 0) {
+            continue; // unreachable, or inside another instruction
+        }
+        if (info.targets[pc]) {
+            fprintf(out, "L%u:\n", pc);
+        }
+        else if (method->code.code[pc] == i_nop || method->code.code[pc] == i_getstatic) {
+            continue; // only a label needs a statement to go with
+        }
+        write_instruction(method, class, &info, pc, out);
+    }
+    fputs("}\n", out);
+    free(info.depths);
+    free(info.stack_refs);
+    free(info.targets);
+    free(info.locals_read);
+    free(info.ref_locals_read);
+    free(info.stack_ints);
+    free(info.local_ref_slots);
+    free(info.stack_ref_slots);
+}
+
+/**
+ * @brief Writes the C file for a class: the functions of the methods main()
+ * reaches, and aot_main() to call it.
+ */
+static void write_class(const class_file_t *class, const method_t *main_method, FILE *out) {
+    u4 method_count = 0;
+    while (class->methods[method_count].name != NULL) {
+        method_count++;
+    }
+    bool *reachable = calloc(method_count, sizeof(bool));
+    assert(reachable != NULL && "Failed to allocate reachable methods");
+    mark_reachable(main_method, class, reachable);
+
+    fputs("// Generated by MiniJVM's aot tool; link with aot_runtime.c and heap.c\n"
+          "#include \"aot_runtime.h\"\n\n",
+          out);
+    // Declare every function first, since methods can call each other in any order
+    for (u4 i = 0; i < method_count; i++) {
+        if (reachable[i]) {
+            write_signature(&class->methods[i], class, out);
+            fputs(";\n", out);
+        }
+    }
+    for (u4 i = 0; i < method_count; i++) {
+        if (reachable[i]) {
+            fputc('\n', out);
+            write_method(&class->methods[i], class, out);
+        }
+    }
+    // main()'s String[] args would be its first local, which is left null
+    fputs("\nvoid aot_main(void) {\n    ", out);
+    write_function_name(main_method, class, out);
+    fputs("(0);\n}\n", out);
+    free(reachable);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "USAGE: %s <class file> [<output C file>]\n", argv[0]);
+        return 1;
+    }
+
+    class_file_t *class = load_class(argv[1]);
+    assert(class != NULL && "Failed to open file");
+    method_t *main_method = find_method(MAIN_METHOD, MAIN_DESCRIPTOR, class);
+    assert(main_method != NULL && "Missing main() method");
+
+    FILE *out = argc == 3 ? fopen(argv[2], "w") : stdout;
+    assert(out != NULL && "Failed to open output file");
+    write_class(class, main_method, out);
+    int error = fclose(out);
+    assert(error == 0 && "Failed to write output file");
+
+    free_class(class);
+}
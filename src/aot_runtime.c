@@ -0,0 +1,47 @@
+#include "aot_runtime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+heap_t *aot_heap;
+aot_frame_t *aot_frames;
+
+void aot_unsupported(int opcode, int pc, const char *method) {
+    output_flush();
+    fprintf(stderr, "Unsupported instruction 0x%02x at pc %d of %s\n", opcode, pc, method);
+    exit(1);
+}
+
+int32_t aot_new_array(int32_t count) {
+    if (count < 0) {
+        output_flush();
+        fprintf(stderr,
+                "Exception in thread \"main\" java.lang.NegativeArraySizeException: %d\n",
+                count);
+        exit(1);
+    }
+    return heap_new_array(aot_heap, count);
+}
+
+/**
+ * @brief Marks the references in every frame of the shadow stack.
+ */
+static void scan_frames(void *context, heap_t *heap) {
+    (void) context;
+    for (const aot_frame_t *frame = aot_frames; frame != NULL; frame = frame->caller) {
+        for (uint32_t i = 0; i < frame->count; i++) {
+            heap_mark(heap, frame->refs[i]);
+        }
+    }
+}
+
+int main(void) {
+    aot_heap = heap_init();
+    heap_set_limit(aot_heap, DEFAULT_HEAP_LIMIT);
+    // Compressed references are addressed with an add, and arrays never move
+    heap_compress_refs(aot_heap);
+    heap_set_root_scanner(aot_heap, scan_frames, NULL);
+    aot_main();
+    output_flush();
+    heap_free(aot_heap);
+}
@@ -0,0 +1,367 @@
+#include "array_kernels.h"
+
+#include <stddef.h>
+
+#include "heap.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/** A set of kernels, which work on elements that are all in bounds */
+typedef struct {
+    const char *name;
+    void (*fill)(int32_t *elements, int32_t value, size_t count);
+    /** `to` and `from` are either the same or don't overlap */
+    void (*copy)(int32_t *to, const int32_t *from, size_t count);
+    int32_t (*sum)(const int32_t *elements, size_t count);
+    /** Returns the last sum, which is `sum` if `count` is 0 */
+    int32_t (*prefix_sum)(int32_t *elements, size_t count, int32_t sum);
+    /** Returns the first index the elements differ at, or `count` */
+    size_t (*mismatch)(const int32_t *a, const int32_t *b, size_t count);
+} kernels_t;
+
+static void scalar_fill(int32_t *elements, int32_t value, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        elements[i] = value;
+    }
+}
+
+static void scalar_copy(int32_t *to, const int32_t *from, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        to[i] = from[i];
+    }
+}
+
+static int32_t scalar_sum(const int32_t *elements, size_t count) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += (uint32_t) elements[i];
+    }
+    return (int32_t) sum;
+}
+
+static int32_t scalar_prefix_sum(int32_t *elements, size_t count, int32_t sum) {
+    for (size_t i = 0; i < count; i++) {
+        sum = (int32_t) ((uint32_t) sum + (uint32_t) elements[i]);
+        elements[i] = sum;
+    }
+    return sum;
+}
+
+static size_t scalar_mismatch(const int32_t *a, const int32_t *b, size_t count) {
+    size_t i = 0;
+    while (i < count && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+static const kernels_t SCALAR_KERNELS = {
+    .name = "scalar",
+    .fill = scalar_fill,
+    .copy = scalar_copy,
+    .sum = scalar_sum,
+    .prefix_sum = scalar_prefix_sum,
+    .mismatch = scalar_mismatch};
+
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64, so these need no check
+
+static void sse2_fill(int32_t *elements, int32_t value, size_t count) {
+    __m128i values = _mm_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_si128((__m128i *) &elements[i], values);
+    }
+    scalar_fill(&elements[i], value, count - i);
+}
+
+static void sse2_copy(int32_t *to, const int32_t *from, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_si128((__m128i *) &to[i], _mm_loadu_si128((const __m128i *) &from[i]));
+    }
+    scalar_copy(&to[i], &from[i], count - i);
+}
+
+/**
+ * @brief Adds up the lanes of a vector.
+ */
+static int32_t sse2_add_lanes(__m128i sums) {
+    sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, 0x4e));
+    sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, 0xb1));
+    return _mm_cvtsi128_si32(sums);
+}
+
+static int32_t sse2_sum(const int32_t *elements, size_t count) {
+    __m128i sums = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sums = _mm_add_epi32(sums, _mm_loadu_si128((const __m128i *) &elements[i]));
+    }
+    return (int32_t) ((uint32_t) sse2_add_lanes(sums) +
+                      (uint32_t) scalar_sum(&elements[i], count - i));
+}
+
+static int32_t sse2_prefix_sum(int32_t *elements, size_t count, int32_t sum) {
+    // Every lane of `carry` holds the sum so far
+    __m128i carry = _mm_set1_epi32(sum);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        // Add each lane into the ones after it, in two steps of shifting and adding
+        __m128i values = _mm_loadu_si128((const __m128i *) &elements[i]);
+        values = _mm_add_epi32(values, _mm_slli_si128(values, 4));
+        values = _mm_add_epi32(values, _mm_slli_si128(values, 8));
+        values = _mm_add_epi32(values, carry);
+        _mm_storeu_si128((__m128i *) &elements[i], values);
+        carry = _mm_shuffle_epi32(values, 0xff);
+    }
+    return scalar_prefix_sum(&elements[i], count - i, _mm_cvtsi128_si32(carry));
+}
+
+static size_t sse2_mismatch(const int32_t *a, const int32_t *b, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i equal = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) &a[i]),
+                                        _mm_loadu_si128((const __m128i *) &b[i]));
+        // One bit per byte, so 4 per element
+        unsigned differ = ~(unsigned) _mm_movemask_epi8(equal) & 0xffff;
+        if (differ != 0) {
+            return i + (size_t) __builtin_ctz(differ) / 4;
+        }
+    }
+    return i + scalar_mismatch(&a[i], &b[i], count - i);
+}
+
+static const kernels_t SSE2_KERNELS = {
+    .name = "sse2",
+    .fill = sse2_fill,
+    .copy = sse2_copy,
+    .sum = sse2_sum,
+    .prefix_sum = sse2_prefix_sum,
+    .mismatch = sse2_mismatch};
+
+// The AVX2 kernels are only used if the CPU has it, so only they are compiled for it
+
+__attribute__((target("avx2"))) static void avx2_fill(int32_t *elements, int32_t value,
+                                                      size_t count) {
+    __m256i values = _mm256_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_si256((__m256i *) &elements[i], values);
+    }
+    scalar_fill(&elements[i], value, count - i);
+}
+
+__attribute__((target("avx2"))) static void avx2_copy(int32_t *to, const int32_t *from,
+                                                      size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm256_storeu_si256((__m256i *) &to[i],
+                            _mm256_loadu_si256((const __m256i *) &from[i]));
+    }
+    scalar_copy(&to[i], &from[i], count - i);
+}
+
+__attribute__((target("avx2"))) static int32_t avx2_sum(const int32_t *elements,
+                                                        size_t count) {
+    __m256i sums = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        sums = _mm256_add_epi32(sums, _mm256_loadu_si256((const __m256i *) &elements[i]));
+    }
+    __m128i halves =
+        _mm_add_epi32(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+    return (int32_t) ((uint32_t) sse2_add_lanes(halves) +
+                      (uint32_t) scalar_sum(&elements[i], count - i));
+}
+
+__attribute__((target("avx2"))) static size_t avx2_mismatch(const int32_t *a,
+                                                            const int32_t *b, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i equal = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) &a[i]),
+                                           _mm256_loadu_si256((const __m256i *) &b[i]));
+        unsigned differ = ~(unsigned) _mm256_movemask_epi8(equal);
+        if (differ != 0) {
+            return i + (size_t) __builtin_ctz(differ) / 4;
+        }
+    }
+    return i + scalar_mismatch(&a[i], &b[i], count - i);
+}
+
+// A prefix sum can't carry across the two halves of an AVX2 register cheaply
+static const kernels_t AVX2_KERNELS = {
+    .name = "avx2",
+    .fill = avx2_fill,
+    .copy = avx2_copy,
+    .sum = avx2_sum,
+    .prefix_sum = sse2_prefix_sum,
+    .mismatch = avx2_mismatch};
+
+#elif defined(__aarch64__)
+
+// NEON is part of AArch64, so these need no check
+
+static void neon_fill(int32_t *elements, int32_t value, size_t count) {
+    int32x4_t values = vdupq_n_s32(value);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        vst1q_s32(&elements[i], values);
+    }
+    scalar_fill(&elements[i], value, count - i);
+}
+
+static void neon_copy(int32_t *to, const int32_t *from, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        vst1q_s32(&to[i], vld1q_s32(&from[i]));
+    }
+    scalar_copy(&to[i], &from[i], count - i);
+}
+
+static int32_t neon_sum(const int32_t *elements, size_t count) {
+    // Unsigned lanes wrap on overflow
+    uint32x4_t sums = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sums = vaddq_u32(sums, vreinterpretq_u32_s32(vld1q_s32(&elements[i])));
+    }
+    return (int32_t) (vaddvq_u32(sums) + (uint32_t) scalar_sum(&elements[i], count - i));
+}
+
+static int32_t neon_prefix_sum(int32_t *elements, size_t count, int32_t sum) {
+    uint32x4_t zero = vdupq_n_u32(0);
+    uint32x4_t carry = vdupq_n_u32((uint32_t) sum);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        // Add each lane into the ones after it, in two steps of shifting and adding
+        uint32x4_t values = vreinterpretq_u32_s32(vld1q_s32(&elements[i]));
+        values = vaddq_u32(values, vextq_u32(zero, values, 3));
+        values = vaddq_u32(values, vextq_u32(zero, values, 2));
+        values = vaddq_u32(values, carry);
+        vst1q_s32(&elements[i], vreinterpretq_s32_u32(values));
+        carry = vdupq_laneq_u32(values, 3);
+    }
+    return scalar_prefix_sum(&elements[i], count - i, (int32_t) vgetq_lane_u32(carry, 0));
+}
+
+static size_t neon_mismatch(const int32_t *a, const int32_t *b, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        // All ones in the lanes that are equal
+        if (vminvq_u32(vceqq_s32(vld1q_s32(&a[i]), vld1q_s32(&b[i]))) == 0) {
+            break;
+        }
+    }
+    return i + scalar_mismatch(&a[i], &b[i], count - i);
+}
+
+static const kernels_t NEON_KERNELS = {
+    .name = "neon",
+    .fill = neon_fill,
+    .copy = neon_copy,
+    .sum = neon_sum,
+    .prefix_sum = neon_prefix_sum,
+    .mismatch = neon_mismatch};
+
+#endif
+
+/** The kernels array_kernels_init() chose */
+static const kernels_t *kernels = &SCALAR_KERNELS;
+
+const char *array_kernels_init(bool simd) {
+    kernels = &SCALAR_KERNELS;
+    if (simd) {
+#if defined(__x86_64__)
+        __builtin_cpu_init();
+        kernels = __builtin_cpu_supports("avx2") ? &AVX2_KERNELS : &SSE2_KERNELS;
+#elif defined(__aarch64__)
+        kernels = &NEON_KERNELS;
+#endif
+    }
+    return kernels->name;
+}
+
+/**
+ * @brief Gets where a loop over an array from `index` to `end` first accesses an
+ * element that isn't there, or `end` if it never does.
+ */
+static int32_t end_in_bounds(const int32_t *array, int32_t index, int32_t end) {
+    if (index < 0) {
+        return index;
+    }
+    int32_t last = end < array[0] ? end : array[0];
+    // A loop that starts past the end of the array fails on its first element
+    return last > index ? last : index;
+}
+
+int32_t array_fill(int32_t *array, int32_t index, int32_t end, int32_t value) {
+    int32_t last = end_in_bounds(array, index, end);
+    if (index < last) {
+        kernels->fill(&array[index + 1], value, (size_t) (last - index));
+    }
+    if (last < end) {
+        heap_index_out_of_bounds(last, array[0]);
+    }
+    return end;
+}
+
+int32_t array_copy(int32_t *to, const int32_t *from, int32_t index, int32_t end) {
+    // Each element is loaded from `from` before it is stored into `to`
+    int32_t from_last = end_in_bounds(from, index, end);
+    int32_t to_last = end_in_bounds(to, index, end);
+    int32_t last = from_last < to_last ? from_last : to_last;
+    if (index < last) {
+        kernels->copy(&to[index + 1], &from[index + 1], (size_t) (last - index));
+    }
+    if (last < end) {
+        heap_index_out_of_bounds(last, from_last == last ? from[0] : to[0]);
+    }
+    return end;
+}
+
+int32_t array_sum(const int32_t *array, int32_t index, int32_t end, int32_t *sum) {
+    int32_t last = end_in_bounds(array, index, end);
+    if (index < last) {
+        int32_t added = kernels->sum(&array[index + 1], (size_t) (last - index));
+        *sum = (int32_t) ((uint32_t) *sum + (uint32_t) added);
+    }
+    if (last < end) {
+        heap_index_out_of_bounds(last, array[0]);
+    }
+    return end;
+}
+
+int32_t array_prefix_sum(int32_t *array, int32_t index, int32_t end, int32_t *sum) {
+    int32_t last = end_in_bounds(array, index, end);
+    if (index < last) {
+        *sum = kernels->prefix_sum(&array[index + 1], (size_t) (last - index), *sum);
+    }
+    if (last < end) {
+        heap_index_out_of_bounds(last, array[0]);
+    }
+    return end;
+}
+
+int32_t array_mismatch(const int32_t *a, const int32_t *b, int32_t index, int32_t end) {
+    // `a` is loaded from before `b`, and the loop stops at the first difference
+    int32_t a_last = end_in_bounds(a, index, end);
+    int32_t b_last = end_in_bounds(b, index, end);
+    int32_t last = a_last < b_last ? a_last : b_last;
+    if (index < last) {
+        size_t count = (size_t) (last - index);
+        size_t equal = kernels->mismatch(&a[index + 1], &b[index + 1], count);
+        if (equal < count) {
+            return index + (int32_t) equal;
+        }
+    }
+    if (last < end) {
+        heap_index_out_of_bounds(last, a_last == last ? a[0] : b[0]);
+    }
+    return end;
+}
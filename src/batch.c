@@ -0,0 +1,355 @@
+#include "batch.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "deque.h"
+#include "output.h"
+
+/** The characters that separate the fields of a job */
+static const char JOB_SEPARATORS[] = " \t\r\n";
+
+/** A class file named in the job file, which every job that names it shares */
+typedef struct batch_class {
+    char *path;
+    /** The loaded class, or NULL if it couldn't be loaded */
+    class_file_t *class;
+    struct batch_class *next;
+} batch_class_t;
+
+/** A line of the job file */
+typedef struct job {
+    /** The line of the job file the job is on, for reporting failures */
+    u4 line;
+    batch_class_t *class;
+    /** The name of the method to invoke, or NULL to run main() */
+    char *name;
+    char *descriptor;
+    int32_t *args;
+    /** The file the job printed to, and where in it its output starts and ends */
+    int output_fd;
+    off_t output_start;
+    off_t output_end;
+    /** Whether the job failed to run to the end */
+    bool failed;
+} job_t;
+
+/** A worker thread, with the context it runs jobs in */
+typedef struct worker {
+    pthread_t thread;
+    /** The jobs dealt to this worker, which the others steal from */
+    work_deque_t deque;
+    jvm_context_t *context;
+    /** The temporary file the worker prints to */
+    FILE *output;
+    /** All the workers, to steal from */
+    struct worker *workers;
+    u4 worker_count;
+    u4 index;
+} worker_t;
+
+/** The jobs in a job file */
+typedef struct job_list {
+    job_t *jobs;
+    size_t count;
+    size_t capacity;
+    batch_class_t *classes;
+} job_list_t;
+
+/**
+ * @brief Finds a class in the job list's classes, loading it if it is new.
+ */
+static batch_class_t *get_class(job_list_t *list, const char *path,
+                                const jvm_class_options_t *options) {
+    for (batch_class_t *class = list->classes; class != NULL; class = class->next) {
+        if (strcmp(class->path, path) == 0) {
+            return class;
+        }
+    }
+    batch_class_t *class = malloc(sizeof(*class));
+    char *copy = strdup(path);
+    assert(class != NULL && copy != NULL && "Failed to allocate class");
+    *class = (batch_class_t){.path = copy, .next = list->classes};
+    if (access(path, R_OK) == 0) {
+        class->class = jvm_load_class(path, options);
+    }
+    else {
+        fprintf(stderr, "Failed to open %s\n", path);
+    }
+    list->classes = class;
+    return class;
+}
+
+/**
+ * @brief Parses a method like "fib(I)I", and the int arguments after it.
+ *
+ * @param job the job to set the method and arguments of
+ * @param method the method's name and descriptor
+ * @param save_pointer the strtok_r() state of the line, to read the arguments from
+ * @return Whether the arguments are ints, one for each of the method's int parameters.
+ */
+static bool parse_method(job_t *job, const char *method, char **save_pointer) {
+    const char *descriptor = strchr(method, '(');
+    if (descriptor == NULL || descriptor == method) {
+        return false;
+    }
+    size_t params = 0;
+    while (descriptor[1 + params] == 'I') {
+        params++;
+    }
+    if (descriptor[1 + params] != ')') {
+        return false;
+    }
+    job->name = strndup(method, (size_t) (descriptor - method));
+    job->descriptor = strdup(descriptor);
+    job->args = calloc(params > 0 ? params : 1, sizeof(int32_t));
+    assert(job->name != NULL && job->descriptor != NULL && job->args != NULL &&
+           "Failed to allocate job");
+    for (size_t i = 0; i < params; i++) {
+        const char *arg = strtok_r(NULL, JOB_SEPARATORS, save_pointer);
+        if (arg == NULL) {
+            return false;
+        }
+        char *end;
+        errno = 0;
+        long value = strtol(arg, &end, 10);
+        if (*end != '\0' || errno != 0 || value < INT32_MIN || value > INT32_MAX) {
+            return false;
+        }
+        job->args[i] = (int32_t) value;
+    }
+    return strtok_r(NULL, JOB_SEPARATORS, save_pointer) == NULL;
+}
+
+/**
+ * @brief Reads a job file and loads the classes its jobs run.
+ *
+ * @return Whether the file could be read and every job in it is valid.
+ */
+static bool read_jobs(const char *job_file, const jvm_class_options_t *options,
+                      job_list_t *list) {
+    FILE *file = fopen(job_file, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s\n", job_file);
+        return false;
+    }
+    bool valid = true;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    for (u4 line_number = 1; valid && getline(&line, &line_capacity, file) != -1;
+         line_number++) {
+        char *save_pointer;
+        const char *path = strtok_r(line, JOB_SEPARATORS, &save_pointer);
+        if (path == NULL || path[0] == '#') {
+            continue;
+        }
+        if (list->count == list->capacity) {
+            list->capacity = list->capacity > 0 ? list->capacity * 2 : 16;
+            list->jobs = realloc(list->jobs, sizeof(job_t[list->capacity]));
+            assert(list->jobs != NULL && "Failed to allocate jobs");
+        }
+        job_t *job = &list->jobs[list->count++];
+        *job = (job_t){.line = line_number};
+        const char *method = strtok_r(NULL, JOB_SEPARATORS, &save_pointer);
+        if (method != NULL && !parse_method(job, method, &save_pointer)) {
+            fprintf(stderr, "Invalid job on line %" PRIu32 " of %s\n", line_number, job_file);
+            valid = false;
+        }
+        else {
+            job->class = get_class(list, path, options);
+        }
+    }
+    free(line);
+    fclose(file);
+    return valid;
+}
+
+/**
+ * @brief Frees the jobs and the classes they ran.
+ */
+static void free_jobs(job_list_t *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->jobs[i].name);
+        free(list->jobs[i].descriptor);
+        free(list->jobs[i].args);
+    }
+    free(list->jobs);
+    while (list->classes != NULL) {
+        batch_class_t *next = list->classes->next;
+        if (list->classes->class != NULL) {
+            jvm_free_class(list->classes->class);
+        }
+        free(list->classes->path);
+        free(list->classes);
+        list->classes = next;
+    }
+}
+
+/**
+ * @brief Runs a job in a worker's context, and then empties the context's heap.
+ */
+static void run_job(worker_t *worker, job_t *job) {
+    job->output_fd = fileno(worker->output);
+    job->output_start = lseek(job->output_fd, 0, SEEK_CUR);
+    // A class that couldn't be loaded was reported when it was loaded, and fails its jobs
+    jvm_status_t status = JVM_EXCEPTION;
+    class_file_t *class = job->class->class;
+    if (class != NULL && job->name == NULL) {
+        status = jvm_run_main(worker->context, class);
+    }
+    else if (class != NULL) {
+        int32_t result;
+        status = jvm_invoke(worker->context, class, job->name, job->descriptor, job->args,
+                            &result);
+        if (status == JVM_OK && job->descriptor[strlen(job->descriptor) - 1] == 'I') {
+            dprintf(job->output_fd, "%" PRId32 "\n", result);
+        }
+    }
+    if (status == JVM_NO_SUCH_METHOD) {
+        fprintf(stderr, "No method %s%s in %s\n",
+                job->name != NULL ? job->name : "main",
+                job->descriptor != NULL ? job->descriptor : "([Ljava/lang/String;)V",
+                job->class->path);
+    }
+    job->failed = status != JVM_OK;
+    job->output_end = lseek(job->output_fd, 0, SEEK_CUR);
+    jvm_context_reset(worker->context);
+}
+
+/**
+ * @brief Steals a job from another worker's deque.
+ *
+ * @return The job, or NULL once every other worker's deque is empty.
+ */
+static job_t *steal_job(worker_t *worker) {
+    bool contended;
+    do {
+        contended = false;
+        for (u4 i = 1; i < worker->worker_count; i++) {
+            worker_t *victim = &worker->workers[(worker->index + i) % worker->worker_count];
+            bool lost_race;
+            job_t *job = deque_steal(&victim->deque, &lost_race);
+            if (job != NULL) {
+                return job;
+            }
+            contended |= lost_race;
+        }
+        // A lost race means the victim may still have jobs left
+    } while (contended);
+    return NULL;
+}
+
+/**
+ * @brief Runs a worker's jobs, and then the jobs it can steal, until none are left.
+ */
+static void *run_worker(void *arg) {
+    worker_t *worker = arg;
+    // Nothing is pushed once the workers start, so empty deques stay empty
+    job_t *job;
+    while ((job = deque_pop(&worker->deque)) != NULL || (job = steal_job(worker)) != NULL) {
+        run_job(worker, job);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Copies a job's output from the file its worker printed it to onto stdout.
+ */
+static void copy_output(const job_t *job) {
+    char buffer[OUTPUT_BUFFER_SIZE];
+    for (off_t offset = job->output_start; offset < job->output_end;) {
+        size_t wanted = (size_t) (job->output_end - offset);
+        ssize_t length = pread(job->output_fd, buffer,
+                               wanted < sizeof(buffer) ? wanted : sizeof(buffer), offset);
+        assert(length > 0 && "Failed to read job output");
+        for (ssize_t written = 0; written < length;) {
+            ssize_t count =
+                write(STDOUT_FILENO, &buffer[written], (size_t) (length - written));
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            assert(count >= 0 && "Failed to write output");
+            written += count;
+        }
+        offset += length;
+    }
+}
+
+int run_batch(const char *job_file, const jvm_class_options_t *class_options,
+              const jvm_context_options_t *context_options, u4 workers) {
+    // The workers share the classes, which are never written to as they run
+    job_list_t list = {0};
+    if (!read_jobs(job_file, class_options, &list)) {
+        free_jobs(&list);
+        return 1;
+    }
+
+    worker_t *pool = calloc(workers, sizeof(*pool));
+    assert(pool != NULL && "Failed to allocate workers");
+    bool created = true;
+    for (u4 i = 0; i < workers; i++) {
+        worker_t *worker = &pool[i];
+        *worker = (worker_t){
+            .workers = pool,
+            .worker_count = workers,
+            .index = i,
+        };
+        worker->output = tmpfile();
+        assert(worker->output != NULL && "Failed to create worker output");
+        jvm_context_options_t options = *context_options;
+        options.output_fd = fileno(worker->output);
+        worker->context = jvm_context_create(&options);
+        created &= worker->context != NULL;
+        // Leave room for every job, since any worker may end up with all of them
+        deque_init(&worker->deque, list.count);
+    }
+    if (!created) {
+        fprintf(stderr, "Failed to reserve the arena for compressed references\n");
+    }
+    else {
+        // Deal the jobs out in turn, so each worker starts with jobs from all over the file
+        for (size_t i = 0; i < list.count; i++) {
+            bool pushed = deque_push(&pool[i % workers].deque, &list.jobs[i]);
+            assert(pushed && "Deque is full");
+        }
+        for (u4 i = 0; i < workers; i++) {
+            int error = pthread_create(&pool[i].thread, NULL, run_worker, &pool[i]);
+            assert(error == 0 && "Failed to start worker thread");
+        }
+        for (u4 i = 0; i < workers; i++) {
+            pthread_join(pool[i].thread, NULL);
+        }
+    }
+
+    for (u4 i = 0; i < workers; i++) {
+        if (pool[i].context != NULL) {
+            // Writes out what the context's output still holds
+            jvm_context_free(pool[i].context);
+        }
+    }
+    size_t failed = 0;
+    if (created) {
+        for (size_t i = 0; i < list.count; i++) {
+            copy_output(&list.jobs[i]);
+            if (list.jobs[i].failed) {
+                fprintf(stderr, "Job on line %" PRIu32 " of %s failed\n", list.jobs[i].line,
+                        job_file);
+                failed++;
+            }
+        }
+    }
+    for (u4 i = 0; i < workers; i++) {
+        deque_free(&pool[i].deque);
+        fclose(pool[i].output);
+    }
+    free(pool);
+    free_jobs(&list);
+    return created && failed == 0 ? 0 : 1;
+}
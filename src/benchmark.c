@@ -0,0 +1,452 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The benchmark harness behind `make bench`. It runs the jvm on each class
+ * file a number of times, with its output thrown away, and measures each run
+ * from the outside: the wall time from exec() to exit, the user-space
+ * instructions retired by the process (a hardware counter, where the kernel
+ * allows it) and its peak resident set size. A benchmark's result is the
+ * fastest and the median wall time over its runs, with how far the median was
+ * above the fastest as an estimate of the noise; the median instruction count;
+ * and the largest peak RSS. The fastest time is the one compared, since noise
+ * only ever makes a run slower.
+ *
+ * The results are written as JSON, one benchmark per line. Given a baseline
+ * (results saved from an earlier run), each benchmark is also compared with
+ * its baseline. Instruction counts hardly vary from run to run, so when both
+ * have one, an instruction count that grew by more than the threshold fails
+ * the run, and the time is only reported. Otherwise the fastest time has to
+ * grow by more than the time threshold plus the larger of the two noise
+ * estimates to fail it.
+ */
+
+/** The default number of times each benchmark runs */
+#define DEFAULT_ITERATIONS 5
+/** The default change in instructions, in percent, that counts as a regression */
+#define DEFAULT_THRESHOLD 5.0
+/** The default change in wall time, in percent and on top of the noise, that does */
+#define DEFAULT_TIME_THRESHOLD 10.0
+/** The longest benchmark name a baseline can hold */
+#define MAX_NAME 128
+/** The most options that can be passed on to the jvm */
+#define MAX_JVM_ARGS 32
+
+/** What one run of a benchmark measured */
+typedef struct {
+    uint64_t wall_ns;
+    /** The user-space instructions retired, if `counted` */
+    uint64_t instructions;
+    bool counted;
+    /** The peak resident set size in KiB */
+    long peak_rss_kb;
+} run_t;
+
+/** A benchmark's result over all its runs */
+typedef struct {
+    char name[MAX_NAME];
+    /** The fastest run's wall time */
+    uint64_t wall_ns;
+    uint64_t median_wall_ns;
+    /** How much slower than the fastest run the median run was, in percent */
+    double wall_noise;
+    uint64_t instructions;
+    /** Whether every run counted its instructions */
+    bool counted;
+    long peak_rss_kb;
+} result_t;
+
+/**
+ * @brief Reads the monotonic clock.
+ */
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + (uint64_t) time.tv_nsec;
+}
+
+/**
+ * @brief Opens a counter of the user-space instructions a process retires
+ * once it calls exec().
+ *
+ * @return The counter's file descriptor, or -1 if the kernel doesn't allow it.
+ */
+static int open_instruction_counter(pid_t pid) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = PERF_COUNT_HW_INSTRUCTIONS,
+        .disabled = 1,
+        .enable_on_exec = 1,
+        .inherit = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+    return (int) syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * @brief Runs a program once with its output sent to /dev/null.
+ *
+ * The child waits on a pipe until its instruction counter is open, so the
+ * counter and the clock both start at its exec().
+ *
+ * @param argv the program and its arguments
+ * @param run set to what the run measured
+ * @return Whether the program exited with status 0.
+ */
+static bool run_once(char *const argv[], run_t *run) {
+    int ready[2];
+    int error = pipe(ready);
+    assert(error == 0 && "Failed to create pipe");
+    pid_t pid = fork();
+    assert(pid >= 0 && "Failed to fork");
+    if (pid == 0) {
+        close(ready[1]);
+        char go;
+        if (read(ready[0], &go, 1) != 1) {
+            _exit(127);
+        }
+        close(ready[0]);
+        int null = open("/dev/null", O_WRONLY);
+        if (null < 0 || dup2(null, STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    close(ready[0]);
+    int counter = open_instruction_counter(pid);
+    uint64_t start = now_ns();
+    ssize_t written = write(ready[1], "", 1);
+    assert(written == 1 && "Failed to start benchmark");
+    close(ready[1]);
+
+    int status;
+    struct rusage usage;
+    pid_t waited = wait4(pid, &status, 0, &usage);
+    assert(waited == pid && "Failed to wait for benchmark");
+    run->wall_ns = now_ns() - start;
+    run->peak_rss_kb = usage.ru_maxrss;
+    run->counted = counter >= 0 &&
+                   read(counter, &run->instructions, sizeof(run->instructions)) ==
+                       (ssize_t) sizeof(run->instructions);
+    if (counter >= 0) {
+        close(counter);
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * @brief Orders two uint64_ts, for qsort().
+ */
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Gets the median of some values, reordering them.
+ */
+static uint64_t median(uint64_t *values, unsigned count) {
+    qsort(values, count, sizeof(*values), compare_u64);
+    return count % 2 == 1 ? values[count / 2]
+                          : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/**
+ * @brief Gets how much a value changed from its baseline, in percent.
+ */
+static double percent_change(uint64_t value, uint64_t baseline) {
+    if (baseline == 0) {
+        return 0.0;
+    }
+    return 100.0 * ((double) value - (double) baseline) / (double) baseline;
+}
+
+/**
+ * @brief Names a benchmark after its class file: "benchmarks/Collatz.class" is "Collatz".
+ */
+static void benchmark_name(const char *path, char name[MAX_NAME]) {
+    const char *base = strrchr(path, '/');
+    base = base != NULL ? base + 1 : path;
+    size_t length = strcspn(base, ".");
+    if (length >= MAX_NAME) {
+        length = MAX_NAME - 1;
+    }
+    memcpy(name, base, length);
+    name[length] = '\0';
+}
+
+/**
+ * @brief Runs a benchmark `iterations` times and takes the fastest time and the
+ * median instruction count.
+ *
+ * @return Whether every run succeeded.
+ */
+static bool run_benchmark(char **argv, unsigned iterations, result_t *result) {
+    uint64_t wall_ns[iterations];
+    uint64_t instructions[iterations];
+    result->counted = true;
+    result->peak_rss_kb = 0;
+    for (unsigned i = 0; i < iterations; i++) {
+        run_t run;
+        if (!run_once(argv, &run)) {
+            return false;
+        }
+        wall_ns[i] = run.wall_ns;
+        instructions[i] = run.instructions;
+        result->counted &= run.counted;
+        if (run.peak_rss_kb > result->peak_rss_kb) {
+            result->peak_rss_kb = run.peak_rss_kb;
+        }
+    }
+    // median() sorts the times, so the fastest is first
+    result->median_wall_ns = median(wall_ns, iterations);
+    result->wall_ns = wall_ns[0];
+    result->wall_noise = percent_change(result->median_wall_ns, result->wall_ns);
+    result->instructions = result->counted ? median(instructions, iterations) : 0;
+    return true;
+}
+
+/**
+ * @brief Writes the results as JSON, one benchmark per line, which is the
+ * layout read_baseline() reads back.
+ */
+static void write_results(const result_t *results, size_t count, unsigned iterations,
+                          const char *path) {
+    FILE *out = fopen(path, "w");
+    assert(out != NULL && "Failed to open results file");
+    fprintf(out, "{\n  \"iterations\": %u,\n  \"benchmarks\": [", iterations);
+    const char *separator = "";
+    for (size_t i = 0; i < count; i++) {
+        const result_t *result = &results[i];
+        fprintf(out,
+                "%s\n    {\"name\": \"%s\", \"wall_ns\": %" PRIu64
+                ", \"median_wall_ns\": %" PRIu64
+                ", \"wall_noise_pct\": %.1f, \"instructions\": ",
+                separator, result->name, result->wall_ns, result->median_wall_ns,
+                result->wall_noise);
+        if (result->counted) {
+            fprintf(out, "%" PRIu64, result->instructions);
+        }
+        else {
+            fprintf(out, "null");
+        }
+        fprintf(out, ", \"peak_rss_kb\": %ld}", result->peak_rss_kb);
+        separator = ",";
+    }
+    fprintf(out, "\n  ]\n}\n");
+    int error = fclose(out);
+    assert(error == 0 && "Failed to write results file");
+}
+
+/**
+ * @brief Reads the results a previous run wrote with write_results().
+ *
+ * @param count set to the number of benchmarks read
+ * @return The results, allocated on the heap, or NULL if the file can't be opened.
+ */
+static result_t *read_baseline(const char *path, size_t *count) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    // Allocated up front, so a baseline with no benchmarks in it is still one
+    size_t capacity = 16;
+    result_t *results = malloc(sizeof(result_t[capacity]));
+    assert(results != NULL && "Failed to allocate baseline");
+    *count = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, file) != -1) {
+        result_t result = {.counted = false};
+        const char *start = strstr(line, "{\"name\": \"");
+        if (start == NULL || sscanf(start, "{\"name\": \"%127[^\"]\", \"wall_ns\": %" SCNu64,
+                                    result.name, &result.wall_ns) != 2) {
+            continue;
+        }
+        // A baseline from before noise was estimated has none, which counts as none
+        const char *noise = strstr(start, "\"wall_noise_pct\": ");
+        if (noise != NULL) {
+            sscanf(noise, "\"wall_noise_pct\": %lf", &result.wall_noise);
+        }
+        const char *instructions = strstr(start, "\"instructions\": ");
+        result.counted =
+            instructions != NULL &&
+            sscanf(instructions, "\"instructions\": %" SCNu64, &result.instructions) == 1;
+        if (*count == capacity) {
+            capacity *= 2;
+            results = realloc(results, sizeof(result_t[capacity]));
+            assert(results != NULL && "Failed to allocate baseline");
+        }
+        results[(*count)++] = result;
+    }
+    free(line);
+    fclose(file);
+    return results;
+}
+
+/**
+ * @brief Reports a benchmark's result on stderr, compared with its baseline if
+ * there is one.
+ *
+ * @return Whether the instruction count regressed beyond the threshold, or, if
+ *   either has no instruction count, the wall time beyond the time threshold
+ *   and the noise.
+ */
+static bool report(const result_t *result, const result_t *baseline, double threshold,
+                   double time_threshold) {
+    bool regressed = false;
+    fprintf(stderr, "[bench] %-22s %10.1f ms (median %.1f ms, +%4.1f%%)", result->name,
+            result->wall_ns / 1e6, result->median_wall_ns / 1e6, result->wall_noise);
+    bool by_instructions = baseline != NULL && result->counted && baseline->counted;
+    if (baseline != NULL) {
+        double change = percent_change(result->wall_ns, baseline->wall_ns);
+        double noise = result->wall_noise > baseline->wall_noise ? result->wall_noise
+                                                                 : baseline->wall_noise;
+        regressed |= !by_instructions && change > time_threshold + noise;
+        fprintf(stderr, " (%+6.1f%%)", change);
+    }
+    if (result->counted) {
+        fprintf(stderr, " %14" PRIu64 " instructions", result->instructions);
+        if (baseline != NULL && baseline->counted) {
+            double change = percent_change(result->instructions, baseline->instructions);
+            regressed |= change > threshold;
+            fprintf(stderr, " (%+6.1f%%)", change);
+        }
+    }
+    fprintf(stderr, " %8ld KiB peak RSS%s\n", result->peak_rss_kb,
+            regressed ? "  REGRESSION" : "");
+    return regressed;
+}
+
+/**
+ * @brief Prints the command-line usage to stderr.
+ */
+static void print_usage(const char *program) {
+    fprintf(stderr, "USAGE: %s [options] <jvm> <class file>...\n", program);
+    fprintf(stderr, "  --iterations=<n>    run each benchmark n times (default %d)\n",
+            DEFAULT_ITERATIONS);
+    fprintf(stderr, "  --output=<file>     write the results to a JSON file\n");
+    fprintf(stderr, "  --baseline=<file>   compare the results with ones written before\n");
+    fprintf(stderr,
+            "  --threshold=<pct>   fail on pct percent more instructions "
+            "(default %.0f)\n",
+            DEFAULT_THRESHOLD);
+    fprintf(stderr,
+            "  --time-threshold=<pct> or, without instruction counts, on a slowdown of\n"
+            "                      pct percent more than the noise (default %.0f)\n",
+            DEFAULT_TIME_THRESHOLD);
+    fprintf(stderr, "  --jvm-arg=<option>  pass an option to the jvm\n");
+}
+
+int main(int argc, char *argv[]) {
+    unsigned iterations = DEFAULT_ITERATIONS;
+    const char *output_path = NULL;
+    const char *baseline_path = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+    double time_threshold = DEFAULT_TIME_THRESHOLD;
+    // The jvm's command line: the jvm, its options and the class file
+    char *jvm_argv[MAX_JVM_ARGS + 3];
+    int jvm_argc = 1;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        const char *option = argv[arg];
+        char *end = NULL;
+        bool valid = true;
+        if (strncmp(option, "--iterations=", strlen("--iterations=")) == 0) {
+            unsigned long value = strtoul(option + strlen("--iterations="), &end, 10);
+            iterations = (unsigned) value;
+            valid = *end == '\0' && value > 0 && value <= 1000;
+        }
+        else if (strncmp(option, "--output=", strlen("--output=")) == 0) {
+            output_path = option + strlen("--output=");
+        }
+        else if (strncmp(option, "--baseline=", strlen("--baseline=")) == 0) {
+            baseline_path = option + strlen("--baseline=");
+        }
+        else if (strncmp(option, "--threshold=", strlen("--threshold=")) == 0) {
+            threshold = strtod(option + strlen("--threshold="), &end);
+            valid = *end == '\0' && threshold >= 0;
+        }
+        else if (strncmp(option, "--time-threshold=", strlen("--time-threshold=")) == 0) {
+            time_threshold = strtod(option + strlen("--time-threshold="), &end);
+            valid = *end == '\0' && time_threshold >= 0;
+        }
+        else if (strncmp(option, "--jvm-arg=", strlen("--jvm-arg=")) == 0) {
+            valid = jvm_argc <= MAX_JVM_ARGS;
+            if (valid) {
+                jvm_argv[jvm_argc++] = argv[arg] + strlen("--jvm-arg=");
+            }
+        }
+        else {
+            valid = false;
+        }
+        if (!valid) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - arg < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    jvm_argv[0] = argv[arg++];
+    jvm_argv[jvm_argc + 1] = NULL;
+
+    size_t baseline_count = 0;
+    result_t *baseline = NULL;
+    if (baseline_path != NULL) {
+        baseline = read_baseline(baseline_path, &baseline_count);
+        if (baseline == NULL) {
+            fprintf(stderr, "Failed to open %s\n", baseline_path);
+            return 1;
+        }
+    }
+
+    size_t count = (size_t) (argc - arg);
+    result_t *results = calloc(count, sizeof(*results));
+    assert(results != NULL && "Failed to allocate results");
+    bool failed = false;
+    size_t regressions = 0;
+    for (size_t i = 0; i < count; i++) {
+        result_t *result = &results[i];
+        jvm_argv[jvm_argc] = argv[arg + i];
+        benchmark_name(argv[arg + i], result->name);
+        if (!run_benchmark(jvm_argv, iterations, result)) {
+            fprintf(stderr, "[bench] %s failed\n", result->name);
+            failed = true;
+            continue;
+        }
+        const result_t *base = NULL;
+        for (size_t j = 0; j < baseline_count; j++) {
+            if (strcmp(baseline[j].name, result->name) == 0) {
+                base = &baseline[j];
+            }
+        }
+        regressions += report(result, base, threshold, time_threshold);
+    }
+    if (output_path != NULL && !failed) {
+        write_results(results, count, iterations, output_path);
+    }
+    if (regressions > 0) {
+        fprintf(stderr, "[bench] %zu benchmarks regressed\n", regressions);
+    }
+    free(results);
+    free(baseline);
+    return failed || regressions > 0 ? 1 : 0;
+}
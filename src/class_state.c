@@ -0,0 +1,65 @@
+#include "class_state.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+class_state_t *class_state_create(class_file_t *class) {
+    class_state_t *state = malloc(sizeof(*state));
+    assert(state != NULL && "Failed to allocate class state");
+    u4 count = 0;
+    while (class->methods[count].name != NULL) {
+        count++;
+    }
+    *state = (class_state_t){
+        .class = class,
+        .class_id = class->id,
+        .methods = calloc(count > 0 ? count : 1, sizeof(method_state_t)),
+        .method_count = count,
+    };
+    assert(state->methods != NULL && "Failed to allocate class state");
+    for (u4 i = 0; i < count; i++) {
+        const method_t *method = &class->methods[i];
+        method_state_t *method_state = &state->methods[i];
+        method_state->insns = method->insns;
+        if (method->jit != NULL) {
+            // Tiering up rewrites the handlers, so the copy is already threaded
+            method_state->insns = malloc(sizeof(insn_t[method->insn_count]));
+            method_state->jit = malloc(sizeof(*method_state->jit));
+            assert(method_state->insns != NULL && method_state->jit != NULL &&
+                   "Failed to allocate class state");
+            memcpy(method_state->insns, method->insns, sizeof(insn_t[method->insn_count]));
+            jit_init_state(method_state->jit, method);
+        }
+        if (method->memo != NULL) {
+            method_state->memo = memo_new_entries(method->memo);
+        }
+    }
+    return state;
+}
+
+void class_state_free(class_state_t *state) {
+    for (u4 i = 0; i < state->method_count; i++) {
+        method_state_t *method_state = &state->methods[i];
+        if (method_state->jit != NULL) {
+            jit_free_state(method_state->jit);
+            free(method_state->jit);
+            free(method_state->insns);
+        }
+        free(method_state->memo);
+    }
+    free(state->methods);
+    free(state);
+}
+
+class_state_t *class_state_find(class_state_t **states, class_file_t *class) {
+    for (class_state_t *state = *states; state != NULL; state = state->next) {
+        if (state->class == class && state->class_id == class->id) {
+            return state;
+        }
+    }
+    class_state_t *state = class_state_create(class);
+    state->next = *states;
+    *states = state;
+    return state;
+}
@@ -0,0 +1,808 @@
+#include "decode.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jvm.h"
+#include "exception.h"
+#include "output.h"
+#include "read_class.h"
+
+const char *const OP_NAMES[NUM_OPS] = {
+    [op_unsupported] = "unsupported",
+    [op_iconst] = "iconst",
+    [op_iload] = "iload",
+    [op_aload] = "aload",
+    [op_istore] = "istore",
+    [op_astore] = "astore",
+    [op_iaload] = "iaload",
+    [op_iastore] = "iastore",
+    [op_dup] = "dup",
+    [op_iadd] = "iadd",
+    [op_isub] = "isub",
+    [op_imul] = "imul",
+    [op_idiv] = "idiv",
+    [op_irem] = "irem",
+    [op_ineg] = "ineg",
+    [op_ishl] = "ishl",
+    [op_ishr] = "ishr",
+    [op_iushr] = "iushr",
+    [op_iand] = "iand",
+    [op_ior] = "ior",
+    [op_ixor] = "ixor",
+    [op_iinc] = "iinc",
+    [op_ifeq] = "ifeq",
+    [op_ifne] = "ifne",
+    [op_iflt] = "iflt",
+    [op_ifge] = "ifge",
+    [op_ifgt] = "ifgt",
+    [op_ifle] = "ifle",
+    [op_if_icmpeq] = "if_icmpeq",
+    [op_if_icmpne] = "if_icmpne",
+    [op_if_icmplt] = "if_icmplt",
+    [op_if_icmpge] = "if_icmpge",
+    [op_if_icmpgt] = "if_icmpgt",
+    [op_if_icmple] = "if_icmple",
+    [op_goto] = "goto",
+    [op_tableswitch] = "tableswitch",
+    [op_lookupswitch] = "lookupswitch",
+    [op_ireturn] = "ireturn",
+    [op_areturn] = "areturn",
+    [op_return] = "return",
+    [op_print] = "print",
+    [op_invokestatic] = "invokestatic",
+    [op_invokestatic_memo] = "invokestatic_memo",
+    [op_newarray] = "newarray",
+    [op_arraylength] = "arraylength",
+    [op_iload_iload_if_icmpeq] = "iload_iload_if_icmpeq",
+    [op_iload_iload_if_icmpne] = "iload_iload_if_icmpne",
+    [op_iload_iload_if_icmplt] = "iload_iload_if_icmplt",
+    [op_iload_iload_if_icmpge] = "iload_iload_if_icmpge",
+    [op_iload_iload_if_icmpgt] = "iload_iload_if_icmpgt",
+    [op_iload_iload_if_icmple] = "iload_iload_if_icmple",
+    [op_iload_aload_arraylength_if_icmpge] = "iload_aload_arraylength_if_icmpge",
+    [op_iinc_goto] = "iinc_goto",
+    [op_iload_iconst_iadd_istore] = "iload_iconst_iadd_istore",
+    [op_aload_iload_iaload] = "aload_iload_iaload",
+    [op_aload_arraylength] = "aload_arraylength",
+    [op_move] = "move",
+    [op_move_const] = "move_const",
+    [op_add] = "add",
+    [op_add_const] = "add_const",
+    [op_sub] = "sub",
+    [op_sub_from_const] = "sub_from_const",
+    [op_mul] = "mul",
+    [op_mul_const] = "mul_const",
+    [op_div] = "div",
+    [op_rem] = "rem",
+    [op_div_pow2] = "div_pow2",
+    [op_rem_pow2] = "rem_pow2",
+    [op_div_magic] = "div_magic",
+    [op_rem_magic] = "rem_magic",
+    [op_neg] = "neg",
+    [op_and] = "and",
+    [op_and_const] = "and_const",
+    [op_or] = "or",
+    [op_or_const] = "or_const",
+    [op_xor] = "xor",
+    [op_xor_const] = "xor_const",
+    [op_shl] = "shl",
+    [op_shl_const] = "shl_const",
+    [op_shr] = "shr",
+    [op_shr_const] = "shr_const",
+    [op_ushr] = "ushr",
+    [op_ushr_const] = "ushr_const",
+    [op_load_element] = "load_element",
+    [op_store_element] = "store_element",
+    [op_load_element_unchecked] = "load_element_unchecked",
+    [op_store_element_unchecked] = "store_element_unchecked",
+    [op_array_length] = "array_length",
+    [op_new_array] = "new_array",
+    [op_fill] = "fill",
+    [op_copy] = "copy",
+    [op_sum] = "sum",
+    [op_prefix_sum] = "prefix_sum",
+    [op_mismatch] = "mismatch",
+    [op_br_eq] = "br_eq",
+    [op_br_ne] = "br_ne",
+    [op_br_lt] = "br_lt",
+    [op_br_ge] = "br_ge",
+    [op_br_gt] = "br_gt",
+    [op_br_le] = "br_le",
+    [op_br_eq_const] = "br_eq_const",
+    [op_br_ne_const] = "br_ne_const",
+    [op_br_lt_const] = "br_lt_const",
+    [op_br_ge_const] = "br_ge_const",
+    [op_br_gt_const] = "br_gt_const",
+    [op_br_le_const] = "br_le_const",
+    [op_br_table] = "br_table",
+    [op_br_lookup] = "br_lookup",
+    [op_return_value] = "return_value",
+    [op_print_value] = "print_value",
+    [op_call] = "call",
+    [op_call_memo] = "call_memo",
+};
+
+/**
+ * @brief Gets the length in bytes of a bytecode instruction other than a switch.
+ *
+ * @param opcode The instruction's opcode.
+ * @return The length of the instruction, or 0 if MiniJVM doesn't support it.
+ */
+static u4 opcode_length(u1 opcode) {
+    switch (opcode) {
+        case i_bipush:
+        case i_ldc:
+        case i_iload:
+        case i_aload:
+        case i_istore:
+        case i_astore:
+        case i_newarray:
+            return 2;
+
+        case i_sipush:
+        case i_iinc:
+        case i_ifeq:
+        case i_ifne:
+        case i_iflt:
+        case i_ifge:
+        case i_ifgt:
+        case i_ifle:
+        case i_if_icmpeq:
+        case i_if_icmpne:
+        case i_if_icmplt:
+        case i_if_icmpge:
+        case i_if_icmpgt:
+        case i_if_icmple:
+        case i_goto:
+        case i_getstatic:
+        case i_invokevirtual:
+        case i_invokestatic:
+            return 3;
+
+        case i_nop:
+        case i_iconst_m1:
+        case i_iconst_0:
+        case i_iconst_1:
+        case i_iconst_2:
+        case i_iconst_3:
+        case i_iconst_4:
+        case i_iconst_5:
+        case i_iload_0:
+        case i_iload_1:
+        case i_iload_2:
+        case i_iload_3:
+        case i_aload_0:
+        case i_aload_1:
+        case i_aload_2:
+        case i_aload_3:
+        case i_iaload:
+        case i_istore_0:
+        case i_istore_1:
+        case i_istore_2:
+        case i_istore_3:
+        case i_astore_0:
+        case i_astore_1:
+        case i_astore_2:
+        case i_astore_3:
+        case i_iastore:
+        case i_dup:
+        case i_iadd:
+        case i_isub:
+        case i_imul:
+        case i_idiv:
+        case i_irem:
+        case i_ineg:
+        case i_ishl:
+        case i_ishr:
+        case i_iushr:
+        case i_iand:
+        case i_ior:
+        case i_ixor:
+        case i_ireturn:
+        case i_areturn:
+        case i_return:
+        case i_arraylength:
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Reads a big-endian u2 operand out of the bytecode.
+ */
+static u2 operand_u2(const u1 *bytecode) {
+    return (u2) bytecode[0] << 8 | bytecode[1];
+}
+
+/**
+ * @brief Reads a big-endian s4 operand out of the bytecode.
+ */
+static int32_t operand_s4(const u1 *bytecode) {
+    return (int32_t) ((uint32_t) bytecode[0] << 24 | (uint32_t) bytecode[1] << 16 |
+                      (uint32_t) bytecode[2] << 8 | bytecode[3]);
+}
+
+/**
+ * @brief Gets the offset of a switch's operands, which are padded to start at
+ * a multiple of 4 bytes from the start of the bytecode.
+ */
+static u4 switch_operands(u4 pc) {
+    return (pc + 4) & ~(u4) 3;
+}
+
+/**
+ * @brief Gets the length in bytes of a bytecode instruction.
+ *
+ * @param bytecode The method's bytecode.
+ * @param pc The offset of the instruction.
+ * @param code_length The length of the bytecode.
+ * @return The length of the instruction, or 0 if MiniJVM doesn't support it or it
+ *   doesn't fit in the bytecode.
+ */
+static u4 instruction_length(const u1 *bytecode, u4 pc, u4 code_length) {
+    u1 opcode = bytecode[pc];
+    if (opcode != i_tableswitch && opcode != i_lookupswitch) {
+        return opcode_length(opcode);
+    }
+    // The default, then low and high or the number of pairs, then the cases
+    u4 operands = switch_operands(pc);
+    u4 header = opcode == i_tableswitch ? 12 : 8;
+    if ((uint64_t) operands + header > code_length) {
+        return 0;
+    }
+    int64_t cases;
+    u4 case_size;
+    if (opcode == i_tableswitch) {
+        cases = (int64_t) operand_s4(&bytecode[operands + 8]) -
+                operand_s4(&bytecode[operands + 4]) + 1;
+        case_size = 4;
+    }
+    else {
+        cases = operand_s4(&bytecode[operands + 4]);
+        case_size = 8;
+    }
+    // A negative number of cases fails verification once the switch is decoded
+    uint64_t end = (uint64_t) operands + header + (cases > 0 ? (uint64_t) cases * case_size : 0);
+    return end <= code_length ? (u4) (end - pc) : 0;
+}
+
+/**
+ * @brief Gets whether an instruction has no effect in MiniJVM and can be left out
+ * of the instruction stream.
+ */
+static bool is_elided(u1 opcode) {
+    return opcode == i_nop || opcode == i_getstatic;
+}
+
+/**
+ * @brief Gets the offset a switch's case jumps to, or -1 if it is outside any method.
+ */
+static int32_t switch_target_pc(u4 pc, int32_t offset) {
+    int64_t target = (int64_t) pc + offset;
+    return target < 0 || target > UINT16_MAX ? -1 : (int32_t) target;
+}
+
+/**
+ * @brief Decodes a tableswitch or lookupswitch into `insn` and its table.
+ * A lookupswitch whose keys span at most twice as many ints as it has cases
+ * becomes a tableswitch, trading a little memory for the binary search.
+ *
+ * Like a branch's, the targets are left as bytecode offsets.
+ *
+ * @return NULL, or why the switch fails verification.
+ */
+static const char *decode_switch(const u1 *bytecode, u4 pc, const class_file_t *class,
+                                 insn_t *insn) {
+    const u1 *operands = &bytecode[switch_operands(pc)];
+    int32_t default_target = switch_target_pc(pc, operand_s4(operands));
+    switch_table_t *table = class_alloc(class, sizeof(*table));
+    insn->table = table;
+    insn->op = op_tableswitch;
+
+    if (bytecode[pc] == i_tableswitch) {
+        int32_t low = operand_s4(&operands[4]);
+        int32_t high = operand_s4(&operands[8]);
+        if (high < low) {
+            return "Tableswitch high is less than low";
+        }
+        table->count = (u4) high - (u4) low + 1;
+        table->low = low;
+        table->targets = class_alloc(class, sizeof(int32_t[table->count + 1]));
+        for (u4 i = 0; i < table->count; i++) {
+            table->targets[i] = switch_target_pc(pc, operand_s4(&operands[12 + 4 * i]));
+        }
+        table->targets[table->count] = default_target;
+        return NULL;
+    }
+
+    int32_t pairs = operand_s4(&operands[4]);
+    if (pairs < 0) {
+        return "Lookupswitch has a negative number of pairs";
+    }
+    const u1 *pair = &operands[8];
+    for (int32_t i = 1; i < pairs; i++) {
+        if (operand_s4(&pair[8 * i]) <= operand_s4(&pair[8 * (i - 1)])) {
+            return "Lookupswitch keys are not sorted";
+        }
+    }
+    int64_t span = pairs == 0 ? 0
+                              : (int64_t) operand_s4(&pair[8 * (pairs - 1)]) -
+                                    operand_s4(&pair[0]) + 1;
+    if (span <= 2 * (int64_t) pairs) {
+        // The keys that aren't cases go to the default
+        table->count = (u4) span;
+        table->low = pairs == 0 ? 0 : operand_s4(&pair[0]);
+        table->targets = class_alloc(class, sizeof(int32_t[table->count + 1]));
+        for (u4 i = 0; i <= table->count; i++) {
+            table->targets[i] = default_target;
+        }
+        for (int32_t i = 0; i < pairs; i++) {
+            u4 index = (u4) operand_s4(&pair[8 * i]) - (u4) table->low;
+            table->targets[index] = switch_target_pc(pc, operand_s4(&pair[8 * i + 4]));
+        }
+        return NULL;
+    }
+    insn->op = op_lookupswitch;
+    table->count = pairs;
+    table->keys = class_alloc(class, sizeof(int32_t[pairs]));
+    table->targets = class_alloc(class, sizeof(int32_t[pairs + 1]));
+    for (int32_t i = 0; i < pairs; i++) {
+        table->keys[i] = operand_s4(&pair[8 * i]);
+        table->targets[i] = switch_target_pc(pc, operand_s4(&pair[8 * i + 4]));
+    }
+    table->targets[pairs] = default_target;
+    return NULL;
+}
+
+/**
+ * @brief Decodes the instruction at `pc` into `insn`.
+ *
+ * Branch targets are left as bytecode offsets; decode_method() resolves them
+ * once every instruction's position in the stream is known.
+ *
+ * @param bytecode The method's bytecode.
+ * @param pc The offset of the instruction to decode.
+ * @param class The class file the method belongs to, for constant pool lookups.
+ * @param insn The instruction to fill in.
+ * @return NULL, or why the instruction fails verification.
+ */
+static const char *decode_instruction(const u1 *bytecode, u4 pc, const class_file_t *class,
+                                      insn_t *insn) {
+    u1 opcode = bytecode[pc];
+    insn->handler = NULL;
+    insn->pc = pc;
+    insn->a = 0;
+    insn->b = 0;
+    insn->c = 0;
+
+    switch (opcode) {
+        case i_iconst_m1:
+        case i_iconst_0:
+        case i_iconst_1:
+        case i_iconst_2:
+        case i_iconst_3:
+        case i_iconst_4:
+        case i_iconst_5:
+            insn->op = op_iconst;
+            insn->a = opcode - i_iconst_0;
+            break;
+        case i_bipush:
+            insn->op = op_iconst;
+            insn->a = (int8_t) bytecode[pc + 1];
+            break;
+        case i_sipush:
+            insn->op = op_iconst;
+            insn->a = (int16_t) operand_u2(&bytecode[pc + 1]);
+            break;
+        case i_ldc: {
+            cp_info *constant = &class->constant_pool[bytecode[pc + 1] - 1];
+            if (constant->tag == CONSTANT_Integer) {
+                insn->op = op_iconst;
+                insn->a = constant->integer.bytes;
+            }
+            else {
+                insn->op = op_unsupported;
+                insn->a = opcode;
+            }
+            break;
+        }
+
+        case i_iload:
+            insn->op = op_iload;
+            insn->a = bytecode[pc + 1];
+            break;
+        case i_iload_0:
+        case i_iload_1:
+        case i_iload_2:
+        case i_iload_3:
+            insn->op = op_iload;
+            insn->a = opcode - i_iload_0;
+            break;
+        case i_aload:
+            insn->op = op_aload;
+            insn->a = bytecode[pc + 1];
+            break;
+        case i_aload_0:
+        case i_aload_1:
+        case i_aload_2:
+        case i_aload_3:
+            insn->op = op_aload;
+            insn->a = opcode - i_aload_0;
+            break;
+        case i_istore:
+            insn->op = op_istore;
+            insn->a = bytecode[pc + 1];
+            break;
+        case i_istore_0:
+        case i_istore_1:
+        case i_istore_2:
+        case i_istore_3:
+            insn->op = op_istore;
+            insn->a = opcode - i_istore_0;
+            break;
+        case i_astore:
+            insn->op = op_astore;
+            insn->a = bytecode[pc + 1];
+            break;
+        case i_astore_0:
+        case i_astore_1:
+        case i_astore_2:
+        case i_astore_3:
+            insn->op = op_astore;
+            insn->a = opcode - i_astore_0;
+            break;
+        case i_iinc:
+            insn->op = op_iinc;
+            insn->a = bytecode[pc + 1];
+            insn->b = (int8_t) bytecode[pc + 2];
+            break;
+
+        case i_iaload:
+            insn->op = op_iaload;
+            break;
+        case i_iastore:
+            insn->op = op_iastore;
+            break;
+        case i_dup:
+            insn->op = op_dup;
+            break;
+        case i_iadd:
+            insn->op = op_iadd;
+            break;
+        case i_isub:
+            insn->op = op_isub;
+            break;
+        case i_imul:
+            insn->op = op_imul;
+            break;
+        case i_idiv:
+            insn->op = op_idiv;
+            break;
+        case i_irem:
+            insn->op = op_irem;
+            break;
+        case i_ineg:
+            insn->op = op_ineg;
+            break;
+        case i_ishl:
+            insn->op = op_ishl;
+            break;
+        case i_ishr:
+            insn->op = op_ishr;
+            break;
+        case i_iushr:
+            insn->op = op_iushr;
+            break;
+        case i_iand:
+            insn->op = op_iand;
+            break;
+        case i_ior:
+            insn->op = op_ior;
+            break;
+        case i_ixor:
+            insn->op = op_ixor;
+            break;
+
+        case i_ifeq:
+        case i_ifne:
+        case i_iflt:
+        case i_ifge:
+        case i_ifgt:
+        case i_ifle:
+        case i_if_icmpeq:
+        case i_if_icmpne:
+        case i_if_icmplt:
+        case i_if_icmpge:
+        case i_if_icmpgt:
+        case i_if_icmple:
+            // The opcodes of both families are consecutive, as are the op_t values
+            insn->op = op_ifeq + (opcode - i_ifeq);
+            insn->a = pc + (int16_t) operand_u2(&bytecode[pc + 1]);
+            break;
+        case i_goto:
+            insn->op = op_goto;
+            insn->a = pc + (int16_t) operand_u2(&bytecode[pc + 1]);
+            break;
+        case i_tableswitch:
+        case i_lookupswitch:
+            return decode_switch(bytecode, pc, class, insn);
+
+        case i_ireturn:
+            insn->op = op_ireturn;
+            break;
+        case i_areturn:
+            insn->op = op_areturn;
+            break;
+        case i_return:
+            insn->op = op_return;
+            break;
+        case i_invokevirtual:
+            insn->op = op_print;
+            break;
+        case i_invokestatic: {
+            u2 index = operand_u2(&bytecode[pc + 1]);
+            const resolved_method_t *callee = &class->resolved_methods[index];
+            // A call into another class can't run, but only fails if it's reached
+            if (callee->method != NULL) {
+                insn->op = op_invokestatic;
+                insn->a = index;
+                insn->callee = callee;
+            }
+            else {
+                insn->op = op_unsupported;
+                insn->a = opcode;
+            }
+            break;
+        }
+        case i_newarray:
+            insn->op = op_newarray;
+            break;
+        case i_arraylength:
+            insn->op = op_arraylength;
+            break;
+
+        default:
+            insn->op = op_unsupported;
+            insn->a = opcode;
+    }
+    return NULL;
+}
+
+/** Marks the offsets in the middle of an instruction, which can't be branched to */
+#define NOT_AN_INSTRUCTION UINT32_MAX
+
+/**
+ * @brief Finds the instruction a branch targets.
+ *
+ * @param index_of_pc The index in the stream of the instruction at each offset.
+ * @param target The offset it targets, replaced with the index of its instruction.
+ * @return NULL, or the reason verification fails if it doesn't target the start
+ *   of an instruction.
+ */
+static const char *resolve_target(const method_t *method, const u4 *index_of_pc,
+                                  int32_t *target) {
+    if (*target < 0 || (u4) *target >= method->code.code_length) {
+        return "Branch target out of range";
+    }
+    if (index_of_pc[*target] == NOT_AN_INSTRUCTION) {
+        return "Branch target inside an instruction";
+    }
+    *target = (int32_t) index_of_pc[*target];
+    return NULL;
+}
+
+/**
+ * @brief Gets whether a method returns a value.
+ */
+static bool returns_value(const method_t *method) {
+    return strchr(method->descriptor, ')')[1] != 'V';
+}
+
+void stack_effect(const insn_t *insn, u4 *pops, u4 *pushes) {
+    *pops = 0;
+    *pushes = 0;
+    switch (insn->op) {
+        case op_iconst:
+        case op_iload:
+        case op_aload:
+            *pushes = 1;
+            break;
+        case op_istore:
+        case op_astore:
+        case op_ifeq:
+        case op_ifne:
+        case op_iflt:
+        case op_ifge:
+        case op_ifgt:
+        case op_ifle:
+        case op_ireturn:
+        case op_areturn:
+        case op_print:
+        case op_tableswitch:
+        case op_lookupswitch:
+            *pops = 1;
+            break;
+        case op_iaload:
+        case op_iadd:
+        case op_isub:
+        case op_imul:
+        case op_idiv:
+        case op_irem:
+        case op_ishl:
+        case op_ishr:
+        case op_iushr:
+        case op_iand:
+        case op_ior:
+        case op_ixor:
+            *pops = 2;
+            *pushes = 1;
+            break;
+        case op_iastore:
+            *pops = 3;
+            break;
+        case op_dup:
+            *pops = 1;
+            *pushes = 2;
+            break;
+        case op_ineg:
+        case op_newarray:
+        case op_arraylength:
+            *pops = 1;
+            *pushes = 1;
+            break;
+        case op_if_icmpeq:
+        case op_if_icmpne:
+        case op_if_icmplt:
+        case op_if_icmpge:
+        case op_if_icmpgt:
+        case op_if_icmple:
+            *pops = 2;
+            break;
+        case op_invokestatic:
+            *pops = insn->callee->num_params;
+            *pushes = returns_value(insn->callee->method);
+            break;
+        default:
+            // iinc, goto, return and traps leave the stack alone
+            break;
+    }
+}
+
+int32_t *compute_depths(const insn_t *insns, u4 count) {
+    int32_t *depths = malloc(sizeof(int32_t[count]));
+    u4 *worklist = malloc(sizeof(u4[count]));
+    assert(depths != NULL && worklist != NULL && "Failed to allocate stack depths");
+    for (u4 i = 0; i < count; i++) {
+        depths[i] = -1;
+    }
+    u4 work_count = 0;
+    depths[0] = 0;
+    worklist[work_count++] = 0;
+    while (work_count > 0) {
+        u4 index = worklist[--work_count];
+        const insn_t *insn = &insns[index];
+        u4 pops, pushes;
+        stack_effect(insn, &pops, &pushes);
+        int32_t after = depths[index] - pops + pushes;
+
+        // The next instruction follows the targets, if control falls through to it
+        u4 target_count = insn_target_count(insn);
+        u4 successor_count = target_count + op_falls_through(insn->op);
+        for (u4 i = 0; i < successor_count; i++) {
+            u4 successor = i < target_count ? insn_target(insn, i) : index + 1;
+            // compute_refmaps() already checked that the depths are consistent
+            if (depths[successor] < 0) {
+                depths[successor] = after;
+                worklist[work_count++] = successor;
+            }
+        }
+    }
+    free(worklist);
+    return depths;
+}
+
+void verify_error(const method_t *method, u4 pc, const char *message) {
+    output_flush();
+    fprintf(stderr, "Exception in thread \"main\" java.lang.VerifyError: ");
+    fprintf(stderr, "(method: %s%s, pc: %u) %s\n", method->name, method->descriptor, pc,
+            message);
+    exception_exit();
+}
+
+void reject_method(method_t *method, const class_file_t *class, u4 pc, const char *message) {
+    insn_t *trap = class_alloc(class, sizeof(insn_t));
+    *trap = (insn_t){.op = op_unsupported, .pc = pc};
+    method->insns = trap;
+    method->insn_count = 1;
+    method->refmaps = NULL;
+    method->refmap_count = 0;
+    method->verify_error = message;
+    method->verify_error_pc = pc;
+}
+
+void decode_method(method_t *method, const class_file_t *class) {
+    const u1 *bytecode = method->code.code;
+    u4 code_length = method->code.code_length;
+    assert(code_length <= UINT16_MAX && "Method code is too long");
+
+    /* First pass: find where each bytecode offset lands in the instruction stream.
+     * Elided instructions map to the instruction that follows them, and every
+     * offset past the first unsupported instruction maps to that instruction. */
+    u4 *index_of_pc = malloc(sizeof(u4[code_length + 1]));
+    assert(index_of_pc != NULL && "Failed to allocate pc map");
+    for (u4 pc = 0; pc <= code_length; pc++) {
+        index_of_pc[pc] = NOT_AN_INSTRUCTION;
+    }
+    u4 count = 0;
+    u4 pc = 0;
+    bool complete = true;
+    while (pc < code_length) {
+        u1 opcode = bytecode[pc];
+        u4 length = instruction_length(bytecode, pc, code_length);
+        if (length == 0 || pc + length > code_length) {
+            complete = false;
+            break;
+        }
+        if (is_elided(opcode)) {
+            index_of_pc[pc] = count;
+        }
+        else {
+            index_of_pc[pc] = count++;
+        }
+        pc += length;
+    }
+    // The stream always ends with a trap, or a return for code that runs off its end
+    u4 end_pc = pc;
+    u4 end_index = count++;
+    for (; pc <= code_length; pc++) {
+        index_of_pc[pc] = end_index;
+    }
+
+    // Second pass: decode each instruction
+    insn_t *insns = class_alloc(class, sizeof(insn_t[count]));
+    insn_t *insn = insns;
+    const char *error = NULL;
+    for (pc = 0; insn < insns + end_index;
+         pc += instruction_length(bytecode, pc, code_length)) {
+        if (is_elided(bytecode[pc])) {
+            continue;
+        }
+        error = decode_instruction(bytecode, pc, class, insn);
+        if (error == NULL && op_is_switch(insn->op)) {
+            for (u4 i = 0; i <= insn->table->count && error == NULL; i++) {
+                error = resolve_target(method, index_of_pc, &insn->table->targets[i]);
+            }
+        }
+        else if (error == NULL && (op_is_branch(insn->op) || insn->op == op_goto)) {
+            error = resolve_target(method, index_of_pc, &insn->a);
+        }
+        if (error != NULL) {
+            break;
+        }
+        insn++;
+    }
+    free(index_of_pc);
+    if (error != NULL) {
+        reject_method(method, class, pc, error);
+        return;
+    }
+    *insn = (insn_t){
+        .op = complete ? op_return : op_unsupported,
+        .pc = end_pc,
+        .a = complete ? 0 : bytecode[end_pc],
+    };
+
+    method->insns = insns;
+    method->insn_count = count;
+}
+
+void decode_class(class_file_t *class) {
+    for (method_t *method = class->methods; method->name != NULL; method++) {
+        decode_method(method, class);
+    }
+}
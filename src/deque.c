@@ -0,0 +1,74 @@
+#include "deque.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+void deque_init(work_deque_t *deque, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size *= 2;
+    }
+    deque->items = calloc(size, sizeof(*deque->items));
+    assert(deque->items != NULL && "Failed to allocate deque");
+    deque->mask = (int64_t) size - 1;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+}
+
+void deque_free(work_deque_t *deque) {
+    free(deque->items);
+}
+
+bool deque_push(work_deque_t *deque, void *item) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top > deque->mask) {
+        return false;
+    }
+    atomic_store_explicit(&deque->items[bottom & deque->mask], item, memory_order_relaxed);
+    // A thief that sees the new bottom sees the item
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return true;
+}
+
+void *deque_pop(work_deque_t *deque) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    // Claim the bottom item before looking at what the thieves have taken
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+    void *item = atomic_load_explicit(&deque->items[bottom & deque->mask],
+                                      memory_order_relaxed);
+    if (top == bottom) {
+        // The last item: whoever moves the top past it first gets it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            item = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return item;
+}
+
+void *deque_steal(work_deque_t *deque, bool *contended) {
+    *contended = false;
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+    void *item = atomic_load_explicit(&deque->items[top & deque->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        *contended = true;
+        return NULL;
+    }
+    return item;
+}
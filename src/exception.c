@@ -0,0 +1,19 @@
+#include "exception.h"
+
+#include <stdlib.h>
+
+/** The thread's exception target, or NULL if exceptions exit */
+static _Thread_local jmp_buf *target;
+
+void exception_exit(void) {
+    if (target != NULL) {
+        longjmp(*target, 1);
+    }
+    exit(1);
+}
+
+jmp_buf *exception_set_target(jmp_buf *new_target) {
+    jmp_buf *old_target = target;
+    target = new_target;
+    return old_target;
+}
@@ -0,0 +1,117 @@
+#include "fuse.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "decode.h"
+
+/** The longest sequence a superinstruction replaces */
+#define MAX_PATTERN_LENGTH 4
+
+/** Where a superinstruction operand comes from: an operand of an instruction it replaces */
+typedef struct {
+    /** The index of the instruction in the sequence */
+    u1 insn;
+    /** Whether the operand is the instruction's `b` rather than its `a` */
+    bool b;
+} operand_source_t;
+
+#define A(insn) {insn, false}
+#define B(insn) {insn, true}
+
+/**
+ * A sequence of operations to replace with a superinstruction.
+ * The patterns were picked from the operation pairs `jvm --profile` reports
+ * for our workloads; add one here (and its handler in interp.c) to fuse
+ * another sequence.
+ */
+typedef struct {
+    /** The operations of the sequence, in order */
+    u2 ops[MAX_PATTERN_LENGTH];
+    /** The number of operations in `ops` */
+    u1 length;
+    /** The superinstruction that replaces the sequence */
+    u2 fused;
+    /** Where the superinstruction's operands `a`, `b` and `c` come from */
+    operand_source_t operands[3];
+} pattern_t;
+
+/** The sequences to fuse, longest first, so the longest match wins */
+static const pattern_t PATTERNS[] = {
+    {{op_iload, op_aload, op_arraylength, op_if_icmpge}, 4,
+     op_iload_aload_arraylength_if_icmpge, {A(0), A(1), A(3)}},
+    {{op_iload, op_iconst, op_iadd, op_istore}, 4, op_iload_iconst_iadd_istore,
+     {A(0), A(1), A(3)}},
+    {{op_iload, op_iload, op_if_icmpeq}, 3, op_iload_iload_if_icmpeq, {A(0), A(1), A(2)}},
+    {{op_iload, op_iload, op_if_icmpne}, 3, op_iload_iload_if_icmpne, {A(0), A(1), A(2)}},
+    {{op_iload, op_iload, op_if_icmplt}, 3, op_iload_iload_if_icmplt, {A(0), A(1), A(2)}},
+    {{op_iload, op_iload, op_if_icmpge}, 3, op_iload_iload_if_icmpge, {A(0), A(1), A(2)}},
+    {{op_iload, op_iload, op_if_icmpgt}, 3, op_iload_iload_if_icmpgt, {A(0), A(1), A(2)}},
+    {{op_iload, op_iload, op_if_icmple}, 3, op_iload_iload_if_icmple, {A(0), A(1), A(2)}},
+    {{op_aload, op_iload, op_iaload}, 3, op_aload_iload_iaload, {A(0), A(1), A(1)}},
+    {{op_iinc, op_goto}, 2, op_iinc_goto, {A(0), B(0), A(1)}},
+    {{op_aload, op_arraylength}, 2, op_aload_arraylength, {A(0), A(0), A(0)}},
+};
+#define NUM_PATTERNS (sizeof(PATTERNS) / sizeof(PATTERNS[0]))
+
+/**
+ * @brief Gets whether a pattern matches the instructions starting at an index,
+ * without any of them but the first being a branch target.
+ */
+static bool matches(const pattern_t *pattern, const insn_t *insns, u4 index, u4 count,
+                    const bool *is_target) {
+    if (index + pattern->length > count) {
+        return false;
+    }
+    for (u4 i = 0; i < pattern->length; i++) {
+        if (insns[index + i].op != pattern->ops[i] || (i > 0 && is_target[index + i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void fuse_method(method_t *method) {
+    insn_t *insns = method->insns;
+    u4 count = method->insn_count;
+    bool *is_target = calloc(count, sizeof(bool));
+    assert(is_target != NULL && "Failed to allocate branch targets");
+    for (u4 i = 0; i < count; i++) {
+        for (u4 t = 0; t < insn_target_count(&insns[i]); t++) {
+            is_target[insn_target(&insns[i], t)] = true;
+        }
+    }
+
+    for (u4 i = 0; i < count;) {
+        const pattern_t *pattern = NULL;
+        for (u4 p = 0; p < NUM_PATTERNS && pattern == NULL; p++) {
+            if (matches(&PATTERNS[p], insns, i, count, is_target)) {
+                pattern = &PATTERNS[p];
+            }
+        }
+        if (pattern == NULL) {
+            i++;
+            continue;
+        }
+        int32_t operands[3];
+        for (u4 j = 0; j < 3; j++) {
+            const insn_t *source = &insns[i + pattern->operands[j].insn];
+            operands[j] = pattern->operands[j].b ? source->b : source->a;
+        }
+        insn_t *fused = &insns[i];
+        fused->op = pattern->fused;
+        fused->a = operands[0];
+        fused->b = operands[1];
+        fused->c = operands[2];
+        // The rest of the sequence is skipped, and can't be reached any other way
+        i += pattern->length;
+    }
+    free(is_target);
+}
+
+void fuse_class(class_file_t *class) {
+    for (method_t *method = class->methods; method->name != NULL; method++) {
+        fuse_method(method);
+    }
+}
@@ -1,81 +1,969 @@
 #include "heap.h"
 
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "exception.h"
+#include "output.h"
+
+/** The number of handles the handle table starts out with */
+const int32_t INITIAL_HANDLES = 64;
+/** The size of each arena chunk that small arrays are carved out of */
+const size_t CHUNK_SIZE = 1 << 20;
+/** The heap size below which no garbage collection is triggered */
+const size_t MIN_COLLECTION_TRIGGER = 8 << 20;
+/** The size of the nursery that new arrays are bump-allocated in, about an L2 cache */
+const size_t NURSERY_SIZE = 1 << 20;
+/** The largest array body allocated in the nursery; bigger arrays start out old */
+const size_t NURSERY_MAX_OBJECT = 64 << 10;
+/** The alignment of array bodies in the nursery */
+const size_t NURSERY_ALIGNMENT = 8;
+/** The largest arena compressed references can address */
+const size_t MAX_COMPRESSED_ARENA = (size_t) INT32_MAX * HEAP_REF_SCALE;
+
+/**
+ * The block sizes (in bytes) that small array bodies are rounded up to.
+ * Keeping the number of distinct sizes small lets freed blocks be reused
+ * by any array of the same class.
+ */
+static const uint32_t SIZE_CLASSES[] = {
+    8,    16,   32,   48,   64,   96,    128,   192,   256,   384,   512,
+    768,  1024, 1536, 2048, 3072, 4096,  6144,  8192,  12288, 16384, 24576,
+    32768, 49152, 65536,
+};
+#define NUM_SIZE_CLASSES (sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]))
+/**
+ * The size class of arrays that are too big for the arena chunks, which get
+ * pages of their own
+ */
+#define LARGE_OBJECT 0xff
+/** The size class of arrays added with heap_add(), which are never collected */
+#define EXTERNAL_OBJECT 0xfe
+/** The size class of arrays in the nursery, which are packed without rounding */
+#define YOUNG_OBJECT 0xfd
+
+/** A chunk of arena memory. Chunks are kept in a list so they can be freed. */
+typedef struct chunk {
+    /** The previously allocated chunk */
+    struct chunk *next;
+    /** The chunk's memory, which arrays are bump-allocated from */
+    char data[];
+} chunk_t;
+
+/** A freed arena block, kept in the free list of its size class */
+typedef struct free_block {
+    struct free_block *next;
+} free_block_t;
+
+/**
+ * A freed large block in the compressed arena, kept in a first-fit list. Its
+ * whole pages are returned to the kernel, so only the bytes before the first
+ * whole page after this header and after the last whole page can be nonzero.
+ */
+typedef struct free_range {
+    struct free_range *next;
+    /** The size of the block in bytes */
+    size_t size;
+} free_range_t;
 
 /**
  * @brief A structure representing a dynamic heap.
- * 
- * This structure manages a dynamic array of pointers, allowing the addition
- * and retrieval of elements. The array is dynamically resized as new elements 
- * are added.
+ *
+ * A reference is an index into a table of handles, each of which points to
+ * the body of an int32_t array. The table doubles in size whenever it fills up,
+ * so adding an array takes amortized constant time. Handle 0 is never used,
+ * so that NULL_REF refers to nothing.
+ *
+ * Once garbage collection is on, small arrays are born in the nursery: a
+ * single buffer they are packed into by bumping a pointer. When it fills up,
+ * a minor collection copies the reachable ones into the old space and empties
+ * it. Since references go through the handle table, moving an array only
+ * updates its handle, and since arrays hold only ints, the VM stack is the
+ * only place that can refer to a young array.
+ *
+ * In the old space, small array bodies are bump-allocated from large zeroed
+ * arena chunks, rounded up to one of the SIZE_CLASSES. Larger ones get an
+ * anonymous mapping of their own, whose pages the kernel zeroes lazily as
+ * they are first touched, so a big array that is only partly used only takes
+ * up the pages it uses. A major collection returns the blocks of unreachable
+ * small arrays to per-class free lists, the mappings of large ones to the
+ * kernel, and their handles to a stack of free handles.
+ *
+ * With compressed references, every block is bump-allocated from one reserved
+ * arena instead, large ones included, and a reference is the offset of its
+ * array from `refs.base` (4 bytes into the arena) in units of HEAP_REF_SCALE.
+ * The arena's pages are just as lazily zeroed, and a freed large block gives
+ * its whole pages back with madvise(MADV_DONTNEED), which also makes them read
+ * as zeros again, so reusing the block only has to clear its partial pages.
+ * After each major collection, adjacent freed blocks of any size are merged
+ * into freed ranges that blocks of every size class can be carved from, and
+ * when the arena still runs out, a collection runs before giving up.
+ * Each block starts with its handle, followed by the array, so the array's
+ * length sits right at the reference and its handle right before it. The
+ * handles don't turn references into pointers anymore, but they still keep
+ * each array's size class and mark bit, and list the arrays to sweep.
  */
 typedef struct heap {
-    /** Generic array of pointers. */
-    int32_t **ptr;
-    /** How many pointers there are currently in the array. */
+    /** The array each handle refers to, indexed by handle (NULL if free). */
+    heap_refs_t refs;
+    /** The size class of each reference's array. */
+    uint8_t *size_class;
+    /** Whether each reference was marked reachable by the current collection. */
+    bool *marked;
+    /** How many handles are in use or free in the table (including handle 0). */
     int32_t count;
+    /** How many references the table has room for. */
+    int32_t capacity;
+    /** The freed handles that can be reused. */
+    int32_t *free_handles;
+    /** The number of handles in `free_handles`. */
+    int32_t free_handle_count;
+    /** The next free byte in the current arena chunk. */
+    char *bump;
+    /** The end of the current arena chunk. */
+    char *bump_end;
+    /** The arena chunks, most recently allocated first. */
+    chunk_t *chunks;
+    /** The freed blocks of each size class. */
+    free_block_t *free_blocks[NUM_SIZE_CLASSES];
+    /** The arena of compressed references, or NULL if references are handles. */
+    char *arena;
+    /** The size of `arena` in bytes. */
+    size_t arena_size;
+    /** The freed large blocks in `arena`. */
+    free_range_t *free_ranges;
+    /** The size of the host's pages, which large blocks are mapped and returned in. */
+    size_t page_size;
+    /** The nursery, or NULL if garbage collection is off. */
+    char *nursery;
+    /** The next free byte in the nursery. */
+    char *nursery_bump;
+    /** The end of the usable part of the nursery, which is smaller under small limits. */
+    char *nursery_end;
+    /** The references to the arrays in the nursery, in allocation order. */
+    int32_t *young;
+    /** The number of references in `young`. */
+    size_t young_count;
+    /** Whether the current collection is a minor one, which only marks young arrays. */
+    bool minor;
+    /** The function that marks the roots, or NULL if garbage collection is off. */
+    heap_root_scanner_t scanner;
+    /** The context passed to `scanner`. */
+    void *scanner_context;
+    /** The maximum number of bytes of array bodies. */
+    size_t limit;
+    /** The number of bytes at which to run the next garbage collection. */
+    size_t trigger;
+    /** The allocation and collection statistics. */
+    heap_stats_t stats;
 } heap_t;
 
 /**
  * @brief Initializes a new heap.
- * 
- * This function allocates memory for a new heap structure and initializes 
- * the pointer array to NULL and the count to zero.
- * 
+ *
+ * This function allocates memory for a new heap structure with an empty
+ * handle table, no arena chunks and garbage collection turned off.
+ *
  * @return A pointer to the initialized heap structure.
  */
 heap_t *heap_init() {
-    // The heap array is initially allocated to hold zero elements.
-    heap_t *heap = malloc(sizeof(heap_t));
-    heap->ptr = NULL;
-    heap->count = 0;
+    heap_t *heap = calloc(1, sizeof(heap_t));
+    assert(heap != NULL && "Failed to allocate heap");
+    heap->count = 1; // reserve NULL_REF
+    heap->limit = DEFAULT_HEAP_LIMIT;
+    heap->trigger = MIN_COLLECTION_TRIGGER;
+    heap->page_size = (size_t) sysconf(_SC_PAGESIZE);
     return heap;
 }
 
+/**
+ * @brief Sizes the usable part of the nursery so that it takes up at most
+ * half of the heap limit.
+ */
+static void size_nursery(heap_t *heap) {
+    assert(heap->nursery_bump == heap->nursery && "Resizing a nonempty nursery");
+    size_t size = NURSERY_SIZE;
+    if (size > heap->limit / 2) {
+        size = heap->limit / 2 & ~(NURSERY_ALIGNMENT - 1);
+    }
+    heap->nursery_end = heap->nursery + size;
+}
+
+void heap_set_root_scanner(heap_t *heap, heap_root_scanner_t scanner, void *context) {
+    heap->scanner = scanner;
+    heap->scanner_context = context;
+    // Moving arrays out of the nursery needs the roots, so only use one with a
+    // scanner, and compressed references can't move
+    if (scanner != NULL && heap->nursery == NULL && heap->arena == NULL) {
+        heap->nursery = calloc(1, NURSERY_SIZE);
+        heap->young = malloc(sizeof(int32_t[NURSERY_SIZE / NURSERY_ALIGNMENT]));
+        assert(heap->nursery != NULL && heap->young != NULL &&
+               "Failed to allocate nursery");
+        heap->nursery_bump = heap->nursery;
+        size_nursery(heap);
+    }
+}
+
+bool heap_compress_refs(heap_t *heap) {
+    assert(heap->count == 1 && heap->nursery == NULL &&
+           "Compressing the references of a heap in use");
+    size_t size = heap->limit * 2 + CHUNK_SIZE;
+    if (size > MAX_COMPRESSED_ARENA || size < heap->limit) {
+        size = MAX_COMPRESSED_ARENA;
+    }
+    // Only the pages that are touched take up memory
+    void *arena = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena == MAP_FAILED) {
+        return false;
+    }
+    heap->arena = arena;
+    heap->arena_size = size;
+    heap->refs.base = heap->arena + sizeof(int32_t);
+    // Skip the first block's worth, so no array is at NULL_REF
+    heap->bump = heap->arena + HEAP_REF_SCALE;
+    heap->bump_end = heap->arena + size;
+    return true;
+}
+
+bool heap_compressed_refs(const heap_t *heap) {
+    return heap->arena != NULL;
+}
+
+void heap_set_limit(heap_t *heap, size_t limit) {
+    heap->limit = limit;
+    if (heap->trigger > limit) {
+        heap->trigger = limit;
+    }
+    if (heap->nursery != NULL) {
+        size_nursery(heap);
+    }
+}
+
+/**
+ * @brief Adds a handle to the table, preferring a freed one and otherwise
+ * doubling the table if it is full.
+ *
+ * @param heap A pointer to the heap structure.
+ * @param ptr The array the handle refers to.
+ * @param size_class The size class of the array.
+ * @return The new reference.
+ */
+static int32_t add_handle(heap_t *heap, int32_t *ptr, uint8_t size_class) {
+    int32_t ref;
+    if (heap->free_handle_count > 0) {
+        ref = heap->free_handles[--heap->free_handle_count];
+    }
+    else {
+        if (heap->count >= heap->capacity) {
+            heap->capacity = heap->capacity == 0 ? INITIAL_HANDLES : heap->capacity * 2;
+            heap->refs.ptr = realloc(heap->refs.ptr, sizeof(int32_t *[heap->capacity]));
+            heap->size_class = realloc(heap->size_class, sizeof(uint8_t[heap->capacity]));
+            heap->marked = realloc(heap->marked, sizeof(bool[heap->capacity]));
+            heap->free_handles =
+                realloc(heap->free_handles, sizeof(int32_t[heap->capacity]));
+            assert(heap->refs.ptr != NULL && heap->size_class != NULL &&
+                   heap->marked != NULL && heap->free_handles != NULL &&
+                   "Failed to grow handle table");
+            heap->refs.ptr[NULL_REF] = NULL;
+        }
+        ref = heap->count++;
+    }
+    heap->refs.ptr[ref] = ptr;
+    heap->size_class[ref] = size_class;
+    heap->marked[ref] = false;
+    return ref;
+}
+
 /**
  * @brief Adds a new pointer to the heap.
- * 
- * This function resizes the internal pointer array to accommodate the new 
- * element, adds the new pointer to the end of the array, and increments the 
- * element count.
- * 
+ *
+ * The heap takes ownership of the pointer and frees it in heap_free().
+ * The garbage collector leaves it alone. With compressed references, the array
+ * has to be in the arena, so it is copied there and freed right away.
+ *
  * @param heap A pointer to the heap structure.
  * @param ptr The pointer to be added to the heap.
  * @return The index at which the new pointer was added.
  */
 int32_t heap_add(heap_t *heap, int32_t *ptr) {
-    heap->ptr = realloc(heap->ptr, (heap->count + 1) * sizeof(int32_t *));
-    heap->ptr[heap->count] = ptr;
-    int32_t temp = heap->count;
-    heap->count += 1;
-    return temp;
+    if (heap->arena == NULL) {
+        return add_handle(heap, ptr, EXTERNAL_OBJECT);
+    }
+    int32_t ref = heap_new_array(heap, ptr[0]);
+    int32_t *array = heap_get(heap, ref);
+    memcpy(array, ptr, sizeof(int32_t[(size_t) ptr[0] + 1]));
+    free(ptr);
+    heap->size_class[array[-1]] = EXTERNAL_OBJECT;
+    return ref;
+}
+
+/**
+ * @brief Finds the smallest size class that fits a number of bytes.
+ *
+ * @param size The number of bytes needed.
+ * @return The index of the size class, or LARGE_OBJECT if none is big enough.
+ */
+static uint8_t find_size_class(size_t size) {
+    for (uint8_t size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++) {
+        if (size <= SIZE_CLASSES[size_class]) {
+            return size_class;
+        }
+    }
+    return LARGE_OBJECT;
 }
 
 /**
- * @brief Retrieves a pointer from the heap by its index.
- * 
- * This function returns the pointer stored at the specified index in the heap.
- * 
+ * @brief Gets the number of bytes in front of each array in its block: its
+ * handle with compressed references, and nothing otherwise.
+ */
+static size_t header_size(const heap_t *heap) {
+    return heap->arena != NULL ? sizeof(int32_t) : 0;
+}
+
+/**
+ * @brief Gets the number of bytes the block of a handle's array takes up.
+ */
+static size_t block_size(const heap_t *heap, int32_t ref) {
+    uint8_t size_class = heap->size_class[ref];
+    size_t size = sizeof(int32_t[(size_t) heap->refs.ptr[ref][0] + 1]) + header_size(heap);
+    if (size_class == YOUNG_OBJECT) {
+        return (size + NURSERY_ALIGNMENT - 1) & ~(NURSERY_ALIGNMENT - 1);
+    }
+    if (size_class == LARGE_OBJECT) {
+        return size;
+    }
+    return SIZE_CLASSES[size_class];
+}
+
+/**
+ * @brief Reports an OutOfMemoryError and ends the program.
+ */
+static void out_of_memory(void) {
+    output_flush();
+    fprintf(stderr, "Exception in thread \"main\" java.lang.OutOfMemoryError: "
+                    "Java heap space\n");
+    exception_exit();
+}
+
+/**
+ * @brief Rounds a size up to a whole number of pages.
+ */
+static size_t page_round_up(const heap_t *heap, size_t size) {
+    return (size + heap->page_size - 1) & ~(heap->page_size - 1);
+}
+
+/**
+ * @brief Rounds an address down to the start of its page.
+ */
+static char *page_start(const heap_t *heap, const char *address) {
+    return (char *) ((uintptr_t) address & ~(uintptr_t) (heap->page_size - 1));
+}
+
+/**
+ * @brief Gives the whole pages of a freed block in the compressed arena back
+ * to the kernel, keeping its header (see free_range_t).
+ *
+ * @param block The start of the block.
+ * @param end The end of the block.
+ */
+static void release_free_range(const heap_t *heap, char *block, char *end) {
+    char *whole_pages = page_start(heap, block + sizeof(free_range_t) + heap->page_size - 1);
+    char *last_page = page_start(heap, end);
+    if (whole_pages < last_page) {
+        madvise(whole_pages, last_page - whole_pages, MADV_DONTNEED);
+    }
+}
+
+/**
+ * @brief Clears the part of a freed large block that can be nonzero (see free_range_t).
+ *
+ * @param block The start of the freed block, and of the part being reused.
+ * @param end The end of the freed block.
+ * @param size The number of bytes being reused.
+ */
+static void clear_free_range(const heap_t *heap, char *block, char *end, size_t size) {
+    char *whole_pages = page_start(heap, block + sizeof(free_range_t) + heap->page_size - 1);
+    char *last_page = page_start(heap, end);
+    char *used_end = block + size;
+    memset(block, 0, (whole_pages < used_end ? whole_pages : used_end) - block);
+    if (last_page < used_end) {
+        char *from = last_page > block ? last_page : block;
+        memset(from, 0, used_end - from);
+    }
+}
+
+/**
+ * @brief Takes a zeroed block from the first freed range in the compressed
+ * arena that fits, keeping what is left of it.
+ *
+ * A range only fits if it is exactly the right size or what is left can hold
+ * a free_range_t, so no bytes are lost to slivers too small to list.
+ *
+ * @param size The number of bytes needed, a multiple of HEAP_REF_SCALE.
+ * @return The zeroed block, or NULL if no range fits.
+ */
+static void *take_free_range(heap_t *heap, size_t size) {
+    for (free_range_t **range = &heap->free_ranges; *range != NULL;
+         range = &(*range)->next) {
+        free_range_t *block = *range;
+        if (block->size != size && block->size < size + sizeof(free_range_t)) {
+            continue;
+        }
+        char *end = (char *) block + block->size;
+        if (block->size != size) {
+            free_range_t *rest = (free_range_t *) ((char *) block + size);
+            *rest = (free_range_t){.next = block->next, .size = block->size - size};
+            *range = rest;
+        }
+        else {
+            *range = block->next;
+        }
+        clear_free_range(heap, (char *) block, end, size);
+        return block;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Allocates a zeroed block in the compressed arena: a freed block of
+ * its size class, part of a freed range, or fresh memory from the bump pointer.
+ *
+ * The arena can't grow, so if none of them has room, a major collection runs
+ * first, which frees the dead blocks and merges the adjacent ones, and only if
+ * the block still doesn't fit is an OutOfMemoryError reported.
+ *
+ * @param size_class The size class of the block, or LARGE_OBJECT.
+ * @param size The number of bytes needed, a multiple of HEAP_REF_SCALE.
+ * @return The zeroed block.
+ */
+static void *compressed_alloc(heap_t *heap, uint8_t size_class, size_t size) {
+    for (bool collected = false;; collected = true) {
+        if (size_class != LARGE_OBJECT && heap->free_blocks[size_class] != NULL) {
+            free_block_t *block = heap->free_blocks[size_class];
+            heap->free_blocks[size_class] = block->next;
+            memset(block, 0, size);
+            return block;
+        }
+        void *block = take_free_range(heap, size);
+        if (block != NULL) {
+            return block;
+        }
+        if ((size_t) (heap->bump_end - heap->bump) >= size) {
+            void *fresh = heap->bump;
+            heap->bump += size;
+            return fresh;
+        }
+        if (collected || heap->scanner == NULL) {
+            out_of_memory();
+        }
+        heap_collect(heap);
+    }
+}
+
+/**
+ * @brief Allocates a zeroed block of a size class, reusing a freed block if
+ * there is one and otherwise bump-allocating from the arena.
+ *
+ * Chunks come from calloc(), so fresh blocks are zeroed without any extra work.
+ *
  * @param heap A pointer to the heap structure.
- * @param ref The index of the pointer to retrieve.
- * @return The pointer stored at the specified index.
+ * @param size_class The size class of the block.
+ * @return The zeroed block.
  */
-int32_t *heap_get(heap_t *heap, int32_t ref) {
-    return heap->ptr[ref];
+static void *arena_alloc(heap_t *heap, uint8_t size_class) {
+    size_t size = SIZE_CLASSES[size_class];
+    if (heap->arena != NULL) {
+        return compressed_alloc(heap, size_class, size);
+    }
+    free_block_t *block = heap->free_blocks[size_class];
+    if (block != NULL) {
+        heap->free_blocks[size_class] = block->next;
+        memset(block, 0, size);
+        return block;
+    }
+    if ((size_t) (heap->bump_end - heap->bump) < size) {
+        chunk_t *chunk = calloc(1, sizeof(chunk_t) + CHUNK_SIZE);
+        assert(chunk != NULL && "Failed to allocate arena chunk");
+        chunk->next = heap->chunks;
+        heap->chunks = chunk;
+        heap->bump = chunk->data;
+        heap->bump_end = chunk->data + CHUNK_SIZE;
+    }
+    void *fresh = heap->bump;
+    heap->bump += size;
+    return fresh;
+}
+
+/**
+ * @brief Allocates a zeroed block for a large array: its own mapping, or a
+ * block in the compressed arena if there is one.
+ *
+ * Neither is written to, so only the pages the array uses are ever faulted in.
+ *
+ * @param size The number of bytes needed.
+ * @return The zeroed block.
+ */
+static void *large_alloc(heap_t *heap, size_t size) {
+    if (heap->arena == NULL) {
+        void *block = mmap(NULL, page_round_up(heap, size), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            out_of_memory();
+        }
+        return block;
+    }
+    size = (size + HEAP_REF_SCALE - 1) & ~(size_t) (HEAP_REF_SCALE - 1);
+    return compressed_alloc(heap, LARGE_OBJECT, size);
+}
+
+void heap_index_out_of_bounds(int32_t index, int32_t length) {
+    output_flush();
+    fprintf(stderr,
+            "Exception in thread \"main\" java.lang.ArrayIndexOutOfBoundsException: "
+            "Index %d out of bounds for length %d\n",
+            index, length);
+    exception_exit();
+}
+
+/**
+ * @brief Counts a new array's bytes in the heap's statistics.
+ */
+static void count_allocation(heap_t *heap, size_t size) {
+    heap->stats.arrays_allocated++;
+    heap->stats.bytes_allocated += size;
+    heap->stats.used_bytes += size;
+    if (heap->stats.used_bytes > heap->stats.peak_bytes) {
+        heap->stats.peak_bytes = heap->stats.used_bytes;
+    }
+}
+
+/**
+ * @brief Allocates a zeroed int32_t array and adds it to the heap.
+ *
+ * The array's first element holds its length, followed by its elements.
+ * Small arrays are allocated in the nursery, running a minor collection first
+ * if it is full. If the allocation would take the heap past its collection
+ * trigger, a major collection runs first.
+ *
+ * @param heap A pointer to the heap structure.
+ * @param count The number of elements in the array.
+ * @return The reference to the new array.
+ */
+int32_t heap_new_array(heap_t *heap, int32_t count) {
+    assert(count >= 0 && "Negative array size");
+    size_t size = sizeof(int32_t[(size_t) count + 1]);
+
+    size_t young_size = (size + NURSERY_ALIGNMENT - 1) & ~(NURSERY_ALIGNMENT - 1);
+    if (heap->nursery != NULL && young_size <= NURSERY_MAX_OBJECT &&
+        young_size <= (size_t) (heap->nursery_end - heap->nursery)) {
+        if ((size_t) (heap->nursery_end - heap->nursery_bump) < young_size) {
+            heap_collect_minor(heap);
+        }
+        if (heap->stats.used_bytes + young_size > heap->limit) {
+            heap_collect(heap);
+            if (heap->stats.used_bytes + young_size > heap->limit) {
+                out_of_memory();
+            }
+        }
+        int32_t *array = (int32_t *) heap->nursery_bump;
+        heap->nursery_bump += young_size;
+        array[0] = count;
+        count_allocation(heap, young_size);
+        int32_t ref = add_handle(heap, array, YOUNG_OBJECT);
+        heap->young[heap->young_count++] = ref;
+        return ref;
+    }
+
+    size += header_size(heap);
+    uint8_t size_class = find_size_class(size);
+    if (size_class != LARGE_OBJECT) {
+        size = SIZE_CLASSES[size_class];
+    }
+
+    if (heap->stats.used_bytes + size > heap->trigger) {
+        heap_collect(heap);
+    }
+    if (heap->stats.used_bytes + size > heap->limit) {
+        out_of_memory();
+    }
+
+    char *block = size_class == LARGE_OBJECT ? large_alloc(heap, size)
+                                             : arena_alloc(heap, size_class);
+    int32_t *array = (int32_t *) (block + header_size(heap));
+    array[0] = count;
+    count_allocation(heap, size);
+    int32_t handle = add_handle(heap, array, size_class);
+    if (heap->arena == NULL) {
+        return handle;
+    }
+    array[-1] = handle;
+    return (int32_t) (((char *) array - heap->refs.base) / HEAP_REF_SCALE);
+}
+
+/**
+ * @brief Finds the handle of a reference, or returns NULL_REF if it doesn't
+ * refer to a live array.
+ */
+static int32_t find_handle(const heap_t *heap, int32_t ref) {
+    if (heap->arena == NULL) {
+        return 0 < ref && ref < heap->count && heap->refs.ptr[ref] != NULL ? ref : NULL_REF;
+    }
+    // Every reference to a block in the arena can be read, freed or not
+    char *array = heap->refs.base + (size_t) (uint32_t) ref * HEAP_REF_SCALE;
+    if (ref <= 0 || array >= heap->bump) {
+        return NULL_REF;
+    }
+    int32_t handle = ((int32_t *) array)[-1];
+    if (handle <= 0 || handle >= heap->count || heap->refs.ptr[handle] != (int32_t *) array) {
+        return NULL_REF;
+    }
+    return handle;
+}
+
+const void *heap_ref_base(const heap_t *heap) {
+    if (heap->arena != NULL) {
+        return heap->refs.base;
+    }
+    return heap->refs.ptr;
+}
+
+void heap_mark(heap_t *heap, int32_t ref) {
+    int32_t handle = find_handle(heap, ref);
+    if (handle != NULL_REF && (!heap->minor || heap->size_class[handle] == YOUNG_OBJECT)) {
+        heap->marked[handle] = true;
+    }
+}
+
+/**
+ * @brief Frees an unreachable array and its handle.
+ */
+static void free_array(heap_t *heap, int32_t ref) {
+    uint8_t size_class = heap->size_class[ref];
+    size_t size = block_size(heap, ref);
+    char *start = (char *) heap->refs.ptr[ref] - header_size(heap);
+    if (size_class == LARGE_OBJECT && heap->arena != NULL) {
+        size_t rounded = (size + HEAP_REF_SCALE - 1) & ~(size_t) (HEAP_REF_SCALE - 1);
+        release_free_range(heap, start, start + rounded);
+        free_range_t *range = (free_range_t *) start;
+        *range = (free_range_t){.next = heap->free_ranges, .size = rounded};
+        heap->free_ranges = range;
+    }
+    else if (size_class == LARGE_OBJECT) {
+        munmap(start, page_round_up(heap, size));
+    }
+    else if (size_class != YOUNG_OBJECT) {
+        free_block_t *block = (free_block_t *) start;
+        block->next = heap->free_blocks[size_class];
+        heap->free_blocks[size_class] = block;
+    }
+    heap->refs.ptr[ref] = NULL;
+    heap->free_handles[heap->free_handle_count++] = ref;
+
+    heap->stats.arrays_freed++;
+    heap->stats.bytes_freed += size;
+    heap->stats.used_bytes -= size;
+}
+
+/**
+ * @brief Moves the marked arrays in the nursery into the old space, frees the
+ * handles of the others and empties the nursery.
+ *
+ * Survivors are copied in allocation order, so arrays allocated together stay
+ * close together in the old space.
+ */
+static void evacuate_nursery(heap_t *heap) {
+    for (size_t i = 0; i < heap->young_count; i++) {
+        int32_t ref = heap->young[i];
+        if (!heap->marked[ref]) {
+            free_array(heap, ref);
+            continue;
+        }
+        heap->marked[ref] = false;
+        size_t young_size = block_size(heap, ref);
+        size_t size = sizeof(int32_t[(size_t) heap->refs.ptr[ref][0] + 1]);
+        uint8_t size_class = find_size_class(size);
+        int32_t *array = arena_alloc(heap, size_class);
+        memcpy(array, heap->refs.ptr[ref], size);
+        heap->refs.ptr[ref] = array;
+        heap->size_class[ref] = size_class;
+
+        heap->stats.arrays_promoted++;
+        heap->stats.bytes_promoted += size;
+        heap->stats.used_bytes += SIZE_CLASSES[size_class] - young_size;
+        if (heap->stats.used_bytes > heap->stats.peak_bytes) {
+            heap->stats.peak_bytes = heap->stats.used_bytes;
+        }
+    }
+    // The next arrays born in the nursery must start out zeroed
+    memset(heap->nursery, 0, heap->nursery_bump - heap->nursery);
+    heap->nursery_bump = heap->nursery;
+    heap->young_count = 0;
+}
+
+/**
+ * @brief Gets how many bytes the heap will use once the nursery is evacuated:
+ * the unmarked arrays in it are freed, and the marked ones grow to fill the
+ * size classes of their blocks in the old space.
+ */
+static size_t used_after_evacuation(const heap_t *heap) {
+    size_t used = heap->stats.used_bytes;
+    for (size_t i = 0; i < heap->young_count; i++) {
+        int32_t ref = heap->young[i];
+        size_t young_size = block_size(heap, ref);
+        if (heap->marked[ref]) {
+            size_t size = sizeof(int32_t[(size_t) heap->refs.ptr[ref][0] + 1]);
+            used += SIZE_CLASSES[find_size_class(size)] - young_size;
+        }
+        else {
+            used -= young_size;
+        }
+    }
+    return used;
+}
+
+/** A freed block or range in the compressed arena, while they are being merged */
+typedef struct {
+    char *start;
+    size_t size;
+    /** The block's size class, or LARGE_OBJECT if it is a freed range */
+    uint8_t size_class;
+} free_run_t;
+
+static int compare_free_runs(const void *a, const void *b) {
+    const char *start_a = ((const free_run_t *) a)->start;
+    const char *start_b = ((const free_run_t *) b)->start;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+/**
+ * @brief Merges each run of adjacent freed blocks and ranges in the compressed
+ * arena into one freed range, after a major collection.
+ *
+ * A freed small block can only be reused by arrays of its own size class, so
+ * without this, a program whose array sizes change over time runs the arena
+ * out even though most of it is free. A run that ends at the bump pointer is
+ * given back to it instead, and a block with no free neighbours stays in the
+ * list of its size class. The lists are rebuilt in address order, so blocks
+ * are reused from the bottom of the arena up.
+ */
+static void merge_free_blocks(heap_t *heap) {
+    size_t count = 0;
+    for (uint8_t size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++) {
+        for (free_block_t *block = heap->free_blocks[size_class]; block != NULL;
+             block = block->next) {
+            count++;
+        }
+    }
+    for (free_range_t *range = heap->free_ranges; range != NULL; range = range->next) {
+        count++;
+    }
+    if (count == 0) {
+        return;
+    }
+    free_run_t *runs = malloc(sizeof(free_run_t[count]));
+    assert(runs != NULL && "Failed to allocate free runs");
+    size_t run_count = 0;
+    free_block_t **block_tails[NUM_SIZE_CLASSES];
+    for (uint8_t size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++) {
+        for (free_block_t *block = heap->free_blocks[size_class]; block != NULL;
+             block = block->next) {
+            runs[run_count++] = (free_run_t){
+                .start = (char *) block, .size = SIZE_CLASSES[size_class], .size_class = size_class};
+        }
+        heap->free_blocks[size_class] = NULL;
+        block_tails[size_class] = &heap->free_blocks[size_class];
+    }
+    for (free_range_t *range = heap->free_ranges; range != NULL; range = range->next) {
+        runs[run_count++] = (free_run_t){
+            .start = (char *) range, .size = range->size, .size_class = LARGE_OBJECT};
+    }
+    heap->free_ranges = NULL;
+    free_range_t **range_tail = &heap->free_ranges;
+    qsort(runs, count, sizeof(free_run_t), compare_free_runs);
+
+    for (size_t i = 0; i < count;) {
+        char *start = runs[i].start;
+        char *end = start + runs[i].size;
+        size_t next = i + 1;
+        while (next < count && runs[next].start == end) {
+            end += runs[next++].size;
+        }
+        if (end == heap->bump) {
+            // The memory past the bump pointer must read as zeros
+            release_free_range(heap, start, end);
+            clear_free_range(heap, start, end, end - start);
+            heap->bump = start;
+        }
+        else if (next == i + 1 && runs[i].size_class != LARGE_OBJECT) {
+            free_block_t *block = (free_block_t *) start;
+            *block_tails[runs[i].size_class] = block;
+            block_tails[runs[i].size_class] = &block->next;
+        }
+        else {
+            if (next > i + 1) {
+                release_free_range(heap, start, end);
+            }
+            free_range_t *range = (free_range_t *) start;
+            range->size = end - start;
+            *range_tail = range;
+            range_tail = &range->next;
+        }
+        i = next;
+    }
+    for (uint8_t size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++) {
+        *block_tails[size_class] = NULL;
+    }
+    *range_tail = NULL;
+    free(runs);
+}
+
+/**
+ * @brief Adds the time since `start` to the heap's collection time.
+ */
+static void count_collection_time(heap_t *heap, const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    heap->stats.gc_nanoseconds += (uint64_t) (end.tv_sec - start->tv_sec) * 1000000000 +
+                                  (end.tv_nsec - start->tv_nsec);
+}
+
+/**
+ * @brief Collects the unreachable arrays in the nursery.
+ *
+ * Only young arrays are marked, and only the nursery is scanned, so the cost
+ * is proportional to the roots and the survivors rather than the whole heap.
+ * If promoting the survivors would take the heap past its limit, a major
+ * collection runs instead, and if it takes the heap past its trigger, a major
+ * collection follows.
+ *
+ * @param heap A pointer to the heap structure.
+ */
+void heap_collect_minor(heap_t *heap) {
+    if (heap->nursery == NULL) {
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    heap->minor = true;
+    heap->scanner(heap->scanner_context, heap);
+    heap->minor = false;
+    if (used_after_evacuation(heap) > heap->limit) {
+        // The survivors only fit if the old space's garbage goes first
+        count_collection_time(heap, &start);
+        heap_collect(heap);
+        return;
+    }
+    evacuate_nursery(heap);
+
+    heap->stats.minor_collections++;
+    count_collection_time(heap, &start);
+    if (heap->stats.used_bytes > heap->trigger) {
+        heap_collect(heap);
+    }
+}
+
+/**
+ * @brief Collects the arrays the root scanner can't reach.
+ *
+ * Arrays only hold ints, so the roots are the only references: marking is a
+ * single pass over them, and sweeping is a pass over the handle table,
+ * followed by evacuating the nursery. If the survivors in the nursery still
+ * don't fit under the limit, it reports an OutOfMemoryError.
+ * Afterwards the next collection is set to run once the heap has doubled.
+ *
+ * @param heap A pointer to the heap structure.
+ */
+void heap_collect(heap_t *heap) {
+    if (heap->scanner == NULL) {
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    heap->scanner(heap->scanner_context, heap);
+    // Sweep the old space first, so the arrays promoted afterwards aren't swept
+    for (int32_t ref = 1; ref < heap->count; ref++) {
+        if (heap->refs.ptr[ref] == NULL || heap->size_class[ref] == YOUNG_OBJECT) {
+            continue;
+        }
+        if (heap->marked[ref] || heap->size_class[ref] == EXTERNAL_OBJECT) {
+            heap->marked[ref] = false;
+        }
+        else {
+            free_array(heap, ref);
+        }
+    }
+    if (heap->arena != NULL) {
+        merge_free_blocks(heap);
+    }
+    if (heap->nursery != NULL) {
+        if (used_after_evacuation(heap) > heap->limit) {
+            // The next collection must only find the arrays it marks itself
+            for (size_t i = 0; i < heap->young_count; i++) {
+                heap->marked[heap->young[i]] = false;
+            }
+            out_of_memory();
+        }
+        evacuate_nursery(heap);
+    }
+
+    heap->trigger = heap->stats.used_bytes * 2;
+    if (heap->trigger < MIN_COLLECTION_TRIGGER) {
+        heap->trigger = MIN_COLLECTION_TRIGGER;
+    }
+    if (heap->trigger > heap->limit) {
+        heap->trigger = heap->limit;
+    }
+
+    heap->stats.collections++;
+    count_collection_time(heap, &start);
+}
+
+heap_stats_t heap_get_stats(const heap_t *heap) {
+    return heap->stats;
 }
 
 /**
  * @brief Frees the memory allocated for the heap.
- * 
- * This function frees all pointers stored in the heap as well as the internal
- * pointer array and the heap structure itself.
- * 
+ *
+ * This function unmaps the large arrays, frees the added ones and the arena chunks,
+ * the nursery, the handle table and the heap structure itself.
+ *
  * @param heap A pointer to the heap structure to be freed.
  */
 void heap_free(heap_t *heap) {
-    for (int32_t i = 0; i < heap->count; i++) {
-        free(heap->ptr[i]);
+    for (int32_t i = 1; i < heap->count && heap->arena == NULL; i++) {
+        if (heap->refs.ptr[i] == NULL) {
+            continue;
+        }
+        if (heap->size_class[i] == LARGE_OBJECT) {
+            munmap(heap->refs.ptr[i], page_round_up(heap, block_size(heap, i)));
+        }
+        else if (heap->size_class[i] == EXTERNAL_OBJECT) {
+            free(heap->refs.ptr[i]);
+        }
+    }
+    while (heap->chunks != NULL) {
+        chunk_t *next = heap->chunks->next;
+        free(heap->chunks);
+        heap->chunks = next;
+    }
+    if (heap->arena != NULL) {
+        munmap(heap->arena, heap->arena_size);
     }
-    free(heap->ptr);
+    free(heap->nursery);
+    free(heap->young);
+    free(heap->refs.ptr);
+    free(heap->size_class);
+    free(heap->marked);
+    free(heap->free_handles);
     free(heap);
 }
@@ -0,0 +1,569 @@
+// For dl_iterate_phdr()'s program headers
+#define _GNU_SOURCE
+
+#include "image_cache.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "decode.h"
+#include "read_class.h"
+#include "refmap.h"
+
+/** The bytes every image starts with */
+static const char IMAGE_MAGIC[8] = "MJVMIMG";
+/** The version of the image format, which changes whenever what is saved does */
+#define IMAGE_VERSION 3
+/** The longest path of an image, including its terminator */
+#define MAX_IMAGE_PATH 4096
+/** The alignment of each object in an image, which is what class_alloc() guarantees */
+#define IMAGE_ALIGNMENT sizeof(max_align_t)
+
+static const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325u;
+static const uint64_t FNV_PRIME = 0x100000001b3u;
+
+/**
+ * The start of an image. It is followed by the objects, from
+ * OBJECTS_OFFSET on, and then by the offsets of the pointers among them.
+ */
+typedef struct {
+    /** IMAGE_MAGIC */
+    char magic[8];
+    /** The layout_fingerprint() of the build that wrote the image */
+    uint64_t layout;
+    /** The key of the class file the image is of */
+    image_key_t key;
+    /** The number of bytes of objects, starting with the class_file_t */
+    uint64_t size;
+    /** The number of pointers among the objects */
+    uint64_t pointer_count;
+    /** An FNV-1a hash of the objects and the pointers' offsets, to catch damaged images */
+    uint64_t checksum;
+} image_header_t;
+
+/** Where the objects of an image start, after its header */
+#define OBJECTS_OFFSET \
+    ((sizeof(image_header_t) + IMAGE_ALIGNMENT - 1) & ~(IMAGE_ALIGNMENT - 1))
+
+/**
+ * An image being built in memory. Objects are only ever referred to by their
+ * offsets, since `data` moves as it grows.
+ */
+typedef struct {
+    /** The objects so far */
+    u1 *data;
+    /** The number of bytes in `data` */
+    size_t size;
+    /** The number of bytes `data` has room for */
+    size_t capacity;
+    /** The offsets of the pointers in `data` */
+    uint64_t *pointers;
+    /** The number of offsets in `pointers` */
+    size_t pointer_count;
+    /** The number of offsets `pointers` has room for */
+    size_t pointer_capacity;
+} image_writer_t;
+
+/**
+ * @brief Adds bytes to an FNV-1a hash.
+ */
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+    const u1 *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/** A hash of the identity of this build, found once by find_build_id() */
+static uint64_t build_id;
+static pthread_once_t build_id_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Hashes the identity of the object this code is linked into, once
+ * dl_iterate_phdr() gets to it: its GNU build ID, which the linker computes
+ * from everything it links, or if it has none, its executable segments.
+ *
+ * @param data The hash to add to.
+ * @return 1 once the object is found, which stops the iteration, and 0 before.
+ */
+static int hash_build_id(struct dl_phdr_info *info, size_t size, void *data) {
+    (void) size;
+    uintptr_t code = (uintptr_t) &hash_build_id;
+    bool contains_code = false;
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *segment = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + segment->p_vaddr;
+        contains_code |= segment->p_type == PT_LOAD && start <= code &&
+                         code - start < segment->p_memsz;
+    }
+    if (!contains_code) {
+        return 0;
+    }
+
+    uint64_t *hash = data;
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *segment = &info->dlpi_phdr[i];
+        if (segment->p_type != PT_NOTE) {
+            continue;
+        }
+        // Each note's name and description are padded to 4 bytes
+        const u1 *note = (const u1 *) (info->dlpi_addr + segment->p_vaddr);
+        const u1 *end = note + segment->p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr) *header = (const ElfW(Nhdr) *) note;
+            const u1 *name = note + sizeof(*header);
+            const u1 *description = name + ((header->n_namesz + 3) & ~3u);
+            if (header->n_type == NT_GNU_BUILD_ID && header->n_namesz == sizeof("GNU") &&
+                memcmp(name, "GNU", sizeof("GNU")) == 0) {
+                *hash = fnv1a(*hash, description, header->n_descsz);
+                return 1;
+            }
+            note = description + ((header->n_descsz + 3) & ~3u);
+        }
+    }
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *segment = &info->dlpi_phdr[i];
+        if (segment->p_type == PT_LOAD && (segment->p_flags & PF_X) != 0) {
+            *hash = fnv1a(*hash, (const void *) (info->dlpi_addr + segment->p_vaddr),
+                          segment->p_filesz);
+        }
+    }
+    return 1;
+}
+
+static void find_build_id(void) {
+    build_id = FNV_OFFSET_BASIS;
+    dl_iterate_phdr(hash_build_id, &build_id);
+}
+
+/**
+ * @brief Gets a hash of everything about this build that an image depends on:
+ * the format version, the sizes of the saved structures, the operations, and
+ * the build itself, since the passes that prepared the image's streams and
+ * the handlers they are threaded with can change without any of the others.
+ */
+static uint64_t layout_fingerprint(void) {
+    const size_t layout[] = {IMAGE_VERSION,     sizeof(void *),   sizeof(class_file_t),
+                             sizeof(cp_info),   sizeof(method_t), sizeof(resolved_method_t),
+                             sizeof(insn_t),    sizeof(refmap_t), sizeof(switch_table_t)};
+    uint64_t hash = fnv1a(FNV_OFFSET_BASIS, layout, sizeof(layout));
+    for (u4 op = 0; op < NUM_OPS; op++) {
+        hash = fnv1a(hash, OP_NAMES[op], strlen(OP_NAMES[op]) + 1);
+    }
+    pthread_once(&build_id_once, find_build_id);
+    return fnv1a(hash, &build_id, sizeof(build_id));
+}
+
+/**
+ * @brief Builds the path of the image with a key, which is named after a hash of the key.
+ *
+ * @param path Set to the path.
+ * @return Whether the path fits in MAX_IMAGE_PATH.
+ */
+static bool image_path(char path[MAX_IMAGE_PATH], const char *dir, const image_key_t *key) {
+    uint64_t name = fnv1a(FNV_OFFSET_BASIS, key, sizeof(*key));
+    int length = snprintf(path, MAX_IMAGE_PATH, "%s/%016" PRIx64 ".img", dir, name);
+    return 0 < length && length < MAX_IMAGE_PATH;
+}
+
+bool image_key_init(image_key_t *key, const char *path, u4 inline_depth, u4 pass_flags) {
+    // Only a regular file can be read again by load_class()
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    void *contents = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        contents = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (contents == MAP_FAILED) {
+        return false;
+    }
+    *key = (image_key_t){
+        .hash = fnv1a(FNV_OFFSET_BASIS, contents, info.st_size),
+        .size = info.st_size,
+        .inline_depth = inline_depth,
+        .pass_flags = pass_flags,
+    };
+    munmap(contents, info.st_size);
+    return true;
+}
+
+/**
+ * @brief Copies an object to the end of an image.
+ *
+ * @return The offset of the copy.
+ */
+static size_t put(image_writer_t *writer, const void *data, size_t size) {
+    size_t padded = (size + IMAGE_ALIGNMENT - 1) & ~(IMAGE_ALIGNMENT - 1);
+    if (writer->capacity - writer->size < padded) {
+        while (writer->capacity - writer->size < padded) {
+            writer->capacity = writer->capacity == 0 ? 4096 : writer->capacity * 2;
+        }
+        writer->data = realloc(writer->data, writer->capacity);
+        assert(writer->data != NULL && "Failed to grow class image");
+    }
+    size_t offset = writer->size;
+    if (size > 0) {
+        memcpy(writer->data + offset, data, size);
+    }
+    memset(writer->data + offset + size, 0, padded - size);
+    writer->size += padded;
+    return offset;
+}
+
+/**
+ * @brief Points a pointer in an image at an object in it.
+ *
+ * @param field The offset of the pointer.
+ * @param target The offset of the object.
+ */
+static void set_pointer(image_writer_t *writer, size_t field, size_t target) {
+    if (writer->pointer_count == writer->pointer_capacity) {
+        writer->pointer_capacity =
+            writer->pointer_capacity == 0 ? 256 : writer->pointer_capacity * 2;
+        writer->pointers =
+            realloc(writer->pointers, sizeof(uint64_t[writer->pointer_capacity]));
+        assert(writer->pointers != NULL && "Failed to grow class image");
+    }
+    writer->pointers[writer->pointer_count++] = field;
+    uintptr_t value = target;
+    memcpy(writer->data + field, &value, sizeof(value));
+}
+
+/**
+ * @brief Clears a pointer in an image that is only meaningful in the run that set it.
+ */
+static void clear_pointer(image_writer_t *writer, size_t field) {
+    memset(writer->data + field, 0, sizeof(void *));
+}
+
+/**
+ * @brief Copies an object a pointer in an image points to, and points the pointer at the copy.
+ * A NULL pointer stays NULL.
+ *
+ * @param field The offset of the pointer.
+ * @param data The object, or NULL.
+ * @param size The number of bytes in the object.
+ * @return The offset of the copy.
+ */
+static size_t put_field(image_writer_t *writer, size_t field, const void *data, size_t size) {
+    if (data == NULL) {
+        return 0;
+    }
+    size_t at = put(writer, data, size);
+    set_pointer(writer, field, at);
+    return at;
+}
+
+/**
+ * Where the objects a class is made of are in its image, for pointers to them
+ */
+typedef struct {
+    /** The class being saved */
+    const class_file_t *class;
+    /** The copy of the class file, which the strings and bytecode point into */
+    size_t file_at;
+    /** The methods array */
+    size_t methods_at;
+    /** The resolved Methodref constants */
+    size_t resolved_at;
+} class_layout_t;
+
+/**
+ * @brief Points a pointer in an image at the copy of something in the class file.
+ */
+static void set_file_pointer(image_writer_t *writer, const class_layout_t *layout,
+                             size_t field, const void *pointer) {
+    const u1 *image = layout->class->image;
+    set_pointer(writer, field, layout->file_at + (size_t) ((const u1 *) pointer - image));
+}
+
+/**
+ * @brief Gets whether an operation's `callee` is set.
+ */
+static bool has_callee(u1 op) {
+    return op == op_invokestatic || op == op_invokestatic_memo || op == op_call ||
+           op == op_call_memo;
+}
+
+/**
+ * @brief Copies a switch's table into an image.
+ *
+ * @return The offset of the copy.
+ */
+static size_t put_switch_table(image_writer_t *writer, const switch_table_t *table) {
+    size_t at = put(writer, table, sizeof(*table));
+    put_field(writer, at + offsetof(switch_table_t, keys), table->keys,
+              sizeof(int32_t[table->count]));
+    put_field(writer, at + offsetof(switch_table_t, targets), table->targets,
+              sizeof(int32_t[table->count + 1]));
+    return at;
+}
+
+/**
+ * @brief Copies a method's instruction stream and reference maps into an image
+ * and points the method's copy at them and at the class file.
+ *
+ * @param at The offset of the method's copy.
+ */
+static void put_method(image_writer_t *writer, const class_layout_t *layout, size_t at,
+                       const method_t *method) {
+    assert(method->jit == NULL && method->memo == NULL &&
+           "Classes are saved before they are memoized or prepared for the JIT");
+    set_file_pointer(writer, layout, at + offsetof(method_t, name), method->name);
+    set_file_pointer(writer, layout, at + offsetof(method_t, descriptor), method->descriptor);
+    set_file_pointer(writer, layout, at + offsetof(method_t, code.code), method->code.code);
+    if (method->verify_error != NULL) {
+        put_field(writer, at + offsetof(method_t, verify_error), method->verify_error,
+                  strlen(method->verify_error) + 1);
+    }
+
+    size_t insns_at = put_field(writer, at + offsetof(method_t, insns), method->insns,
+                                sizeof(insn_t[method->insn_count]));
+    for (u4 i = 0; i < method->insn_count; i++) {
+        const insn_t *insn = &method->insns[i];
+        size_t insn_at = insns_at + i * sizeof(insn_t);
+        // The handlers are the addresses of this run's interpreter (see thread_class())
+        clear_pointer(writer, insn_at + offsetof(insn_t, handler));
+        if (has_callee(insn->op)) {
+            size_t index = insn->callee - layout->class->resolved_methods;
+            set_pointer(writer, insn_at + offsetof(insn_t, callee),
+                        layout->resolved_at + index * sizeof(resolved_method_t));
+        }
+        else if (op_is_switch(insn->op)) {
+            set_pointer(writer, insn_at + offsetof(insn_t, table),
+                        put_switch_table(writer, insn->table));
+        }
+    }
+
+    size_t maps_at = put_field(writer, at + offsetof(method_t, refmaps), method->refmaps,
+                               sizeof(refmap_t[method->refmap_count]));
+    for (u4 i = 0; i < method->refmap_count; i++) {
+        const refmap_t *map = &method->refmaps[i];
+        put_field(writer, maps_at + i * sizeof(refmap_t) + offsetof(refmap_t, bits),
+                  map->bits, sizeof(uint32_t[(map->slots + 31) / 32]));
+    }
+}
+
+/**
+ * @brief Gets the size of what a constant's `info` points to, for the constants
+ * whose values are allocated on their own.
+ */
+static size_t constant_info_size(cp_tag_t tag) {
+    switch (tag) {
+        case CONSTANT_Class:
+            return sizeof(CONSTANT_Class_info);
+        case CONSTANT_Fieldref:
+        case CONSTANT_Methodref:
+            return sizeof(CONSTANT_FieldOrMethodref_info);
+        case CONSTANT_NameAndType:
+            return sizeof(CONSTANT_NameAndType_info);
+        default:
+            assert(false && "Unknown constant type");
+            return 0;
+    }
+}
+
+/**
+ * @brief Writes out an image, to a temporary file that replaces the image's
+ * path once it is complete.
+ */
+static void write_image(const char *dir, const image_key_t *key,
+                        const image_writer_t *writer) {
+    char path[MAX_IMAGE_PATH];
+    char temporary[MAX_IMAGE_PATH];
+    if (!image_path(path, dir, key)) {
+        return;
+    }
+    // Threads of one process may write the same image at once, so each write gets a name
+    static atomic_uint writes;
+    int length = snprintf(temporary, sizeof(temporary), "%s.%ld.%u.tmp", path, (long) getpid(),
+                          atomic_fetch_add(&writes, 1));
+    if (length < 0 || (size_t) length >= sizeof(temporary)) {
+        return;
+    }
+    FILE *out = fopen(temporary, "wb");
+    if (out == NULL) {
+        return;
+    }
+
+    image_header_t header = {
+        .layout = layout_fingerprint(),
+        .key = *key,
+        .size = writer->size,
+        .pointer_count = writer->pointer_count,
+        .checksum = fnv1a(fnv1a(FNV_OFFSET_BASIS, writer->data, writer->size), writer->pointers,
+                          sizeof(uint64_t[writer->pointer_count])),
+    };
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    static const u1 padding[IMAGE_ALIGNMENT];
+    bool written =
+        fwrite(&header, sizeof(header), 1, out) == 1 &&
+        fwrite(padding, 1, OBJECTS_OFFSET - sizeof(header), out) ==
+            OBJECTS_OFFSET - sizeof(header) &&
+        fwrite(writer->data, 1, writer->size, out) == writer->size &&
+        fwrite(writer->pointers, sizeof(uint64_t), writer->pointer_count, out) ==
+            writer->pointer_count;
+    written &= fclose(out) == 0;
+    if (!written || rename(temporary, path) != 0) {
+        unlink(temporary);
+    }
+}
+
+void image_cache_store(const char *dir, const image_key_t *key, const class_file_t *class) {
+    image_writer_t writer = {0};
+    class_layout_t layout = {.class = class};
+
+    // The class comes first, and is given its image and an arena when it's loaded
+    class_file_t copy = *class;
+    copy.image = NULL;
+    copy.image_size = 0;
+    copy.image_mapped = false;
+    copy.arena = NULL;
+    size_t class_at = put(&writer, &copy, sizeof(copy));
+    layout.file_at = put(&writer, class->image, class->image_size);
+
+    u4 constant_count = 0;
+    while (class->constant_pool[constant_count].info != NULL) {
+        constant_count++;
+    }
+    u4 method_count = 0;
+    while (class->methods[method_count].name != NULL) {
+        method_count++;
+    }
+    size_t pool_at =
+        put_field(&writer, class_at + offsetof(class_file_t, constant_pool),
+                  class->constant_pool, sizeof(cp_info[constant_count + 1]));
+    layout.methods_at = put_field(&writer, class_at + offsetof(class_file_t, methods),
+                                  class->methods, sizeof(method_t[method_count + 1]));
+    layout.resolved_at =
+        put_field(&writer, class_at + offsetof(class_file_t, resolved_methods),
+                  class->resolved_methods, sizeof(resolved_method_t[constant_count + 1]));
+
+    for (u4 i = 0; i < constant_count; i++) {
+        const cp_info *constant = &class->constant_pool[i];
+        size_t constant_at = pool_at + i * sizeof(cp_info);
+        size_t field = constant_at + offsetof(cp_info, info);
+        if (constant->tag == CONSTANT_Utf8) {
+            set_file_pointer(&writer, &layout, field, constant->info);
+        }
+        else if (constant->tag == CONSTANT_Integer) {
+            set_pointer(&writer, field, constant_at + offsetof(cp_info, integer));
+        }
+        else {
+            put_field(&writer, field, constant->info, constant_info_size(constant->tag));
+        }
+    }
+    for (u4 i = 0; i <= constant_count; i++) {
+        const method_t *method = class->resolved_methods[i].method;
+        if (method != NULL) {
+            set_pointer(&writer,
+                        layout.resolved_at + i * sizeof(resolved_method_t) +
+                            offsetof(resolved_method_t, method),
+                        layout.methods_at + (method - class->methods) * sizeof(method_t));
+        }
+    }
+    for (u4 i = 0; i < method_count; i++) {
+        put_method(&writer, &layout, layout.methods_at + i * sizeof(method_t),
+                   &class->methods[i]);
+    }
+
+    write_image(dir, key, &writer);
+    free(writer.data);
+    free(writer.pointers);
+}
+
+/**
+ * @brief Checks that a mapped image is complete, undamaged and matches a key and this build,
+ * and adds the address its objects are mapped at to the pointers among them.
+ *
+ * @param image The mapping of the image, which is private and writable.
+ * @param size The number of bytes in the image.
+ * @return Whether the image is valid.
+ */
+static bool relocate_image(u1 *image, size_t size, const image_key_t *key) {
+    image_header_t header;
+    memcpy(&header, image, sizeof(header));
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.layout != layout_fingerprint() ||
+        memcmp(&header.key, key, sizeof(*key)) != 0) {
+        return false;
+    }
+    // The objects are followed by the pointers' offsets and nothing else
+    size_t rest = size - OBJECTS_OFFSET;
+    if (header.size < sizeof(class_file_t) || header.size > rest ||
+        header.pointer_count != (rest - header.size) / sizeof(uint64_t) ||
+        (rest - header.size) % sizeof(uint64_t) != 0) {
+        return false;
+    }
+    u1 *objects = image + OBJECTS_OFFSET;
+    if (fnv1a(FNV_OFFSET_BASIS, objects, rest) != header.checksum) {
+        return false;
+    }
+
+    const u1 *pointers = objects + header.size;
+    for (uint64_t i = 0; i < header.pointer_count; i++) {
+        uint64_t field;
+        memcpy(&field, pointers + i * sizeof(field), sizeof(field));
+        uintptr_t target;
+        if (field % sizeof(target) != 0 || field > header.size - sizeof(target)) {
+            return false;
+        }
+        memcpy(&target, objects + field, sizeof(target));
+        if (target > header.size) {
+            return false;
+        }
+        target += (uintptr_t) objects;
+        memcpy(objects + field, &target, sizeof(target));
+    }
+    return true;
+}
+
+class_file_t *image_cache_load(const char *dir, const image_key_t *key) {
+    char path[MAX_IMAGE_PATH];
+    if (!image_path(path, dir, key)) {
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    void *mapping = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) &&
+        (size_t) info.st_size >= OBJECTS_OFFSET) {
+        // The mapping is private, so relocating and threading the image never reach the file
+        mapping = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+    u1 *image = mapping;
+    if (!relocate_image(image, info.st_size, key)) {
+        munmap(mapping, info.st_size);
+        return NULL;
+    }
+
+    class_file_t *class = (class_file_t *) (image + OBJECTS_OFFSET);
+    class->image = image;
+    class->image_size = info.st_size;
+    class->image_mapped = true;
+    class_init_arena(class);
+    return class;
+}
@@ -0,0 +1,282 @@
+#include "inline.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode.h"
+#include "read_class.h"
+#include "refmap.h"
+#include "stack.h"
+
+/**
+ * A method's stack instructions with its calls inlined. Its locals below its
+ * `max_locals` are its own, and the ones from there on are the inlined callees'.
+ */
+typedef struct {
+    insn_t *insns;
+    u4 count;
+    u4 capacity;
+    /** The deepest the operand stack gets, including in the inlined callees */
+    u4 max_stack;
+    /** The number of locals, including the inlined callees' */
+    u4 locals;
+} expansion_t;
+
+/**
+ * @brief Adds an instruction to the end of an expansion.
+ */
+static void append(expansion_t *expansion, insn_t insn) {
+    if (expansion->count == expansion->capacity) {
+        expansion->capacity = expansion->capacity == 0 ? 64 : expansion->capacity * 2;
+        expansion->insns =
+            realloc(expansion->insns, sizeof(insn_t[expansion->capacity]));
+        assert(expansion->insns != NULL && "Failed to grow inlined stream");
+    }
+    expansion->insns[expansion->count++] = insn;
+}
+
+/**
+ * @brief Gets whether an operation names a local in its `a`.
+ */
+static bool names_local(u1 op) {
+    return op == op_iload || op == op_istore || op == op_iinc;
+}
+
+/**
+ * @brief Gets whether a method's signature and operations allow inlining it.
+ * It has to take only ints, return an int or nothing, and not touch arrays
+ * or switch, since copies would share its switches' tables; its calls are
+ * checked as they are inlined.
+ */
+static bool is_inlinable(const method_t *method) {
+    // Constructors take `this`, which their descriptor doesn't show
+    if (strcmp(method->name, "<init>") == 0 || method->insn_count > INLINE_BUDGET) {
+        return false;
+    }
+    const char *type = method->descriptor;
+    if (*type++ != '(') {
+        return false;
+    }
+    while (*type == 'I') {
+        type++;
+    }
+    if (type[0] != ')' || (type[1] != 'I' && type[1] != 'V') || type[2] != '\0') {
+        return false;
+    }
+    for (u4 i = 0; i < method->insn_count; i++) {
+        switch (method->insns[i].op) {
+            case op_aload:
+            case op_astore:
+            case op_iaload:
+            case op_iastore:
+            case op_areturn:
+            case op_newarray:
+            case op_arraylength:
+            case op_tableswitch:
+            case op_lookupswitch:
+                return false;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+static void expand(const method_t *method, u4 depth, expansion_t *out, u4 *new_index,
+                   bool *inlined);
+
+/**
+ * @brief Appends a copy of a call's callee to an expansion in place of the call,
+ * if the callee can be inlined.
+ *
+ * @param out The expansion of the caller so far.
+ * @param call The invokestatic.
+ * @param max_locals The caller's `max_locals`, where the callee's locals start.
+ * @param stack_depth The operand stack depth before the call, including the arguments.
+ * @param depth The number of levels of calls left to inline.
+ * @return Whether the call was inlined.
+ */
+static bool inline_call(expansion_t *out, const insn_t *call, u4 max_locals,
+                        u4 stack_depth, u4 depth) {
+    const method_t *callee = call->callee->method;
+    if (depth == 0 || !is_inlinable(callee)) {
+        return false;
+    }
+    expansion_t body;
+    expand(callee, depth - 1, &body, NULL, NULL);
+
+    // Calls left in the body would be safepoints, and returns have to leave one value
+    bool inlinable = body.count <= INLINE_BUDGET;
+    int32_t *depths = inlinable ? compute_depths(body.insns, body.count) : NULL;
+    for (u4 i = 0; inlinable && i < body.count; i++) {
+        u1 op = body.insns[i].op;
+        if (depths[i] >= 0) {
+            inlinable = op != op_invokestatic && op != op_unsupported &&
+                        (op != op_ireturn || depths[i] == 1) &&
+                        (op != op_return || depths[i] == 0);
+        }
+    }
+    free(depths);
+
+    if (inlinable) {
+        // The arguments are on the operand stack, the last one on top
+        u4 params = call->callee->num_params;
+        for (u4 i = params; i > 0; i--) {
+            append(out, (insn_t){.op = op_istore, .pc = call->pc, .a = max_locals + i - 1});
+        }
+        u4 start = out->count;
+        u4 end = start + body.count;
+        for (u4 i = 0; i < body.count; i++) {
+            insn_t insn = body.insns[i];
+            insn.pc = call->pc;
+            if (names_local(insn.op)) {
+                insn.a += max_locals;
+            }
+            if (op_is_branch(insn.op) || insn.op == op_goto) {
+                insn.a += start;
+            }
+            // The returned value stays on top of the operand stack, like a call leaves it
+            if (insn.op == op_ireturn || insn.op == op_return) {
+                insn = (insn_t){.op = op_goto, .pc = call->pc, .a = end};
+            }
+            append(out, insn);
+        }
+        if (out->locals < max_locals + body.locals) {
+            out->locals = max_locals + body.locals;
+        }
+        if (out->max_stack < stack_depth - params + body.max_stack) {
+            out->max_stack = stack_depth - params + body.max_stack;
+        }
+    }
+    free(body.insns);
+    return inlinable;
+}
+
+/**
+ * @brief Copies a method's stack instructions, inlining the calls that can be.
+ *
+ * @param method The method, whose stream is still the decoded one.
+ * @param depth The number of levels of calls to inline.
+ * @param out Set to the expansion.
+ * @param new_index If not NULL, set to the index in the expansion of each
+ *   instruction of the method; an inlined call's index is the start of its copy.
+ * @param inlined If not NULL, set to whether each instruction is an inlined call.
+ */
+static void expand(const method_t *method, u4 depth, expansion_t *out, u4 *new_index,
+                   bool *inlined) {
+    u4 count = method->insn_count;
+    u4 *index = new_index != NULL ? new_index : malloc(sizeof(u4[count]));
+    assert(index != NULL && "Failed to allocate inlined stream");
+    int32_t *depths = compute_depths(method->insns, count);
+    *out = (expansion_t){
+        .max_stack = method->code.max_stack,
+        .locals = method->code.max_locals,
+    };
+    for (u4 i = 0; i < count; i++) {
+        const insn_t *insn = &method->insns[i];
+        index[i] = out->count;
+        bool is_inlined = insn->op == op_invokestatic && depths[i] >= 0 &&
+                          inline_call(out, insn, method->code.max_locals, depths[i], depth);
+        if (!is_inlined) {
+            append(out, *insn);
+        }
+        if (inlined != NULL) {
+            inlined[i] = is_inlined;
+        }
+    }
+    // The method's own branches go to where their targets moved; inline_class() moves switches
+    for (u4 i = 0; i < count; i++) {
+        const insn_t *insn = &method->insns[i];
+        if (op_is_branch(insn->op) || insn->op == op_goto) {
+            out->insns[index[i]].a = index[insn->a];
+        }
+    }
+    free(depths);
+    if (new_index == NULL) {
+        free(index);
+    }
+}
+
+void inline_class(class_file_t *class, u4 depth) {
+    u4 count = 0;
+    while (class->methods[count].name != NULL) {
+        count++;
+    }
+
+    // Every expansion copies the callees' decoded streams, so none is replaced until the end
+    expansion_t *expansions = malloc(sizeof(expansion_t[count + 1]));
+    bool *changed = calloc(count + 1, sizeof(bool));
+    assert(expansions != NULL && changed != NULL && "Failed to allocate inlined streams");
+    for (u4 m = 0; m < count; m++) {
+        method_t *method = &class->methods[m];
+        u4 *new_index = malloc(sizeof(u4[method->insn_count]));
+        bool *inlined = malloc(sizeof(bool[method->insn_count]));
+        assert(new_index != NULL && inlined != NULL && "Failed to allocate inlined stream");
+        expansion_t *expansion = &expansions[m];
+        expand(method, depth, expansion, new_index, inlined);
+        for (u4 i = 0; i < method->insn_count; i++) {
+            changed[m] |= inlined[i];
+        }
+        // The operand stack and the inlined callees' locals have to fit in `max_stack`
+        u4 inlined_locals = expansion->locals - method->code.max_locals;
+        changed[m] &= expansion->max_stack + inlined_locals <= UINT16_MAX;
+
+        if (changed[m]) {
+            // The inlined calls' safepoints are gone, and the others move
+            u4 refmaps = 0;
+            for (u4 i = 0; i < method->refmap_count; i++) {
+                refmap_t map = method->refmaps[i];
+                if (!inlined[map.insn]) {
+                    map.insn = new_index[map.insn];
+                    method->refmaps[refmaps++] = map;
+                }
+            }
+            method->refmap_count = refmaps;
+
+            // No callee is copied with its switches, so their tables are only this stream's
+            for (u4 i = 0; i < method->insn_count; i++) {
+                if (op_is_switch(method->insns[i].op)) {
+                    switch_table_t *table = method->insns[i].table;
+                    for (u4 t = 0; t <= table->count; t++) {
+                        table->targets[t] = new_index[table->targets[t]];
+                    }
+                }
+            }
+        }
+        free(new_index);
+        free(inlined);
+    }
+
+    for (u4 m = 0; m < count; m++) {
+        method_t *method = &class->methods[m];
+        expansion_t *expansion = &expansions[m];
+        if (changed[m]) {
+            // The inlined callees' locals go above the operand stack
+            u4 max_locals = method->code.max_locals;
+            u4 first_inlined = max_locals + FRAME_GAP_SLOTS + expansion->max_stack;
+            for (u4 i = 0; i < expansion->count; i++) {
+                insn_t *insn = &expansion->insns[i];
+                if (names_local(insn->op) && (u4) insn->a >= max_locals) {
+                    insn->a = first_inlined + (insn->a - max_locals);
+                }
+            }
+            method->insns = class_alloc(class, sizeof(insn_t[expansion->count]));
+            memcpy(method->insns, expansion->insns, sizeof(insn_t[expansion->count]));
+            method->insn_count = expansion->count;
+            method->code.max_stack = expansion->max_stack + (expansion->locals - max_locals);
+        }
+        free(expansion->insns);
+    }
+    free(expansions);
+    free(changed);
+
+    // Calls reserve the frames of their callees by the sizes they resolved to
+    for (u4 i = 1; class->constant_pool[i - 1].info != NULL; i++) {
+        resolved_method_t *resolved = &class->resolved_methods[i];
+        if (resolved->method != NULL) {
+            resolved->max_stack = resolved->method->code.max_stack;
+        }
+    }
+}
@@ -0,0 +1,890 @@
+#include "interp.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "array_kernels.h"
+#include "decode.h"
+#include "exception.h"
+#include "jit.h"
+#include "memo.h"
+#include "optimize.h"
+#include "output.h"
+#include "profile.h"
+
+/*
+ * The threaded interpreter. Each instruction's `handler` holds the address of
+ * the code for its operation, so dispatching to the next instruction is a
+ * single indirect jump (GCC/Clang's "labels as values" extension) instead of a
+ * trip through a switch.
+ *
+ * The top of the operand stack is cached in `tos`, so most instructions never
+ * load or store it: `sp` points at the top value's slot, whose memory is stale,
+ * and the slots below it hold the rest of the stack. Pushing writes the old top
+ * back to its slot. The value is written back before calls, whose arguments
+ * have to be in memory to become the callee's locals, so at every safepoint
+ * only the top slot of the stopped frame is stale, and that holds an int.
+ *
+ * Methods translated into register operations (see optimize.h) don't use the
+ * operand stack pointer at all, and name their operands by their offsets from
+ * `locals`. A returned value is written back to the slot it is returned to,
+ * so it reaches callers in either form. Such methods can also be compiled
+ * (see jit.h): the interpreter counts each one's calls and backward branches,
+ * and once it is hot, compiles it and threads its instructions to `do_native`
+ * instead, which runs the native code from there and dispatches to the
+ * instruction it stopped at; only calls, allocations, prints, returns,
+ * switches and the array loops, which run their kernels (see array_kernels.h),
+ * run here. The counters, the code and the rethreaded instructions are all in
+ * the run's class state (see class_state.h), as are the memo tables, so a run
+ * never writes to the class; each frame runs its method's stream from there.
+ *
+ * Every method was verified when it was loaded (see refmap.h), so handlers
+ * never check stack depths, local indices or the types of their operands.
+ * Array accesses are checked, except the unchecked ones the optimizer proved are
+ * in bounds.
+ *
+ * Calls and returns don't recurse: invokestatic pushes a frame record on the
+ * VM stack and switches `fp`, `locals`, `insns` and `ip` to the callee, and a
+ * return pops the record and switches them back to the caller. A memoized call
+ * (see memo.h) that finds its result skips all of that.
+ *
+ * Since all of a run's state but those few registers is on the VM stack, a
+ * run can stop anywhere and continue later, even on another thread. Backward
+ * branches and calls poll the stack's `preempt` flag, so every loop and every
+ * recursion reaches a poll; when it is set, the interpreter writes `tos` back,
+ * records `ip` and `sp` in the stack's `suspension` and returns, and
+ * interpret_resume() picks the registers back up from there. Native code
+ * polls the flag on its backward branches too, and returns to be stopped here.
+ *
+ * This file is compiled twice. Compiled with PROFILE defined, it produces
+ * interpret_profiled() instead, which also counts every operation, pair of
+ * consecutive operations and call. Dispatching through the handlers would
+ * jump into the unprofiled interpreter, so it looks each operation up in its
+ * own dispatch table instead. interpret() is left without a trace of profiling.
+ */
+
+#ifdef PROFILE
+#define DISPATCH()                                                                       \
+    do {                                                                                 \
+        profile->op_counts[ip->op]++;                                                    \
+        goto *dispatch_table[ip->op];                                                    \
+    } while (0)
+// Every instruction NEXT() leaves is followed by another, at worst the final trap
+#define NEXT()                                                                           \
+    do {                                                                                 \
+        profile->pair_counts[ip[0].op][ip[1].op]++;                                      \
+        ip++;                                                                            \
+        DISPATCH();                                                                      \
+    } while (0)
+// Superinstructions skip the rest of the sequence they replace
+#define SKIP(length)                                                                     \
+    do {                                                                                 \
+        profile->pair_counts[ip[0].op][ip[length].op]++;                                 \
+        ip += (length);                                                                  \
+        DISPATCH();                                                                      \
+    } while (0)
+#define PROFILE_ENTER(method) profile_enter(profile, (method))
+#define PROFILE_EXIT() profile_exit(profile)
+#define PROFILE_MEMO(method, hit) profile_memo(profile, (method), (hit))
+// The profiled interpreter never compiles anything, and always runs to the end
+#define COUNT_TOWARD_JIT(counter) ((void) 0)
+#define POLL() ((void) 0)
+#else
+#define DISPATCH() goto *ip->handler
+#define NEXT()                                                                           \
+    do {                                                                                 \
+        ip++;                                                                            \
+        DISPATCH();                                                                      \
+    } while (0)
+#define SKIP(length)                                                                     \
+    do {                                                                                 \
+        ip += (length);                                                                  \
+        DISPATCH();                                                                      \
+    } while (0)
+#define PROFILE_ENTER(method) ((void) 0)
+#define PROFILE_EXIT() ((void) 0)
+#define PROFILE_MEMO(method, hit) ((void) 0)
+// Counts a call or backward branch of the running method, compiling it once it's hot
+#define COUNT_TOWARD_JIT(counter)                                                        \
+    do {                                                                                 \
+        jit_state_t *jit = fp->state->jit;                                               \
+        if (jit != NULL && --jit->counter == 0) {                                        \
+            goto tier_up;                                                                \
+        }                                                                                \
+    } while (0)
+// Stops the run if another thread asked it to
+#define POLL()                                                                           \
+    do {                                                                                 \
+        if (atomic_load_explicit(&stack->preempt, memory_order_relaxed)) {               \
+            goto stop;                                                                   \
+        }                                                                                \
+    } while (0)
+#endif
+#define JUMP(target)                                                                     \
+    do {                                                                                 \
+        const insn_t *from = ip;                                                         \
+        ip = &insns[target];                                                             \
+        if (ip <= from) {                                                                \
+            COUNT_TOWARD_JIT(backedges_left);                                            \
+            POLL();                                                                      \
+        }                                                                                \
+        DISPATCH();                                                                      \
+    } while (0)
+
+#define PUSH(value) (*sp++ = tos, tos = (value))
+// Discards the top value, loading the one below it into `tos`
+#define DROP() (tos = *--sp)
+
+#define BINARY_OP(operator)                                                              \
+    do {                                                                                 \
+        tos = sp[-1] operator tos;                                                       \
+        sp--;                                                                            \
+        NEXT();                                                                          \
+    } while (0)
+#define BRANCH_IF(condition)                                                             \
+    do {                                                                                 \
+        if (condition) {                                                                 \
+            JUMP(ip->a);                                                                 \
+        }                                                                                \
+        NEXT();                                                                          \
+    } while (0)
+#define BRANCH_IF_ZERO(operator)                                                         \
+    do {                                                                                 \
+        int32_t value = tos;                                                             \
+        DROP();                                                                          \
+        BRANCH_IF(value operator 0);                                                     \
+    } while (0)
+#define COMPARE_BRANCH_IF(operator)                                                      \
+    do {                                                                                 \
+        int32_t value2 = tos;                                                            \
+        int32_t value1 = sp[-1];                                                         \
+        sp -= 2;                                                                         \
+        tos = sp[0];                                                                     \
+        BRANCH_IF(value1 operator value2);                                               \
+    } while (0)
+#define COMPARE_LOCALS_BRANCH_IF(operator)                                               \
+    do {                                                                                 \
+        if (locals[ip->a] operator locals[ip->b]) {                                      \
+            JUMP(ip->c);                                                                 \
+        }                                                                                \
+        SKIP(3);                                                                         \
+    } while (0)
+
+#define REGISTER_OP(operator)                                                            \
+    do {                                                                                 \
+        locals[ip->a] = locals[ip->b] operator locals[ip->c];                            \
+        NEXT();                                                                          \
+    } while (0)
+#define REGISTER_CONST_OP(operator)                                                      \
+    do {                                                                                 \
+        locals[ip->a] = locals[ip->b] operator ip->c;                                    \
+        NEXT();                                                                          \
+    } while (0)
+// The operands of the array loops: the index register, register `x` and the bound
+#define LOOP_INDEX() (&locals[(uint32_t) ip->a & 0xffff])
+#define LOOP_X() (&locals[(uint32_t) ip->a >> 16])
+#define LOOP_END() ((ip->aux & ARRAY_LOOP_CONSTANT_BOUND) ? ip->c : locals[ip->c])
+#define REGISTER_BRANCH_IF(operator) BRANCH_IF(locals[ip->b] operator locals[ip->c])
+#define REGISTER_CONST_BRANCH_IF(operator) BRANCH_IF(locals[ip->b] operator ip->c)
+
+/**
+ * @brief Reports a NegativeArraySizeException and ends the program.
+ */
+static void __attribute__((noreturn)) negative_array_size(int32_t count) {
+    output_flush();
+    fprintf(stderr, "Exception in thread \"main\" java.lang.NegativeArraySizeException: %d\n",
+            count);
+    exception_exit();
+}
+
+#ifdef PROFILE
+optional_value_t interpret_profiled(method_t *method, int32_t *locals, class_state_t *state,
+                                    heap_t *heap, vm_stack_t *stack, profile_t *profile) {
+#else
+optional_value_t interpret(method_t *method, int32_t *locals, class_state_t *state,
+                           heap_t *heap, vm_stack_t *stack) {
+#endif
+    static const void *const dispatch_table[NUM_OPS] = {
+        [op_unsupported] = &&do_unsupported,
+        [op_iconst] = &&do_iconst,
+        [op_iload] = &&do_iload,
+        [op_aload] = &&do_iload,
+        [op_istore] = &&do_istore,
+        [op_astore] = &&do_istore,
+        [op_iaload] = &&do_iaload,
+        [op_iastore] = &&do_iastore,
+        [op_dup] = &&do_dup,
+        [op_iadd] = &&do_iadd,
+        [op_isub] = &&do_isub,
+        [op_imul] = &&do_imul,
+        [op_idiv] = &&do_idiv,
+        [op_irem] = &&do_irem,
+        [op_ineg] = &&do_ineg,
+        [op_ishl] = &&do_ishl,
+        [op_ishr] = &&do_ishr,
+        [op_iushr] = &&do_iushr,
+        [op_iand] = &&do_iand,
+        [op_ior] = &&do_ior,
+        [op_ixor] = &&do_ixor,
+        [op_iinc] = &&do_iinc,
+        [op_ifeq] = &&do_ifeq,
+        [op_ifne] = &&do_ifne,
+        [op_iflt] = &&do_iflt,
+        [op_ifge] = &&do_ifge,
+        [op_ifgt] = &&do_ifgt,
+        [op_ifle] = &&do_ifle,
+        [op_if_icmpeq] = &&do_if_icmpeq,
+        [op_if_icmpne] = &&do_if_icmpne,
+        [op_if_icmplt] = &&do_if_icmplt,
+        [op_if_icmpge] = &&do_if_icmpge,
+        [op_if_icmpgt] = &&do_if_icmpgt,
+        [op_if_icmple] = &&do_if_icmple,
+        [op_goto] = &&do_goto,
+        [op_tableswitch] = &&do_tableswitch,
+        [op_lookupswitch] = &&do_lookupswitch,
+        [op_ireturn] = &&do_ireturn,
+        [op_areturn] = &&do_ireturn,
+        [op_return] = &&do_return,
+        [op_print] = &&do_print,
+        [op_invokestatic] = &&do_invokestatic,
+        [op_invokestatic_memo] = &&do_invokestatic_memo,
+        [op_newarray] = &&do_newarray,
+        [op_arraylength] = &&do_arraylength,
+        [op_iload_iload_if_icmpeq] = &&do_iload_iload_if_icmpeq,
+        [op_iload_iload_if_icmpne] = &&do_iload_iload_if_icmpne,
+        [op_iload_iload_if_icmplt] = &&do_iload_iload_if_icmplt,
+        [op_iload_iload_if_icmpge] = &&do_iload_iload_if_icmpge,
+        [op_iload_iload_if_icmpgt] = &&do_iload_iload_if_icmpgt,
+        [op_iload_iload_if_icmple] = &&do_iload_iload_if_icmple,
+        [op_iload_aload_arraylength_if_icmpge] = &&do_iload_aload_arraylength_if_icmpge,
+        [op_iinc_goto] = &&do_iinc_goto,
+        [op_iload_iconst_iadd_istore] = &&do_iload_iconst_iadd_istore,
+        [op_aload_iload_iaload] = &&do_aload_iload_iaload,
+        [op_aload_arraylength] = &&do_aload_arraylength,
+        [op_move] = &&do_move,
+        [op_move_const] = &&do_move_const,
+        [op_add] = &&do_add,
+        [op_add_const] = &&do_add_const,
+        [op_sub] = &&do_sub,
+        [op_sub_from_const] = &&do_sub_from_const,
+        [op_mul] = &&do_mul,
+        [op_mul_const] = &&do_mul_const,
+        [op_div] = &&do_div,
+        [op_rem] = &&do_rem,
+        [op_div_pow2] = &&do_div_pow2,
+        [op_rem_pow2] = &&do_rem_pow2,
+        [op_div_magic] = &&do_div_magic,
+        [op_rem_magic] = &&do_rem_magic,
+        [op_neg] = &&do_neg,
+        [op_and] = &&do_and,
+        [op_and_const] = &&do_and_const,
+        [op_or] = &&do_or,
+        [op_or_const] = &&do_or_const,
+        [op_xor] = &&do_xor,
+        [op_xor_const] = &&do_xor_const,
+        [op_shl] = &&do_shl,
+        [op_shl_const] = &&do_shl_const,
+        [op_shr] = &&do_shr,
+        [op_shr_const] = &&do_shr_const,
+        [op_ushr] = &&do_ushr,
+        [op_ushr_const] = &&do_ushr_const,
+        [op_load_element] = &&do_load_element,
+        [op_store_element] = &&do_store_element,
+        [op_load_element_unchecked] = &&do_load_element_unchecked,
+        [op_store_element_unchecked] = &&do_store_element_unchecked,
+        [op_array_length] = &&do_array_length,
+        [op_new_array] = &&do_new_array,
+        [op_fill] = &&do_fill,
+        [op_copy] = &&do_copy,
+        [op_sum] = &&do_sum,
+        [op_prefix_sum] = &&do_prefix_sum,
+        [op_mismatch] = &&do_mismatch,
+        [op_br_eq] = &&do_br_eq,
+        [op_br_ne] = &&do_br_ne,
+        [op_br_lt] = &&do_br_lt,
+        [op_br_ge] = &&do_br_ge,
+        [op_br_gt] = &&do_br_gt,
+        [op_br_le] = &&do_br_le,
+        [op_br_eq_const] = &&do_br_eq_const,
+        [op_br_ne_const] = &&do_br_ne_const,
+        [op_br_lt_const] = &&do_br_lt_const,
+        [op_br_ge_const] = &&do_br_ge_const,
+        [op_br_gt_const] = &&do_br_gt_const,
+        [op_br_le_const] = &&do_br_le_const,
+        [op_br_table] = &&do_br_table,
+        [op_br_lookup] = &&do_br_lookup,
+        [op_return_value] = &&do_return_value,
+        [op_print_value] = &&do_print_value,
+        [op_call] = &&do_call,
+        [op_call_memo] = &&do_call_memo,
+    };
+
+    class_file_t *class = state->class;
+    // The states of the class's methods, which every frame of the run points at
+    method_state_t *const states = state->methods;
+
+#ifndef PROFILE
+    // Called by thread_class() to fill in the handlers of a class's instructions
+    if (method == NULL && stack == NULL) {
+        for (method_t *m = class->methods; m->name != NULL; m++) {
+            for (u4 i = 0; i < m->insn_count; i++) {
+                m->insns[i].handler = dispatch_table[m->insns[i].op];
+            }
+        }
+        return (optional_value_t){.has_value = false};
+    }
+#endif
+
+#ifndef PROFILE
+    // Compiled code only runs with the encoding of references it was compiled for
+    const bool compressed_refs = heap_compressed_refs(heap);
+#endif
+
+    // The run returns when the frame at this depth does
+    size_t entry_depth;
+    frame_t *fp;
+    const insn_t *insns;
+    const insn_t *ip;
+    int32_t *sp;
+    int32_t tos;
+    // The frame of a called method starts here
+    int32_t *callee_locals;
+
+#ifndef PROFILE
+    // Called by interpret_resume() to continue a stopped run
+    if (method == NULL) {
+        const vm_suspension_t *suspension = &stack->suspension;
+        assert(suspension->stopped && "No stopped run to resume");
+        stack->suspension.stopped = false;
+        entry_depth = suspension->entry_depth;
+        fp = &stack->frames[stack->depth - 1];
+        locals = fp->locals;
+        insns = fp->state->insns;
+        ip = suspension->ip;
+        sp = suspension->sp;
+        tos = sp[0];
+        DISPATCH();
+    }
+#endif
+
+    // Push the entry frame; interpret() returns when this frame does
+    if (!vm_stack_reserve_frame(stack) ||
+        !vm_stack_fits(stack, locals,
+                       frame_slots(method->code.max_locals, method->code.max_stack))) {
+        vm_stack_overflow(stack);
+    }
+    entry_depth = stack->depth++;
+    fp = &stack->frames[entry_depth];
+    fp->method = method;
+    fp->state = &states[method - class->methods];
+    fp->locals = locals;
+    PROFILE_ENTER(method);
+
+    insns = fp->state->insns;
+    ip = insns;
+    // The operand stack follows the locals in the frame, and starts out empty
+    sp = locals + method->code.max_locals + FRAME_GAP_SLOTS - 1;
+    tos = 0;
+
+    COUNT_TOWARD_JIT(calls_left);
+    POLL();
+    DISPATCH();
+
+do_unsupported:
+    if (fp->method->verify_error != NULL) {
+        verify_error(fp->method, fp->method->verify_error_pc, fp->method->verify_error);
+    }
+    fprintf(stderr, "Unsupported instruction 0x%02x at pc %u of %s\n", ip->a, ip->pc,
+            fp->method->name);
+    assert(false);
+    abort();
+
+do_iconst:
+    PUSH(ip->a);
+    NEXT();
+
+do_iload:
+    PUSH(locals[ip->a]);
+    NEXT();
+
+do_istore:
+    locals[ip->a] = tos;
+    DROP();
+    NEXT();
+
+do_iinc:
+    locals[ip->a] += ip->b;
+    NEXT();
+
+do_iaload: {
+    int32_t *array = heap_get(heap, sp[-1]);
+    heap_check_index(array, tos);
+    tos = array[tos + 1];
+    sp--;
+    NEXT();
+}
+
+do_iastore: {
+    int32_t *array = heap_get(heap, sp[-2]);
+    heap_check_index(array, sp[-1]);
+    array[sp[-1] + 1] = tos;
+    sp -= 3;
+    tos = sp[0];
+    NEXT();
+}
+
+do_dup:
+    *sp++ = tos;
+    NEXT();
+
+do_iadd:
+    BINARY_OP(+);
+do_isub:
+    BINARY_OP(-);
+do_imul:
+    BINARY_OP(*);
+do_idiv:
+    BINARY_OP(/);
+do_irem:
+    BINARY_OP(%);
+do_iand:
+    BINARY_OP(&);
+do_ior:
+    BINARY_OP(|);
+do_ixor:
+    BINARY_OP(^);
+
+do_ineg:
+    tos = -tos;
+    NEXT();
+
+// Java only uses the low 5 bits of a shift amount
+do_ishl:
+    tos = (int32_t) ((uint32_t) sp[-1] << (tos & 0x1f));
+    sp--;
+    NEXT();
+do_ishr:
+    tos = sp[-1] >> (tos & 0x1f);
+    sp--;
+    NEXT();
+do_iushr:
+    tos = (int32_t) ((uint32_t) sp[-1] >> (tos & 0x1f));
+    sp--;
+    NEXT();
+
+do_ifeq:
+    BRANCH_IF_ZERO(==);
+do_ifne:
+    BRANCH_IF_ZERO(!=);
+do_iflt:
+    BRANCH_IF_ZERO(<);
+do_ifge:
+    BRANCH_IF_ZERO(>=);
+do_ifgt:
+    BRANCH_IF_ZERO(>);
+do_ifle:
+    BRANCH_IF_ZERO(<=);
+do_if_icmpeq:
+    COMPARE_BRANCH_IF(==);
+do_if_icmpne:
+    COMPARE_BRANCH_IF(!=);
+do_if_icmplt:
+    COMPARE_BRANCH_IF(<);
+do_if_icmpge:
+    COMPARE_BRANCH_IF(>=);
+do_if_icmpgt:
+    COMPARE_BRANCH_IF(>);
+do_if_icmple:
+    COMPARE_BRANCH_IF(<=);
+
+do_goto:
+    JUMP(ip->a);
+
+do_tableswitch: {
+    int32_t key = tos;
+    DROP();
+    JUMP(ip->table->targets[tableswitch_case(ip->table, key)]);
+}
+do_lookupswitch: {
+    int32_t key = tos;
+    DROP();
+    JUMP(ip->table->targets[lookupswitch_case(ip->table, key)]);
+}
+
+do_ireturn: {
+    PROFILE_EXIT();
+    if (stack->depth-- == entry_depth + 1) {
+        return (optional_value_t){.has_value = true, .value = tos};
+    }
+    // The value replaces the arguments the caller passed, and stays in `tos`
+    sp = fp->locals;
+    sp[0] = tos;
+    fp--;
+    if (fp->memo != NULL) {
+        memo_complete(fp->memo, (u4) stack->depth + 1, tos);
+        fp->memo = NULL;
+    }
+    locals = fp->locals;
+    insns = fp->state->insns;
+    ip = fp->return_ip;
+    DISPATCH();
+}
+
+do_return:
+    PROFILE_EXIT();
+    if (stack->depth-- == entry_depth + 1) {
+        return (optional_value_t){.has_value = false};
+    }
+    sp = fp->locals - 1;
+    tos = sp[0];
+    fp--;
+    locals = fp->locals;
+    insns = fp->state->insns;
+    ip = fp->return_ip;
+    DISPATCH();
+
+do_print:
+    output_int(tos);
+    DROP();
+    NEXT();
+
+do_invokestatic:
+    /* The arguments are the top `num_params` values, with the first one deepest,
+     * so once the top is written back they are the first locals of the callee's frame */
+    sp[0] = tos;
+    callee_locals = sp - ip->callee->num_params + 1;
+    goto invoke;
+do_call:
+    callee_locals = locals + ip->a;
+invoke: {
+    const resolved_method_t *callee = ip->callee;
+    if (!vm_stack_reserve_frame(stack) ||
+        !vm_stack_fits(stack, callee_locals,
+                       frame_slots(callee->max_locals, callee->max_stack))) {
+        vm_stack_overflow(stack);
+    }
+    fp = &stack->frames[stack->depth - 1]; // the records may have moved
+    fp->return_ip = ip + 1;
+    fp = &stack->frames[stack->depth++];
+    fp->method = callee->method;
+    fp->state = &states[callee->method - class->methods];
+    fp->locals = callee_locals;
+    PROFILE_ENTER(callee->method);
+
+    locals = callee_locals;
+    insns = fp->state->insns;
+    ip = insns;
+    sp = locals + callee->max_locals + FRAME_GAP_SLOTS - 1;
+    COUNT_TOWARD_JIT(calls_left);
+    POLL();
+    DISPATCH();
+}
+
+do_invokestatic_memo:
+    sp[0] = tos;
+    callee_locals = sp - ip->callee->num_params + 1;
+    goto invoke_memo;
+do_call_memo:
+    callee_locals = locals + ip->a;
+invoke_memo: {
+    // A call with the arguments of one that already returned is skipped
+    const method_t *callee = ip->callee->method;
+    memo_table_t *table = callee->memo;
+    memo_entry_t *entry = memo_find(table, states[callee - class->methods].memo, callee_locals);
+    if (memo_hit(table, entry, callee_locals)) {
+        PROFILE_MEMO(callee, true);
+        // The value replaces the arguments, like a returned one, and stays in `tos`
+        sp = callee_locals;
+        sp[0] = tos = entry->value;
+        NEXT();
+    }
+    PROFILE_MEMO(callee, false);
+    if (!vm_stack_reserve_frame(stack)) {
+        vm_stack_overflow(stack);
+    }
+    // The callee runs one frame deeper, and its return completes the entry
+    memo_claim(table, entry, callee_locals, (u4) stack->depth + 1);
+    stack->frames[stack->depth - 1].memo = entry;
+    goto invoke;
+}
+
+do_newarray:
+    if (tos < 0) {
+        negative_array_size(tos);
+    }
+    // Allocating can collect garbage, which needs to know where this frame is
+    fp->return_ip = ip + 1;
+    tos = heap_new_array(heap, tos);
+    NEXT();
+
+do_arraylength:
+    tos = heap_get(heap, tos)[0];
+    NEXT();
+
+do_iload_iload_if_icmpeq:
+    COMPARE_LOCALS_BRANCH_IF(==);
+do_iload_iload_if_icmpne:
+    COMPARE_LOCALS_BRANCH_IF(!=);
+do_iload_iload_if_icmplt:
+    COMPARE_LOCALS_BRANCH_IF(<);
+do_iload_iload_if_icmpge:
+    COMPARE_LOCALS_BRANCH_IF(>=);
+do_iload_iload_if_icmpgt:
+    COMPARE_LOCALS_BRANCH_IF(>);
+do_iload_iload_if_icmple:
+    COMPARE_LOCALS_BRANCH_IF(<=);
+
+do_iload_aload_arraylength_if_icmpge:
+    if (locals[ip->a] >= heap_get(heap, locals[ip->b])[0]) {
+        JUMP(ip->c);
+    }
+    SKIP(4);
+
+do_iinc_goto:
+    locals[ip->a] += ip->b;
+    JUMP(ip->c);
+
+do_iload_iconst_iadd_istore:
+    locals[ip->c] = locals[ip->a] + ip->b;
+    SKIP(4);
+
+do_aload_iload_iaload: {
+    int32_t *array = heap_get(heap, locals[ip->a]);
+    heap_check_index(array, locals[ip->b]);
+    PUSH(array[locals[ip->b] + 1]);
+    SKIP(3);
+}
+
+do_aload_arraylength:
+    PUSH(heap_get(heap, locals[ip->a])[0]);
+    SKIP(2);
+
+do_move:
+    locals[ip->a] = locals[ip->b];
+    NEXT();
+do_move_const:
+    locals[ip->a] = ip->b;
+    NEXT();
+do_add:
+    REGISTER_OP(+);
+do_add_const:
+    REGISTER_CONST_OP(+);
+do_sub:
+    REGISTER_OP(-);
+do_sub_from_const:
+    locals[ip->a] = ip->c - locals[ip->b];
+    NEXT();
+do_mul:
+    REGISTER_OP(*);
+do_mul_const:
+    REGISTER_CONST_OP(*);
+do_div:
+    REGISTER_OP(/);
+do_rem:
+    REGISTER_OP(%);
+do_div_pow2: {
+    // Dividing by shifting rounds down, so bias negative dividends to round toward zero
+    int32_t dividend = locals[ip->b];
+    int32_t bias = (dividend >> 31) & ((1 << ip->c) - 1);
+    locals[ip->a] = (dividend + bias) >> ip->c;
+    NEXT();
+}
+do_rem_pow2: {
+    int32_t dividend = locals[ip->b];
+    int32_t bias = (dividend >> 31) & ((1 << ip->c) - 1);
+    locals[ip->a] = ((dividend + bias) & ((1 << ip->c) - 1)) - bias;
+    NEXT();
+}
+do_div_magic:
+    locals[ip->a & 0xffff] = magic_divide(locals[(uint32_t) ip->a >> 16], ip->b, ip->aux);
+    NEXT();
+do_rem_magic: {
+    int32_t dividend = locals[(uint32_t) ip->a >> 16];
+    int32_t quotient = magic_divide(dividend, ip->b, ip->aux);
+    locals[ip->a & 0xffff] = dividend - quotient * ip->c;
+    NEXT();
+}
+do_neg:
+    locals[ip->a] = -locals[ip->b];
+    NEXT();
+do_and:
+    REGISTER_OP(&);
+do_and_const:
+    REGISTER_CONST_OP(&);
+do_or:
+    REGISTER_OP(|);
+do_or_const:
+    REGISTER_CONST_OP(|);
+do_xor:
+    REGISTER_OP(^);
+do_xor_const:
+    REGISTER_CONST_OP(^);
+do_shl:
+    locals[ip->a] = (int32_t) ((uint32_t) locals[ip->b] << (locals[ip->c] & 0x1f));
+    NEXT();
+do_shl_const:
+    locals[ip->a] = (int32_t) ((uint32_t) locals[ip->b] << ip->c);
+    NEXT();
+do_shr:
+    locals[ip->a] = locals[ip->b] >> (locals[ip->c] & 0x1f);
+    NEXT();
+do_shr_const:
+    REGISTER_CONST_OP(>>);
+do_ushr:
+    locals[ip->a] = (int32_t) ((uint32_t) locals[ip->b] >> (locals[ip->c] & 0x1f));
+    NEXT();
+do_ushr_const:
+    locals[ip->a] = (int32_t) ((uint32_t) locals[ip->b] >> ip->c);
+    NEXT();
+
+do_load_element: {
+    int32_t *array = heap_get(heap, locals[ip->b]);
+    heap_check_index(array, locals[ip->c]);
+    locals[ip->a] = array[locals[ip->c] + 1];
+    NEXT();
+}
+do_store_element: {
+    int32_t *array = heap_get(heap, locals[ip->a]);
+    heap_check_index(array, locals[ip->b]);
+    array[locals[ip->b] + 1] = locals[ip->c];
+    NEXT();
+}
+do_load_element_unchecked:
+    locals[ip->a] = heap_get(heap, locals[ip->b])[locals[ip->c] + 1];
+    NEXT();
+do_store_element_unchecked:
+    heap_get(heap, locals[ip->a])[locals[ip->b] + 1] = locals[ip->c];
+    NEXT();
+do_array_length:
+    locals[ip->a] = heap_get(heap, locals[ip->b])[0];
+    NEXT();
+do_new_array:
+    if (locals[ip->b] < 0) {
+        negative_array_size(locals[ip->b]);
+    }
+    fp->return_ip = ip + 1;
+    locals[ip->a] = heap_new_array(heap, locals[ip->b]);
+    NEXT();
+
+do_fill:
+    if (*LOOP_INDEX() < LOOP_END()) {
+        *LOOP_INDEX() =
+            array_fill(heap_get(heap, *LOOP_X()), *LOOP_INDEX(), LOOP_END(), locals[ip->b]);
+    }
+    NEXT();
+do_copy:
+    if (*LOOP_INDEX() < LOOP_END()) {
+        *LOOP_INDEX() = array_copy(heap_get(heap, *LOOP_X()), heap_get(heap, locals[ip->b]),
+                                   *LOOP_INDEX(), LOOP_END());
+    }
+    NEXT();
+do_sum:
+    if (*LOOP_INDEX() < LOOP_END()) {
+        *LOOP_INDEX() =
+            array_sum(heap_get(heap, locals[ip->b]), *LOOP_INDEX(), LOOP_END(), LOOP_X());
+    }
+    NEXT();
+do_prefix_sum:
+    if (*LOOP_INDEX() < LOOP_END()) {
+        *LOOP_INDEX() = array_prefix_sum(heap_get(heap, locals[ip->b]), *LOOP_INDEX(),
+                                         LOOP_END(), LOOP_X());
+    }
+    NEXT();
+do_mismatch:
+    if (*LOOP_INDEX() < LOOP_END()) {
+        *LOOP_INDEX() = array_mismatch(heap_get(heap, *LOOP_X()),
+                                       heap_get(heap, locals[ip->b]), *LOOP_INDEX(),
+                                       LOOP_END());
+    }
+    NEXT();
+
+do_br_eq:
+    REGISTER_BRANCH_IF(==);
+do_br_ne:
+    REGISTER_BRANCH_IF(!=);
+do_br_lt:
+    REGISTER_BRANCH_IF(<);
+do_br_ge:
+    REGISTER_BRANCH_IF(>=);
+do_br_gt:
+    REGISTER_BRANCH_IF(>);
+do_br_le:
+    REGISTER_BRANCH_IF(<=);
+do_br_eq_const:
+    REGISTER_CONST_BRANCH_IF(==);
+do_br_ne_const:
+    REGISTER_CONST_BRANCH_IF(!=);
+do_br_lt_const:
+    REGISTER_CONST_BRANCH_IF(<);
+do_br_ge_const:
+    REGISTER_CONST_BRANCH_IF(>=);
+do_br_gt_const:
+    REGISTER_CONST_BRANCH_IF(>);
+do_br_le_const:
+    REGISTER_CONST_BRANCH_IF(<=);
+
+do_br_table:
+    JUMP(ip->table->targets[tableswitch_case(ip->table, locals[ip->a])]);
+do_br_lookup:
+    JUMP(ip->table->targets[lookupswitch_case(ip->table, locals[ip->a])]);
+
+do_return_value:
+    tos = locals[ip->a];
+    goto do_ireturn;
+
+do_print_value:
+    output_int(locals[ip->a]);
+    NEXT();
+
+#ifndef PROFILE
+tier_up: {
+    /* The running method just got hot, so compile it and send its compiled
+     * instructions to the native code. That includes `ip`, so even a frame
+     * that never returns, like a main() that is one long loop, continues in
+     * native code (on-stack replacement). */
+    method_state_t *hot = fp->state;
+    jit_compile_method(fp->method, hot->jit, compressed_refs);
+    for (u4 i = 0; i < fp->method->insn_count; i++) {
+        if (hot->jit->entries[i] != NULL) {
+            hot->insns[i].handler = &&do_native;
+        }
+    }
+    DISPATCH();
+}
+
+do_native: {
+    // Run native code until it reaches an instruction the interpreter runs
+    const jit_state_t *jit = fp->state->jit;
+    ip = &insns[jit->code(locals, heap_ref_base(heap), jit->entries[ip - insns],
+                          &stack->preempt)];
+    // The code also returns at a backward branch when the run was preempted
+    POLL();
+    DISPATCH();
+}
+
+stop:
+    // The top value goes back to its slot, so the frames hold everything but `ip` and `sp`
+    sp[0] = tos;
+    stack->suspension = (vm_suspension_t){
+        .stopped = true,
+        .entry_depth = entry_depth,
+        .ip = ip,
+        .sp = sp,
+    };
+    atomic_store_explicit(&stack->preempt, false, memory_order_relaxed);
+    return (optional_value_t){.has_value = false};
+#endif
+}
+
+#ifndef PROFILE
+void thread_class(class_file_t *class) {
+    class_state_t state = {.class = class};
+    interpret(NULL, NULL, &state, NULL, NULL);
+}
+
+optional_value_t interpret_resume(class_state_t *state, heap_t *heap, vm_stack_t *stack) {
+    return interpret(NULL, NULL, state, heap, stack);
+}
+#endif
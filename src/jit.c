@@ -0,0 +1,1093 @@
+#include "jit.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "decode.h"
+#include "heap.h"
+#include "optimize.h"
+#include "read_class.h"
+
+/*
+ * The template JIT. Each register operation is translated on its own into a
+ * fixed sequence of machine instructions that loads its source registers from
+ * the frame, computes and stores the result back, so there is no register
+ * allocation and the frame is always up to date. What the JIT saves is the
+ * dispatch: a whole loop runs as one block of native code.
+ *
+ * While a method's code runs, the host registers hold:
+ *   rbx: `locals`, so register `n` is the memory operand [rbx + 4 * n]
+ *   r12: the heap's handle table, or the base of its compressed references
+ *   r13: the run's preempt flag
+ *   eax, ecx, edx: temporaries
+ * The code is a single function that saves rbx, r12 and r13 and jumps to the
+ * entry it is given. Each instruction the interpreter has to run compiles to
+ * an exit that returns the instruction's index, so branches can reach it.
+ * Array accesses the optimizer couldn't prove in bounds branch to a stub at
+ * the end of the code that reports the ArrayIndexOutOfBoundsException.
+ * Backward branches go through a poll stub of their own after it, which takes
+ * the branch if no preemption is pending and otherwise exits at its target,
+ * so a compiled loop stops as soon as an interpreted one would.
+ *
+ * The AArch64 backend has the same templates and layout, with x19, x20 and
+ * x21 in the roles of rbx, r12 and r13, w9 to w11 and x12 and x13 as
+ * temporaries, and x16 for addresses. Its code saves them in a frame record
+ * of its own, so it can be entered and left just like the x86-64 code.
+ * A backend for another host needs the same templates (and jit_available()
+ * to say so); until then its methods are interpreted.
+ */
+
+/** Machine code being emitted, in a growable buffer */
+typedef struct {
+    u1 *bytes;
+    size_t size;
+    size_t capacity;
+} code_buffer_t;
+
+/** A branch whose displacement is filled in once its target is emitted */
+typedef struct {
+    /** The offset of the displacement in the code (on AArch64, of the branch instruction) */
+    size_t offset;
+    /** The index of the instruction the branch goes to */
+    u4 target;
+} fixup_t;
+
+/**
+ * @brief Gets whether a method only has operations the JIT can compile or exit on.
+ * Stack operations need the interpreter's operand stack pointer, so methods
+ * that have any are left to the interpreter.
+ */
+static bool is_compilable(const method_t *method) {
+    for (u4 i = 0; i < method->insn_count; i++) {
+        u1 op = method->insns[i].op;
+        bool register_op = op >= op_move || op == op_iinc || op == op_goto ||
+                           op == op_iinc_goto || op == op_return || op == op_unsupported;
+        if (!register_op) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Gets whether the interpreter runs an operation rather than the native code.
+ */
+static bool is_exit(u1 op) {
+    return op == op_call || op == op_call_memo || op == op_new_array || op == op_print_value ||
+           op == op_return_value || op == op_return || op == op_unsupported ||
+           op == op_br_table || op == op_br_lookup || (op_fill <= op && op <= op_mismatch);
+}
+
+#if defined(__x86_64__) || defined(__aarch64__)
+
+/* The parts shared by the backends */
+
+/**
+ * @brief Appends bytes to the code.
+ */
+static void emit_bytes(code_buffer_t *code, const u1 *bytes, size_t count) {
+    if (code->size + count > code->capacity) {
+        code->capacity = code->capacity * 2 + count;
+        code->bytes = realloc(code->bytes, code->capacity);
+        assert(code->bytes != NULL && "Failed to grow JIT buffer");
+    }
+    memcpy(&code->bytes[code->size], bytes, count);
+    code->size += count;
+}
+
+#define EMIT(code, ...)                                                                  \
+    emit_bytes((code), (const u1[]){__VA_ARGS__}, sizeof((const u1[]){__VA_ARGS__}))
+
+/**
+ * @brief Appends a little-endian 32-bit immediate or displacement.
+ */
+static void emit_u4(code_buffer_t *code, int32_t value) {
+    uint32_t bits = value;
+    EMIT(code, bits, bits >> 8, bits >> 16, bits >> 24);
+}
+
+/**
+ * @brief Gets the index a branch of instruction `index` to `target` is fixed
+ * up as. A backward branch goes to a new poll stub (see emit_poll_stub()),
+ * which goes on to `target` unless the run was preempted.
+ *
+ * @param stub The index the out-of-bounds stub is fixed up as; the poll stubs
+ *   are fixed up as the indices after it.
+ * @param polls The targets of the poll stubs, added to.
+ * @param poll_count The number of `polls`.
+ */
+static u4 branch_target(u4 index, u4 target, u4 stub, u4 *polls, u4 *poll_count) {
+    if (target > index) {
+        return target;
+    }
+    polls[*poll_count] = target;
+    return stub + 1 + (*poll_count)++;
+}
+
+// The poll stubs load the preempt flag as a byte
+_Static_assert(sizeof(atomic_bool) == 1, "atomic_bool isn't a byte");
+
+#if defined(__x86_64__)
+
+/** The host's registers, numbered as in the x86 instruction encoding */
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3 };
+
+/** The jcc condition codes of the comparisons, in op_t order: eq, ne, lt, ge, gt, le */
+static const u1 CONDITION_CODES[] = {0x4, 0x5, 0xc, 0xd, 0xf, 0xe};
+
+/**
+ * @brief Appends the ModRM byte and displacement of the memory operand for a
+ * frame register, [rbx + 4 * slot].
+ *
+ * @param reg The host register or opcode extension of the ModRM reg field.
+ * @param slot The frame register.
+ */
+static void emit_slot(code_buffer_t *code, u1 reg, int32_t slot) {
+    int32_t displacement = slot * 4;
+    if (-128 <= displacement && displacement < 128) {
+        EMIT(code, 0x40 | reg << 3 | RBX, displacement);
+    }
+    else {
+        EMIT(code, 0x80 | reg << 3 | RBX);
+        emit_u4(code, displacement);
+    }
+}
+
+/**
+ * @brief Appends an instruction with a one-byte opcode and a frame register
+ * operand, e.g. `mov eax, [slot]`.
+ */
+static void emit_op_slot(code_buffer_t *code, u1 opcode, u1 reg, int32_t slot) {
+    EMIT(code, opcode);
+    emit_slot(code, reg, slot);
+}
+
+/** Loads a frame register into a host register */
+#define LOAD(code, reg, slot) emit_op_slot((code), 0x8b, (reg), (slot))
+/** Stores a host register into a frame register */
+#define STORE(code, reg, slot) emit_op_slot((code), 0x89, (reg), (slot))
+
+/**
+ * @brief Appends a jump or conditional jump with a displacement to fill in later.
+ *
+ * @param opcode The opcode bytes, without the displacement.
+ * @param target The index of the instruction to jump to.
+ */
+static void emit_jump(code_buffer_t *code, const u1 *opcode, size_t opcode_size,
+                      u4 target, fixup_t *fixups, u4 *fixup_count) {
+    emit_bytes(code, opcode, opcode_size);
+    fixups[(*fixup_count)++] = (fixup_t){.offset = code->size, .target = target};
+    emit_u4(code, 0);
+}
+
+/**
+ * @brief Fills in the displacement of a jump.
+ *
+ * @param target_offset The offset of the code the jump goes to.
+ */
+static void patch_branch(code_buffer_t *code, const fixup_t *fixup, size_t target_offset) {
+    int32_t displacement = target_offset - (fixup->offset + 4);
+    memcpy(&code->bytes[fixup->offset], &displacement, sizeof(displacement));
+}
+
+/**
+ * @brief Appends the start of the code: it saves the registers it keeps
+ * `locals`, `refs` and `preempt` in and jumps to the entry.
+ */
+static void emit_prologue(code_buffer_t *code) {
+    /* push rbx; push r12; push r13; mov rbx, rdi (locals); mov r12, rsi (refs);
+     * mov r13, rcx (preempt); jmp rdx (entry) */
+    EMIT(code, 0x53, 0x41, 0x54, 0x41, 0x55, 0x48, 0x89, 0xfb, 0x49, 0x89, 0xf4, 0x49, 0x89,
+         0xcd, 0xff, 0xe2);
+}
+
+/**
+ * @brief Appends the code that returns an instruction index to the interpreter.
+ */
+static void emit_exit(code_buffer_t *code, u4 index) {
+    // mov eax, index; pop r13; pop r12; pop rbx; ret
+    EMIT(code, 0xb8);
+    emit_u4(code, index);
+    EMIT(code, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+}
+
+/**
+ * @brief Appends a branch of instruction `index`, through a poll stub if it's
+ * backward (see branch_target()).
+ */
+static void emit_branch(code_buffer_t *code, const u1 *opcode, size_t opcode_size, u4 index,
+                        u4 target, u4 stub, fixup_t *fixups, u4 *fixup_count, u4 *polls,
+                        u4 *poll_count) {
+    emit_jump(code, opcode, opcode_size, branch_target(index, target, stub, polls, poll_count),
+              fixups, fixup_count);
+}
+
+/**
+ * @brief Appends the stub a backward branch to `target` jumps to, which goes on
+ * to the target unless the run's preempt flag is set, and exits at the target
+ * if it is, so the interpreter stops the run there.
+ */
+static void emit_poll_stub(code_buffer_t *code, u4 target, fixup_t *fixups, u4 *fixup_count) {
+    // cmp byte [r13], 0; je target
+    EMIT(code, 0x41, 0x80, 0x7d, 0x00, 0x00);
+    emit_jump(code, (const u1[]){0x0f, 0x84}, 2, target, fixups, fixup_count);
+    emit_exit(code, target);
+}
+
+/**
+ * @brief Appends the code that leaves the address of register `array`'s array
+ * (its length, followed by its elements) in rdx.
+ *
+ * @param compressed_refs Whether r12 is the base of compressed references
+ *   rather than the handle table.
+ */
+static void emit_array_address(code_buffer_t *code, int32_t array, bool compressed_refs) {
+    // mov eax, [array]; then lea rdx, [r12 + 8 * rax] or mov rdx, [r12 + 8 * rax]
+    LOAD(code, RAX, array);
+    EMIT(code, 0x49, compressed_refs ? 0x8d : 0x8b, 0x14, 0xc4);
+}
+
+/**
+ * @brief Appends the code that leaves the address of element register `index`
+ * of register `array`'s array in rdx + 4 * rcx + 4.
+ */
+static void emit_element_address(code_buffer_t *code, int32_t array, int32_t index,
+                                 bool compressed_refs) {
+    // movsxd rcx, [index]
+    emit_array_address(code, array, compressed_refs);
+    EMIT(code, 0x48, 0x63);
+    emit_slot(code, RCX, index);
+}
+
+/**
+ * @brief Appends the check that the index of emit_element_address() is in its
+ * array's bounds, which compares it as unsigned so negative indices fail too.
+ *
+ * @param stub The index the out-of-bounds stub is fixed up as.
+ */
+static void emit_bounds_check(code_buffer_t *code, u4 stub, fixup_t *fixups,
+                              u4 *fixup_count) {
+    // cmp ecx, [rdx]; jae stub
+    EMIT(code, 0x3b, 0x0a);
+    emit_jump(code, (const u1[]){0x0f, 0x83}, 2, stub, fixups, fixup_count);
+}
+
+/**
+ * @brief Appends the stub that the bounds checks branch to, with the index in
+ * ecx and the array in rdx. It never returns.
+ */
+static void emit_out_of_bounds_stub(code_buffer_t *code) {
+    // mov edi, ecx; mov esi, [rdx]; and rsp, -16; mov rax, imm64; call rax
+    EMIT(code, 0x89, 0xcf, 0x8b, 0x32, 0x48, 0x83, 0xe4, 0xf0, 0x48, 0xb8);
+    uint64_t address = (uint64_t) (uintptr_t) heap_index_out_of_bounds;
+    emit_bytes(code, (const u1 *) &address, sizeof(address));
+    EMIT(code, 0xff, 0xd0);
+}
+
+/**
+ * @brief Appends the code for a division by a constant with a magic number,
+ * which leaves the quotient in eax and the dividend in ecx (see magic_divide()).
+ */
+static void emit_magic_divide(code_buffer_t *code, const insn_t *insn) {
+    // mov ecx, [source]; movsxd rax, ecx; imul rax, rax, magic; sar rax, 32
+    LOAD(code, RCX, (int32_t) ((uint32_t) insn->a >> 16));
+    EMIT(code, 0x48, 0x63, 0xc1);
+    EMIT(code, 0x48, 0x69, 0xc0);
+    emit_u4(code, insn->b);
+    EMIT(code, 0x48, 0xc1, 0xf8, 0x20);
+    if (insn->aux & MAGIC_ADD_DIVIDEND) {
+        EMIT(code, 0x01, 0xc8); // add eax, ecx
+    }
+    else if (insn->aux & MAGIC_SUBTRACT_DIVIDEND) {
+        EMIT(code, 0x29, 0xc8); // sub eax, ecx
+    }
+    // sar eax, shift; mov edx, eax; shr edx, 31; add eax, edx
+    EMIT(code, 0xc1, 0xf8, insn->aux & MAGIC_SHIFT_MASK);
+    EMIT(code, 0x89, 0xc2, 0xc1, 0xea, 0x1f, 0x01, 0xd0);
+}
+
+/**
+ * @brief Appends the code that leaves register `source` divided by 2^shift,
+ * rounded toward zero, in eax, and the bias it added in ecx.
+ */
+static void emit_pow2_divide(code_buffer_t *code, int32_t source, int32_t shift) {
+    // mov eax, [source]; mov ecx, eax; sar ecx, 31; and ecx, 2^shift - 1; add eax, ecx
+    LOAD(code, RAX, source);
+    EMIT(code, 0x89, 0xc1, 0xc1, 0xf9, 0x1f, 0x81, 0xe1);
+    emit_u4(code, (int32_t) (((uint32_t) 1 << shift) - 1));
+    EMIT(code, 0x01, 0xc8);
+}
+
+/**
+ * @brief Appends the template of one instruction.
+ *
+ * @param insn The instruction.
+ * @param index Its index in the method's stream.
+ * @param stub The index the out-of-bounds stub is fixed up as.
+ * @param compressed_refs Whether references are compressed (see heap_compress_refs()).
+ * @param fixups The branches to fill in, added to.
+ * @param fixup_count The number of `fixups`.
+ * @param polls The targets of the poll stubs, added to (see emit_branch()).
+ * @param poll_count The number of `polls`.
+ */
+static void emit_insn(code_buffer_t *code, const insn_t *insn, u4 index, u4 stub,
+                      bool compressed_refs, fixup_t *fixups, u4 *fixup_count, u4 *polls,
+                      u4 *poll_count) {
+    // The ALU opcodes of the form `op eax, [slot]`
+    static const u1 ALU_OPCODES[NUM_OPS] = {[op_add] = 0x03, [op_sub] = 0x2b,
+                                            [op_and] = 0x23, [op_or] = 0x0b,
+                                            [op_xor] = 0x33};
+    // The opcode extensions of the form `op r/m32, imm32` (0x81 /ext)
+    static const u1 IMMEDIATE_EXTENSIONS[NUM_OPS] = {
+        [op_add_const] = 0, [op_or_const] = 1, [op_and_const] = 4, [op_xor_const] = 6};
+    // The opcode extensions of shifts (0xd3 /ext by cl, and 0xc1 /ext by an immediate)
+    static const u1 SHIFT_EXTENSIONS[NUM_OPS] = {
+        [op_shl] = 4,       [op_shr] = 7,       [op_ushr] = 5,
+        [op_shl_const] = 4, [op_shr_const] = 7, [op_ushr_const] = 5};
+
+    if (is_exit(insn->op)) {
+        emit_exit(code, index);
+        return;
+    }
+    switch (insn->op) {
+        case op_move:
+            LOAD(code, RAX, insn->b);
+            STORE(code, RAX, insn->a);
+            break;
+        case op_move_const:
+            emit_op_slot(code, 0xc7, 0, insn->a);
+            emit_u4(code, insn->b);
+            break;
+        case op_add:
+        case op_sub:
+        case op_and:
+        case op_or:
+        case op_xor:
+            LOAD(code, RAX, insn->b);
+            emit_op_slot(code, ALU_OPCODES[insn->op], RAX, insn->c);
+            STORE(code, RAX, insn->a);
+            break;
+        case op_add_const:
+        case op_and_const:
+        case op_or_const:
+        case op_xor_const:
+            LOAD(code, RAX, insn->b);
+            EMIT(code, 0x81, 0xc0 | IMMEDIATE_EXTENSIONS[insn->op] << 3 | RAX);
+            emit_u4(code, insn->c);
+            STORE(code, RAX, insn->a);
+            break;
+        case op_sub_from_const:
+            EMIT(code, 0xb8);
+            emit_u4(code, insn->c);
+            emit_op_slot(code, 0x2b, RAX, insn->b);
+            STORE(code, RAX, insn->a);
+            break;
+        case op_iinc:
+            emit_op_slot(code, 0x81, 0, insn->a);
+            emit_u4(code, insn->b);
+            break;
+        case op_mul:
+            LOAD(code, RAX, insn->b);
+            EMIT(code, 0x0f, 0xaf);
+            emit_slot(code, RAX, insn->c);
+            STORE(code, RAX, insn->a);
+            break;
+        case op_mul_const:
+            emit_op_slot(code, 0x69, RAX, insn->b);
+            emit_u4(code, insn->c);
+            STORE(code, RAX, insn->a);
+            break;
+        case op_div:
+        case op_rem:
+            // mov eax, [b]; cdq; idiv [c]
+            LOAD(code, RAX, insn->b);
+            EMIT(code, 0x99);
+            emit_op_slot(code, 0xf7, 7, insn->c);
+            STORE(code, insn->op == op_div ? RAX : RDX, insn->a);
+            break;
+        case op_div_pow2:
+            emit_pow2_divide(code, insn->b, insn->c);
+            EMIT(code, 0xc1, 0xf8, insn->c); // sar eax, shift
+            STORE(code, RAX, insn->a);
+            break;
+        case op_rem_pow2:
+            emit_pow2_divide(code, insn->b, insn->c);
+            // and eax, 2^shift - 1; sub eax, ecx
+            EMIT(code, 0x25);
+            emit_u4(code, (int32_t) (((uint32_t) 1 << insn->c) - 1));
+            EMIT(code, 0x29, 0xc8);
+            STORE(code, RAX, insn->a);
+            break;
+        case op_div_magic:
+            emit_magic_divide(code, insn);
+            STORE(code, RAX, insn->a & 0xffff);
+            break;
+        case op_rem_magic:
+            emit_magic_divide(code, insn);
+            // imul eax, eax, divisor; sub ecx, eax
+            EMIT(code, 0x69, 0xc0);
+            emit_u4(code, insn->c);
+            EMIT(code, 0x29, 0xc1);
+            STORE(code, RCX, insn->a & 0xffff);
+            break;
+        case op_neg:
+            LOAD(code, RAX, insn->b);
+            EMIT(code, 0xf7, 0xd8);
+            STORE(code, RAX, insn->a);
+            break;
+        case op_shl:
+        case op_shr:
+        case op_ushr:
+            // The hardware also only uses the low 5 bits of a shift amount
+            LOAD(code, RAX, insn->b);
+            LOAD(code, RCX, insn->c);
+            EMIT(code, 0xd3, 0xc0 | SHIFT_EXTENSIONS[insn->op] << 3 | RAX);
+            STORE(code, RAX, insn->a);
+            break;
+        case op_shl_const:
+        case op_shr_const:
+        case op_ushr_const:
+            LOAD(code, RAX, insn->b);
+            EMIT(code, 0xc1, 0xc0 | SHIFT_EXTENSIONS[insn->op] << 3 | RAX, insn->c);
+            STORE(code, RAX, insn->a);
+            break;
+        case op_load_element:
+        case op_load_element_unchecked:
+            // mov eax, [rdx + 4 * rcx + 4]
+            emit_element_address(code, insn->b, insn->c, compressed_refs);
+            if (insn->op == op_load_element) {
+                emit_bounds_check(code, stub, fixups, fixup_count);
+            }
+            EMIT(code, 0x8b, 0x44, 0x8a, 0x04);
+            STORE(code, RAX, insn->a);
+            break;
+        case op_store_element:
+        case op_store_element_unchecked:
+            // mov eax, [c]; mov [rdx + 4 * rcx + 4], eax
+            emit_element_address(code, insn->a, insn->b, compressed_refs);
+            if (insn->op == op_store_element) {
+                emit_bounds_check(code, stub, fixups, fixup_count);
+            }
+            LOAD(code, RAX, insn->c);
+            EMIT(code, 0x89, 0x44, 0x8a, 0x04);
+            break;
+        case op_array_length:
+            // mov eax, [rdx]
+            emit_array_address(code, insn->b, compressed_refs);
+            EMIT(code, 0x8b, 0x02);
+            STORE(code, RAX, insn->a);
+            break;
+        case op_br_eq:
+        case op_br_ne:
+        case op_br_lt:
+        case op_br_ge:
+        case op_br_gt:
+        case op_br_le:
+            LOAD(code, RAX, insn->b);
+            emit_op_slot(code, 0x3b, RAX, insn->c);
+            emit_branch(code,
+                        (const u1[]){0x0f, 0x80 | CONDITION_CODES[insn->op - op_br_eq]}, 2,
+                        index, insn->a, stub, fixups, fixup_count, polls, poll_count);
+            break;
+        case op_br_eq_const:
+        case op_br_ne_const:
+        case op_br_lt_const:
+        case op_br_ge_const:
+        case op_br_gt_const:
+        case op_br_le_const: {
+            // cmp dword [b], c
+            u1 condition = CONDITION_CODES[insn->op - op_br_eq_const];
+            emit_op_slot(code, 0x81, 7, insn->b);
+            emit_u4(code, insn->c);
+            emit_branch(code, (const u1[]){0x0f, 0x80 | condition}, 2, index, insn->a, stub,
+                        fixups, fixup_count, polls, poll_count);
+            break;
+        }
+        case op_goto:
+            emit_branch(code, (const u1[]){0xe9}, 1, index, insn->a, stub, fixups, fixup_count,
+                        polls, poll_count);
+            break;
+        case op_iinc_goto:
+            emit_op_slot(code, 0x81, 0, insn->a);
+            emit_u4(code, insn->b);
+            emit_branch(code, (const u1[]){0xe9}, 1, index, insn->c, stub, fixups, fixup_count,
+                        polls, poll_count);
+            break;
+        default:
+            assert(false && "Operation has no template");
+    }
+}
+
+#elif defined(__aarch64__)
+
+/** The host's registers: temporaries first, then the ones that live across the code */
+enum {
+    W0 = 0,
+    W1 = 1,
+    W9 = 9,
+    W10 = 10,
+    W11 = 11,
+    X12 = 12,
+    X13 = 13,
+    X16 = 16,
+    LOCALS = 19,
+    REFS = 20,
+    PREEMPT = 21,
+    /** The stack pointer or the zero register, depending on the instruction */
+    SP = 31,
+    ZR = 31
+};
+
+/** The b.cond condition codes of the comparisons, in op_t order: eq, ne, lt, ge, gt, le */
+static const u1 CONDITION_CODES[] = {0x0, 0x1, 0xb, 0xa, 0xc, 0xd};
+/** The condition code of an unsigned >= */
+#define CONDITION_HS 0x2
+
+/**
+ * @brief Appends an instruction.
+ */
+static void emit_word(code_buffer_t *code, uint32_t word) {
+    emit_u4(code, (int32_t) word);
+}
+
+/**
+ * @brief Appends the code that leaves a 32-bit constant in a register.
+ */
+static void emit_mov_const(code_buffer_t *code, u1 reg, int32_t value) {
+    // movz wd, #low; movk wd, #high, lsl #16
+    uint32_t bits = value;
+    emit_word(code, 0x52800000 | (bits & 0xffff) << 5 | reg);
+    if (bits >> 16 != 0) {
+        emit_word(code, 0x72a00000 | (bits >> 16) << 5 | reg);
+    }
+}
+
+/**
+ * @brief Appends a load of a frame register into a host register, or a store
+ * of a host register into a frame register, [x19 + 4 * slot].
+ *
+ * @param opcode The instruction with a scaled 12-bit offset: 0xb9400000 (ldr) or
+ *   0xb9000000 (str).
+ */
+static void emit_slot_access(code_buffer_t *code, uint32_t opcode, u1 reg, int32_t slot) {
+    if (0 <= slot && slot < 4096) {
+        // ldr/str wt, [x19, #4 * slot]
+        emit_word(code, opcode | slot << 10 | LOCALS << 5 | reg);
+    }
+    else {
+        // mov w16, #4 * slot; ldr/str wt, [x19, w16, sxtw]
+        emit_mov_const(code, X16, slot * 4);
+        uint32_t register_opcode = (opcode & 0x00400000) | 0xb820c800;
+        emit_word(code, register_opcode | X16 << 16 | LOCALS << 5 | reg);
+    }
+}
+
+/** Loads a frame register into a host register */
+#define LOAD(code, reg, slot) emit_slot_access((code), 0xb9400000, (reg), (slot))
+/** Stores a host register into a frame register */
+#define STORE(code, reg, slot) emit_slot_access((code), 0xb9000000, (reg), (slot))
+
+/**
+ * @brief Appends an instruction with three 32-bit registers, `op wd, wn, wm`.
+ */
+static void emit_three(code_buffer_t *code, uint32_t opcode, u1 d, u1 n, u1 m) {
+    emit_word(code, opcode | m << 16 | n << 5 | d);
+}
+
+/**
+ * @brief Appends a branch whose offset is filled in later (see patch_branch()).
+ *
+ * @param opcode The branch without its offset: b, b.cond or cbz.
+ * @param target The index of the instruction to jump to.
+ */
+static void emit_jump(code_buffer_t *code, uint32_t opcode, u4 target, fixup_t *fixups,
+                      u4 *fixup_count) {
+    fixups[(*fixup_count)++] = (fixup_t){.offset = code->size, .target = target};
+    emit_word(code, opcode);
+}
+
+/**
+ * @brief Appends a branch of instruction `index`, through a poll stub if it's
+ * backward (see branch_target()).
+ */
+static void emit_branch(code_buffer_t *code, uint32_t opcode, u4 index, u4 target, u4 stub,
+                        fixup_t *fixups, u4 *fixup_count, u4 *polls, u4 *poll_count) {
+    emit_jump(code, opcode, branch_target(index, target, stub, polls, poll_count), fixups,
+              fixup_count);
+}
+
+/**
+ * @brief Fills in the offset of a branch.
+ *
+ * @param target_offset The offset of the code the branch goes to.
+ */
+static void patch_branch(code_buffer_t *code, const fixup_t *fixup, size_t target_offset) {
+    int64_t distance = ((int64_t) target_offset - (int64_t) fixup->offset) / 4;
+    uint32_t word;
+    memcpy(&word, &code->bytes[fixup->offset], sizeof(word));
+    if ((word & 0xfc000000) == 0x14000000) {
+        // b has a 26-bit offset
+        assert(-(1 << 25) <= distance && distance < (1 << 25) && "JIT branch out of range");
+        word |= distance & 0x3ffffff;
+    }
+    else {
+        // b.cond and cbz have a 19-bit offset
+        assert(-(1 << 18) <= distance && distance < (1 << 18) && "JIT branch out of range");
+        word |= (distance & 0x7ffff) << 5;
+    }
+    memcpy(&code->bytes[fixup->offset], &word, sizeof(word));
+}
+
+/**
+ * @brief Appends the start of the code: it saves the registers it keeps
+ * `locals`, `refs` and `preempt` in and jumps to the entry.
+ */
+static void emit_prologue(code_buffer_t *code) {
+    // stp x29, x30, [sp, #-48]!; mov x29, sp; stp x19, x20, [sp, #16]; str x21, [sp, #32]
+    emit_word(code, 0xa9bd7bfd);
+    emit_word(code, 0x910003fd);
+    emit_word(code, 0xa90153f3);
+    emit_word(code, 0xf90013f5);
+    // mov x19, x0 (locals); mov x20, x1 (refs); mov x21, x3 (preempt); br x2 (entry)
+    emit_word(code, 0xaa0003f3);
+    emit_word(code, 0xaa0103f4);
+    emit_word(code, 0xaa0303f5);
+    emit_word(code, 0xd61f0040);
+}
+
+/**
+ * @brief Appends the code that returns an instruction index to the interpreter.
+ */
+static void emit_exit(code_buffer_t *code, u4 index) {
+    // mov w0, #index; ldr x21, [sp, #32]; ldp x19, x20, [sp, #16]; ldp x29, x30, [sp], #48; ret
+    emit_mov_const(code, W0, index);
+    emit_word(code, 0xf94013f5);
+    emit_word(code, 0xa94153f3);
+    emit_word(code, 0xa8c37bfd);
+    emit_word(code, 0xd65f03c0);
+}
+
+/**
+ * @brief Appends the stub a backward branch to `target` jumps to, which goes on
+ * to the target unless the run's preempt flag is set, and exits at the target
+ * if it is, so the interpreter stops the run there.
+ */
+static void emit_poll_stub(code_buffer_t *code, u4 target, fixup_t *fixups, u4 *fixup_count) {
+    // ldrb w9, [x21]; cbz w9, target
+    emit_word(code, 0x39400000 | PREEMPT << 5 | W9);
+    emit_jump(code, 0x34000000 | W9, target, fixups, fixup_count);
+    emit_exit(code, target);
+}
+
+/**
+ * @brief Appends the code that leaves the address of register `array`'s array
+ * (its length, followed by its elements) in x12.
+ *
+ * @param compressed_refs Whether x20 is the base of compressed references
+ *   rather than the handle table.
+ */
+static void emit_array_address(code_buffer_t *code, int32_t array, bool compressed_refs) {
+    // ldr w9, [array]; then add x12, x20, x9, lsl #3 or ldr x12, [x20, x9, lsl #3]
+    LOAD(code, W9, array);
+    if (compressed_refs) {
+        emit_word(code, 0x8b000000 | W9 << 16 | 3 << 10 | REFS << 5 | X12);
+    }
+    else {
+        emit_word(code, 0xf8607800 | W9 << 16 | REFS << 5 | X12);
+    }
+}
+
+/**
+ * @brief Appends the code that leaves the address of register `array`'s array
+ * in x12, its elements' in x13 and element register `index` in w10.
+ */
+static void emit_element_address(code_buffer_t *code, int32_t array, int32_t index,
+                                 bool compressed_refs) {
+    // add x13, x12, #4; ldr w10, [index]
+    emit_array_address(code, array, compressed_refs);
+    emit_word(code, 0x91000000 | 4 << 10 | X12 << 5 | X13);
+    LOAD(code, W10, index);
+}
+
+/**
+ * @brief Appends the check that the index of emit_element_address() is in its
+ * array's bounds, which compares it as unsigned so negative indices fail too.
+ *
+ * @param stub The index the out-of-bounds stub is fixed up as.
+ */
+static void emit_bounds_check(code_buffer_t *code, u4 stub, fixup_t *fixups,
+                              u4 *fixup_count) {
+    // ldr w11, [x12]; cmp w10, w11; b.hs stub
+    emit_word(code, 0xb9400000 | X12 << 5 | W11);
+    emit_three(code, 0x6b000000, ZR, W10, W11);
+    emit_jump(code, 0x54000000 | CONDITION_HS, stub, fixups, fixup_count);
+}
+
+/**
+ * @brief Appends the stub that the bounds checks branch to, with the index in
+ * w10 and the array in x12. It never returns.
+ */
+static void emit_out_of_bounds_stub(code_buffer_t *code) {
+    // mov w0, w10; ldr w1, [x12]
+    emit_three(code, 0x2a000000, W0, ZR, W10);
+    emit_word(code, 0xb9400000 | X12 << 5 | W1);
+    // movz x16, #address; movk x16, #address, lsl #16, #32 and #48; blr x16
+    uint64_t address = (uint64_t) (uintptr_t) heap_index_out_of_bounds;
+    for (uint32_t shift = 0; shift < 64; shift += 16) {
+        uint32_t opcode = shift == 0 ? 0xd2800000 : 0xf2800000 | (shift / 16) << 21;
+        emit_word(code, opcode | ((address >> shift) & 0xffff) << 5 | X16);
+    }
+    emit_word(code, 0xd63f0000 | X16 << 5);
+}
+
+/**
+ * @brief Appends the code for a division by a constant with a magic number,
+ * which leaves the quotient in w9 and the dividend in w10 (see magic_divide()).
+ */
+static void emit_magic_divide(code_buffer_t *code, const insn_t *insn) {
+    // ldr w10, [source]; mov w11, #magic; smull x9, w10, w11; asr x9, x9, #32
+    LOAD(code, W10, (int32_t) ((uint32_t) insn->a >> 16));
+    emit_mov_const(code, W11, insn->b);
+    emit_three(code, 0x9b207c00, W9, W10, W11);
+    emit_word(code, 0x9360fc00 | W9 << 5 | W9);
+    if (insn->aux & MAGIC_ADD_DIVIDEND) {
+        emit_three(code, 0x0b000000, W9, W9, W10); // add w9, w9, w10
+    }
+    else if (insn->aux & MAGIC_SUBTRACT_DIVIDEND) {
+        emit_three(code, 0x4b000000, W9, W9, W10); // sub w9, w9, w10
+    }
+    // asr w9, w9, #shift; add w9, w9, w9, lsr #31
+    emit_word(code, 0x13007c00 | (insn->aux & MAGIC_SHIFT_MASK) << 16 | W9 << 5 | W9);
+    emit_three(code, 0x0b407c00, W9, W9, W9);
+}
+
+/**
+ * @brief Appends the code that leaves register `source` divided by 2^shift,
+ * rounded toward zero, in w9, the bias it added in w10 and 2^shift - 1 in w11.
+ */
+static void emit_pow2_divide(code_buffer_t *code, int32_t source, int32_t shift) {
+    // ldr w9, [source]; asr w10, w9, #31; mov w11, #(2^shift - 1); and w10, w10, w11;
+    // add w9, w9, w10
+    LOAD(code, W9, source);
+    emit_word(code, 0x131f7c00 | W9 << 5 | W10);
+    emit_mov_const(code, W11, (int32_t) (((uint32_t) 1 << shift) - 1));
+    emit_three(code, 0x0a000000, W10, W10, W11);
+    emit_three(code, 0x0b000000, W9, W9, W10);
+}
+
+/**
+ * @brief Appends the template of one instruction.
+ *
+ * @param insn The instruction.
+ * @param index Its index in the method's stream.
+ * @param stub The index the out-of-bounds stub is fixed up as.
+ * @param compressed_refs Whether references are compressed (see heap_compress_refs()).
+ * @param fixups The branches to fill in, added to.
+ * @param fixup_count The number of `fixups`.
+ * @param polls The targets of the poll stubs, added to (see emit_branch()).
+ * @param poll_count The number of `polls`.
+ */
+static void emit_insn(code_buffer_t *code, const insn_t *insn, u4 index, u4 stub,
+                      bool compressed_refs, fixup_t *fixups, u4 *fixup_count, u4 *polls,
+                      u4 *poll_count) {
+    // The opcodes of the form `op wd, wn, wm`, which the constant forms use too
+    static const uint32_t THREE_REGISTER_OPCODES[NUM_OPS] = {
+        [op_add] = 0x0b000000,       [op_sub] = 0x4b000000,       [op_and] = 0x0a000000,
+        [op_or] = 0x2a000000,        [op_xor] = 0x4a000000,       [op_mul] = 0x1b007c00,
+        [op_add_const] = 0x0b000000, [op_and_const] = 0x0a000000, [op_or_const] = 0x2a000000,
+        [op_xor_const] = 0x4a000000, [op_mul_const] = 0x1b007c00, [op_shl] = 0x1ac02000,
+        [op_shr] = 0x1ac02800,       [op_ushr] = 0x1ac02400};
+
+    if (is_exit(insn->op)) {
+        emit_exit(code, index);
+        return;
+    }
+    switch (insn->op) {
+        case op_move:
+            LOAD(code, W9, insn->b);
+            STORE(code, W9, insn->a);
+            break;
+        case op_move_const:
+            emit_mov_const(code, W9, insn->b);
+            STORE(code, W9, insn->a);
+            break;
+        case op_add:
+        case op_sub:
+        case op_and:
+        case op_or:
+        case op_xor:
+        case op_mul:
+        case op_shl:
+        case op_shr:
+        case op_ushr:
+            // The hardware also only uses the low 5 bits of a shift amount
+            LOAD(code, W9, insn->b);
+            LOAD(code, W10, insn->c);
+            emit_three(code, THREE_REGISTER_OPCODES[insn->op], W9, W9, W10);
+            STORE(code, W9, insn->a);
+            break;
+        case op_add_const:
+        case op_and_const:
+        case op_or_const:
+        case op_xor_const:
+        case op_mul_const:
+            LOAD(code, W9, insn->b);
+            emit_mov_const(code, W10, insn->c);
+            emit_three(code, THREE_REGISTER_OPCODES[insn->op], W9, W9, W10);
+            STORE(code, W9, insn->a);
+            break;
+        case op_sub_from_const:
+            emit_mov_const(code, W9, insn->c);
+            LOAD(code, W10, insn->b);
+            emit_three(code, 0x4b000000, W9, W9, W10);
+            STORE(code, W9, insn->a);
+            break;
+        case op_iinc:
+            LOAD(code, W9, insn->a);
+            emit_mov_const(code, W10, insn->b);
+            emit_three(code, 0x0b000000, W9, W9, W10);
+            STORE(code, W9, insn->a);
+            break;
+        case op_div:
+        case op_rem:
+            // sdiv w11, w9, w10; then msub w9, w11, w10, w9 for the remainder
+            LOAD(code, W9, insn->b);
+            LOAD(code, W10, insn->c);
+            emit_three(code, 0x1ac00c00, W11, W9, W10);
+            if (insn->op == op_rem) {
+                emit_word(code, 0x1b008000 | W10 << 16 | W9 << 10 | W11 << 5 | W9);
+            }
+            STORE(code, insn->op == op_div ? W11 : W9, insn->a);
+            break;
+        case op_div_pow2:
+            emit_pow2_divide(code, insn->b, insn->c);
+            // asr w9, w9, #shift
+            emit_word(code, 0x13007c00 | (u4) insn->c << 16 | W9 << 5 | W9);
+            STORE(code, W9, insn->a);
+            break;
+        case op_rem_pow2:
+            emit_pow2_divide(code, insn->b, insn->c);
+            // and w9, w9, w11; sub w9, w9, w10
+            emit_three(code, 0x0a000000, W9, W9, W11);
+            emit_three(code, 0x4b000000, W9, W9, W10);
+            STORE(code, W9, insn->a);
+            break;
+        case op_div_magic:
+            emit_magic_divide(code, insn);
+            STORE(code, W9, insn->a & 0xffff);
+            break;
+        case op_rem_magic:
+            emit_magic_divide(code, insn);
+            // mov w11, #divisor; msub w10, w9, w11, w10
+            emit_mov_const(code, W11, insn->c);
+            emit_word(code, 0x1b008000 | W11 << 16 | W10 << 10 | W9 << 5 | W10);
+            STORE(code, W10, insn->a & 0xffff);
+            break;
+        case op_neg:
+            LOAD(code, W9, insn->b);
+            emit_three(code, 0x4b000000, W9, ZR, W9);
+            STORE(code, W9, insn->a);
+            break;
+        case op_shl_const: {
+            // lsl w9, w9, #shift, which is ubfm w9, w9, #(-shift % 32), #(31 - shift)
+            u4 shift = insn->c & 31;
+            LOAD(code, W9, insn->b);
+            emit_word(code,
+                      0x53000000 | (-shift & 31) << 16 | (31 - shift) << 10 | W9 << 5 | W9);
+            STORE(code, W9, insn->a);
+            break;
+        }
+        case op_shr_const:
+        case op_ushr_const:
+            // asr or lsr w9, w9, #shift, which are sbfm and ubfm w9, w9, #shift, #31
+            LOAD(code, W9, insn->b);
+            emit_word(code, (insn->op == op_shr_const ? 0x13007c00 : 0x53007c00) |
+                                (insn->c & 31) << 16 | W9 << 5 | W9);
+            STORE(code, W9, insn->a);
+            break;
+        case op_load_element:
+        case op_load_element_unchecked:
+            // ldr w9, [x13, w10, uxtw #2]
+            emit_element_address(code, insn->b, insn->c, compressed_refs);
+            if (insn->op == op_load_element) {
+                emit_bounds_check(code, stub, fixups, fixup_count);
+            }
+            emit_word(code, 0xb8605800 | W10 << 16 | X13 << 5 | W9);
+            STORE(code, W9, insn->a);
+            break;
+        case op_store_element:
+        case op_store_element_unchecked:
+            // ldr w9, [c]; str w9, [x13, w10, uxtw #2]
+            emit_element_address(code, insn->a, insn->b, compressed_refs);
+            if (insn->op == op_store_element) {
+                emit_bounds_check(code, stub, fixups, fixup_count);
+            }
+            LOAD(code, W9, insn->c);
+            emit_word(code, 0xb8205800 | W10 << 16 | X13 << 5 | W9);
+            break;
+        case op_array_length:
+            // ldr w9, [x12]
+            emit_array_address(code, insn->b, compressed_refs);
+            emit_word(code, 0xb9400000 | X12 << 5 | W9);
+            STORE(code, W9, insn->a);
+            break;
+        case op_br_eq:
+        case op_br_ne:
+        case op_br_lt:
+        case op_br_ge:
+        case op_br_gt:
+        case op_br_le:
+            // cmp w9, w10; b.cond a
+            LOAD(code, W9, insn->b);
+            LOAD(code, W10, insn->c);
+            emit_three(code, 0x6b000000, ZR, W9, W10);
+            emit_branch(code, 0x54000000 | CONDITION_CODES[insn->op - op_br_eq], index, insn->a,
+                        stub, fixups, fixup_count, polls, poll_count);
+            break;
+        case op_br_eq_const:
+        case op_br_ne_const:
+        case op_br_lt_const:
+        case op_br_ge_const:
+        case op_br_gt_const:
+        case op_br_le_const:
+            LOAD(code, W9, insn->b);
+            emit_mov_const(code, W10, insn->c);
+            emit_three(code, 0x6b000000, ZR, W9, W10);
+            emit_branch(code, 0x54000000 | CONDITION_CODES[insn->op - op_br_eq_const], index,
+                        insn->a, stub, fixups, fixup_count, polls, poll_count);
+            break;
+        case op_goto:
+            emit_branch(code, 0x14000000, index, insn->a, stub, fixups, fixup_count, polls,
+                        poll_count);
+            break;
+        case op_iinc_goto:
+            LOAD(code, W9, insn->a);
+            emit_mov_const(code, W10, insn->b);
+            emit_three(code, 0x0b000000, W9, W9, W10);
+            STORE(code, W9, insn->a);
+            emit_branch(code, 0x14000000, index, insn->c, stub, fixups, fixup_count, polls,
+                        poll_count);
+            break;
+        default:
+            assert(false && "Operation has no template");
+    }
+}
+
+#endif
+
+bool jit_available(void) {
+    return true;
+}
+
+void jit_compile_method(const method_t *method, jit_state_t *jit, bool compressed_refs) {
+    if (jit->code != NULL) {
+        return;
+    }
+    u4 count = method->insn_count;
+    code_buffer_t code = {.capacity = 64 + count * 32};
+    code.bytes = malloc(code.capacity);
+    // The stubs' offsets follow the instructions': the out-of-bounds stub's, then
+    // one poll stub's for each backward branch
+    size_t *offsets = malloc(sizeof(size_t[2 * count + 1]));
+    // Every instruction has at most one branch, and so does each poll stub
+    fixup_t *fixups = malloc(sizeof(fixup_t[2 * count]));
+    u4 *polls = malloc(sizeof(u4[count]));
+    assert(code.bytes != NULL && offsets != NULL && fixups != NULL && polls != NULL &&
+           "Failed to allocate JIT buffers");
+    u4 fixup_count = 0;
+    u4 poll_count = 0;
+
+    emit_prologue(&code);
+    for (u4 i = 0; i < count; i++) {
+        offsets[i] = code.size;
+        emit_insn(&code, &method->insns[i], i, count, compressed_refs, fixups, &fixup_count,
+                  polls, &poll_count);
+    }
+    offsets[count] = code.size;
+    emit_out_of_bounds_stub(&code);
+    for (u4 i = 0; i < poll_count; i++) {
+        offsets[count + 1 + i] = code.size;
+        emit_poll_stub(&code, polls[i], fixups, &fixup_count);
+    }
+    for (u4 i = 0; i < fixup_count; i++) {
+        patch_branch(&code, &fixups[i], offsets[fixups[i].target]);
+    }
+
+    // Copy the code into memory that is executable but no longer writable
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t mapping_size = (code.size + page_size - 1) / page_size * page_size;
+    void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(mapping != MAP_FAILED && "Failed to map JIT code");
+    memcpy(mapping, code.bytes, code.size);
+    // Hosts whose instruction cache doesn't see the stores need it cleared
+    __builtin___clear_cache((char *) mapping, (char *) mapping + code.size);
+    int result = mprotect(mapping, mapping_size, PROT_READ | PROT_EXEC);
+    assert(result == 0 && "Failed to make JIT code executable");
+    (void) result;
+
+    jit->entries = calloc(count > 0 ? count : 1, sizeof(const void *));
+    assert(jit->entries != NULL && "Failed to allocate JIT entries");
+    jit->mapping = mapping;
+    jit->mapping_size = mapping_size;
+    for (u4 i = 0; i < count; i++) {
+        if (!is_exit(method->insns[i].op)) {
+            jit->entries[i] = (const u1 *) mapping + offsets[i];
+        }
+    }
+    free(code.bytes);
+    free(offsets);
+    free(fixups);
+    free(polls);
+    jit->code = (jit_code_t) mapping;
+}
+
+#else
+
+bool jit_available(void) {
+    return false;
+}
+
+void jit_compile_method(const method_t *method, jit_state_t *jit, bool compressed_refs) {
+    (void) method;
+    (void) jit;
+    (void) compressed_refs;
+    (void) is_exit;
+    assert(false && "No JIT backend for this host");
+}
+
+#endif
+
+void jit_prepare_class(class_file_t *class, u4 calls, u4 backedges) {
+    assert(calls > 0 && backedges > 0 && "JIT thresholds must be positive");
+    if (!jit_available()) {
+        return;
+    }
+    for (method_t *method = class->methods; method->name != NULL; method++) {
+        if (is_compilable(method)) {
+            jit_method_t *jit = class_alloc(class, sizeof(*jit));
+            jit->calls = calls;
+            jit->backedges = backedges;
+            method->jit = jit;
+        }
+    }
+}
+
+void jit_init_state(jit_state_t *jit, const method_t *method) {
+    *jit = (jit_state_t){
+        .calls_left = method->jit->calls,
+        .backedges_left = method->jit->backedges,
+    };
+}
+
+void jit_free_state(jit_state_t *jit) {
+    if (jit->code != NULL) {
+        munmap(jit->mapping, jit->mapping_size);
+        free(jit->entries);
+        jit->code = NULL;
+    }
+}
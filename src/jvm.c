@@ -6,8 +6,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "array_kernels.h"
+#include "batch.h"
+#include "decode.h"
 #include "heap.h"
+#include "inline.h"
+#include "interp.h"
+#include "class_state.h"
+#include "jit.h"
+#include "memo.h"
+#include "minijvm.h"
+#include "output.h"
+#include "profile.h"
 #include "read_class.h"
 
 int const OFFSET_ICONST = 0x03;
@@ -26,18 +38,6 @@ const char MAIN_METHOD[] = "main";
  */
 const char MAIN_DESCRIPTOR[] = "([Ljava/lang/String;)V";
 
-/**
- * Represents the return value of a Java method: either void or an int or a reference.
- * For simplification, we represent a reference as an index into a heap-allocated array.
- * (In a real JVM, methods could also return object references or other primitives.)
- */
-typedef struct {
-    /** Whether this returned value is an int */
-    bool has_value;
-    /** The returned value (only valid if `has_value` is true) */
-    int32_t value;
-} optional_value_t;
-
 void push(int32_t *operand_stack, int32_t *stack_pointer, int32_t value) {
     operand_stack[++(*stack_pointer)] = value;
 }
@@ -46,6 +46,54 @@ int32_t pop(int32_t *operand_stack, int32_t *stack_pointer) {
     return operand_stack[(*stack_pointer)--];
 }
 
+/**
+ * Reads a big-endian s4 operand out of the bytecode.
+ */
+int32_t read_s4(const u1 *bytecode) {
+    return (int32_t) ((uint32_t) bytecode[0] << 24 | (uint32_t) bytecode[1] << 16 |
+                      (uint32_t) bytecode[2] << 8 | bytecode[3]);
+}
+
+/**
+ * Finds the case of a tableswitch or lookupswitch that a key selects,
+ * straight from the bytecode.
+ *
+ * @param bytecode the method's bytecode
+ * @param pc the offset of the switch
+ * @param key the key
+ * @return the offset of the case's target from the switch
+ */
+int32_t switch_offset(const u1 *bytecode, u4 pc, int32_t key) {
+    // The operands start at the next multiple of 4 bytes from the start of the bytecode
+    const u1 *operands = &bytecode[(pc + 4) & ~(u4) 3];
+    if (bytecode[pc] == i_tableswitch) {
+        int32_t low = read_s4(&operands[4]);
+        int32_t high = read_s4(&operands[8]);
+        if (key >= low && key <= high) {
+            return read_s4(&operands[12 + 4 * (u4) (key - low)]);
+        }
+        return read_s4(operands);
+    }
+    // A lookupswitch's pairs are sorted by key
+    const u1 *pairs = &operands[8];
+    int32_t low = 0;
+    int32_t high = read_s4(&operands[4]) - 1;
+    while (low <= high) {
+        int32_t mid = low + (high - low) / 2;
+        int32_t match = read_s4(&pairs[8 * mid]);
+        if (match == key) {
+            return read_s4(&pairs[8 * mid + 4]);
+        }
+        if (match < key) {
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return read_s4(operands);
+}
+
 int32_t perform_binary_operation(int32_t value1, int32_t value2, u1 instruction) {
     switch (instruction) {
         case i_iadd:
@@ -121,6 +169,9 @@ bool should_jump_based_on_instruction(u1 instruction, int32_t *operand_stack,
 
 /**
  * Runs a method's instructions until the method returns.
+ * This is the original switch-based interpreter, which decodes the bytecode
+ * as it runs. The threaded interpreter (see interp.h) is used unless the
+ * `--switch` flag is given.
  *
  * @param method the method to run
  * @param locals the array of local variables, including the method parameters.
@@ -131,6 +182,11 @@ bool should_jump_based_on_instruction(u1 instruction, int32_t *operand_stack,
  */
 optional_value_t execute(method_t *method, int32_t *locals, class_file_t *class,
                          heap_t *heap) {
+    // It runs the bytecode, but a method that failed verification still can't run
+    if (method->verify_error != NULL) {
+        verify_error(method, method->verify_error_pc, method->verify_error);
+    }
+
     /* You should remove these casts to void in your solution.
      * They are just here so the code compiles without warnings. */
 
@@ -167,7 +223,7 @@ optional_value_t execute(method_t *method, int32_t *locals, class_file_t *class,
 
             case i_invokevirtual: {
                 int32_t val = pop(operand_stack, &stack_pointer);
-                printf("%d\n", val); // print popped value and newline
+                output_int(val); // print popped value and newline
             }
                 pc += 3; // move past the opcode and its two-byte operands
                 break;
@@ -288,9 +344,7 @@ optional_value_t execute(method_t *method, int32_t *locals, class_file_t *class,
                         class->constant_pool[index - 1]; // adjust for 0 indexing
 
                     if (constant.tag == CONSTANT_Integer) {
-                        CONSTANT_Integer_info *int_info =
-                            (CONSTANT_Integer_info *) constant.info;
-                        operand_stack[++stack_pointer] = int_info->bytes;
+                        operand_stack[++stack_pointer] = constant.integer.bytes;
                     }
                 }
                 pc++;
@@ -320,6 +374,12 @@ optional_value_t execute(method_t *method, int32_t *locals, class_file_t *class,
                 pc += offset;
             } break;
 
+            case i_tableswitch:
+            case i_lookupswitch: {
+                int32_t key = pop(operand_stack, &stack_pointer);
+                pc += switch_offset(bytecode, pc, key);
+            } break;
+
             case i_ireturn:
                 pc++;
                 {
@@ -331,14 +391,16 @@ optional_value_t execute(method_t *method, int32_t *locals, class_file_t *class,
             case i_invokestatic: {
                 pc++; // move past opcode
                 u2 index = (bytecode[pc] << 8) | bytecode[pc + 1];
-                method_t *called_method = find_method_from_index(index, class);
+                const resolved_method_t *callee = &class->resolved_methods[index];
+                method_t *called_method = callee->method;
+                assert(called_method != NULL && "Unresolved method");
 
-                int num_params = get_number_of_parameters(called_method);
-                int32_t method_locals[called_method->code.max_locals];
+                int num_params = callee->num_params;
+                int32_t method_locals[callee->max_locals];
 
                 // pop arguments from operand stack in reverse order to go from stack to
                 // queue
-                memset(method_locals, 0, called_method->code.max_locals);
+                memset(method_locals, 0, sizeof(method_locals));
                 for (int i = num_params - 1; i >= 0; i--) {
                     method_locals[i] = pop(operand_stack, &stack_pointer);
                 }
@@ -367,21 +429,8 @@ optional_value_t execute(method_t *method, int32_t *locals, class_file_t *class,
 
             case i_newarray: {
                 int32_t count = pop(operand_stack, &stack_pointer);
-                int32_t *new_array;
-                if (count <= 0) {
-                    new_array = malloc(sizeof(int32_t));
-                }
-                else {
-                    new_array = calloc(
-                        (count + 1),
-                        sizeof(
-                            int32_t)); //  allocate for one more int32_t to include count
-                }
-                new_array[0] = count; // fill the first index of the array with count
-                for (int32_t i = 1; i < count + 1; i++) {
-                    new_array[i] = 0;
-                }
-                int32_t ref = heap_add(heap, new_array);
+                // the heap stores count in the first index, and the elements start out 0
+                int32_t ref = heap_new_array(heap, count);
                 operand_stack[++stack_pointer] = ref;
             }
                 pc += 2;
@@ -406,6 +455,7 @@ optional_value_t execute(method_t *method, int32_t *locals, class_file_t *class,
                 int32_t index = pop(operand_stack, &stack_pointer);
                 int32_t ref = pop(operand_stack, &stack_pointer);
                 int32_t *array = heap_get(heap, ref);
+                heap_check_index(array, index);
                 array[index + 1] = value;
             }
                 pc++;
@@ -415,6 +465,7 @@ optional_value_t execute(method_t *method, int32_t *locals, class_file_t *class,
                 int32_t index = pop(operand_stack, &stack_pointer);
                 int32_t ref = pop(operand_stack, &stack_pointer);
                 int32_t *array = heap_get(heap, ref);
+                heap_check_index(array, index);
                 operand_stack[++stack_pointer] = array[index + 1];
             }
                 pc++;
@@ -464,37 +515,333 @@ optional_value_t execute(method_t *method, int32_t *locals, class_file_t *class,
     return result;
 }
 
+/**
+ * Prints the command-line usage to stderr.
+ */
+void print_usage(const char *program) {
+    fprintf(stderr, "USAGE: %s [options] <class file>\n", program);
+    fprintf(stderr, "       %s [options] --batch=<job file>\n", program);
+    fprintf(stderr, "  --switch          run on the original switch interpreter\n");
+    fprintf(stderr, "  --no-optimize     don't translate methods into optimized register "
+                    "operations\n");
+    fprintf(stderr, "  --no-fuse         don't replace common sequences with "
+                    "superinstructions\n");
+    fprintf(stderr, "  --no-inline       don't inline small methods into their callers\n");
+    fprintf(stderr,
+            "  --inline-depth=<n> inline calls up to n levels deep (default %d)\n",
+            DEFAULT_INLINE_DEPTH);
+    fprintf(stderr, "  --no-jit          don't compile optimized methods to native code\n");
+    fprintf(stderr, "  --no-simd         run array loops without vector instructions\n");
+    fprintf(stderr, "  --unbuffered      write each printed line with writev() right away\n");
+    fprintf(stderr, "  --memoize         cache the results of pure int methods\n");
+    fprintf(stderr,
+            "  --memoize=<n>     in tables of n entries per method (default %d)\n",
+            DEFAULT_MEMO_ENTRIES);
+    fprintf(stderr,
+            "  --jit-calls=<n>   compile a method after n calls (default %d)\n",
+            DEFAULT_JIT_CALLS);
+    fprintf(stderr,
+            "  --jit-backedges=<n> or after n backward branches in it (default %d)\n",
+            DEFAULT_JIT_BACKEDGES);
+    fprintf(stderr,
+            "  --max-depth=<n>   allow at most n nested calls (default %zu)\n",
+            DEFAULT_MAX_DEPTH);
+    fprintf(stderr,
+            "  --heap-limit=<n>  limit the heap to n bytes, with an optional k/m/g "
+            "suffix (default %zum)\n",
+            DEFAULT_HEAP_LIMIT >> 20);
+    fprintf(stderr, "  --compressed-refs make references offsets into one arena instead of "
+                    "handles\n");
+    fprintf(stderr, "  --gc-stats        print garbage collection statistics at exit\n");
+    fprintf(stderr, "  --profile         print operation, pair and method profiles at exit\n");
+    fprintf(stderr, "  --profile=<file>  write the profiles to a JSON file instead\n");
+    fprintf(stderr, "  --image-cache=<dir> reuse the prepared class from an image in dir, "
+                    "or save one there\n");
+    fprintf(stderr, "  --batch=<file>    run each job in a job file, on a pool of threads\n");
+    fprintf(stderr, "  --workers=<n>     with n threads (default one per online CPU)\n");
+}
+
+/**
+ * Parses a size like "4096", "64k" or "256m".
+ *
+ * @param text the text to parse
+ * @param size set to the parsed size
+ * @return whether `text` is a valid, nonzero size
+ */
+bool parse_size(const char *text, size_t *size) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    switch (*end) {
+        case 'k':
+        case 'K':
+            value <<= 10;
+            end++;
+            break;
+        case 'm':
+        case 'M':
+            value <<= 20;
+            end++;
+            break;
+        case 'g':
+        case 'G':
+            value <<= 30;
+            end++;
+            break;
+    }
+    *size = value;
+    return end != text && *end == '\0' && value > 0;
+}
+
+/**
+ * Parses a JIT threshold, a count from 1 to UINT32_MAX.
+ *
+ * @param text the text to parse
+ * @param threshold set to the parsed count
+ * @return whether `text` is a valid threshold
+ */
+bool parse_threshold(const char *text, u4 *threshold) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    *threshold = value;
+    return end != text && *end == '\0' && 0 < value && value <= UINT32_MAX;
+}
+
+/**
+ * Prints a heap's garbage collection statistics to stderr.
+ */
+void print_gc_stats(const heap_t *heap) {
+    heap_stats_t stats = heap_get_stats(heap);
+    fprintf(stderr,
+            "[gc] %" PRIu64 " minor and %" PRIu64 " major collections in %.3f ms\n",
+            stats.minor_collections, stats.collections, stats.gc_nanoseconds / 1e6);
+    fprintf(stderr, "[gc] allocated %" PRIu64 " arrays (%" PRIu64 " bytes)\n",
+            stats.arrays_allocated, stats.bytes_allocated);
+    fprintf(stderr, "[gc] freed %" PRIu64 " arrays (%" PRIu64 " bytes)\n",
+            stats.arrays_freed, stats.bytes_freed);
+    fprintf(stderr, "[gc] promoted %" PRIu64 " arrays (%" PRIu64 " bytes)\n",
+            stats.arrays_promoted, stats.bytes_promoted);
+    fprintf(stderr, "[gc] %zu bytes in use, peak %zu bytes\n", stats.used_bytes,
+            stats.peak_bytes);
+}
+
+/**
+ * Reports a profile: as JSON if a path is given, and otherwise as a report on stderr.
+ */
+void write_profile(const profile_t *profile, const char *path) {
+    if (path == NULL) {
+        profile_print(profile, stderr);
+        return;
+    }
+    FILE *out = fopen(path, "w");
+    assert(out != NULL && "Failed to open profile file");
+    profile_write_json(profile, out);
+    int error = fclose(out);
+    assert(error == 0 && "Failed to write profile file");
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "USAGE: %s <class file>\n", argv[0]);
+    // Run the pre-decoded stream on the threaded interpreter unless told otherwise
+    bool use_switch = false;
+    size_t max_depth = DEFAULT_MAX_DEPTH;
+    size_t heap_limit = DEFAULT_HEAP_LIMIT;
+    bool gc_stats = false;
+    bool compressed_refs = false;
+    bool optimize = true;
+    bool fuse = true;
+    // How many levels of calls to inline, or 0 to inline nothing
+    u4 inline_depth = DEFAULT_INLINE_DEPTH;
+    bool jit = true;
+    bool simd = true;
+    bool unbuffered = false;
+    // The size of each memo table, or 0 to memoize nothing
+    u4 memo_entries = 0;
+    // How hot a method has to get before it is compiled
+    u4 jit_calls = DEFAULT_JIT_CALLS;
+    u4 jit_backedges = DEFAULT_JIT_BACKEDGES;
+    bool profiling = false;
+    // Where to write the profile as JSON, or NULL to print a report to stderr
+    const char *profile_path = NULL;
+    // The directory to cache prepared classes in, or NULL to prepare them every run
+    const char *image_cache = NULL;
+    // The job file to run, or NULL to run one class
+    const char *batch_file = NULL;
+    long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    u4 workers = online_cpus > 0 ? (u4) online_cpus : 1;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        const char *option = argv[arg];
+        bool valid = true;
+        if (strcmp(option, "--switch") == 0) {
+            use_switch = true;
+        }
+        else if (strncmp(option, "--max-depth=", strlen("--max-depth=")) == 0) {
+            char *end;
+            max_depth = strtoul(option + strlen("--max-depth="), &end, 10);
+            valid = *end == '\0' && max_depth > 0;
+        }
+        else if (strncmp(option, "--heap-limit=", strlen("--heap-limit=")) == 0) {
+            valid = parse_size(option + strlen("--heap-limit="), &heap_limit);
+        }
+        else if (strcmp(option, "--no-optimize") == 0) {
+            optimize = false;
+        }
+        else if (strcmp(option, "--no-fuse") == 0) {
+            fuse = false;
+        }
+        else if (strcmp(option, "--no-inline") == 0) {
+            inline_depth = 0;
+        }
+        else if (strncmp(option, "--inline-depth=", strlen("--inline-depth=")) == 0) {
+            valid = parse_threshold(option + strlen("--inline-depth="), &inline_depth);
+        }
+        else if (strcmp(option, "--no-jit") == 0) {
+            jit = false;
+        }
+        else if (strcmp(option, "--no-simd") == 0) {
+            simd = false;
+        }
+        else if (strcmp(option, "--unbuffered") == 0) {
+            unbuffered = true;
+        }
+        else if (strcmp(option, "--memoize") == 0) {
+            memo_entries = DEFAULT_MEMO_ENTRIES;
+        }
+        else if (strncmp(option, "--memoize=", strlen("--memoize=")) == 0) {
+            valid = parse_threshold(option + strlen("--memoize="), &memo_entries) &&
+                    memo_entries <= MAX_MEMO_ENTRIES;
+        }
+        else if (strncmp(option, "--jit-calls=", strlen("--jit-calls=")) == 0) {
+            valid = parse_threshold(option + strlen("--jit-calls="), &jit_calls);
+        }
+        else if (strncmp(option, "--jit-backedges=", strlen("--jit-backedges=")) == 0) {
+            valid = parse_threshold(option + strlen("--jit-backedges="), &jit_backedges);
+        }
+        else if (strcmp(option, "--compressed-refs") == 0) {
+            compressed_refs = true;
+        }
+        else if (strcmp(option, "--gc-stats") == 0) {
+            gc_stats = true;
+        }
+        else if (strcmp(option, "--profile") == 0) {
+            profiling = true;
+        }
+        else if (strncmp(option, "--profile=", strlen("--profile=")) == 0) {
+            profiling = true;
+            profile_path = option + strlen("--profile=");
+            valid = *profile_path != '\0';
+        }
+        else if (strncmp(option, "--image-cache=", strlen("--image-cache=")) == 0) {
+            image_cache = option + strlen("--image-cache=");
+            valid = *image_cache != '\0';
+        }
+        else if (strncmp(option, "--batch=", strlen("--batch=")) == 0) {
+            batch_file = option + strlen("--batch=");
+            valid = *batch_file != '\0';
+        }
+        else if (strncmp(option, "--workers=", strlen("--workers=")) == 0) {
+            valid = parse_threshold(option + strlen("--workers="), &workers);
+        }
+        else {
+            valid = false;
+        }
+        if (!valid) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    /* Only the threaded interpreter can be profiled, and batches only run on the
+     * unprofiled threaded interpreter */
+    bool batch = batch_file != NULL;
+    if (argc - arg != (batch ? 0 : 1) || (use_switch && profiling) ||
+        (batch && (use_switch || profiling || gc_stats))) {
+        print_usage(argv[0]);
         return 1;
     }
 
-    // Open the class file for reading
-    FILE *class_file = fopen(argv[1], "r");
-    assert(class_file != NULL && "Failed to open file");
-
-    // Parse the class file
-    class_file_t *class = get_class(class_file);
-    int error = fclose(class_file);
-    assert(error == 0 && "Failed to close file");
+    // Hot methods are compiled as they run, except by the profiled interpreter
+    jvm_class_options_t class_options = {
+        .optimize = optimize,
+        .fuse = fuse,
+        .inline_depth = inline_depth,
+        .memo_entries = memo_entries,
+        .jit = jit && !profiling && !use_switch,
+        .jit_calls = jit_calls,
+        .jit_backedges = jit_backedges,
+        .image_cache = image_cache,
+    };
+    if (batch) {
+        jvm_init(simd);
+        jvm_context_options_t context_options = {
+            .heap_limit = heap_limit,
+            .max_depth = max_depth,
+            .compressed_refs = compressed_refs,
+            .unbuffered = unbuffered,
+        };
+        return run_batch(batch_file, &class_options, &context_options, workers);
+    }
+    if (access(argv[arg], R_OK) != 0) {
+        fprintf(stderr, "Failed to open %s\n", argv[arg]);
+        return 1;
+    }
+    class_file_t *class = jvm_load_class(argv[arg], &class_options);
+    if (class == NULL) {
+        fprintf(stderr, "Failed to open %s\n", argv[arg]);
+        return 1;
+    }
+    array_kernels_init(simd);
+    output_set_unbuffered(unbuffered);
 
     // The heap array is initially allocated to hold zero elements.
     heap_t *heap = heap_init();
+    heap_set_limit(heap, heap_limit);
+    if (compressed_refs && !heap_compress_refs(heap)) {
+        fprintf(stderr, "Failed to reserve the arena for compressed references\n");
+        return 1;
+    }
 
     // Execute the main method
     method_t *main_method = find_method(MAIN_METHOD, MAIN_DESCRIPTOR, class);
     assert(main_method != NULL && "Missing main() method");
     /* In a real JVM, locals[0] would contain a reference to String[] args.
-     * But since TeenyJVM doesn't support Objects, we leave it uninitialized. */
-    int32_t locals[main_method->code.max_locals];
-    // Initialize all local variables to 0
-    memset(locals, 0, sizeof(locals));
-    optional_value_t result = execute(main_method, locals, class, heap);
+     * But since TeenyJVM doesn't support Objects, we leave it 0 (NULL_REF). */
+    optional_value_t result;
+    if (use_switch) {
+        int32_t locals[main_method->code.max_locals];
+        // Initialize all local variables to 0
+        memset(locals, 0, sizeof(locals));
+        // The switch interpreter has no frame records, so it can't collect garbage
+        result = execute(main_method, locals, class, heap);
+    }
+    else {
+        // main()'s frame is at the bottom of the VM stack, whose slots start out 0
+        vm_stack_t *stack = vm_stack_init(DEFAULT_STACK_SLOTS, max_depth);
+        heap_set_root_scanner(heap, vm_stack_scan_roots, stack);
+        // What the run compiles and memoizes
+        class_state_t *state = class_state_create(class);
+        if (profiling) {
+            profile_t *profile = profile_init(class);
+            result =
+                interpret_profiled(main_method, stack->base, state, heap, stack, profile);
+            // The program's output comes before the reports on stderr
+            output_flush();
+            write_profile(profile, profile_path);
+            profile_free(profile);
+        }
+        else {
+            result = interpret(main_method, stack->base, state, heap, stack);
+        }
+        class_state_free(state);
+        vm_stack_free(stack);
+    }
     assert(!result.has_value && "main() should return void");
+    output_flush();
+
+    if (gc_stats) {
+        print_gc_stats(heap);
+    }
 
     // Free the internal data structures
-    free_class(class);
+    jvm_free_class(class);
 
     // Free the heap
     heap_free(heap);
@@ -0,0 +1,216 @@
+#include "memo.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "decode.h"
+#include "read_class.h"
+
+/**
+ * @brief Gets the number of int parameters a descriptor like "(II)I" takes.
+ *
+ * @return The number of parameters, or -1 if the method takes anything but
+ *   at most MEMO_MAX_PARAMS ints or doesn't return an int.
+ */
+static int int_params(const char *descriptor) {
+    if (*descriptor++ != '(') {
+        return -1;
+    }
+    int count = 0;
+    for (; *descriptor == 'I'; descriptor++) {
+        count++;
+    }
+    bool returns_int = descriptor[0] == ')' && descriptor[1] == 'I' && descriptor[2] == '\0';
+    return returns_int && count <= MEMO_MAX_PARAMS ? count : -1;
+}
+
+/**
+ * @brief Gets whether an operation only computes with ints in the frame.
+ * Calls are allowed too; whether their callees are pure is checked separately.
+ * So are traps, since a call that reaches one never returns a result to keep.
+ */
+static bool is_pure_op(u1 op) {
+    switch (op) {
+        case op_unsupported:
+        case op_iconst:
+        case op_iload:
+        case op_istore:
+        case op_dup:
+        case op_iadd:
+        case op_isub:
+        case op_imul:
+        case op_idiv:
+        case op_irem:
+        case op_ineg:
+        case op_ishl:
+        case op_ishr:
+        case op_iushr:
+        case op_iand:
+        case op_ior:
+        case op_ixor:
+        case op_iinc:
+        case op_goto:
+        case op_tableswitch:
+        case op_lookupswitch:
+        case op_ireturn:
+        case op_invokestatic:
+        case op_iload_iload_if_icmpeq:
+        case op_iload_iload_if_icmpne:
+        case op_iload_iload_if_icmplt:
+        case op_iload_iload_if_icmpge:
+        case op_iload_iload_if_icmpgt:
+        case op_iload_iload_if_icmple:
+        case op_iinc_goto:
+        case op_iload_iconst_iadd_istore:
+        case op_return_value:
+        case op_call:
+        case op_br_table:
+        case op_br_lookup:
+            return true;
+        default:
+            // The register arithmetic runs from op_move to op_ushr_const
+            return op_is_branch(op) || (op_move <= op && op <= op_ushr_const);
+    }
+}
+
+/**
+ * @brief Gets whether an operation is a superinstruction that jumps to instruction `c`.
+ */
+static bool jumps_to_c(u1 op) {
+    return (op_iload_iload_if_icmpeq <= op && op <= op_iload_iload_if_icmple) ||
+           op == op_iinc_goto;
+}
+
+/**
+ * @brief Gets the number of instructions an instruction may jump to,
+ * counting the superinstructions' targets.
+ */
+static u4 jump_target_count(const insn_t *insn) {
+    return jumps_to_c(insn->op) ? 1 : insn_target_count(insn);
+}
+
+/**
+ * @brief Gets one of the instructions an instruction may jump to.
+ *
+ * @param i Which target, less than jump_target_count().
+ */
+static u4 jump_target(const insn_t *insn, u4 i) {
+    return jumps_to_c(insn->op) ? (u4) insn->c : insn_target(insn, i);
+}
+
+/**
+ * @brief Gets whether a method only computes with ints, ignoring what it calls.
+ * The return at the end of the stream (see decode_method()) doesn't count if
+ * nothing reaches it.
+ */
+static bool has_pure_ops(const method_t *method) {
+    if (int_params(method->descriptor) < 0) {
+        return false;
+    }
+    u4 last = method->insn_count - 1;
+    bool end_reached = false;
+    for (u4 i = 0; i < method->insn_count; i++) {
+        const insn_t *insn = &method->insns[i];
+        if (!is_pure_op(insn->op) && i != last) {
+            return false;
+        }
+        for (u4 t = 0; t < jump_target_count(insn); t++) {
+            end_reached |= jump_target(insn, t) == last;
+        }
+    }
+    u1 before_end = last > 0 ? method->insns[last - 1].op : op_goto;
+    end_reached |= before_end != op_ireturn && before_end != op_return_value &&
+                   before_end != op_goto && before_end != op_iinc_goto &&
+                   !op_is_switch(before_end);
+    return is_pure_op(method->insns[last].op) || !end_reached;
+}
+
+/**
+ * @brief Gets whether a pure method takes long enough that memoizing it pays:
+ * whether it makes a call or has a loop. Looking the arguments up costs
+ * about as much as running a short method without either.
+ */
+static bool worth_memoizing(const method_t *method) {
+    for (u4 i = 0; i < method->insn_count; i++) {
+        const insn_t *insn = &method->insns[i];
+        if (insn->op == op_invokestatic || insn->op == op_call) {
+            return true;
+        }
+        for (u4 t = 0; t < jump_target_count(insn); t++) {
+            if (jump_target(insn, t) <= i) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Gets whether an instruction calls a method that isn't known to be pure.
+ */
+static bool calls_impure(const insn_t *insn, const class_file_t *class, const bool *pure) {
+    if (insn->op != op_invokestatic && insn->op != op_call) {
+        return false;
+    }
+    const method_t *callee = insn->callee->method;
+    return callee == NULL || !pure[callee - class->methods];
+}
+
+void memoize_class(class_file_t *class, u4 entries) {
+    u4 size = 1;
+    while (size < entries) {
+        size *= 2;
+    }
+    u4 count = 0;
+    while (class->methods[count].name != NULL) {
+        count++;
+    }
+
+    /* Start from every method that only computes with ints, and drop the ones
+     * that call a method that isn't pure until none is left, so recursive
+     * methods (even mutually recursive ones) stay pure */
+    bool *pure = malloc(sizeof(bool[count + 1]));
+    assert(pure != NULL && "Failed to allocate purity analysis");
+    for (u4 i = 0; i < count; i++) {
+        pure[i] = has_pure_ops(&class->methods[i]);
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (u4 i = 0; i < count; i++) {
+            const method_t *method = &class->methods[i];
+            for (u4 j = 0; pure[i] && j < method->insn_count; j++) {
+                if (calls_impure(&method->insns[j], class, pure)) {
+                    pure[i] = false;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    for (u4 i = 0; i < count; i++) {
+        method_t *method = &class->methods[i];
+        if (pure[i] && worth_memoizing(method)) {
+            memo_table_t *table = class_alloc(class, sizeof(*table));
+            table->mask = size - 1;
+            table->num_params = (u2) int_params(method->descriptor);
+            method->memo = table;
+        }
+    }
+    free(pure);
+
+    for (method_t *method = class->methods; method->name != NULL; method++) {
+        for (u4 i = 0; i < method->insn_count; i++) {
+            insn_t *insn = &method->insns[i];
+            if ((insn->op == op_invokestatic || insn->op == op_call) &&
+                insn->callee->method != NULL && insn->callee->method->memo != NULL) {
+                insn->op = insn->op == op_invokestatic ? op_invokestatic_memo : op_call_memo;
+            }
+        }
+    }
+}
+
+memo_entry_t *memo_new_entries(const memo_table_t *table) {
+    memo_entry_t *entries = calloc((size_t) table->mask + 1, sizeof(memo_entry_t));
+    assert(entries != NULL && "Failed to allocate memo table");
+    return entries;
+}
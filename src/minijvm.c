@@ -0,0 +1,291 @@
+#include "minijvm.h"
+
+#include <assert.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "array_kernels.h"
+#include "class_state.h"
+#include "decode.h"
+#include "exception.h"
+#include "fuse.h"
+#include "heap.h"
+#include "image_cache.h"
+#include "inline.h"
+#include "interp.h"
+#include "jit.h"
+#include "memo.h"
+#include "optimize.h"
+#include "output.h"
+#include "read_class.h"
+#include "refmap.h"
+#include "stack.h"
+
+/** A class that belongs to a context, in the list of the context's classes */
+typedef struct owned_class {
+    class_file_t *class;
+    struct owned_class *next;
+} owned_class_t;
+
+/** The name and descriptor of the method jvm_run_main() runs */
+static const char MAIN_METHOD_NAME[] = "main";
+static const char MAIN_METHOD_DESCRIPTOR[] = "([Ljava/lang/String;)V";
+
+struct jvm_context {
+    jvm_context_options_t options;
+    heap_t *heap;
+    /** The VM stack, whose frames are the heap's roots */
+    vm_stack_t *stack;
+    output_t *output;
+    /** The classes loaded with jvm_context_load_class(), newest first */
+    owned_class_t *classes;
+    /** What running each class changed in this context (see class_state.h) */
+    class_state_t *states;
+    /** The state of the run that stopped's class, for jvm_resume() to continue it with */
+    class_state_t *stopped_state;
+};
+
+void jvm_init(bool simd) {
+    array_kernels_init(simd);
+}
+
+jvm_class_options_t jvm_default_class_options(void) {
+    return (jvm_class_options_t){
+        .optimize = true,
+        .fuse = true,
+        .inline_depth = DEFAULT_INLINE_DEPTH,
+        .jit = true,
+        .jit_calls = DEFAULT_JIT_CALLS,
+        .jit_backedges = DEFAULT_JIT_BACKEDGES,
+    };
+}
+
+jvm_context_options_t jvm_default_context_options(void) {
+    return (jvm_context_options_t){
+        .heap_limit = DEFAULT_HEAP_LIMIT,
+        .max_depth = DEFAULT_MAX_DEPTH,
+        .output_fd = STDOUT_FILENO,
+    };
+}
+
+class_file_t *jvm_load_class(const char *path, const jvm_class_options_t *options) {
+    class_file_t *class = NULL;
+    // A cached image of the class skips everything up to memoization
+    image_key_t image_key;
+    u4 pass_flags =
+        (options->optimize ? IMAGE_OPTIMIZED : 0) | (options->fuse ? IMAGE_FUSED : 0);
+    bool use_image_cache =
+        options->image_cache != NULL &&
+        image_key_init(&image_key, path, options->inline_depth, pass_flags);
+    if (use_image_cache) {
+        class = image_cache_load(options->image_cache, &image_key);
+    }
+    if (class == NULL) {
+        // Map the class file into memory and parse it
+        class = load_class(path);
+        if (class == NULL) {
+            return NULL;
+        }
+
+        // Translate the bytecode into the threaded interpreter's instruction stream
+        decode_class(class);
+        /* Verify the methods and find which frame slots hold references, so the garbage
+         * collector can find its roots */
+        compute_class_refmaps(class);
+        if (options->inline_depth > 0) {
+            inline_class(class, options->inline_depth);
+        }
+        if (options->optimize) {
+            optimize_class(class);
+        }
+        if (options->fuse) {
+            fuse_class(class);
+        }
+        if (use_image_cache) {
+            image_cache_store(options->image_cache, &image_key, class);
+        }
+    }
+    if (options->memo_entries > 0) {
+        memoize_class(class, options->memo_entries);
+    }
+    if (options->jit) {
+        jit_prepare_class(class, options->jit_calls, options->jit_backedges);
+    }
+    thread_class(class);
+    static atomic_uint_fast64_t class_ids;
+    class->id = atomic_fetch_add_explicit(&class_ids, 1, memory_order_relaxed) + 1;
+    return class;
+}
+
+void jvm_free_class(class_file_t *class) {
+    free_class(class);
+}
+
+/**
+ * @brief Gives a context a new, empty heap.
+ *
+ * @return Whether the heap's compressed references could be set up.
+ */
+static bool new_heap(jvm_context_t *context) {
+    heap_t *heap = heap_init();
+    heap_set_limit(heap, context->options.heap_limit);
+    if (context->options.compressed_refs && !heap_compress_refs(heap)) {
+        heap_free(heap);
+        return false;
+    }
+    heap_set_root_scanner(heap, vm_stack_scan_roots, context->stack);
+    context->heap = heap;
+    return true;
+}
+
+jvm_context_t *jvm_context_create(const jvm_context_options_t *options) {
+    jvm_context_t *context = calloc(1, sizeof(*context));
+    assert(context != NULL && "Failed to allocate context");
+    context->options = *options;
+    context->stack = vm_stack_init(DEFAULT_STACK_SLOTS, options->max_depth);
+    if (!new_heap(context)) {
+        vm_stack_free(context->stack);
+        free(context);
+        return NULL;
+    }
+    context->output = output_init(options->output_fd);
+    output_t *previous_output = output_select(context->output);
+    output_set_unbuffered(options->unbuffered);
+    output_select(previous_output);
+    return context;
+}
+
+void jvm_context_free(jvm_context_t *context) {
+    while (context->states != NULL) {
+        class_state_t *next = context->states->next;
+        class_state_free(context->states);
+        context->states = next;
+    }
+    while (context->classes != NULL) {
+        owned_class_t *next = context->classes->next;
+        jvm_free_class(context->classes->class);
+        free(context->classes);
+        context->classes = next;
+    }
+    output_free(context->output);
+    heap_free(context->heap);
+    vm_stack_free(context->stack);
+    free(context);
+}
+
+class_file_t *jvm_context_load_class(jvm_context_t *context, const char *path,
+                                     const jvm_class_options_t *options) {
+    class_file_t *class = jvm_load_class(path, options);
+    if (class != NULL) {
+        owned_class_t *owned = malloc(sizeof(*owned));
+        assert(owned != NULL && "Failed to allocate context");
+        *owned = (owned_class_t){.class = class, .next = context->classes};
+        context->classes = owned;
+    }
+    return class;
+}
+
+void jvm_context_reset(jvm_context_t *context) {
+    // A stopped run's frames refer to arrays on the old heap
+    vm_stack_reset(context->stack);
+    heap_free(context->heap);
+    bool created = new_heap(context);
+    assert(created && "Failed to reserve the arena for compressed references");
+}
+
+/**
+ * @brief Gets whether a descriptor only takes ints and returns an int or nothing.
+ */
+static bool takes_ints(const char *descriptor) {
+    if (*descriptor++ != '(') {
+        return false;
+    }
+    while (*descriptor == 'I') {
+        descriptor++;
+    }
+    return descriptor[0] == ')' && (descriptor[1] == 'I' || descriptor[1] == 'V') &&
+           descriptor[2] == '\0';
+}
+
+/**
+ * @brief Runs a method whose frame, starting with its arguments, is at the
+ * bottom of a context's VM stack, or continues the context's stopped run if
+ * `method` is NULL, catching the exceptions it throws.
+ *
+ * @param result Set to the returned int, if there is one and `result` isn't NULL.
+ */
+static jvm_status_t run(jvm_context_t *context, class_state_t *state, method_t *method,
+                        int32_t *result) {
+    vm_stack_t *stack = context->stack;
+    output_t *previous_output = output_select(context->output);
+    jvm_status_t status = JVM_EXCEPTION;
+    jmp_buf target;
+    jmp_buf *previous_target = exception_set_target(&target);
+    if (setjmp(target) == 0) {
+        optional_value_t value =
+            method != NULL ? interpret(method, stack->base, state, context->heap, stack)
+                           : interpret_resume(state, context->heap, stack);
+        if (stack->suspension.stopped) {
+            context->stopped_state = state;
+            status = JVM_STOPPED;
+        }
+        else {
+            if (value.has_value && result != NULL) {
+                *result = value.value;
+            }
+            status = JVM_OK;
+        }
+    }
+    else {
+        // The exception left the frames it was thrown through on the stack
+        vm_stack_reset(stack);
+    }
+    /* A preemption that came too late to stop the run was meant for it, and one that
+     * came before it started (say, as soon as its turn began) already stopped it */
+    atomic_store_explicit(&stack->preempt, false, memory_order_relaxed);
+    exception_set_target(previous_target);
+    output_flush();
+    output_select(previous_output);
+    return status;
+}
+
+jvm_status_t jvm_invoke(jvm_context_t *context, class_file_t *class, const char *name,
+                        const char *descriptor, const int32_t *args, int32_t *result) {
+    assert(!context->stack->suspension.stopped && "Context has a stopped run");
+    method_t *method = find_method(name, descriptor, class);
+    if (method == NULL || !takes_ints(descriptor)) {
+        return JVM_NO_SUCH_METHOD;
+    }
+    u2 params = get_number_of_parameters(method);
+    if (params > 0) {
+        memcpy(context->stack->base, args, sizeof(int32_t[params]));
+    }
+    return run(context, class_state_find(&context->states, class), method, result);
+}
+
+jvm_status_t jvm_run_main(jvm_context_t *context, class_file_t *class) {
+    assert(!context->stack->suspension.stopped && "Context has a stopped run");
+    method_t *method = find_method(MAIN_METHOD_NAME, MAIN_METHOD_DESCRIPTOR, class);
+    if (method == NULL) {
+        return JVM_NO_SUCH_METHOD;
+    }
+    // MiniJVM has no Strings, so `args` is null
+    context->stack->base[0] = NULL_REF;
+    return run(context, class_state_find(&context->states, class), method, NULL);
+}
+
+void jvm_context_preempt(jvm_context_t *context) {
+    atomic_store_explicit(&context->stack->preempt, true, memory_order_relaxed);
+}
+
+void jvm_context_cancel_preempt(jvm_context_t *context) {
+    atomic_store_explicit(&context->stack->preempt, false, memory_order_relaxed);
+}
+
+jvm_status_t jvm_resume(jvm_context_t *context, int32_t *result) {
+    assert(context->stack->suspension.stopped && "Context has no stopped run");
+    return run(context, context->stopped_state, NULL, result);
+}
@@ -0,0 +1,1822 @@
+#include "optimize.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode.h"
+#include "read_class.h"
+#include "refmap.h"
+#include "stack.h"
+
+/** The number of registers op_div_magic can encode */
+#define MAX_REGISTERS ((u4) UINT16_MAX + 1)
+
+/**
+ * The operations of the IR the optimizer works on. Each one stands for a
+ * family of register operations (see op_t); which one it becomes is decided
+ * once its operands are known.
+ */
+typedef enum {
+    /** Does nothing; removed instructions become this */
+    IR_NOP,
+    IR_MOVE,
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_REM,
+    IR_AND,
+    IR_OR,
+    IR_XOR,
+    IR_SHL,
+    IR_SHR,
+    IR_USHR,
+    IR_NEG,
+    IR_LOAD,
+    /** Store `src[2]` into element `src[1]` of `src[0]`'s array */
+    IR_STORE,
+    IR_LENGTH,
+    IR_NEW_ARRAY,
+    /** Branch to `target` if `src[0]` compares to `src[1]` by `condition` */
+    IR_BRANCH,
+    IR_GOTO,
+    /** Jump to the case of `src[0]` in the `table` of the switch it came from */
+    IR_SWITCH,
+    IR_RETURN_VALUE,
+    IR_RETURN,
+    IR_PRINT,
+    /** Call `callee` with the arguments in the registers from `dst` on */
+    IR_CALL,
+    /**
+     * An array loop (op_fill + `condition`) with the index register `dst`, the
+     * registers `x` and `y` in `src[0]` and `src[1]`, and the bound in `src[2]`
+     */
+    IR_ARRAY_LOOP,
+    /** An instruction that is copied into the new stream as it is, like op_unsupported */
+    IR_KEEP
+} ir_op_t;
+
+/** An operand of an IR instruction: a register, or a constant */
+typedef struct {
+    bool constant;
+    /** The register number or the constant */
+    int32_t value;
+} operand_t;
+
+/** An IR instruction, standing for the stack instruction at the same index */
+typedef struct {
+    ir_op_t op;
+    /** For IR_BRANCH, the comparison, as an offset from op_br_eq (eq, ne, lt, ge, gt, le) */
+    u1 condition;
+    /** The number of operands in `src` */
+    u1 src_count;
+    /** The register the instruction writes; for IR_CALL, its first argument */
+    int32_t dst;
+    operand_t src[3];
+    /** For IR_BRANCH and IR_GOTO, the index of the instruction to branch to */
+    u4 target;
+} ir_t;
+
+/** What a register is known to hold at a point in a basic block */
+typedef struct {
+    enum { KNOWN_NOTHING, KNOWN_CONSTANT, KNOWN_COPY } kind;
+    /** The constant, or the register holding the same value */
+    int32_t value;
+} known_t;
+
+/** The comparisons of IR_BRANCH, in op_t order */
+enum { COMPARE_EQ, COMPARE_NE, COMPARE_LT, COMPARE_GE, COMPARE_GT, COMPARE_LE };
+
+/** What a register is known to hold at a point in a method, for eliminate_bounds_checks() */
+typedef struct {
+    /** The smallest and largest values the register can hold */
+    int32_t min;
+    int32_t max;
+    /** The register of an array whose length is greater than this register, or -1 */
+    int32_t below;
+    /** The register of an array whose length this register holds, or -1 */
+    int32_t length_of;
+    /** A register that this one holds one more than, or -1 */
+    int32_t plus_one;
+    /** If the register holds an array, the smallest length it can have */
+    int32_t min_length;
+} bound_t;
+
+/** The largest number of instructions times registers to eliminate bounds checks for */
+#define MAX_BOUNDS_FACTS ((u4) 1 << 18)
+
+/** The array loops of IR_ARRAY_LOOP, in op_t order */
+enum { LOOP_FILL, LOOP_COPY, LOOP_SUM, LOOP_PREFIX_SUM, LOOP_MISMATCH };
+
+/** What a register holds at a point in an iteration of a loop, for recognize_array_loop() */
+typedef struct {
+    enum {
+        /** What register `value` held when the iteration started */
+        VALUE_ENTRY,
+        /** The constant `value` */
+        VALUE_CONSTANT,
+        /** The length of register `array`'s array */
+        VALUE_LENGTH,
+        /** The element of register `array`'s array at the loop's index */
+        VALUE_ELEMENT,
+        /** That element plus what register `value` held when the iteration started */
+        VALUE_ACCUMULATED,
+        /** The loop's index plus one */
+        VALUE_NEXT_INDEX
+    } kind;
+    int32_t value;
+    int32_t array;
+    /** For a VALUE_CONSTANT a move put in a register, the index of the move */
+    int32_t origin;
+} loop_value_t;
+
+/** A register an iteration of a loop reads or writes, for recognize_array_loop() */
+typedef struct {
+    int32_t reg;
+    /** What it holds at the current point of the iteration */
+    loop_value_t value;
+    /** Whether the iteration reads what it held when the iteration started */
+    bool read_on_entry;
+    /** Whether the instructions before the loop's exit branch write it */
+    bool written_in_head;
+    /** Whether the instructions after the loop's exit branch write it */
+    bool written_in_body;
+} loop_register_t;
+
+/** The largest number of instructions a loop can have to become an array loop */
+#define MAX_LOOP_INSNS 16
+
+/**
+ * @brief Gets whether a method returns a value.
+ */
+static bool returns_value(const method_t *method) {
+    return strchr(method->descriptor, ')')[1] != 'V';
+}
+
+#define REGISTER(number) ((operand_t){.constant = false, .value = (number)})
+#define CONSTANT(number) ((operand_t){.constant = true, .value = (number)})
+
+/**
+ * @brief Translates a stack instruction into an IR instruction.
+ *
+ * @param insn The stack instruction.
+ * @param depth The operand stack depth before it.
+ * @param stack_base The register of the first operand stack slot.
+ * @param ir The IR instruction to fill in.
+ */
+static void translate(const insn_t *insn, u4 depth, u4 stack_base, ir_t *ir) {
+    // The registers of the operand stack slots, counting down from the top
+    u4 top = stack_base + depth - 1;
+    *ir = (ir_t){.op = IR_KEEP};
+    switch (insn->op) {
+        case op_iconst:
+            *ir = (ir_t){IR_MOVE, 0, 1, top + 1, {CONSTANT(insn->a)}, 0};
+            break;
+        case op_iload:
+        case op_aload:
+            *ir = (ir_t){IR_MOVE, 0, 1, top + 1, {REGISTER(insn->a)}, 0};
+            break;
+        case op_istore:
+        case op_astore:
+            *ir = (ir_t){IR_MOVE, 0, 1, insn->a, {REGISTER(top)}, 0};
+            break;
+        case op_iinc:
+            *ir = (ir_t){IR_ADD, 0, 2, insn->a, {REGISTER(insn->a), CONSTANT(insn->b)}, 0};
+            break;
+        case op_iaload:
+            *ir = (ir_t){IR_LOAD, 0, 2, top - 1, {REGISTER(top - 1), REGISTER(top)}, 0};
+            break;
+        case op_iastore:
+            *ir = (ir_t){
+                IR_STORE, 0, 3, 0, {REGISTER(top - 2), REGISTER(top - 1), REGISTER(top)}, 0};
+            break;
+        case op_dup:
+            *ir = (ir_t){IR_MOVE, 0, 1, top + 1, {REGISTER(top)}, 0};
+            break;
+        case op_iadd:
+        case op_isub:
+        case op_imul:
+        case op_idiv:
+        case op_irem:
+        case op_ishl:
+        case op_ishr:
+        case op_iushr:
+        case op_iand:
+        case op_ior:
+        case op_ixor: {
+            static const ir_op_t BINARY_OPS[] = {
+                [op_iadd] = IR_ADD, [op_isub] = IR_SUB,   [op_imul] = IR_MUL,
+                [op_idiv] = IR_DIV, [op_irem] = IR_REM,   [op_ishl] = IR_SHL,
+                [op_ishr] = IR_SHR, [op_iushr] = IR_USHR, [op_iand] = IR_AND,
+                [op_ior] = IR_OR,   [op_ixor] = IR_XOR,
+            };
+            *ir = (ir_t){
+                BINARY_OPS[insn->op], 0, 2, top - 1, {REGISTER(top - 1), REGISTER(top)}, 0};
+            break;
+        }
+        case op_ineg:
+            *ir = (ir_t){IR_NEG, 0, 1, top, {REGISTER(top)}, 0};
+            break;
+        case op_ifeq:
+        case op_ifne:
+        case op_iflt:
+        case op_ifge:
+        case op_ifgt:
+        case op_ifle:
+            *ir = (ir_t){
+                IR_BRANCH, insn->op - op_ifeq, 2, 0, {REGISTER(top), CONSTANT(0)}, insn->a};
+            break;
+        case op_if_icmpeq:
+        case op_if_icmpne:
+        case op_if_icmplt:
+        case op_if_icmpge:
+        case op_if_icmpgt:
+        case op_if_icmple:
+            *ir = (ir_t){IR_BRANCH,
+                         insn->op - op_if_icmpeq,
+                         2,
+                         0,
+                         {REGISTER(top - 1), REGISTER(top)},
+                         insn->a};
+            break;
+        case op_goto:
+            *ir = (ir_t){.op = IR_GOTO, .target = insn->a};
+            break;
+        case op_tableswitch:
+        case op_lookupswitch:
+            *ir = (ir_t){IR_SWITCH, 0, 1, 0, {REGISTER(top)}, 0};
+            break;
+        case op_ireturn:
+        case op_areturn:
+            *ir = (ir_t){IR_RETURN_VALUE, 0, 1, 0, {REGISTER(top)}, 0};
+            break;
+        case op_return:
+            *ir = (ir_t){.op = IR_RETURN};
+            break;
+        case op_print:
+            *ir = (ir_t){IR_PRINT, 0, 1, 0, {REGISTER(top)}, 0};
+            break;
+        case op_invokestatic:
+            *ir = (ir_t){.op = IR_CALL, .dst = top + 1 - insn->callee->num_params};
+            break;
+        case op_newarray:
+            *ir = (ir_t){IR_NEW_ARRAY, 0, 1, top, {REGISTER(top)}, 0};
+            break;
+        case op_arraylength:
+            *ir = (ir_t){IR_LENGTH, 0, 1, top, {REGISTER(top)}, 0};
+            break;
+    }
+}
+
+/**
+ * @brief Gets whether an IR instruction writes its `dst` register.
+ */
+static bool defines(const ir_t *ir, const insn_t *origin) {
+    switch (ir->op) {
+        case IR_NOP:
+        case IR_STORE:
+        case IR_BRANCH:
+        case IR_GOTO:
+        case IR_SWITCH:
+        case IR_RETURN_VALUE:
+        case IR_RETURN:
+        case IR_PRINT:
+        case IR_KEEP:
+            return false;
+        case IR_CALL:
+            return returns_value(origin->callee->method);
+        default:
+            return true;
+    }
+}
+
+/**
+ * @brief Gets whether an IR instruction can be removed if its result is never read.
+ * Instructions that can trap, allocate or have other effects must stay.
+ */
+static bool is_removable(const ir_t *ir) {
+    switch (ir->op) {
+        case IR_MOVE:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_AND:
+        case IR_OR:
+        case IR_XOR:
+        case IR_SHL:
+        case IR_SHR:
+        case IR_USHR:
+        case IR_NEG:
+            return true;
+        case IR_DIV:
+        case IR_REM:
+            // Only a division by a register can divide by zero
+            return ir->src[1].constant;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Gets whether an operand of an IR instruction can be a constant.
+ *
+ * @param ir The instruction.
+ * @param index The index of the operand.
+ * @param value The constant.
+ */
+static bool accepts_constant(const ir_t *ir, u4 index, int32_t value) {
+    switch (ir->op) {
+        case IR_MOVE:
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_AND:
+        case IR_OR:
+        case IR_XOR:
+        case IR_BRANCH:
+            // Constants on the left of these are moved to the right, or folded
+            return true;
+        case IR_DIV:
+        case IR_REM:
+            // A division by zero is left to trap at run time
+            return index == 1 && value != 0;
+        case IR_SHL:
+        case IR_SHR:
+        case IR_USHR:
+            return index == 1;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Evaluates a comparison of IR_BRANCH.
+ */
+static bool compare(u1 condition, int32_t left, int32_t right) {
+    switch (condition) {
+        case COMPARE_EQ:
+            return left == right;
+        case COMPARE_NE:
+            return left != right;
+        case COMPARE_LT:
+            return left < right;
+        case COMPARE_GE:
+            return left >= right;
+        case COMPARE_GT:
+            return left > right;
+        default:
+            return left <= right;
+    }
+}
+
+/**
+ * @brief Evaluates an arithmetic IR operation on constants, with Java's semantics.
+ *
+ * @param op The operation.
+ * @param left The first operand.
+ * @param right The second operand, if the operation has one.
+ * @param result Set to the result.
+ * @return false if the operation can't be evaluated ahead of time.
+ */
+static bool evaluate(ir_op_t op, int32_t left, int32_t right, int32_t *result) {
+    uint32_t x = left;
+    uint32_t y = right;
+    switch (op) {
+        case IR_ADD:
+            *result = (int32_t) (x + y);
+            return true;
+        case IR_SUB:
+            *result = (int32_t) (x - y);
+            return true;
+        case IR_MUL:
+            *result = (int32_t) (x * y);
+            return true;
+        case IR_DIV:
+        case IR_REM:
+            if (right == 0) {
+                return false;
+            }
+            // INT_MIN / -1 overflows back to INT_MIN
+            if (right == -1) {
+                *result = op == IR_DIV ? (int32_t) -x : 0;
+            }
+            else {
+                *result = op == IR_DIV ? left / right : left % right;
+            }
+            return true;
+        case IR_AND:
+            *result = left & right;
+            return true;
+        case IR_OR:
+            *result = left | right;
+            return true;
+        case IR_XOR:
+            *result = left ^ right;
+            return true;
+        case IR_SHL:
+            *result = (int32_t) (x << (y & 0x1f));
+            return true;
+        case IR_SHR:
+            *result = left >> (y & 0x1f);
+            return true;
+        case IR_USHR:
+            *result = (int32_t) (x >> (y & 0x1f));
+            return true;
+        case IR_NEG:
+            *result = (int32_t) -x;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Gets the base-2 logarithm of a power of two, or -1 if a value isn't one.
+ * INT32_MIN counts as 2^31, since multiplying by it is shifting by 31.
+ */
+static int32_t log2_of(int32_t value) {
+    uint32_t bits = value;
+    if (bits == 0 || (bits & (bits - 1)) != 0) {
+        return -1;
+    }
+    return __builtin_ctz(bits);
+}
+
+/**
+ * @brief Turns an IR instruction into a move of a constant.
+ */
+static void make_constant(ir_t *ir, int32_t value) {
+    *ir = (ir_t){IR_MOVE, 0, 1, ir->dst, {CONSTANT(value)}, 0};
+}
+
+/**
+ * @brief Simplifies an arithmetic IR instruction whose second operand is a constant.
+ */
+static void simplify(ir_t *ir) {
+    operand_t left = ir->src[0];
+    int32_t right = ir->src[1].value;
+    switch (ir->op) {
+        case IR_ADD:
+        case IR_OR:
+        case IR_XOR:
+            if (right == 0) {
+                *ir = (ir_t){IR_MOVE, 0, 1, ir->dst, {left}, 0};
+            }
+            break;
+        case IR_SUB:
+            // Subtracting is adding the negation, even for INT32_MIN
+            ir->op = IR_ADD;
+            ir->src[1].value = (int32_t) -(uint32_t) right;
+            simplify(ir);
+            break;
+        case IR_AND:
+            if (right == 0) {
+                make_constant(ir, 0);
+            }
+            else if (right == -1) {
+                *ir = (ir_t){IR_MOVE, 0, 1, ir->dst, {left}, 0};
+            }
+            break;
+        case IR_MUL:
+            if (right == 0) {
+                make_constant(ir, 0);
+            }
+            else if (right == -1) {
+                *ir = (ir_t){IR_NEG, 0, 1, ir->dst, {left}, 0};
+            }
+            else if (log2_of(right) >= 0) {
+                ir->op = IR_SHL;
+                ir->src[1].value = log2_of(right);
+                simplify(ir);
+            }
+            break;
+        case IR_DIV:
+            if (right == 1) {
+                *ir = (ir_t){IR_MOVE, 0, 1, ir->dst, {left}, 0};
+            }
+            else if (right == -1) {
+                *ir = (ir_t){IR_NEG, 0, 1, ir->dst, {left}, 0};
+            }
+            break;
+        case IR_REM:
+            if (right == 1 || right == -1) {
+                make_constant(ir, 0);
+            }
+            break;
+        case IR_SHL:
+        case IR_SHR:
+        case IR_USHR:
+            // Java only uses the low 5 bits of a shift amount
+            ir->src[1].value = right & 0x1f;
+            if (ir->src[1].value == 0) {
+                *ir = (ir_t){IR_MOVE, 0, 1, ir->dst, {left}, 0};
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * @brief Forgets what is known about a register and the registers known to copy it.
+ */
+static void forget(known_t *known, u4 registers, int32_t reg) {
+    known[reg].kind = KNOWN_NOTHING;
+    for (u4 r = 0; r < registers; r++) {
+        if (known[r].kind == KNOWN_COPY && known[r].value == reg) {
+            known[r].kind = KNOWN_NOTHING;
+        }
+    }
+}
+
+/**
+ * @brief Propagates the constants and copies known before an IR instruction into
+ * its operands, folds and simplifies it, and records what it makes known.
+ */
+static void propagate(ir_t *ir, const insn_t *origin, known_t *known, u4 registers) {
+    // Read the source of a copy instead of the copy
+    bool all_constant = ir->src_count > 0;
+    int32_t values[3];
+    for (u4 i = 0; i < ir->src_count; i++) {
+        operand_t *operand = &ir->src[i];
+        if (!operand->constant && known[operand->value].kind == KNOWN_COPY) {
+            operand->value = known[operand->value].value;
+        }
+        bool constant = operand->constant || known[operand->value].kind == KNOWN_CONSTANT;
+        values[i] = operand->constant ? operand->value : known[operand->value].value;
+        all_constant = all_constant && constant;
+    }
+
+    int32_t result;
+    if (ir->op == IR_BRANCH && all_constant) {
+        bool taken = compare(ir->condition, values[0], values[1]);
+        *ir = taken ? (ir_t){.op = IR_GOTO, .target = ir->target} : (ir_t){.op = IR_NOP};
+    }
+    else if (ir->op == IR_SWITCH && all_constant) {
+        *ir = (ir_t){.op = IR_GOTO, .target = switch_target(origin->table, values[0])};
+    }
+    else if (ir->op != IR_MOVE && all_constant &&
+             evaluate(ir->op, values[0], ir->src_count > 1 ? values[1] : 0, &result)) {
+        make_constant(ir, result);
+    }
+    else {
+        for (u4 i = 0; i < ir->src_count; i++) {
+            operand_t *operand = &ir->src[i];
+            if (!operand->constant && known[operand->value].kind == KNOWN_CONSTANT &&
+                accepts_constant(ir, i, known[operand->value].value)) {
+                *operand = CONSTANT(known[operand->value].value);
+            }
+        }
+        if (ir->src_count == 2 && ir->src[0].constant) {
+            operand_t constant = ir->src[0];
+            switch (ir->op) {
+                case IR_ADD:
+                case IR_MUL:
+                case IR_AND:
+                case IR_OR:
+                case IR_XOR:
+                    ir->src[0] = ir->src[1];
+                    ir->src[1] = constant;
+                    break;
+                case IR_BRANCH: {
+                    // a < b is b > a
+                    static const u1 SWAPPED[] = {COMPARE_EQ, COMPARE_NE, COMPARE_GT,
+                                                 COMPARE_LE, COMPARE_LT, COMPARE_GE};
+                    ir->src[0] = ir->src[1];
+                    ir->src[1] = constant;
+                    ir->condition = SWAPPED[ir->condition];
+                    break;
+                }
+                case IR_SUB:
+                    if (constant.value == 0) {
+                        *ir = (ir_t){IR_NEG, 0, 1, ir->dst, {ir->src[1]}, 0};
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        if (ir->src_count == 2 && !ir->src[0].constant && ir->src[1].constant) {
+            simplify(ir);
+        }
+    }
+
+    // Record what the instruction leaves in the registers it writes
+    if (ir->op == IR_CALL) {
+        // The callee's frame overwrites every register from the first argument on
+        for (u4 r = ir->dst; r < registers; r++) {
+            forget(known, registers, r);
+        }
+    }
+    else if (defines(ir, origin)) {
+        forget(known, registers, ir->dst);
+        if (ir->op == IR_MOVE && ir->src[0].constant) {
+            known[ir->dst] = (known_t){KNOWN_CONSTANT, ir->src[0].value};
+        }
+        else if (ir->op == IR_MOVE && ir->src[0].value != ir->dst) {
+            known[ir->dst] = (known_t){KNOWN_COPY, ir->src[0].value};
+        }
+    }
+    if (ir->op == IR_MOVE && !ir->src[0].constant && ir->src[0].value == ir->dst) {
+        ir->op = IR_NOP;
+    }
+}
+
+/**
+ * @brief Gets the number of instructions an IR instruction can jump to,
+ * besides falling through to the next one.
+ *
+ * @param ir The IR instruction.
+ * @param origin The stack instruction it came from, which has a switch's table.
+ */
+static u4 ir_target_count(const ir_t *ir, const insn_t *origin) {
+    switch (ir->op) {
+        case IR_GOTO:
+        case IR_BRANCH:
+            return 1;
+        case IR_SWITCH:
+            return origin->table->count + 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @brief Gets one of the instructions an IR instruction can jump to.
+ *
+ * @param i Which target, less than ir_target_count().
+ */
+static u4 ir_target(const ir_t *ir, const insn_t *origin, u4 i) {
+    return ir->op == IR_SWITCH ? (u4) origin->table->targets[i] : ir->target;
+}
+
+/**
+ * @brief Gets the number of successors of an IR instruction: its targets,
+ * followed by the next instruction if control can fall through to it.
+ */
+static u4 ir_successor_count(const ir_t *ir, const insn_t *origin) {
+    switch (ir->op) {
+        case IR_GOTO:
+        case IR_SWITCH:
+        case IR_RETURN_VALUE:
+        case IR_RETURN:
+        case IR_KEEP:
+            return ir_target_count(ir, origin);
+        default:
+            return ir_target_count(ir, origin) + 1;
+    }
+}
+
+/**
+ * @brief Gets one of the successors of an IR instruction.
+ *
+ * @param index The index of the instruction.
+ * @param i Which successor, less than ir_successor_count().
+ */
+static u4 ir_successor(const ir_t *ir, const insn_t *origin, u4 index, u4 i) {
+    return i < ir_target_count(ir, origin) ? ir_target(ir, origin, i) : index + 1;
+}
+
+#define SET_BIT(bits, bit) ((bits)[(bit) / 32] |= (uint32_t) 1 << ((bit) % 32))
+#define CLEAR_BIT(bits, bit) ((bits)[(bit) / 32] &= ~((uint32_t) 1 << ((bit) % 32)))
+#define TEST_BIT(bits, bit) (((bits)[(bit) / 32] >> ((bit) % 32)) & 1)
+
+/**
+ * @brief Computes the registers that are live after an IR instruction.
+ *
+ * @param origin The stack instruction it came from.
+ * @param live_in The registers live before each instruction.
+ * @param words The number of words in each set of registers.
+ * @param live_out Set to the registers live after the instruction.
+ */
+static void compute_live_out(const ir_t *ir, const insn_t *origin, u4 index,
+                             const uint32_t *live_in, u4 words, uint32_t *live_out) {
+    memset(live_out, 0, sizeof(uint32_t[words]));
+    u4 count = ir_successor_count(ir, origin);
+    for (u4 i = 0; i < count; i++) {
+        const uint32_t *successor_in = &live_in[ir_successor(ir, origin, index, i) * words];
+        for (u4 w = 0; w < words; w++) {
+            live_out[w] |= successor_in[w];
+        }
+    }
+}
+
+/**
+ * @brief Computes the registers that are live before each IR instruction.
+ *
+ * @param method The method, whose instruction stream and reference maps the IR
+ *   instructions correspond to.
+ * @param irs The IR instructions.
+ * @param registers The number of registers.
+ * @return The live registers of each instruction in turn, `(registers + 31) / 32`
+ *   words each, which the caller must free.
+ */
+static uint32_t *compute_live_in(const method_t *method, const ir_t *irs, u4 registers) {
+    u4 count = method->insn_count;
+    u4 words = (registers + 31) / 32;
+    uint32_t *live_in = calloc(count * words, sizeof(uint32_t));
+    uint32_t *live = malloc(sizeof(uint32_t[words]));
+    assert(live_in != NULL && live != NULL && "Failed to allocate liveness");
+    u4 stack_base = method->code.max_locals + FRAME_GAP_SLOTS;
+
+    // Iterate backward until the live registers of every instruction are stable
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (u4 i = count; i-- > 0;) {
+            const ir_t *ir = &irs[i];
+            const insn_t *origin = &method->insns[i];
+            compute_live_out(ir, origin, i, live_in, words, live);
+            if (defines(ir, origin)) {
+                CLEAR_BIT(live, ir->dst);
+            }
+            for (u4 s = 0; s < ir->src_count; s++) {
+                if (!ir->src[s].constant) {
+                    SET_BIT(live, ir->src[s].value);
+                }
+            }
+            if (ir->op == IR_CALL) {
+                for (u4 r = 0; r < origin->callee->num_params; r++) {
+                    SET_BIT(live, ir->dst + r);
+                }
+            }
+            // An array loop starts from the index it writes
+            if (ir->op == IR_ARRAY_LOOP) {
+                SET_BIT(live, ir->dst);
+            }
+            // A collection at a safepoint reads the references in its map
+            const refmap_t *map = NULL;
+            if (ir->op == IR_CALL || ir->op == IR_NEW_ARRAY) {
+                map = find_refmap(method, i);
+            }
+            for (u4 slot = 0; map != NULL && slot < map->slots; slot++) {
+                if (refmap_is_ref(map, slot)) {
+                    u4 reg = slot < method->code.max_locals
+                                 ? slot
+                                 : stack_base + (slot - method->code.max_locals);
+                    SET_BIT(live, reg);
+                }
+            }
+            uint32_t *in = &live_in[i * words];
+            if (memcmp(in, live, sizeof(uint32_t[words])) != 0) {
+                memcpy(in, live, sizeof(uint32_t[words]));
+                changed = true;
+            }
+        }
+    }
+    free(live);
+    return live_in;
+}
+
+/**
+ * @brief Removes the IR instructions whose results are never read.
+ *
+ * @param method The method, whose instruction stream and reference maps the IR
+ *   instructions correspond to.
+ * @param irs The IR instructions.
+ * @param registers The number of registers.
+ * @return Whether any instruction was removed.
+ */
+static bool remove_dead_code(const method_t *method, ir_t *irs, u4 registers) {
+    u4 count = method->insn_count;
+    u4 words = (registers + 31) / 32;
+    uint32_t *live_in = compute_live_in(method, irs, registers);
+    uint32_t *live = malloc(sizeof(uint32_t[words]));
+    assert(live != NULL && "Failed to allocate liveness");
+
+    bool removed = false;
+    for (u4 i = 0; i < count; i++) {
+        ir_t *ir = &irs[i];
+        if (is_removable(ir)) {
+            compute_live_out(ir, &method->insns[i], i, live_in, words, live);
+            if (!TEST_BIT(live, ir->dst)) {
+                ir->op = IR_NOP;
+                removed = true;
+            }
+        }
+    }
+    free(live_in);
+    free(live);
+    return removed;
+}
+
+/**
+ * @brief Computes, for each IR instruction, the index of the first one at or
+ * after it that isn't removed, which is where a branch to it lands.
+ */
+static void compute_landing(const ir_t *irs, u4 count, u4 *landing) {
+    u4 next = count - 1;
+    for (u4 i = count; i-- > 0;) {
+        if (irs[i].op != IR_NOP) {
+            next = i;
+        }
+        landing[i] = next;
+    }
+}
+
+/**
+ * @brief Removes branches whose target is where control flows anyway.
+ */
+static void remove_useless_branches(ir_t *irs, u4 count, u4 *landing) {
+    bool removed = true;
+    while (removed) {
+        removed = false;
+        compute_landing(irs, count, landing);
+        for (u4 i = 0; i + 1 < count; i++) {
+            ir_t *ir = &irs[i];
+            if ((ir->op == IR_GOTO || ir->op == IR_BRANCH) &&
+                landing[ir->target] == landing[i + 1]) {
+                ir->op = IR_NOP;
+                removed = true;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Finds the register of a loop_register_t table, adding it if it's not there.
+ */
+static loop_register_t *loop_register(loop_register_t *table, u4 *count, int32_t reg) {
+    for (u4 i = 0; i < *count; i++) {
+        if (table[i].reg == reg) {
+            return &table[i];
+        }
+    }
+    table[*count] = (loop_register_t){
+        .reg = reg, .value = {.kind = VALUE_ENTRY, .value = reg, .array = -1, .origin = -1}};
+    return &table[(*count)++];
+}
+
+/**
+ * @brief Gets what an operand of an instruction in a loop holds.
+ */
+static loop_value_t loop_read(loop_register_t *table, u4 *count, operand_t operand) {
+    if (operand.constant) {
+        return (loop_value_t){
+            .kind = VALUE_CONSTANT, .value = operand.value, .array = -1, .origin = -1};
+    }
+    loop_register_t *reg = loop_register(table, count, operand.value);
+    if (reg->value.kind == VALUE_ENTRY) {
+        reg->read_on_entry = true;
+    }
+    return reg->value;
+}
+
+/**
+ * @brief Gets whether two values of registers in a loop are the same.
+ */
+static bool same_value(loop_value_t a, loop_value_t b) {
+    return a.kind == b.kind && a.value == b.value && a.array == b.array;
+}
+
+/**
+ * @brief Replaces a loop with an array loop (see array_kernels.h), if it is one.
+ *
+ * The loop has to start with instructions that compute the same values in
+ * every iteration, followed by the branch out of the loop when its index
+ * reaches the bound, `if (i >= n)`. Its body can only access the arrays at
+ * the index, and has to end by incrementing the index and going back to the
+ * start. The values of one iteration are followed symbolically to find out
+ * which array loop it is, and the start is kept, followed by the array loop.
+ * Everything else the loop writes has to be dead wherever it exits to.
+ *
+ * @param irs The IR instructions.
+ * @param insns The stack instructions they came from.
+ * @param count The number of IR instructions.
+ * @param back The index of the backward IR_GOTO at the end of the loop.
+ * @param live_in The registers that are live before each instruction.
+ * @param words The number of words in each set of registers.
+ * @return Whether the loop was replaced.
+ */
+static bool recognize_array_loop(ir_t *irs, const insn_t *insns, u4 count, u4 back,
+                                 const uint32_t *live_in, u4 words) {
+    u4 head = irs[back].target;
+    // Control can only enter the loop at its start
+    for (u4 j = 0; j < count; j++) {
+        for (u4 t = 0; (j < head || j > back) && t < ir_target_count(&irs[j], &insns[j]);
+             t++) {
+            u4 target = ir_target(&irs[j], &insns[j], t);
+            if (head < target && target <= back) {
+                return false;
+            }
+        }
+    }
+
+    loop_register_t table[4 * MAX_LOOP_INSNS];
+    u4 table_count = 0;
+    // The instructions of the start, which run once before the array loop
+    u4 hoisted[MAX_LOOP_INSNS + 1];
+    u4 hoisted_count = 0;
+    int32_t index = -1;
+    operand_t bound = CONSTANT(0);
+    u4 exit = 0;
+    u4 exit_branch = 0;
+    // The arrays that are loaded from, in order
+    int32_t loads[2];
+    u4 load_count = 0;
+    bool has_store = false;
+    int32_t store_array = -1;
+    int32_t store_reg = -1;
+    loop_value_t stored = {0};
+    bool has_mismatch = false;
+    u4 mismatch_target = 0;
+    u4 insn_count = 0;
+    for (u4 j = head; j < back; j++) {
+        const ir_t *ir = &irs[j];
+        if (ir->op == IR_NOP) {
+            continue;
+        }
+        if (++insn_count > MAX_LOOP_INSNS) {
+            return false;
+        }
+        bool in_body = index >= 0;
+        loop_value_t result = {.kind = VALUE_ENTRY, .value = -1, .array = -1, .origin = -1};
+        switch (ir->op) {
+            case IR_MOVE:
+                result = loop_read(table, &table_count, ir->src[0]);
+                if (ir->src[0].constant) {
+                    result.origin = (int32_t) j;
+                }
+                break;
+            case IR_LENGTH: {
+                loop_value_t array = loop_read(table, &table_count, ir->src[0]);
+                if (array.kind != VALUE_ENTRY) {
+                    return false;
+                }
+                result = (loop_value_t){VALUE_LENGTH, -1, array.value, -1};
+                break;
+            }
+            case IR_LOAD: {
+                loop_value_t array = loop_read(table, &table_count, ir->src[0]);
+                loop_value_t at = loop_read(table, &table_count, ir->src[1]);
+                if (!in_body || array.kind != VALUE_ENTRY || at.kind != VALUE_ENTRY ||
+                    at.value != index || load_count == 2) {
+                    return false;
+                }
+                loads[load_count++] = array.value;
+                result = (loop_value_t){VALUE_ELEMENT, -1, array.value, -1};
+                break;
+            }
+            case IR_ADD: {
+                loop_value_t left = loop_read(table, &table_count, ir->src[0]);
+                loop_value_t right = loop_read(table, &table_count, ir->src[1]);
+                if (left.kind == VALUE_ELEMENT) {
+                    loop_value_t swap = left;
+                    left = right;
+                    right = swap;
+                }
+                if (!in_body || left.kind != VALUE_ENTRY) {
+                    return false;
+                }
+                if (left.value == index && right.kind == VALUE_CONSTANT && right.value == 1) {
+                    result = (loop_value_t){VALUE_NEXT_INDEX, -1, -1, -1};
+                }
+                else if (left.value != index && right.kind == VALUE_ELEMENT) {
+                    result = (loop_value_t){VALUE_ACCUMULATED, left.value, right.array, -1};
+                }
+                else {
+                    return false;
+                }
+                break;
+            }
+            case IR_STORE: {
+                loop_value_t array = loop_read(table, &table_count, ir->src[0]);
+                loop_value_t at = loop_read(table, &table_count, ir->src[1]);
+                if (!in_body || has_store || array.kind != VALUE_ENTRY ||
+                    at.kind != VALUE_ENTRY || at.value != index) {
+                    return false;
+                }
+                has_store = true;
+                store_array = array.value;
+                store_reg = ir->src[2].value;
+                stored = loop_read(table, &table_count, ir->src[2]);
+                continue;
+            }
+            case IR_BRANCH: {
+                loop_value_t left = loop_read(table, &table_count, ir->src[0]);
+                loop_value_t right = loop_read(table, &table_count, ir->src[1]);
+                bool exits = ir->target < head || ir->target > back;
+                if (!in_body) {
+                    // The exit branch, comparing the index to a bound that doesn't change
+                    if (ir->condition != COMPARE_GE || left.kind != VALUE_ENTRY || !exits ||
+                        right.kind == VALUE_ELEMENT || right.kind == VALUE_ACCUMULATED) {
+                        return false;
+                    }
+                    index = left.value;
+                    bound = ir->src[1];
+                    exit = ir->target;
+                    exit_branch = j;
+                }
+                else {
+                    // The first element the arrays differ at leaves the loop
+                    if (has_mismatch || ir->condition != COMPARE_NE ||
+                        left.kind != VALUE_ELEMENT || right.kind != VALUE_ELEMENT ||
+                        load_count != 2 || !exits ||
+                        !((left.array == loads[0] && right.array == loads[1]) ||
+                          (left.array == loads[1] && right.array == loads[0]))) {
+                        return false;
+                    }
+                    has_mismatch = true;
+                    mismatch_target = ir->target;
+                }
+                continue;
+            }
+            default:
+                return false;
+        }
+        if (!in_body) {
+            hoisted[hoisted_count++] = j;
+        }
+        loop_register_t *reg = loop_register(table, &table_count, ir->dst);
+        reg->value = result;
+        reg->written_in_head |= !in_body;
+        reg->written_in_body |= in_body;
+    }
+    if (index < 0 ||
+        loop_register(table, &table_count, index)->value.kind != VALUE_NEXT_INDEX) {
+        return false;
+    }
+
+    // Find which array loop it is
+    u1 kind;
+    int32_t x = -1;
+    int32_t y = -1;
+    if (has_store) {
+        if (has_mismatch) {
+            return false;
+        }
+        if (stored.kind == VALUE_ENTRY && stored.value != index && load_count == 0) {
+            kind = LOOP_FILL;
+            x = store_array;
+            y = stored.value;
+        }
+        else if (stored.kind == VALUE_CONSTANT && stored.origin >= 0 &&
+                 irs[stored.origin].dst == store_reg && load_count == 0) {
+            // The constant's move runs once before the array loop
+            kind = LOOP_FILL;
+            x = store_array;
+            y = store_reg;
+            if ((u4) stored.origin > exit_branch) {
+                hoisted[hoisted_count++] = stored.origin;
+            }
+        }
+        else if (stored.kind == VALUE_ELEMENT && load_count == 1) {
+            kind = LOOP_COPY;
+            x = store_array;
+            y = stored.array;
+        }
+        else if (stored.kind == VALUE_ACCUMULATED && stored.array == store_array &&
+                 load_count == 1 &&
+                 same_value(loop_register(table, &table_count, stored.value)->value, stored)) {
+            kind = LOOP_PREFIX_SUM;
+            x = stored.value;
+            y = store_array;
+        }
+        else {
+            return false;
+        }
+    }
+    else if (has_mismatch) {
+        kind = LOOP_MISMATCH;
+        x = loads[0];
+        y = loads[1];
+    }
+    else {
+        // The one register that accumulates the array's elements
+        kind = LOOP_SUM;
+        for (u4 r = 0; r < table_count; r++) {
+            loop_value_t value = table[r].value;
+            if (value.kind == VALUE_ACCUMULATED && value.value == table[r].reg) {
+                x = table[r].reg;
+                y = value.array;
+            }
+        }
+        if (x < 0 || load_count != 1) {
+            return false;
+        }
+    }
+    bool accumulates = kind == LOOP_SUM || kind == LOOP_PREFIX_SUM;
+
+    for (u4 r = 0; r < table_count; r++) {
+        const loop_register_t *reg = &table[r];
+        bool loop_state = reg->reg == index || (accumulates && reg->reg == x);
+        // Only the index and the sum carry values from one iteration to the next
+        if (reg->read_on_entry && !loop_state &&
+            !same_value(reg->value,
+                        (loop_value_t){.kind = VALUE_ENTRY, .value = reg->reg, .array = -1})) {
+            return false;
+        }
+        if (loop_state) {
+            continue;
+        }
+        // What the start writes is the same after the array loop, but not what the body does
+        if (reg->written_in_body && !reg->written_in_head &&
+            TEST_BIT(&live_in[exit * words], reg->reg)) {
+            return false;
+        }
+        if (has_mismatch && reg->written_in_body &&
+            TEST_BIT(&live_in[mismatch_target * words], reg->reg)) {
+            return false;
+        }
+    }
+    for (u4 h = 0; h < hoisted_count; h++) {
+        for (u4 k = 0; k < h; k++) {
+            if (irs[hoisted[h]].dst == irs[hoisted[k]].dst) {
+                return false;
+            }
+        }
+    }
+
+    // Replace the loop with its start, the array loop, and the jumps to its exits
+    ir_t replacement[MAX_LOOP_INSNS + 4];
+    u4 length = 0;
+    for (u4 h = 0; h < hoisted_count; h++) {
+        replacement[length++] = irs[hoisted[h]];
+    }
+    replacement[length++] =
+        (ir_t){IR_ARRAY_LOOP, kind, 3, index, {REGISTER(x), REGISTER(y), bound}, 0};
+    if (has_mismatch) {
+        replacement[length++] = (ir_t){
+            IR_BRANCH, COMPARE_LT, 2, 0, {REGISTER(index), bound}, mismatch_target};
+    }
+    replacement[length++] = (ir_t){.op = IR_GOTO, .target = exit};
+    assert(length <= back - head + 1 && "Array loop is longer than the loop");
+    for (u4 j = head; j <= back; j++) {
+        irs[j] = j - head < length ? replacement[j - head] : (ir_t){.op = IR_NOP};
+    }
+    return true;
+}
+
+/**
+ * @brief Replaces the loops that array loops can run with them.
+ */
+static void recognize_array_loops(const method_t *method, ir_t *irs, u4 registers) {
+    u4 count = method->insn_count;
+    uint32_t *live_in = NULL;
+    for (u4 i = 0; i < count; i++) {
+        if (irs[i].op == IR_GOTO && irs[i].target <= i) {
+            // Replacing a loop only makes fewer registers live, so one analysis does
+            if (live_in == NULL) {
+                live_in = compute_live_in(method, irs, registers);
+            }
+            recognize_array_loop(irs, method->insns, count, i, live_in,
+                                 (registers + 31) / 32);
+        }
+    }
+    free(live_in);
+}
+
+/** The bound_t of a register nothing is known about */
+#define UNBOUNDED                                                                      \
+    ((bound_t){.min = INT32_MIN,                                                       \
+               .max = INT32_MAX,                                                       \
+               .below = -1,                                                            \
+               .length_of = -1,                                                        \
+               .plus_one = -1,                                                         \
+               .min_length = 0})
+
+/**
+ * @brief Narrows the range of values a register is known to hold.
+ */
+static void narrow(bound_t *bound, int64_t min, int64_t max) {
+    if (min > bound->min) {
+        bound->min = min > INT32_MAX ? INT32_MAX : min;
+    }
+    if (max < bound->max) {
+        bound->max = max < INT32_MIN ? INT32_MIN : max;
+    }
+}
+
+/**
+ * @brief Forgets what is known about a register and the bounds that refer to it.
+ */
+static void unbound(bound_t *bounds, u4 registers, int32_t reg) {
+    bounds[reg] = UNBOUNDED;
+    for (u4 r = 0; r < registers; r++) {
+        if (bounds[r].below == reg) {
+            bounds[r].below = -1;
+        }
+        if (bounds[r].length_of == reg) {
+            bounds[r].length_of = -1;
+        }
+        if (bounds[r].plus_one == reg) {
+            bounds[r].plus_one = -1;
+        }
+    }
+}
+
+/**
+ * @brief Records what an IR instruction that doesn't branch makes known about its
+ * registers.
+ */
+static void bound_insn(const ir_t *ir, const insn_t *origin, bound_t *bounds,
+                       u4 registers, u4 stack_base) {
+    const operand_t *src = ir->src;
+    int32_t dst = ir->dst;
+    switch (ir->op) {
+        case IR_LOAD:
+        case IR_STORE: {
+            // An access that didn't throw leaves its index in bounds
+            bound_t *array = &bounds[src[0].value];
+            bound_t *index = &bounds[src[1].value];
+            narrow(index, 0, INT32_MAX - 1);
+            index->below = src[0].value;
+            if (index->min >= array->min_length) {
+                array->min_length = index->min + 1;
+            }
+            if (ir->op == IR_LOAD) {
+                unbound(bounds, registers, dst);
+            }
+            return;
+        }
+        case IR_CALL:
+            for (u4 r = dst; r < registers; r++) {
+                unbound(bounds, registers, r);
+            }
+            return;
+        case IR_ARRAY_LOOP:
+            unbound(bounds, registers, dst);
+            if (ir->condition == LOOP_SUM || ir->condition == LOOP_PREFIX_SUM) {
+                unbound(bounds, registers, src[0].value);
+            }
+            return;
+        case IR_NEW_ARRAY: {
+            int32_t count = src[0].value;
+            bound_t length = bounds[count];
+            unbound(bounds, registers, dst);
+            bounds[dst].min_length = length.min > 0 ? length.min : 0;
+            if (count != dst) {
+                narrow(&bounds[count], 0, INT32_MAX);
+                bounds[count].length_of = dst;
+            }
+            // An array of n + 1 elements has an element n
+            if (length.plus_one >= 0 && length.plus_one != dst) {
+                bounds[length.plus_one].below = dst;
+            }
+            return;
+        }
+        default:
+            if (!defines(ir, origin)) {
+                return;
+            }
+            break;
+    }
+
+    bound_t result = UNBOUNDED;
+    const bound_t *left = src[0].constant ? NULL : &bounds[src[0].value];
+    int32_t right = src[1].value;
+    switch (ir->op) {
+        case IR_MOVE:
+            if (left == NULL) {
+                narrow(&result, src[0].value, src[0].value);
+            }
+            else {
+                result = *left;
+            }
+            break;
+        case IR_LENGTH:
+            narrow(&result, bounds[src[0].value].min_length, INT32_MAX);
+            result.length_of = src[0].value;
+            break;
+        case IR_ADD:
+            if (src[1].constant) {
+                // i + 1 can't overflow if i is below an array's length
+                int64_t max = left->below >= 0 && left->max == INT32_MAX ? INT32_MAX - 1
+                                                                          : left->max;
+                if ((int64_t) left->min + right >= INT32_MIN &&
+                    max + right <= INT32_MAX) {
+                    narrow(&result, (int64_t) left->min + right, max + right);
+                }
+                if (right == 1) {
+                    result.plus_one = src[0].value;
+                }
+            }
+            break;
+        case IR_AND: {
+            // An operand that isn't negative bounds the result
+            bool right_nonnegative = src[1].constant ? right >= 0 : bounds[right].min >= 0;
+            int32_t right_max = src[1].constant ? right : bounds[right].max;
+            if (left->min >= 0 && right_nonnegative) {
+                narrow(&result, 0, left->max < right_max ? left->max : right_max);
+            }
+            else if (left->min >= 0 || right_nonnegative) {
+                narrow(&result, 0, left->min >= 0 ? left->max : right_max);
+            }
+            break;
+        }
+        case IR_REM:
+            // A remainder has the sign of the dividend and is smaller than the divisor
+            if (left->min >= 0) {
+                int64_t max = left->max;
+                if (src[1].constant && right != INT32_MIN) {
+                    int64_t divisor = right < 0 ? -(int64_t) right : right;
+                    max = divisor - 1 < max ? divisor - 1 : max;
+                }
+                narrow(&result, 0, max);
+            }
+            break;
+        case IR_USHR:
+            if (src[1].constant && right > 0) {
+                narrow(&result, 0, INT32_MAX >> (right - 1));
+            }
+            break;
+        default:
+            break;
+    }
+    unbound(bounds, registers, dst);
+    if (ir->op == IR_MOVE && left != NULL && src[0].value >= (int32_t) stack_base &&
+        dst < (int32_t) stack_base) {
+        // Storing an operand stack slot into a local keeps the facts about it
+        for (u4 r = 0; r < registers; r++) {
+            if (bounds[r].below == src[0].value) {
+                bounds[r].below = dst;
+            }
+            if (bounds[r].length_of == src[0].value) {
+                bounds[r].length_of = dst;
+            }
+        }
+    }
+    if (result.below == dst) {
+        result.below = -1;
+    }
+    if (result.length_of == dst) {
+        result.length_of = -1;
+    }
+    if (result.plus_one == dst) {
+        result.plus_one = -1;
+    }
+    bounds[dst] = result;
+}
+
+/**
+ * @brief Records what a comparison being true makes known about its operands.
+ *
+ * @param condition The comparison.
+ * @param left The register on its left.
+ * @param right The register or constant on its right.
+ */
+static void bound_comparison(u1 condition, int32_t left, operand_t right, bound_t *bounds) {
+    bound_t *x = &bounds[left];
+    if (right.constant) {
+        int64_t value = right.value;
+        switch (condition) {
+            case COMPARE_EQ:
+                narrow(x, value, value);
+                break;
+            case COMPARE_LT:
+                narrow(x, INT32_MIN, value - 1);
+                break;
+            case COMPARE_GE:
+                narrow(x, value, INT32_MAX);
+                break;
+            case COMPARE_GT:
+                narrow(x, value + 1, INT32_MAX);
+                break;
+            case COMPARE_LE:
+                narrow(x, INT32_MIN, value);
+                break;
+            default:
+                break;
+        }
+        return;
+    }
+    if (condition == COMPARE_NE) {
+        return;
+    }
+    // Write left > right and left >= right as right < left and right <= left
+    bound_t *smaller = x;
+    bound_t *larger = &bounds[right.value];
+    if (condition == COMPARE_GT || condition == COMPARE_GE) {
+        smaller = larger;
+        larger = x;
+    }
+    int64_t gap = condition == COMPARE_LT || condition == COMPARE_GT;
+    if (condition == COMPARE_EQ) {
+        narrow(smaller, larger->min, larger->max);
+        narrow(larger, smaller->min, smaller->max);
+        return;
+    }
+    narrow(smaller, INT32_MIN, larger->max - gap);
+    narrow(larger, (int64_t) smaller->min + gap, INT32_MAX);
+    if (gap && larger->length_of >= 0) {
+        smaller->below = larger->length_of;
+    }
+    if (larger->below >= 0) {
+        smaller->below = larger->below;
+    }
+}
+
+/**
+ * @brief Merges what is known on one path into what is known on every path to an
+ * instruction.
+ *
+ * @param into What is known before the instruction.
+ * @param reached Whether any path to the instruction was merged yet; set to true.
+ * @param widen Whether the path is a backward branch. A range that grows along one
+ *   is widened all the way, so loops converge.
+ * @return Whether `into` changed.
+ */
+static bool merge_bounds(bound_t *into, bool *reached, const bound_t *from, u4 registers,
+                         bool widen) {
+    if (!*reached) {
+        *reached = true;
+        memcpy(into, from, sizeof(bound_t[registers]));
+        return true;
+    }
+    bool changed = false;
+    for (u4 r = 0; r < registers; r++) {
+        bound_t merged = into[r];
+        if (from[r].min < merged.min) {
+            merged.min = widen ? INT32_MIN : from[r].min;
+        }
+        if (from[r].max > merged.max) {
+            merged.max = widen ? INT32_MAX : from[r].max;
+        }
+        if (from[r].min_length < merged.min_length) {
+            merged.min_length = widen ? 0 : from[r].min_length;
+        }
+        if (merged.below != from[r].below) {
+            merged.below = -1;
+        }
+        if (merged.length_of != from[r].length_of) {
+            merged.length_of = -1;
+        }
+        if (merged.plus_one != from[r].plus_one) {
+            merged.plus_one = -1;
+        }
+        if (merged.min != into[r].min || merged.max != into[r].max ||
+            merged.min_length != into[r].min_length || merged.below != into[r].below ||
+            merged.length_of != into[r].length_of || merged.plus_one != into[r].plus_one) {
+            into[r] = merged;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/**
+ * @brief Finds the array accesses whose index is always in bounds.
+ *
+ * An index is in bounds if it is known not to be negative and to be less than
+ * the array's length: either less than the length's register or less than
+ * the shortest length the array can have. Those facts come from constants,
+ * array lengths, the comparisons of the branches taken to reach the access,
+ * and earlier accesses; they flow over the method's control flow until they
+ * are stable, so the test of a loop like `for (i = 0; i < a.length; i++)`
+ * proves every `a[i]` in its body safe, and the accesses don't need their own
+ * checks.
+ *
+ * @param method The method the IR instructions correspond to.
+ * @param irs The IR instructions.
+ * @param registers The number of registers.
+ * @param in_bounds Set to whether each instruction is an access that is in bounds.
+ */
+static void eliminate_bounds_checks(const method_t *method, const ir_t *irs, u4 registers,
+                                    bool *in_bounds) {
+    u4 count = method->insn_count;
+    memset(in_bounds, 0, sizeof(bool[count]));
+    if ((uint64_t) count * registers > MAX_BOUNDS_FACTS) {
+        return;
+    }
+    u4 stack_base = method->code.max_locals + FRAME_GAP_SLOTS;
+    bound_t *bounds_in = malloc(sizeof(bound_t[count * registers]));
+    bool *reached = calloc(count, sizeof(bool));
+    bound_t *bounds = malloc(sizeof(bound_t[registers]));
+    bound_t *taken = malloc(sizeof(bound_t[registers]));
+    assert(bounds_in != NULL && reached != NULL && bounds != NULL && taken != NULL &&
+           "Failed to allocate bounds");
+    for (u4 r = 0; r < registers; r++) {
+        bounds[r] = UNBOUNDED;
+    }
+    // The parameters can hold anything
+    merge_bounds(bounds_in, &reached[0], bounds, registers, false);
+
+    // Iterate forward until what is known before every instruction is stable
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (u4 i = 0; i < count; i++) {
+            const ir_t *ir = &irs[i];
+            if (!reached[i]) {
+                continue;
+            }
+            memcpy(bounds, &bounds_in[i * registers], sizeof(bound_t[registers]));
+            if (ir->op == IR_BRANCH) {
+                static const u1 NEGATED[] = {COMPARE_NE, COMPARE_EQ, COMPARE_GE,
+                                             COMPARE_LT, COMPARE_LE, COMPARE_GT};
+                memcpy(taken, bounds, sizeof(bound_t[registers]));
+                bound_comparison(ir->condition, ir->src[0].value, ir->src[1], taken);
+                bound_comparison(NEGATED[ir->condition], ir->src[0].value, ir->src[1],
+                                 bounds);
+                changed |= merge_bounds(&bounds_in[ir->target * registers],
+                                        &reached[ir->target], taken, registers,
+                                        ir->target <= i);
+                changed |= merge_bounds(&bounds_in[(i + 1) * registers], &reached[i + 1],
+                                        bounds, registers, false);
+                continue;
+            }
+            bound_insn(ir, &method->insns[i], bounds, registers, stack_base);
+            u4 successor_count = ir_successor_count(ir, &method->insns[i]);
+            for (u4 s = 0; s < successor_count; s++) {
+                u4 successor = ir_successor(ir, &method->insns[i], i, s);
+                changed |= merge_bounds(&bounds_in[successor * registers],
+                                        &reached[successor], bounds, registers,
+                                        successor <= i);
+            }
+        }
+    }
+
+    for (u4 i = 0; i < count; i++) {
+        const ir_t *ir = &irs[i];
+        if (reached[i] && (ir->op == IR_LOAD || ir->op == IR_STORE)) {
+            const bound_t *array = &bounds_in[i * registers + ir->src[0].value];
+            const bound_t *index = &bounds_in[i * registers + ir->src[1].value];
+            in_bounds[i] = index->min >= 0 && (index->below == ir->src[0].value ||
+                                               index->max < array->min_length);
+        }
+    }
+    free(bounds_in);
+    free(reached);
+    free(bounds);
+    free(taken);
+}
+
+/**
+ * @brief Computes the magic number of a divisor for magic_divide()
+ * (Hacker's Delight, figure 10-1).
+ *
+ * @param divisor The divisor, which must not be 0, 1, -1 or a positive power of 2.
+ * @param magic Set to the magic number.
+ * @return The `aux` operand to go with the magic number.
+ */
+static u1 compute_magic(int32_t divisor, int32_t *magic) {
+    const uint32_t two31 = 0x80000000;
+    uint32_t abs_divisor = divisor < 0 ? -(uint32_t) divisor : (uint32_t) divisor;
+    uint32_t t = two31 + ((uint32_t) divisor >> 31);
+    // The absolute value of the largest dividend that is one less than a multiple
+    uint32_t abs_nc = t - 1 - t % abs_divisor;
+    u4 p = 31;
+    uint32_t q1 = two31 / abs_nc;
+    uint32_t r1 = two31 - q1 * abs_nc;
+    uint32_t q2 = two31 / abs_divisor;
+    uint32_t r2 = two31 - q2 * abs_divisor;
+    uint32_t delta;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= abs_nc) {
+            q1++;
+            r1 -= abs_nc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= abs_divisor) {
+            q2++;
+            r2 -= abs_divisor;
+        }
+        delta = abs_divisor - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    uint32_t m = q2 + 1;
+    *magic = (int32_t) (divisor < 0 ? -m : m);
+
+    u1 aux = p - 32;
+    if (divisor > 0 && *magic < 0) {
+        aux |= MAGIC_ADD_DIVIDEND;
+    }
+    else if (divisor < 0 && *magic > 0) {
+        aux |= MAGIC_SUBTRACT_DIVIDEND;
+    }
+    return aux;
+}
+
+/**
+ * @brief Chooses the register operation for an IR instruction and encodes it.
+ *
+ * @param ir The IR instruction.
+ * @param origin The stack instruction it came from.
+ * @param landing Where a branch to each IR instruction lands.
+ * @param new_index The index in the new stream of each IR instruction that is kept.
+ * @param in_bounds Whether the instruction is an array access that is always in bounds.
+ * @param insn The instruction to fill in.
+ */
+static void emit(const ir_t *ir, const insn_t *origin, const u4 *landing,
+                 const u4 *new_index, bool in_bounds, insn_t *insn) {
+    *insn = (insn_t){.pc = origin->pc};
+    int32_t dst = ir->dst;
+    operand_t left = ir->src[0];
+    operand_t right = ir->src[1];
+    // The register operation for each IR operation with a register or constant on the right
+    static const u1 REGISTER_OPS[][2] = {
+        [IR_ADD] = {op_add, op_add_const},   [IR_SUB] = {op_sub, op_sub},
+        [IR_MUL] = {op_mul, op_mul_const},   [IR_DIV] = {op_div, op_div_magic},
+        [IR_REM] = {op_rem, op_rem_magic},   [IR_AND] = {op_and, op_and_const},
+        [IR_OR] = {op_or, op_or_const},      [IR_XOR] = {op_xor, op_xor_const},
+        [IR_SHL] = {op_shl, op_shl_const},   [IR_SHR] = {op_shr, op_shr_const},
+        [IR_USHR] = {op_ushr, op_ushr_const}};
+    switch (ir->op) {
+        case IR_MOVE:
+            insn->op = left.constant ? op_move_const : op_move;
+            insn->a = dst;
+            insn->b = left.value;
+            break;
+        case IR_SUB:
+            if (left.constant) {
+                insn->op = op_sub_from_const;
+                insn->a = dst;
+                insn->b = right.value;
+                insn->c = left.value;
+                break;
+            }
+            // fall through
+        case IR_ADD:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_REM:
+        case IR_AND:
+        case IR_OR:
+        case IR_XOR:
+        case IR_SHL:
+        case IR_SHR:
+        case IR_USHR:
+            insn->op = REGISTER_OPS[ir->op][right.constant];
+            insn->a = dst;
+            insn->b = left.value;
+            insn->c = right.value;
+            if (insn->op == op_add_const && dst == left.value) {
+                insn->op = op_iinc;
+                insn->b = right.value;
+            }
+            else if (insn->op == op_div_magic || insn->op == op_rem_magic) {
+                int32_t log2 = right.value > 0 ? log2_of(right.value) : -1;
+                if (log2 >= 0) {
+                    insn->op = ir->op == IR_DIV ? op_div_pow2 : op_rem_pow2;
+                    insn->c = log2;
+                }
+                else {
+                    insn->a = (int32_t) ((uint32_t) dst | (uint32_t) left.value << 16);
+                    insn->aux = compute_magic(right.value, &insn->b);
+                }
+            }
+            break;
+        case IR_NEG:
+            insn->op = op_neg;
+            insn->a = dst;
+            insn->b = left.value;
+            break;
+        case IR_LOAD:
+            insn->op = in_bounds ? op_load_element_unchecked : op_load_element;
+            insn->a = dst;
+            insn->b = left.value;
+            insn->c = right.value;
+            break;
+        case IR_STORE:
+            insn->op = in_bounds ? op_store_element_unchecked : op_store_element;
+            insn->a = left.value;
+            insn->b = right.value;
+            insn->c = ir->src[2].value;
+            break;
+        case IR_LENGTH:
+            insn->op = op_array_length;
+            insn->a = dst;
+            insn->b = left.value;
+            break;
+        case IR_NEW_ARRAY:
+            insn->op = op_new_array;
+            insn->a = dst;
+            insn->b = left.value;
+            break;
+        case IR_BRANCH:
+            insn->op = (right.constant ? op_br_eq_const : op_br_eq) + ir->condition;
+            insn->a = new_index[landing[ir->target]];
+            insn->b = left.value;
+            insn->c = right.value;
+            break;
+        case IR_GOTO:
+            insn->op = op_goto;
+            insn->a = new_index[landing[ir->target]];
+            break;
+        case IR_SWITCH:
+            // The stack instructions are replaced, so their table can be reused
+            insn->op = origin->table->keys == NULL ? op_br_table : op_br_lookup;
+            insn->a = left.value;
+            insn->table = origin->table;
+            for (u4 i = 0; i <= insn->table->count; i++) {
+                insn->table->targets[i] = new_index[landing[insn->table->targets[i]]];
+            }
+            break;
+        case IR_RETURN_VALUE:
+            insn->op = op_return_value;
+            insn->a = left.value;
+            break;
+        case IR_RETURN:
+            insn->op = op_return;
+            break;
+        case IR_PRINT:
+            insn->op = op_print_value;
+            insn->a = left.value;
+            break;
+        case IR_CALL:
+            insn->op = op_call;
+            insn->a = dst;
+            insn->callee = origin->callee;
+            break;
+        case IR_ARRAY_LOOP:
+            insn->op = op_fill + ir->condition;
+            insn->a = (int32_t) ((uint32_t) dst | (uint32_t) left.value << 16);
+            insn->b = right.value;
+            insn->c = ir->src[2].value;
+            insn->aux = ir->src[2].constant ? ARRAY_LOOP_CONSTANT_BOUND : 0;
+            break;
+        default:
+            *insn = *origin;
+            break;
+    }
+}
+
+void optimize_method(method_t *method, const class_file_t *class) {
+    u4 count = method->insn_count;
+    u4 stack_base = method->code.max_locals + FRAME_GAP_SLOTS;
+    u4 registers = frame_slots(method->code.max_locals, method->code.max_stack);
+    if (registers > MAX_REGISTERS) {
+        return;
+    }
+
+    // Translate the reachable instructions; the final trap or return always stays
+    int32_t *depths = compute_depths(method->insns, count);
+    ir_t *irs = malloc(sizeof(ir_t[count]));
+    bool *is_target = calloc(count, sizeof(bool));
+    known_t *known = malloc(sizeof(known_t[registers]));
+    assert(irs != NULL && is_target != NULL && known != NULL && "Failed to allocate IR");
+    for (u4 i = 0; i < count; i++) {
+        const insn_t *insn = &method->insns[i];
+        if (depths[i] < 0 && i + 1 < count) {
+            irs[i] = (ir_t){.op = IR_NOP};
+            continue;
+        }
+        translate(insn, depths[i] < 0 ? 0 : depths[i], stack_base, &irs[i]);
+        for (u4 t = 0; t < insn_target_count(insn); t++) {
+            is_target[insn_target(insn, t)] = true;
+        }
+    }
+    free(depths);
+
+    // Propagate constants and copies through each basic block
+    for (u4 i = 0; i < count; i++) {
+        if (i == 0 || is_target[i]) {
+            for (u4 r = 0; r < registers; r++) {
+                known[r].kind = KNOWN_NOTHING;
+            }
+        }
+        if (irs[i].op != IR_NOP) {
+            propagate(&irs[i], &method->insns[i], known, registers);
+        }
+    }
+    free(known);
+    free(is_target);
+
+    // Removing dead code can make the code it read dead
+    while (remove_dead_code(method, irs, registers)) {
+    }
+    recognize_array_loops(method, irs, registers);
+    u4 *landing = malloc(sizeof(u4[count]));
+    u4 *new_index = malloc(sizeof(u4[count]));
+    bool *in_bounds = malloc(sizeof(bool[count]));
+    assert(landing != NULL && new_index != NULL && in_bounds != NULL &&
+           "Failed to allocate IR");
+    eliminate_bounds_checks(method, irs, registers, in_bounds);
+    remove_useless_branches(irs, count, landing);
+
+    u4 new_count = 0;
+    for (u4 i = 0; i < count; i++) {
+        if (irs[i].op != IR_NOP) {
+            new_index[i] = new_count++;
+        }
+    }
+    insn_t *insns = class_alloc(class, sizeof(insn_t[new_count]));
+    for (u4 i = 0; i < count; i++) {
+        if (irs[i].op != IR_NOP) {
+            emit(&irs[i], &method->insns[i], landing, new_index, in_bounds[i],
+                 &insns[new_index[i]]);
+        }
+    }
+    // Safepoints are never removed, and keep their order
+    for (u4 i = 0; i < method->refmap_count; i++) {
+        method->refmaps[i].insn = new_index[method->refmaps[i].insn];
+    }
+    free(irs);
+    free(landing);
+    free(new_index);
+    free(in_bounds);
+
+    method->insns = insns;
+    method->insn_count = new_count;
+}
+
+void optimize_class(class_file_t *class) {
+    for (method_t *method = class->methods; method->name != NULL; method++) {
+        optimize_method(method, class);
+    }
+}
@@ -0,0 +1,163 @@
+#include "output.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/** The longest line output_int() prints: "-2147483648\n" */
+#define MAX_LINE 12
+
+/** The digits of 00 to 99, two by two, so a division by 100 yields two at once */
+static const char DIGIT_PAIRS[] = "00010203040506070809"
+                                  "10111213141516171819"
+                                  "20212223242526272829"
+                                  "30313233343536373839"
+                                  "40414243444546474849"
+                                  "50515253545556575859"
+                                  "60616263646566676869"
+                                  "70717273747576777879"
+                                  "80818283848586878889"
+                                  "90919293949596979899";
+
+/** An output sink: a file descriptor and the printed ints waiting to be written to it */
+struct output {
+    /** The file descriptor the ints are written to */
+    int fd;
+    /** Whether each line is written as soon as it is printed */
+    bool unbuffered;
+    /** The number of bytes in `buffer` */
+    size_t buffered;
+    char buffer[OUTPUT_BUFFER_SIZE];
+};
+
+/** The process's standard output, which every thread prints to unless it selects another */
+static output_t standard_output = {.fd = STDOUT_FILENO};
+/** The output the thread prints to */
+static _Thread_local output_t *current = &standard_output;
+/** Whether flush_at_exit() has been registered, by whichever thread printed first */
+static atomic_bool flushes_at_exit;
+
+/**
+ * @brief Converts an int to decimal, writing it backward from `end`.
+ *
+ * @return The start of the digits.
+ */
+static char *format_int(int32_t value, char *end) {
+    uint32_t magnitude = value < 0 ? -(uint32_t) value : (uint32_t) value;
+    char *digits = end;
+    while (magnitude >= 100) {
+        digits -= 2;
+        memcpy(digits, &DIGIT_PAIRS[magnitude % 100 * 2], 2);
+        magnitude /= 100;
+    }
+    if (magnitude >= 10) {
+        digits -= 2;
+        memcpy(digits, &DIGIT_PAIRS[magnitude * 2], 2);
+    }
+    else {
+        *--digits = (char) ('0' + magnitude);
+    }
+    if (value < 0) {
+        *--digits = '-';
+    }
+    return digits;
+}
+
+/**
+ * @brief Writes all of a set of buffers to a file descriptor, retrying if a write
+ * is interrupted or only partly done. Output that can't be written is dropped.
+ */
+static void write_all(int fd, struct iovec *parts, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, parts, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        for (; count > 0 && (size_t) written >= parts->iov_len; parts++, count--) {
+            written -= (ssize_t) parts->iov_len;
+        }
+        if (count > 0) {
+            parts->iov_base = (char *) parts->iov_base + written;
+            parts->iov_len -= (size_t) written;
+        }
+    }
+}
+
+/**
+ * @brief Writes out the exiting thread's output and the standard output.
+ */
+static void flush_at_exit(void) {
+    output_flush();
+    output_t *selected = output_select(&standard_output);
+    output_flush();
+    output_select(selected);
+}
+
+output_t *output_init(int fd) {
+    output_t *output = malloc(sizeof(*output));
+    assert(output != NULL && "Failed to allocate output");
+    output->fd = fd;
+    output->unbuffered = false;
+    output->buffered = 0;
+    return output;
+}
+
+void output_free(output_t *output) {
+    output_t *selected = output_select(output);
+    output_flush();
+    output_select(selected == output ? &standard_output : selected);
+    free(output);
+}
+
+output_t *output_select(output_t *output) {
+    output_t *previous = current;
+    current = output != NULL ? output : &standard_output;
+    return previous;
+}
+
+void output_set_unbuffered(bool value) {
+    output_flush();
+    current->unbuffered = value;
+}
+
+void output_int(int32_t value) {
+    output_t *output = current;
+    if (output->unbuffered) {
+        char digits[MAX_LINE];
+        char *start = format_int(value, &digits[MAX_LINE]);
+        struct iovec line[] = {{start, (size_t) (&digits[MAX_LINE] - start)}, {"\n", 1}};
+        write_all(output->fd, line, 2);
+        return;
+    }
+    if (OUTPUT_BUFFER_SIZE - output->buffered < MAX_LINE) {
+        output_flush();
+    }
+    if (!atomic_load_explicit(&flushes_at_exit, memory_order_relaxed) &&
+        !atomic_exchange(&flushes_at_exit, true)) {
+        atexit(flush_at_exit);
+    }
+    // Convert right into the buffer, then move the digits to the front of the space
+    char *end = &output->buffer[output->buffered + MAX_LINE - 1];
+    char *start = format_int(value, end);
+    size_t length = (size_t) (end - start);
+    memmove(&output->buffer[output->buffered], start, length);
+    output->buffer[output->buffered + length] = '\n';
+    output->buffered += length + 1;
+}
+
+void output_flush(void) {
+    output_t *output = current;
+    if (output->buffered == 0) {
+        return;
+    }
+    struct iovec all = {output->buffer, output->buffered};
+    write_all(output->fd, &all, 1);
+    output->buffered = 0;
+}
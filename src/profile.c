@@ -0,0 +1,223 @@
+#include "profile.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+
+/** The number of calls the profiler has room for before it grows */
+const size_t INITIAL_PROFILE_CALLS = 64;
+/** The number of operation pairs the report lists */
+const size_t REPORTED_PAIRS = 20;
+
+/** A count of something, and which thing it counts, for sorting */
+typedef struct {
+    uint64_t count;
+    u4 index;
+} ranked_t;
+
+/**
+ * @brief Orders ranked entries from the highest to the lowest count.
+ */
+static int compare_ranked(const void *left, const void *right) {
+    uint64_t left_count = ((const ranked_t *) left)->count;
+    uint64_t right_count = ((const ranked_t *) right)->count;
+    return (left_count < right_count) - (left_count > right_count);
+}
+
+/**
+ * @brief Gets the current time in nanoseconds.
+ */
+static uint64_t now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+/**
+ * @brief Counts the methods of a class.
+ */
+static u4 method_count(const class_file_t *class) {
+    u4 count = 0;
+    while (class->methods[count].name != NULL) {
+        count++;
+    }
+    return count;
+}
+
+profile_t *profile_init(const class_file_t *class) {
+    profile_t *profile = calloc(1, sizeof(*profile));
+    assert(profile != NULL && "Failed to allocate profile");
+    profile->class = class;
+    profile->methods = calloc(method_count(class), sizeof(method_profile_t));
+    profile->call_capacity = INITIAL_PROFILE_CALLS;
+    profile->calls = malloc(sizeof(profile_call_t[profile->call_capacity]));
+    assert(profile->methods != NULL && profile->calls != NULL &&
+           "Failed to allocate profile");
+    return profile;
+}
+
+void profile_enter(profile_t *profile, const method_t *method) {
+    if (profile->call_depth == profile->call_capacity) {
+        profile->call_capacity *= 2;
+        profile->calls =
+            realloc(profile->calls, sizeof(profile_call_t[profile->call_capacity]));
+        assert(profile->calls != NULL && "Failed to grow profile");
+    }
+    u4 index = method - profile->class->methods;
+    profile->methods[index].calls++;
+    profile->methods[index].active_calls++;
+    profile->calls[profile->call_depth++] = (profile_call_t){
+        .method = index,
+        .start = now(),
+    };
+}
+
+void profile_exit(profile_t *profile) {
+    assert(profile->call_depth > 0 && "Returned from a call that wasn't entered");
+    profile_call_t *call = &profile->calls[--profile->call_depth];
+    uint64_t elapsed = now() - call->start;
+    method_profile_t *method = &profile->methods[call->method];
+    if (--method->active_calls == 0) {
+        method->inclusive_nanoseconds += elapsed;
+    }
+    method->exclusive_nanoseconds += elapsed - call->callee_nanoseconds;
+    if (profile->call_depth > 0) {
+        profile->calls[profile->call_depth - 1].callee_nanoseconds += elapsed;
+    }
+}
+
+void profile_memo(profile_t *profile, const method_t *method, bool hit) {
+    method_profile_t *stats = &profile->methods[method - profile->class->methods];
+    if (hit) {
+        stats->memo_hits++;
+    }
+    else {
+        stats->memo_misses++;
+    }
+}
+
+void profile_print(const profile_t *profile, FILE *out) {
+    uint64_t total = 0;
+    ranked_t ops[NUM_OPS];
+    for (u4 op = 0; op < NUM_OPS; op++) {
+        ops[op] = (ranked_t){.count = profile->op_counts[op], .index = op};
+        total += profile->op_counts[op];
+    }
+    qsort(ops, NUM_OPS, sizeof(ranked_t), compare_ranked);
+    fprintf(out, "[profile] %" PRIu64 " instructions executed\n", total);
+    fprintf(out, "[profile] %-44s %14s %7s\n", "operation", "count", "share");
+    for (u4 i = 0; i < NUM_OPS && ops[i].count > 0; i++) {
+        fprintf(out, "[profile] %-44s %14" PRIu64 " %6.2f%%\n", OP_NAMES[ops[i].index],
+                ops[i].count, 100.0 * ops[i].count / total);
+    }
+
+    ranked_t *pairs = malloc(sizeof(ranked_t[NUM_OPS * NUM_OPS]));
+    assert(pairs != NULL && "Failed to allocate profile report");
+    for (u4 i = 0; i < NUM_OPS * NUM_OPS; i++) {
+        pairs[i] = (ranked_t){.count = profile->pair_counts[i / NUM_OPS][i % NUM_OPS],
+                              .index = i};
+    }
+    qsort(pairs, NUM_OPS * NUM_OPS, sizeof(ranked_t), compare_ranked);
+    fprintf(out, "[profile] %-44s %14s %7s\n", "operation pair", "count", "share");
+    for (u4 i = 0; i < REPORTED_PAIRS && pairs[i].count > 0; i++) {
+        char name[80];
+        snprintf(name, sizeof(name), "%s; %s", OP_NAMES[pairs[i].index / NUM_OPS],
+                 OP_NAMES[pairs[i].index % NUM_OPS]);
+        fprintf(out, "[profile] %-44s %14" PRIu64 " %6.2f%%\n", name, pairs[i].count,
+                100.0 * pairs[i].count / total);
+    }
+    free(pairs);
+
+    u4 count = method_count(profile->class);
+    ranked_t *methods = malloc(sizeof(ranked_t[count + 1]));
+    assert(methods != NULL && "Failed to allocate profile report");
+    for (u4 i = 0; i < count; i++) {
+        methods[i] = (ranked_t){
+            .count = profile->methods[i].exclusive_nanoseconds,
+            .index = i,
+        };
+    }
+    qsort(methods, count, sizeof(ranked_t), compare_ranked);
+    fprintf(out, "[profile] %-44s %14s %12s %12s\n", "method", "calls", "incl. ms",
+            "excl. ms");
+    for (u4 i = 0; i < count; i++) {
+        const method_t *method = &profile->class->methods[methods[i].index];
+        const method_profile_t *stats = &profile->methods[methods[i].index];
+        if (stats->calls == 0) {
+            continue;
+        }
+        char name[80];
+        snprintf(name, sizeof(name), "%s%s", method->name, method->descriptor);
+        fprintf(out, "[profile] %-44s %14" PRIu64 " %12.3f %12.3f\n", name, stats->calls,
+                stats->inclusive_nanoseconds / 1e6, stats->exclusive_nanoseconds / 1e6);
+    }
+
+    // The methods stay in the same order, so the memoized ones that take longest come first
+    bool memoized = false;
+    for (u4 i = 0; i < count; i++) {
+        const method_t *method = &profile->class->methods[methods[i].index];
+        const method_profile_t *stats = &profile->methods[methods[i].index];
+        uint64_t lookups = stats->memo_hits + stats->memo_misses;
+        if (lookups == 0) {
+            continue;
+        }
+        if (!memoized) {
+            fprintf(out, "[profile] %-44s %14s %12s %12s\n", "memoized method", "lookups",
+                    "hits", "hit rate");
+            memoized = true;
+        }
+        char name[80];
+        snprintf(name, sizeof(name), "%s%s", method->name, method->descriptor);
+        fprintf(out, "[profile] %-44s %14" PRIu64 " %12" PRIu64 " %11.2f%%\n", name, lookups,
+                stats->memo_hits, 100.0 * stats->memo_hits / lookups);
+    }
+    free(methods);
+}
+
+void profile_write_json(const profile_t *profile, FILE *out) {
+    fprintf(out, "{\n  \"ops\": {");
+    const char *separator = "";
+    for (u4 op = 0; op < NUM_OPS; op++) {
+        if (profile->op_counts[op] > 0) {
+            fprintf(out, "%s\n    \"%s\": %" PRIu64, separator, OP_NAMES[op],
+                    profile->op_counts[op]);
+            separator = ",";
+        }
+    }
+    fprintf(out, "\n  },\n  \"pairs\": [");
+    separator = "";
+    for (u4 first = 0; first < NUM_OPS; first++) {
+        for (u4 second = 0; second < NUM_OPS; second++) {
+            uint64_t count = profile->pair_counts[first][second];
+            if (count > 0) {
+                fprintf(out, "%s\n    [\"%s\", \"%s\", %" PRIu64 "]", separator,
+                        OP_NAMES[first], OP_NAMES[second], count);
+                separator = ",";
+            }
+        }
+    }
+    fprintf(out, "\n  ],\n  \"methods\": [");
+    separator = "";
+    for (u4 i = 0; profile->class->methods[i].name != NULL; i++) {
+        const method_t *method = &profile->class->methods[i];
+        const method_profile_t *stats = &profile->methods[i];
+        if (stats->calls == 0) {
+            continue;
+        }
+        fprintf(out,
+                "%s\n    {\"name\": \"%s\", \"descriptor\": \"%s\", \"calls\": %" PRIu64
+                ", \"inclusive_ns\": %" PRIu64 ", \"exclusive_ns\": %" PRIu64
+                ", \"memo_hits\": %" PRIu64 ", \"memo_misses\": %" PRIu64 "}",
+                separator, method->name, method->descriptor, stats->calls,
+                stats->inclusive_nanoseconds, stats->exclusive_nanoseconds, stats->memo_hits,
+                stats->memo_misses);
+        separator = ",";
+    }
+    fprintf(out, "\n  ]\n}\n");
+}
+
+void profile_free(profile_t *profile) {
+    free(profile->methods);
+    free(profile->calls);
+    free(profile);
+}
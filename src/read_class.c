@@ -1,28 +1,130 @@
 #include "read_class.h"
 
 #include <assert.h>
+#include <fcntl.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 const u4 CLASS_MAGIC = 0xCAFEBABE;
 const u2 IS_STATIC = 0x0008;
+/** The size of the first buffer get_class() reads a class file into */
+const size_t INITIAL_IMAGE_SIZE = 4096;
+/**
+ * The size of a class's first arena chunk per byte of its class file, which
+ * fits the parsed structures and the decoded instruction streams in one chunk
+ */
+const size_t ARENA_SIZE_PER_IMAGE_BYTE = 24;
+/** The smallest arena chunk */
+const size_t MIN_ARENA_SIZE = 4096;
+
+/**
+ * A chunk of a class's arena. Allocations are bump-allocated from the newest
+ * chunk; when it is full, a chunk twice as big is added. Chunks are never
+ * resized, so the allocations never move.
+ */
+typedef struct class_arena {
+    /** The previously allocated chunk */
+    struct class_arena *next;
+    /** The number of bytes in `data` */
+    size_t size;
+    /** The number of bytes of `data` that are allocated */
+    size_t used;
+    /** The chunk's memory, zeroed when the chunk is allocated */
+    max_align_t data[];
+} class_arena_t;
+
+/**
+ * @brief Adds a zeroed chunk to an arena.
+ *
+ * @param next The arena's newest chunk, or NULL if it has none.
+ * @param size The minimum number of bytes in the chunk.
+ * @return The new chunk.
+ */
+static class_arena_t *new_arena_chunk(class_arena_t *next, size_t size) {
+    class_arena_t *chunk = calloc(1, sizeof(*chunk) + size);
+    assert(chunk != NULL && "Failed to allocate class arena");
+    chunk->next = next;
+    chunk->size = size;
+    return chunk;
+}
+
+/**
+ * @brief Bump-allocates zeroed memory from an arena, adding a chunk if needed.
+ *
+ * @param arena The arena's newest chunk, which is updated if a chunk is added.
+ * @param size The number of bytes to allocate.
+ * @return The allocated memory.
+ */
+static void *arena_alloc(class_arena_t **arena, size_t size) {
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+    class_arena_t *chunk = *arena;
+    if (chunk->size - chunk->used < size) {
+        size_t chunk_size = chunk->size * 2;
+        if (chunk_size < size) {
+            chunk_size = size;
+        }
+        chunk = *arena = new_arena_chunk(chunk, chunk_size);
+    }
+    void *memory = (char *) chunk->data + chunk->used;
+    chunk->used += size;
+    return memory;
+}
+
+void *class_alloc(const class_file_t *class, size_t size) {
+    // The arena pointer is updated through the class, which is itself in the arena
+    return arena_alloc(&((class_file_t *) class)->arena, size);
+}
+
+void class_init_arena(class_file_t *class) {
+    class->arena = new_arena_chunk(NULL, MIN_ARENA_SIZE);
+}
+
+/**
+ * A position in the image of a class file being parsed.
+ * Parsing only moves `next` forward; running into `end` is an error.
+ */
+typedef struct {
+    /** The next byte to read */
+    u1 *next;
+    /** The end of the image */
+    u1 *end;
+} cursor_t;
+
+/**
+ * @brief Takes the next bytes of the image, checking that there are enough left.
+ *
+ * @param cursor The position in the image.
+ * @param length The number of bytes to take.
+ * @return A pointer to the taken bytes, which stay in the image.
+ */
+static u1 *read_bytes(cursor_t *cursor, size_t length) {
+    assert((size_t) (cursor->end - cursor->next) >= length &&
+           "Reached end of file prematurely");
+    u1 *bytes = cursor->next;
+    cursor->next += length;
+    return bytes;
+}
 
 /*
  * Functions for reading unsigned big-endian integers. We can't read directly
  * into a u2 or u4 variable because x86 stores integers in little-endian.
  */
-u1 read_u1(FILE *class_file) {
-    int result = fgetc(class_file);
-    assert(result != EOF && "Reached end of file prematurely");
-    return result;
+u1 read_u1(cursor_t *cursor) {
+    return *read_bytes(cursor, 1);
 }
-u2 read_u2(FILE *class_file) {
-    return (u2) read_u1(class_file) << 8 | read_u1(class_file);
+u2 read_u2(cursor_t *cursor) {
+    u1 *bytes = read_bytes(cursor, 2);
+    return (u2) bytes[0] << 8 | bytes[1];
 }
-u4 read_u4(FILE *class_file) {
-    return (u4) read_u2(class_file) << 16 | read_u2(class_file);
+u4 read_u4(cursor_t *cursor) {
+    u1 *bytes = read_bytes(cursor, 4);
+    return (u4) bytes[0] << 24 | (u4) bytes[1] << 16 | (u4) bytes[2] << 8 | bytes[3];
 }
 u2 constant_pool_size(cp_info *constant_pool) {
     cp_info *constant = constant_pool;
@@ -78,9 +180,13 @@ u2 get_number_of_parameters(const method_t *method) {
     u2 params = 0;
 
     for (start++; start < end; start++) {
-        if (start[0] == '[') {
+        // An array's element type, or a class name up to its ';', is part of the parameter
+        while (start[0] == '[') {
             start++;
         }
+        if (start[0] == 'L') {
+            start = strchr(start, ';');
+        }
         params++;
     }
 
@@ -124,79 +230,113 @@ method_t *find_method_from_index(u2 index, const class_file_t *class) {
     return find_method(name->info, descriptor->info, class);
 }
 
+/**
+ * @brief Resolves the Methodref constants of a class.
+ *
+ * Only methods of the class itself are resolved; a call to any other class's
+ * method (such as the Object constructor javac calls from <init>) is left with
+ * a NULL method.
+ *
+ * @param class Pointer to the parsed class structure.
+ * @param this_class The constant pool index of the class's own Class constant.
+ */
+void link_class(class_file_t *class, u2 this_class) {
+    u2 constant_pool_count = constant_pool_size(class->constant_pool);
+    resolved_method_t *resolved =
+        class_alloc(class, sizeof(resolved_method_t[constant_pool_count + 1]));
+
+    for (u2 index = 1; index <= constant_pool_count; index++) {
+        cp_info *constant = &class->constant_pool[index - 1];
+        if (constant->tag != CONSTANT_Methodref) {
+            continue;
+        }
+        CONSTANT_FieldOrMethodref_info *method_ref = constant->info;
+        if (method_ref->class_index != this_class) {
+            continue;
+        }
+        method_t *method = find_method_from_index(index, class);
+        if (method != NULL) {
+            resolved[index] = (resolved_method_t){
+                .method = method,
+                .num_params = get_number_of_parameters(method),
+                .max_locals = method->code.max_locals,
+                .max_stack = method->code.max_stack,
+            };
+        }
+    }
+    class->resolved_methods = resolved;
+}
+
 /**
  * @brief Reads the header information of a class file.
  * 
- * @param class_file Pointer to the open class file.
+ * @param cursor The position of the section in the class file image.
  * @return A class_header_t structure containing the header information.
  */
-class_header_t get_class_header(FILE *class_file) {
+class_header_t get_class_header(cursor_t *cursor) {
     class_header_t header;
-    header.magic = read_u4(class_file);
+    header.magic = read_u4(cursor);
     assert(header.magic == CLASS_MAGIC);
-    header.major_version = read_u2(class_file);
-    header.minor_version = read_u2(class_file);
+    header.major_version = read_u2(cursor);
+    header.minor_version = read_u2(cursor);
     return header;
 }
 
 /**
  * @brief Reads the constant pool from a class file.
  * 
- * @param class_file Pointer to the open class file.
+ * @param cursor The position of the section in the class file image.
+ * @param class The class being parsed, whose arena to allocate from.
  * @return A pointer to the allocated constant pool array.
  */
-cp_info *get_constant_pool(FILE *class_file) {
+cp_info *get_constant_pool(cursor_t *cursor, class_file_t *class) {
     // Constant pool count includes unused constant at index 0
-    u2 constant_pool_count = read_u2(class_file) - 1;
-    cp_info *constant_pool = malloc(sizeof(cp_info[constant_pool_count + 1]));
-    assert(constant_pool != NULL && "Failed to allocate constant pool");
+    u2 constant_pool_count = read_u2(cursor) - 1;
+    cp_info *constant_pool =
+        class_alloc(class, sizeof(cp_info[constant_pool_count + 1]));
 
     cp_info *constant = constant_pool;
     while (constant_pool_count > 0) {
-        constant->tag = read_u1(class_file);
+        constant->tag = read_u1(cursor);
         switch (constant->tag) {
             case CONSTANT_Utf8: {
-                u2 length = read_u2(class_file);
-                char *info = malloc(length + 1);
-                assert(info != NULL && "Failed to allocate UTF8 constant");
-                size_t bytes_read = fread(info, 1, length, class_file);
-                assert(bytes_read == length && "Failed to read UTF8 constant");
+                u2 length = read_u2(cursor);
+                u1 *bytes = read_bytes(cursor, length);
+                /* Terminate the string in place by sliding it over its tag and length,
+                 * which have already been read, so it stays in the image */
+                char *info = (char *) bytes - 3;
+                memmove(info, bytes, length);
                 info[length] = '\0';
                 constant->info = info;
                 break;
             }
 
-            case CONSTANT_Integer: {
-                CONSTANT_Integer_info *value = malloc(sizeof(*value));
-                assert(value != NULL && "Failed to allocate integer constant");
-                value->bytes = read_u4(class_file);
-                constant->info = value;
+            case CONSTANT_Integer:
+                constant->integer.bytes = read_u4(cursor);
+                constant->info = &constant->integer;
                 break;
-            }
 
             case CONSTANT_Class: {
-                CONSTANT_Class_info *value = malloc(sizeof(*value));
-                assert(value != NULL && "Failed to allocate class constant");
-                value->string_index = read_u2(class_file);
+                CONSTANT_Class_info *value = class_alloc(class, sizeof(*value));
+                value->string_index = read_u2(cursor);
                 constant->info = value;
                 break;
             }
 
             case CONSTANT_Methodref:
             case CONSTANT_Fieldref: {
-                CONSTANT_FieldOrMethodref_info *value = malloc(sizeof(*value));
-                assert(value != NULL && "Failed to allocate FieldRef/MethodRef constant");
-                value->class_index = read_u2(class_file);
-                value->name_and_type_index = read_u2(class_file);
+                CONSTANT_FieldOrMethodref_info *value =
+                    class_alloc(class, sizeof(*value));
+                value->class_index = read_u2(cursor);
+                value->name_and_type_index = read_u2(cursor);
                 constant->info = value;
                 break;
             }
 
             case CONSTANT_NameAndType: {
-                CONSTANT_NameAndType_info *value = malloc(sizeof(*value));
-                assert(value != NULL && "Failed to allocate NameAndType constant");
-                value->name_index = read_u2(class_file);
-                value->descriptor_index = read_u2(class_file);
+                CONSTANT_NameAndType_info *value = class_alloc(class, sizeof(*value));
+                value->name_index = read_u2(cursor);
+                value->descriptor_index = read_u2(cursor);
                 constant->info = value;
                 break;
             }
@@ -217,17 +357,17 @@ cp_info *get_constant_pool(FILE *class_file) {
 /**
  * @brief Reads the class information section from a class file.
  * 
- * @param class_file Pointer to the open class file.
+ * @param cursor The position of the section in the class file image.
  * @return A class_info_t structure containing the class information.
  */
-class_info_t get_class_info(FILE *class_file) {
+class_info_t get_class_info(cursor_t *cursor) {
     class_info_t info;
-    info.access_flags = read_u2(class_file);
-    info.this_class = read_u2(class_file);
-    info.super_class = read_u2(class_file);
-    u2 interfaces_count = read_u2(class_file);
+    info.access_flags = read_u2(cursor);
+    info.this_class = read_u2(cursor);
+    info.super_class = read_u2(cursor);
+    u2 interfaces_count = read_u2(cursor);
     assert(interfaces_count == 0 && "This VM does not support interfaces.");
-    u2 fields_count = read_u2(class_file);
+    u2 fields_count = read_u2(cursor);
     assert(fields_count == 0 && "This VM does not support fields.");
     return info;
 }
@@ -235,35 +375,33 @@ class_info_t get_class_info(FILE *class_file) {
 /**
  * @brief Reads and processes the attributes of a method.
  * 
- * @param class_file Pointer to the open class file.
+ * @param cursor The position of the section in the class file image.
  * @param info Pointer to the method_info structure containing method details.
  * @param code Pointer to the code_t structure where method code will be stored.
  * @param constant_pool Pointer to the constant pool array.
  */
-void read_method_attributes(FILE *class_file, method_info *info, code_t *code,
+void read_method_attributes(cursor_t *cursor, method_info *info, code_t *code,
                             cp_info *constant_pool) {
     bool found_code = false;
     for (u2 attributes = info->attributes_count; attributes > 0; attributes--) {
         attribute_info ainfo;
-        ainfo.attribute_name_index = read_u2(class_file);
-        ainfo.attribute_length = read_u4(class_file);
-        long attribute_end = ftell(class_file) + ainfo.attribute_length;
+        ainfo.attribute_name_index = read_u2(cursor);
+        ainfo.attribute_length = read_u4(cursor);
+        // Take the whole attribute, so the part of it we don't parse is skipped
+        cursor_t attribute = {.next = read_bytes(cursor, ainfo.attribute_length)};
+        attribute.end = attribute.next + ainfo.attribute_length;
         cp_info *type_constant = get_constant(constant_pool, ainfo.attribute_name_index);
         assert(type_constant->tag == CONSTANT_Utf8 && "Expected a UTF8");
         if (strcmp(type_constant->info, "Code") == 0) {
             assert(!found_code && "Duplicate method code");
             found_code = true;
 
-            code->max_stack = read_u2(class_file);
-            code->max_locals = read_u2(class_file);
-            code->code_length = read_u4(class_file);
-            code->code = malloc(code->code_length);
-            assert(code->code != NULL && "Failed to allocate method code");
-            size_t bytes_read = fread(code->code, 1, code->code_length, class_file);
-            assert(bytes_read == code->code_length && "Failed to read method code");
+            code->max_stack = read_u2(&attribute);
+            code->max_locals = read_u2(&attribute);
+            code->code_length = read_u4(&attribute);
+            // The bytecode stays in the image
+            code->code = read_bytes(&attribute, code->code_length);
         }
-        // Skip the rest of the attribute
-        fseek(class_file, attribute_end, SEEK_SET);
     }
     assert(found_code && "Missing method code");
 }
@@ -271,22 +409,22 @@ void read_method_attributes(FILE *class_file, method_info *info, code_t *code,
 /**
  * @brief Reads the methods section of a class file.
  * 
- * @param class_file Pointer to the open class file.
- * @param constant_pool Pointer to the constant pool array.
+ * @param cursor The position of the section in the class file image.
+ * @param class The class being parsed, whose constant pool has been read.
  * @return A pointer to the allocated methods array.
  */
-method_t *get_methods(FILE *class_file, cp_info *constant_pool) {
-    u2 method_count = read_u2(class_file);
-    method_t *methods = malloc(sizeof(method_t[method_count + 1]));
-    assert(methods != NULL && "Failed to allocate methods");
+method_t *get_methods(cursor_t *cursor, class_file_t *class) {
+    cp_info *constant_pool = class->constant_pool;
+    u2 method_count = read_u2(cursor);
+    method_t *methods = class_alloc(class, sizeof(method_t[method_count + 1]));
 
     method_t *method = methods;
     while (method_count > 0) {
         method_info info;
-        info.access_flags = read_u2(class_file);
-        info.name_index = read_u2(class_file);
-        info.descriptor_index = read_u2(class_file);
-        info.attributes_count = read_u2(class_file);
+        info.access_flags = read_u2(cursor);
+        info.name_index = read_u2(cursor);
+        info.descriptor_index = read_u2(cursor);
+        info.attributes_count = read_u2(cursor);
 
         cp_info *name = get_constant(constant_pool, info.name_index);
         assert(name->tag == CONSTANT_Utf8 && "Expected a UTF8");
@@ -302,7 +440,9 @@ method_t *get_methods(FILE *class_file, cp_info *constant_pool) {
                    "This VM only supports static methods.");
         }
 
-        read_method_attributes(class_file, &info, &method->code, constant_pool);
+        read_method_attributes(cursor, &info, &method->code, constant_pool);
+        /* The instruction stream is filled in by decode_method(),
+         * and the reference maps by compute_refmaps() */
 
         method++;
         method_count--;
@@ -314,46 +454,128 @@ method_t *get_methods(FILE *class_file, cp_info *constant_pool) {
 }
 
 /**
- * @brief Parses a class file and constructs a class_file_t structure.
- * 
- * @param class_file Pointer to the open class file.
+ * @brief Parses the image of a class file and constructs a class_file_t structure.
+ *
+ * The class's Utf8 constants and bytecode point into the image, so the class
+ * takes ownership of it.
+ *
+ * @param image The contents of the class file, which parsing modifies.
+ * @param size The number of bytes in the image.
+ * @param mapped Whether the image was mapped with mmap() rather than malloc()ed.
  * @return A pointer to the allocated class_file_t structure.
  */
-class_file_t *get_class(FILE *class_file) {
-    class_file_t *class = malloc(sizeof(*class));
-    assert(class != NULL && "Failed to allocate class");
+static class_file_t *parse_class(u1 *image, size_t size, bool mapped) {
+    size_t arena_size = size * ARENA_SIZE_PER_IMAGE_BYTE;
+    if (arena_size < MIN_ARENA_SIZE) {
+        arena_size = MIN_ARENA_SIZE;
+    }
+    class_arena_t *arena = new_arena_chunk(NULL, arena_size);
+    class_file_t *class = arena_alloc(&arena, sizeof(*class));
+    class->arena = arena;
+    class->image = image;
+    class->image_size = size;
+    class->image_mapped = mapped;
+    cursor_t position = {.next = image, .end = image + size};
+    cursor_t *cursor = &position;
 
     /* Read the leading header of the class file.
      * We don't need the result, but we need to skip past the header. */
-    get_class_header(class_file);
+    get_class_header(cursor);
 
     // Read the constant pool
-    class->constant_pool = get_constant_pool(class_file);
+    class->constant_pool = get_constant_pool(cursor, class);
 
-    /* Read information about the class that was compiled.
-     * We don't need the result, but we need to skip past it. */
-    get_class_info(class_file);
+    // Read information about the class that was compiled
+    class_info_t info = get_class_info(cursor);
 
     // Read the list of static methods
-    class->methods = get_methods(class_file, class->constant_pool);
+    class->methods = get_methods(cursor, class);
+
+    // Resolve the methods called by invokestatic instructions
+    link_class(class, info.this_class);
 
     return class;
 }
 
+/**
+ * @brief Reads a class file into memory in one go and parses it.
+ *
+ * @param class_file Pointer to the open class file.
+ * @return A pointer to the allocated class_file_t structure.
+ */
+class_file_t *get_class(FILE *class_file) {
+    size_t capacity = INITIAL_IMAGE_SIZE;
+    size_t size = 0;
+    u1 *image = malloc(capacity);
+    assert(image != NULL && "Failed to allocate class file image");
+    while (true) {
+        size += fread(image + size, 1, capacity - size, class_file);
+        if (size < capacity) {
+            break;
+        }
+        capacity *= 2;
+        image = realloc(image, capacity);
+        assert(image != NULL && "Failed to allocate class file image");
+    }
+    assert(!ferror(class_file) && "Failed to read class file");
+    return parse_class(image, size, false);
+}
+
+/**
+ * @brief Maps a class file into memory and parses it.
+ *
+ * The mapping is private, so the in-place changes parsing makes to the image
+ * (terminating Utf8 constants) never reach the file. Falls back to get_class()
+ * if the file can't be mapped, e.g. if it is a pipe.
+ *
+ * @param path The path of the class file.
+ * @return A pointer to the allocated class_file_t structure, or NULL if the
+ *   file can't be opened.
+ */
+class_file_t *load_class(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    void *image = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        image = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    if (image != MAP_FAILED) {
+        close(fd);
+        return parse_class(image, info.st_size, true);
+    }
+
+    FILE *class_file = fdopen(fd, "r");
+    assert(class_file != NULL && "Failed to open file");
+    class_file_t *class = get_class(class_file);
+    int error = fclose(class_file);
+    assert(error == 0 && "Failed to close file");
+    return class;
+}
+
 /**
  * @brief Frees the memory allocated for a class_file_t structure.
- * 
+ *
+ * Everything but the image is in the class's arena, so there is nothing to walk.
+ * A class loaded from a class image (see image_cache.h) is in that image instead,
+ * and only what was allocated after it was loaded is in its arena.
+ *
  * @param class Pointer to the class_file_t structure to free.
  */
 void free_class(class_file_t *class) {
-    for (cp_info *constant = class->constant_pool; constant->info != NULL; constant++) {
-        free(constant->info);
+    // The class itself is in its arena or its image, so it can't be used after either is freed
+    class_arena_t *chunk = class->arena;
+    if (class->image_mapped) {
+        munmap(class->image, class->image_size);
     }
-    free(class->constant_pool);
-
-    for (method_t *method = class->methods; method->name != NULL; method++) {
-        free(method->code.code);
+    else {
+        free(class->image);
+    }
+    while (chunk != NULL) {
+        class_arena_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
-    free(class->methods);
-    free(class);
 }
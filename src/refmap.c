@@ -0,0 +1,421 @@
+#include "refmap.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode.h"
+#include "read_class.h"
+
+/** What a frame slot is known to hold at an instruction */
+typedef enum {
+    /** Unknown: uninitialized, or an int on some paths and a reference on others */
+    TYPE_TOP,
+    TYPE_INT,
+    TYPE_REF
+} slot_type_t;
+
+/** The typestate of a frame before an instruction runs */
+typedef struct {
+    /** The operand stack depth, or -1 if the instruction hasn't been reached */
+    int32_t depth;
+    /** The types of the locals followed by the operand stack (max_locals + max_stack) */
+    u1 *types;
+} typestate_t;
+
+/**
+ * @brief Gets the type of a field descriptor's value, e.g. TYPE_REF for "[I".
+ *
+ * @param descriptor The field descriptor.
+ * @param end Set to the character after the descriptor.
+ */
+static slot_type_t descriptor_type(const char *descriptor, const char **end) {
+    const char *c = descriptor;
+    slot_type_t type = TYPE_INT;
+    if (*c == '[' || *c == 'L') {
+        type = TYPE_REF;
+        while (*c == '[') {
+            c++;
+        }
+        if (*c == 'L') {
+            c = strchr(c, ';');
+        }
+    }
+    *end = c + 1;
+    return type;
+}
+
+/**
+ * @brief Gets the type a method returns, or TYPE_TOP if it returns void.
+ */
+static slot_type_t return_type(const method_t *method) {
+    const char *returned = strchr(method->descriptor, ')') + 1;
+    if (*returned == 'V') {
+        return TYPE_TOP;
+    }
+    return descriptor_type(returned, &returned);
+}
+
+/**
+ * @brief Merges a typestate into the typestate of a successor instruction.
+ *
+ * @return Whether the successor's typestate changed.
+ */
+static bool merge(typestate_t *into, const typestate_t *from, u4 max_locals) {
+    if (into->depth < 0) {
+        into->depth = from->depth;
+        memcpy(into->types, from->types, max_locals + from->depth);
+        return true;
+    }
+    assert(into->depth == from->depth && "Inconsistent stack depth");
+    bool changed = false;
+    for (u4 slot = 0; slot < max_locals + from->depth; slot++) {
+        if (into->types[slot] != from->types[slot] && into->types[slot] != TYPE_TOP) {
+            into->types[slot] = TYPE_TOP;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/**
+ * @brief Applies an instruction to a typestate, checking that the values it
+ * uses have the right types and that its locals and stack slots are in the frame.
+ *
+ * @param insn The instruction.
+ * @param state The typestate before the instruction, updated to the one after it.
+ * @param method The method the instruction belongs to.
+ * @return NULL, or why the instruction fails verification.
+ */
+static const char *apply(const insn_t *insn, typestate_t *state, const method_t *method) {
+    u4 max_locals = method->code.max_locals;
+    u1 *locals = state->types;
+    u1 *stack = state->types + max_locals;
+#define PUSH_TYPE(type)                                                                  \
+    do {                                                                                 \
+        if ((u4) state->depth == method->code.max_stack) {                               \
+            return "Operand stack overflow";                                             \
+        }                                                                                \
+        stack[state->depth++] = (type);                                                  \
+    } while (0)
+#define POP_TYPE(type)                                                                   \
+    do {                                                                                 \
+        if (state->depth == 0) {                                                         \
+            return "Operand stack underflow";                                            \
+        }                                                                                \
+        if (stack[--state->depth] != (type)) {                                           \
+            return (type) == TYPE_INT ? "Expecting to find an int on the stack"          \
+                                      : "Expecting to find an array on the stack";       \
+        }                                                                                \
+    } while (0)
+#define CHECK_LOCAL(index)                                                               \
+    do {                                                                                 \
+        if ((u4) (index) >= max_locals) {                                                \
+            return "Local variable index out of range";                                  \
+        }                                                                                \
+    } while (0)
+#define LOAD_LOCAL(index, type)                                                          \
+    do {                                                                                 \
+        CHECK_LOCAL(index);                                                              \
+        if (locals[index] != (type)) {                                                   \
+            return (type) == TYPE_INT ? "Expecting an int in the local variable"         \
+                                      : "Expecting an array in the local variable";      \
+        }                                                                                \
+        PUSH_TYPE(type);                                                                 \
+    } while (0)
+#define STORE_LOCAL(index, type)                                                         \
+    do {                                                                                 \
+        CHECK_LOCAL(index);                                                              \
+        POP_TYPE(type);                                                                  \
+        locals[index] = (type);                                                          \
+    } while (0)
+    switch (insn->op) {
+        case op_iconst:
+            PUSH_TYPE(TYPE_INT);
+            break;
+        case op_iload:
+            LOAD_LOCAL(insn->a, TYPE_INT);
+            break;
+        case op_aload:
+            LOAD_LOCAL(insn->a, TYPE_REF);
+            break;
+        case op_istore:
+            STORE_LOCAL(insn->a, TYPE_INT);
+            break;
+        case op_astore:
+            STORE_LOCAL(insn->a, TYPE_REF);
+            break;
+        case op_iinc:
+            CHECK_LOCAL(insn->a);
+            if (locals[insn->a] != TYPE_INT) {
+                return "Expecting an int in the local variable";
+            }
+            break;
+        case op_iaload:
+            POP_TYPE(TYPE_INT);
+            POP_TYPE(TYPE_REF);
+            PUSH_TYPE(TYPE_INT);
+            break;
+        case op_iastore:
+            POP_TYPE(TYPE_INT);
+            POP_TYPE(TYPE_INT);
+            POP_TYPE(TYPE_REF);
+            break;
+        case op_dup: {
+            if (state->depth == 0) {
+                return "Operand stack underflow";
+            }
+            u1 top = stack[state->depth - 1];
+            PUSH_TYPE(top);
+            break;
+        }
+        case op_iadd:
+        case op_isub:
+        case op_imul:
+        case op_idiv:
+        case op_irem:
+        case op_ishl:
+        case op_ishr:
+        case op_iushr:
+        case op_iand:
+        case op_ior:
+        case op_ixor:
+            POP_TYPE(TYPE_INT);
+            POP_TYPE(TYPE_INT);
+            PUSH_TYPE(TYPE_INT);
+            break;
+        case op_ineg:
+            POP_TYPE(TYPE_INT);
+            PUSH_TYPE(TYPE_INT);
+            break;
+        case op_ifeq:
+        case op_ifne:
+        case op_iflt:
+        case op_ifge:
+        case op_ifgt:
+        case op_ifle:
+        case op_tableswitch:
+        case op_lookupswitch:
+        case op_print:
+            POP_TYPE(TYPE_INT);
+            break;
+        case op_if_icmpeq:
+        case op_if_icmpne:
+        case op_if_icmplt:
+        case op_if_icmpge:
+        case op_if_icmpgt:
+        case op_if_icmple:
+            POP_TYPE(TYPE_INT);
+            POP_TYPE(TYPE_INT);
+            break;
+        case op_invokestatic: {
+            // The arguments are popped last to first, so check them in that order
+            const method_t *callee = insn->callee->method;
+            slot_type_t params[insn->callee->num_params + 1];
+            const char *param = callee->descriptor + 1;
+            for (u4 i = 0; *param != ')'; i++) {
+                params[i] = descriptor_type(param, &param);
+            }
+            for (u4 i = insn->callee->num_params; i > 0; i--) {
+                POP_TYPE(params[i - 1]);
+            }
+            slot_type_t returned = return_type(callee);
+            if (returned != TYPE_TOP) {
+                PUSH_TYPE(returned);
+            }
+            break;
+        }
+        case op_newarray:
+            POP_TYPE(TYPE_INT);
+            PUSH_TYPE(TYPE_REF);
+            break;
+        case op_arraylength:
+            POP_TYPE(TYPE_REF);
+            PUSH_TYPE(TYPE_INT);
+            break;
+        case op_ireturn:
+            if (return_type(method) != TYPE_INT) {
+                return "Method doesn't return an int";
+            }
+            POP_TYPE(TYPE_INT);
+            break;
+        case op_areturn:
+            if (return_type(method) != TYPE_REF) {
+                return "Method doesn't return an array";
+            }
+            POP_TYPE(TYPE_REF);
+            break;
+        case op_return:
+            if (return_type(method) != TYPE_TOP) {
+                return "Method must return a value";
+            }
+            break;
+        default:
+            // Gotos and traps change nothing
+            break;
+    }
+    return NULL;
+#undef PUSH_TYPE
+#undef POP_TYPE
+#undef CHECK_LOCAL
+#undef LOAD_LOCAL
+#undef STORE_LOCAL
+}
+
+void compute_refmaps(method_t *method, const class_file_t *class) {
+    if (method->verify_error != NULL) {
+        // The decoder already rejected it
+        return;
+    }
+    u4 count = method->insn_count;
+    u4 max_locals = method->code.max_locals;
+    u4 frame_slots = max_locals + method->code.max_stack;
+
+    typestate_t *states = malloc(sizeof(typestate_t[count]));
+    u1 *types = malloc(sizeof(u1[count * frame_slots + 1]));
+    u4 *worklist = malloc(sizeof(u4[count]));
+    bool *pending = calloc(count, sizeof(bool));
+    u1 *scratch = malloc(sizeof(u1[frame_slots + 1]));
+    assert(states != NULL && types != NULL && worklist != NULL && pending != NULL &&
+           scratch != NULL && "Failed to allocate typestates");
+    for (u4 i = 0; i < count; i++) {
+        states[i] = (typestate_t){.depth = -1, .types = &types[i * frame_slots]};
+    }
+
+    // The parameters are the first locals; the other locals are uninitialized
+    typestate_t *entry = &states[0];
+    entry->depth = 0;
+    memset(entry->types, TYPE_TOP, frame_slots);
+    const char *param = method->descriptor + 1;
+    u4 slot = 0;
+    // Constructors are the only instance methods, and get `this` before their parameters
+    if (strcmp(method->name, "<init>") == 0 && max_locals > 0) {
+        entry->types[slot++] = TYPE_REF;
+    }
+    const char *error = NULL;
+    u4 error_pc = 0;
+    for (; *param != ')'; slot++) {
+        if (slot >= max_locals) {
+            error = "Parameters don't fit in the locals";
+            break;
+        }
+        entry->types[slot] = descriptor_type(param, &param);
+    }
+
+    // Propagate typestates until nothing changes
+    u4 work_count = 0;
+    worklist[work_count++] = 0;
+    pending[0] = true;
+    while (work_count > 0 && error == NULL) {
+        u4 index = worklist[--work_count];
+        pending[index] = false;
+        const insn_t *insn = &method->insns[index];
+        typestate_t after = {.depth = states[index].depth, .types = scratch};
+        memcpy(scratch, states[index].types, max_locals + after.depth);
+        error = apply(insn, &after, method);
+        if (error != NULL) {
+            error_pc = insn->pc;
+            break;
+        }
+
+        // The next instruction follows the targets, if control falls through to it
+        u4 target_count = insn_target_count(insn);
+        u4 successor_count = target_count + op_falls_through(insn->op);
+        for (u4 i = 0; i < successor_count; i++) {
+            u4 successor = i < target_count ? insn_target(insn, i) : index + 1;
+            assert(successor < count && "Control falls off the instruction stream");
+            if (states[successor].depth >= 0 && states[successor].depth != after.depth) {
+                error = "Inconsistent stack height";
+                error_pc = method->insns[successor].pc;
+                break;
+            }
+            if (merge(&states[successor], &after, max_locals) && !pending[successor]) {
+                pending[successor] = true;
+                worklist[work_count++] = successor;
+            }
+        }
+    }
+
+    if (error != NULL) {
+        free(states);
+        free(types);
+        free(worklist);
+        free(pending);
+        free(scratch);
+        reject_method(method, class, error_pc, error);
+        return;
+    }
+
+    // Record the typestates of the reachable safepoints as bitmaps
+    u4 safepoints = 0;
+    size_t bit_words = 0;
+    for (u4 i = 0; i < count; i++) {
+        u2 op = method->insns[i].op;
+        if ((op == op_newarray || op == op_invokestatic) && states[i].depth >= 0) {
+            safepoints++;
+            bit_words += (max_locals + states[i].depth + 31) / 32;
+        }
+    }
+    // The maps and their bits belong to the class, which frees them
+    refmap_t *maps = NULL;
+    if (safepoints > 0) {
+        size_t size = sizeof(refmap_t[safepoints]) + sizeof(uint32_t[bit_words]);
+        maps = class_alloc(class, size);
+    }
+    uint32_t *bits = (uint32_t *) &maps[safepoints];
+    refmap_t *map = maps;
+    for (u4 i = 0; i < count; i++) {
+        const insn_t *insn = &method->insns[i];
+        if ((insn->op != op_newarray && insn->op != op_invokestatic) ||
+            states[i].depth < 0) {
+            continue;
+        }
+        u4 depth = states[i].depth;
+        if (insn->op == op_invokestatic) {
+            depth -= insn->callee->num_params;
+        }
+        map->insn = i;
+        map->slots = max_locals + depth;
+        map->bits = bits;
+        for (u4 slot = 0; slot < map->slots; slot++) {
+            if (states[i].types[slot] == TYPE_REF) {
+                bits[slot / 32] |= (uint32_t) 1 << (slot % 32);
+            }
+        }
+        bits += (max_locals + states[i].depth + 31) / 32;
+        map++;
+    }
+
+    free(states);
+    free(types);
+    free(worklist);
+    free(pending);
+    free(scratch);
+    method->refmaps = maps;
+    method->refmap_count = safepoints;
+}
+
+void compute_class_refmaps(class_file_t *class) {
+    for (method_t *method = class->methods; method->name != NULL; method++) {
+        compute_refmaps(method, class);
+    }
+}
+
+const refmap_t *find_refmap(const method_t *method, u4 insn) {
+    // The maps are sorted by instruction index
+    u4 low = 0;
+    u4 high = method->refmap_count;
+    while (low < high) {
+        u4 mid = low + (high - low) / 2;
+        if (method->refmaps[mid].insn < insn) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    if (low < method->refmap_count && method->refmaps[low].insn == insn) {
+        return &method->refmaps[low];
+    }
+    return NULL;
+}
@@ -0,0 +1,297 @@
+#include "scheduler.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/** The number of nanoseconds in a second */
+#define NS_PER_SECOND ((uint64_t) 1000 * 1000 * 1000)
+
+struct guest {
+    jvm_context_t *context;
+    class_file_t *class;
+    /** The method to run, or NULL to run main() */
+    char *name;
+    char *descriptor;
+    int32_t *args;
+    /** The most time the guest may run for, or 0 if it may run until it ends */
+    uint64_t time_budget_ns;
+    /** The time the guest has run for so far */
+    uint64_t run_time_ns;
+    /** Whether the run has started, so the next turn resumes it */
+    bool started;
+    /** Whether the run has ended, and `status` and `result` say how */
+    bool done;
+    jvm_status_t status;
+    int32_t result;
+    /** The next guest in the run queue */
+    struct guest *next;
+};
+
+/** A worker thread, and the guest it is running */
+typedef struct {
+    pthread_t thread;
+    scheduler_t *scheduler;
+    /** The guest the worker is running, or NULL; the ticker preempts it */
+    guest_t *running;
+    /** When the running guest's turn is over */
+    uint64_t slice_end_ns;
+} worker_t;
+
+struct scheduler {
+    /** Guards everything but the threads */
+    pthread_mutex_t lock;
+    /** Signaled when a guest is queued or the scheduler shuts down */
+    pthread_cond_t runnable;
+    /** Signaled when a guest ends */
+    pthread_cond_t done;
+    /** Signaled when a turn starts or the scheduler shuts down, to wake the ticker */
+    pthread_cond_t ticker_wake;
+    /** The run queue, oldest first */
+    guest_t *head;
+    guest_t *tail;
+    /** The number of guests spawned and not yet joined */
+    size_t guests;
+    bool shutting_down;
+    uint64_t time_slice_ns;
+    worker_t *workers;
+    u4 worker_count;
+    pthread_t ticker;
+};
+
+/**
+ * @brief Reads the monotonic clock, which the condition variables also use.
+ */
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * NS_PER_SECOND + (uint64_t) time.tv_nsec;
+}
+
+/**
+ * @brief Adds a guest at the tail of the run queue. The lock must be held.
+ */
+static void enqueue(scheduler_t *scheduler, guest_t *guest) {
+    guest->next = NULL;
+    if (scheduler->tail != NULL) {
+        scheduler->tail->next = guest;
+    }
+    else {
+        scheduler->head = guest;
+    }
+    scheduler->tail = guest;
+    pthread_cond_signal(&scheduler->runnable);
+}
+
+/**
+ * @brief Runs a guest for one turn, from where its last turn stopped.
+ */
+static jvm_status_t run_turn(guest_t *guest) {
+    if (guest->started) {
+        return jvm_resume(guest->context, &guest->result);
+    }
+    guest->started = true;
+    if (guest->name == NULL) {
+        return jvm_run_main(guest->context, guest->class);
+    }
+    return jvm_invoke(guest->context, guest->class, guest->name, guest->descriptor,
+                      guest->args, &guest->result);
+}
+
+/**
+ * @brief Runs turns of the guests at the head of the run queue until the
+ * scheduler shuts down.
+ */
+static void *run_worker(void *arg) {
+    worker_t *worker = arg;
+    scheduler_t *scheduler = worker->scheduler;
+    pthread_mutex_lock(&scheduler->lock);
+    while (true) {
+        while (scheduler->head == NULL && !scheduler->shutting_down) {
+            pthread_cond_wait(&scheduler->runnable, &scheduler->lock);
+        }
+        if (scheduler->head == NULL) {
+            break;
+        }
+        guest_t *guest = scheduler->head;
+        scheduler->head = guest->next;
+        if (scheduler->head == NULL) {
+            scheduler->tail = NULL;
+        }
+        // The turn is a slice long, or as long as the guest's budget has left
+        uint64_t turn_ns = scheduler->time_slice_ns;
+        if (guest->time_budget_ns > 0 &&
+            guest->time_budget_ns - guest->run_time_ns < turn_ns) {
+            turn_ns = guest->time_budget_ns - guest->run_time_ns;
+        }
+        uint64_t start = now_ns();
+        worker->running = guest;
+        worker->slice_end_ns = start + turn_ns;
+        pthread_cond_signal(&scheduler->ticker_wake);
+        pthread_mutex_unlock(&scheduler->lock);
+
+        // Only this worker touches the guest until it is queued again or done
+        jvm_status_t status = run_turn(guest);
+        guest->run_time_ns += now_ns() - start;
+        bool over_budget =
+            guest->time_budget_ns > 0 && guest->run_time_ns >= guest->time_budget_ns;
+        if (status == JVM_STOPPED && over_budget) {
+            jvm_context_reset(guest->context);
+        }
+
+        pthread_mutex_lock(&scheduler->lock);
+        // The ticker only preempts running guests, so it leaves this one alone from here on,
+        // but it may have preempted the turn after it ended, which would stop the next run
+        worker->running = NULL;
+        jvm_context_cancel_preempt(guest->context);
+        if (status == JVM_STOPPED && !over_budget) {
+            enqueue(scheduler, guest);
+        }
+        else {
+            guest->status = status;
+            guest->done = true;
+            pthread_cond_broadcast(&scheduler->done);
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return NULL;
+}
+
+/**
+ * @brief Preempts each running guest whose turn is over, sleeping until the
+ * next turn ends in between.
+ */
+static void *run_ticker(void *arg) {
+    scheduler_t *scheduler = arg;
+    pthread_mutex_lock(&scheduler->lock);
+    while (!scheduler->shutting_down) {
+        uint64_t now = now_ns();
+        uint64_t wake = UINT64_MAX;
+        for (u4 i = 0; i < scheduler->worker_count; i++) {
+            worker_t *worker = &scheduler->workers[i];
+            if (worker->running == NULL) {
+                continue;
+            }
+            if (worker->slice_end_ns <= now) {
+                jvm_context_preempt(worker->running->context);
+                // If the guest doesn't stop before then, preempt it again a slice later
+                worker->slice_end_ns = now + scheduler->time_slice_ns;
+            }
+            if (worker->slice_end_ns < wake) {
+                wake = worker->slice_end_ns;
+            }
+        }
+        if (wake == UINT64_MAX) {
+            // Nothing is running, so wait for a turn to start
+            pthread_cond_wait(&scheduler->ticker_wake, &scheduler->lock);
+        }
+        else {
+            struct timespec deadline = {
+                .tv_sec = (time_t) (wake / NS_PER_SECOND),
+                .tv_nsec = (long) (wake % NS_PER_SECOND),
+            };
+            pthread_cond_timedwait(&scheduler->ticker_wake, &scheduler->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return NULL;
+}
+
+scheduler_t *scheduler_create(u4 workers, uint64_t time_slice_ns) {
+    assert(workers > 0 && time_slice_ns > 0 && "Invalid scheduler options");
+    scheduler_t *scheduler = calloc(1, sizeof(*scheduler));
+    assert(scheduler != NULL && "Failed to allocate scheduler");
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->runnable, NULL);
+    pthread_cond_init(&scheduler->done, NULL);
+    // The ticker's deadlines are on the monotonic clock
+    pthread_condattr_t monotonic;
+    pthread_condattr_init(&monotonic);
+    pthread_condattr_setclock(&monotonic, CLOCK_MONOTONIC);
+    pthread_cond_init(&scheduler->ticker_wake, &monotonic);
+    pthread_condattr_destroy(&monotonic);
+    scheduler->time_slice_ns = time_slice_ns;
+    scheduler->worker_count = workers;
+    scheduler->workers = calloc(workers, sizeof(*scheduler->workers));
+    assert(scheduler->workers != NULL && "Failed to allocate workers");
+    for (u4 i = 0; i < workers; i++) {
+        scheduler->workers[i].scheduler = scheduler;
+        int error = pthread_create(&scheduler->workers[i].thread, NULL, run_worker,
+                                   &scheduler->workers[i]);
+        assert(error == 0 && "Failed to start worker thread");
+    }
+    int error = pthread_create(&scheduler->ticker, NULL, run_ticker, scheduler);
+    assert(error == 0 && "Failed to start ticker thread");
+    return scheduler;
+}
+
+guest_t *scheduler_spawn(scheduler_t *scheduler, jvm_context_t *context, class_file_t *class,
+                         const char *name, const char *descriptor, const int32_t *args,
+                         uint64_t time_budget_ns) {
+    guest_t *guest = calloc(1, sizeof(*guest));
+    assert(guest != NULL && "Failed to allocate guest");
+    guest->context = context;
+    guest->class = class;
+    guest->time_budget_ns = time_budget_ns;
+    if (name != NULL) {
+        // One int per 'I' between the parentheses; jvm_invoke() rejects other parameters
+        size_t params = strspn(descriptor + 1, "I");
+        guest->name = strdup(name);
+        guest->descriptor = strdup(descriptor);
+        guest->args = calloc(params > 0 ? params : 1, sizeof(int32_t));
+        assert(guest->name != NULL && guest->descriptor != NULL && guest->args != NULL &&
+               "Failed to allocate guest");
+        if (params > 0) {
+            memcpy(guest->args, args, sizeof(int32_t[params]));
+        }
+    }
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->guests++;
+    enqueue(scheduler, guest);
+    pthread_mutex_unlock(&scheduler->lock);
+    return guest;
+}
+
+jvm_status_t scheduler_join(scheduler_t *scheduler, guest_t *guest, int32_t *result,
+                            uint64_t *run_time_ns) {
+    pthread_mutex_lock(&scheduler->lock);
+    while (!guest->done) {
+        pthread_cond_wait(&scheduler->done, &scheduler->lock);
+    }
+    scheduler->guests--;
+    pthread_mutex_unlock(&scheduler->lock);
+    jvm_status_t status = guest->status;
+    if (status == JVM_OK && result != NULL) {
+        *result = guest->result;
+    }
+    if (run_time_ns != NULL) {
+        *run_time_ns = guest->run_time_ns;
+    }
+    free(guest->name);
+    free(guest->descriptor);
+    free(guest->args);
+    free(guest);
+    return status;
+}
+
+void scheduler_free(scheduler_t *scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    assert(scheduler->guests == 0 && "Scheduler has guests that weren't joined");
+    scheduler->shutting_down = true;
+    pthread_cond_broadcast(&scheduler->runnable);
+    pthread_cond_signal(&scheduler->ticker_wake);
+    pthread_mutex_unlock(&scheduler->lock);
+    for (u4 i = 0; i < scheduler->worker_count; i++) {
+        pthread_join(scheduler->workers[i].thread, NULL);
+    }
+    pthread_join(scheduler->ticker, NULL);
+    pthread_cond_destroy(&scheduler->ticker_wake);
+    pthread_cond_destroy(&scheduler->done);
+    pthread_cond_destroy(&scheduler->runnable);
+    pthread_mutex_destroy(&scheduler->lock);
+    free(scheduler->workers);
+    free(scheduler);
+}
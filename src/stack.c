@@ -0,0 +1,137 @@
+#include "stack.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "class_state.h"
+#include "decode.h"
+#include "exception.h"
+#include "output.h"
+#include "refmap.h"
+
+/** The number of frame records allocated up front */
+const size_t INITIAL_FRAMES = 64;
+/** The number of innermost frames a stack overflow trace shows */
+const size_t TRACE_FRAMES = 16;
+
+/**
+ * @brief Reserves a VM stack.
+ *
+ * The slots are mapped with MAP_NORESERVE, so only the pages that frames
+ * actually reach take up memory.
+ *
+ * @param slots The maximum number of slots the stack can hold.
+ * @param max_depth The maximum number of frames that can be active at once.
+ * @return A pointer to the initialized stack.
+ */
+vm_stack_t *vm_stack_init(size_t slots, size_t max_depth) {
+    vm_stack_t *stack = malloc(sizeof(*stack));
+    assert(stack != NULL && "Failed to allocate VM stack");
+    void *area = mmap(NULL, slots * sizeof(int32_t), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(area != MAP_FAILED && "Failed to reserve VM stack");
+    stack->base = area;
+    stack->limit = stack->base + slots;
+
+    stack->capacity = max_depth < INITIAL_FRAMES ? max_depth : INITIAL_FRAMES;
+    // No frame is waiting for a memoized call until one makes it
+    stack->frames = calloc(stack->capacity, sizeof(frame_t));
+    assert(stack->frames != NULL && "Failed to allocate frame records");
+    stack->depth = 0;
+    stack->max_depth = max_depth;
+    atomic_init(&stack->preempt, false);
+    stack->suspension = (vm_suspension_t){.stopped = false};
+    return stack;
+}
+
+/**
+ * @brief Makes room for another frame record, doubling the record array if needed.
+ *
+ * @param stack A pointer to the VM stack.
+ * @return Whether another frame fits within the maximum call depth.
+ */
+bool vm_stack_reserve_frame(vm_stack_t *stack) {
+    if (stack->depth < stack->capacity) {
+        return true;
+    }
+    if (stack->capacity >= stack->max_depth) {
+        return false;
+    }
+    size_t capacity = stack->capacity * 2;
+    if (capacity > stack->max_depth) {
+        capacity = stack->max_depth;
+    }
+    stack->frames = realloc(stack->frames, sizeof(frame_t[capacity]));
+    assert(stack->frames != NULL && "Failed to grow frame records");
+    memset(&stack->frames[stack->capacity], 0, sizeof(frame_t[capacity - stack->capacity]));
+    stack->capacity = capacity;
+    return true;
+}
+
+/**
+ * @brief Reports a StackOverflowError and ends the program.
+ *
+ * Like the JVM, this prints the innermost frames of the stack to stderr.
+ *
+ * @param stack A pointer to the overflowed VM stack.
+ */
+void vm_stack_overflow(const vm_stack_t *stack) {
+    output_flush();
+    fprintf(stderr, "Exception in thread \"main\" java.lang.StackOverflowError\n");
+    size_t shown = 0;
+    for (size_t i = stack->depth; i > 0 && shown < TRACE_FRAMES; i--, shown++) {
+        fprintf(stderr, "\tat %s%s\n", stack->frames[i - 1].method->name,
+                stack->frames[i - 1].method->descriptor);
+    }
+    if (stack->depth > shown) {
+        fprintf(stderr, "\t... %zu more\n", stack->depth - shown);
+    }
+    exception_exit();
+}
+
+void vm_stack_reset(vm_stack_t *stack) {
+    // A frame that was waiting for a memoized call would complete its entry on a later return
+    for (size_t i = 0; i < stack->depth; i++) {
+        stack->frames[i].memo = NULL;
+    }
+    stack->depth = 0;
+    stack->suspension.stopped = false;
+}
+
+/**
+ * @brief Marks the references held by the active frames.
+ *
+ * @param context A pointer to the VM stack.
+ * @param heap A pointer to the heap being collected.
+ */
+void vm_stack_scan_roots(void *context, heap_t *heap) {
+    vm_stack_t *stack = context;
+    for (size_t i = 0; i < stack->depth; i++) {
+        const frame_t *frame = &stack->frames[i];
+        u4 safepoint = frame->return_ip - 1 - frame->state->insns;
+        const refmap_t *map = find_refmap(frame->method, safepoint);
+        assert(map != NULL && "Frame is not stopped at a safepoint");
+        u4 max_locals = frame->method->code.max_locals;
+        const int32_t *operand_stack = frame->locals + max_locals + FRAME_GAP_SLOTS;
+        for (u4 slot = 0; slot < map->slots; slot++) {
+            if (refmap_is_ref(map, slot)) {
+                heap_mark(heap, slot < max_locals ? frame->locals[slot]
+                                                  : operand_stack[slot - max_locals]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Releases a VM stack, its slots and its frame records.
+ *
+ * @param stack A pointer to the stack to free.
+ */
+void vm_stack_free(vm_stack_t *stack) {
+    munmap(stack->base, (stack->limit - stack->base) * sizeof(int32_t));
+    free(stack->frames);
+    free(stack);
+}
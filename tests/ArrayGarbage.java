@@ -0,0 +1,37 @@
+/**
+ * Allocates arrays adding up to more than the heap limit, while one array stays
+ * reachable from a local of main() and a new one from its operand stack during
+ * the next call. The program only finishes if garbage is collected, and only
+ * prints the right sums if every root was found.
+ */
+public class ArrayGarbage {
+    /** Makes an array of `size` copies of `value` */
+    static int[] filled(int size, int value) {
+        int[] array = new int[size];
+        for (int i = 0; i < size; i++) {
+            array[i] = value;
+        }
+        return array;
+    }
+
+    /** Adds `a`'s first element to the sum of `b`'s elements */
+    static int combine(int[] a, int[] b) {
+        int sum = a[0];
+        for (int i = 0; i < b.length; i++) {
+            sum += b[i];
+        }
+        return sum;
+    }
+
+    public static void main(String[] args) {
+        int[] kept = filled(1000, 3);
+        int total = 0;
+        for (int i = 0; i < 300000; i++) {
+            // The first array is on the stack while the second is allocated
+            total += combine(filled(8, i), filled(256, 1));
+            total += kept[i % 1000];
+        }
+        System.out.println(total);
+        System.out.println(combine(kept, kept));
+    }
+}
@@ -0,0 +1,17 @@
+/**
+ * Sums an array in a loop that is hot enough to be compiled before it reads one element
+ * past the end, so the compiled code's bounds check throws the exception.
+ */
+public class ArrayIndexCompiled {
+    public static void main(String[] args) {
+        int[] ones = new int[20000];
+        for (int i = 0; i < ones.length; i++) {
+            ones[i] = 1;
+        }
+        int sum = 0;
+        for (int i = 0; i <= ones.length; i++) {
+            sum += ones[i];
+        }
+        System.out.println(sum);
+    }
+}
@@ -0,0 +1,10 @@
+/**
+ * Reads the first element of an empty array, which has no valid index at all.
+ */
+public class ArrayIndexEmpty {
+    public static void main(String[] args) {
+        int[] empty = new int[0];
+        System.out.println(empty.length);
+        System.out.println(empty[0]);
+    }
+}
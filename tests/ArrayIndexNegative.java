@@ -0,0 +1,13 @@
+/**
+ * Reads an array at a negative index, which throws an ArrayIndexOutOfBoundsException
+ * that reports the index and the array's length.
+ */
+public class ArrayIndexNegative {
+    public static void main(String[] args) {
+        int[] array = new int[5];
+        array[4] = 7;
+        System.out.println(array[4]);
+        int index = -1;
+        System.out.println(array[index]);
+    }
+}
@@ -0,0 +1,13 @@
+/**
+ * Writes one element past the end of an array, in a loop whose bound is off by one,
+ * which throws an ArrayIndexOutOfBoundsException at the array's length.
+ */
+public class ArrayIndexPastEnd {
+    public static void main(String[] args) {
+        int[] squares = new int[10];
+        for (int i = 0; i <= squares.length; i++) {
+            squares[i] = i * i;
+            System.out.println(squares[i]);
+        }
+    }
+}
@@ -0,0 +1,19 @@
+/**
+ * Allocates 200,000 short-lived arrays, in phases of growing sizes, under
+ * compressed references and an 8 MiB heap. Each phase's sizes need a bigger
+ * size class than the last one's, so the blocks the previous phases freed only
+ * fit its arrays once the collector has merged them.
+ */
+public class CompressedChurn {
+    public static void main(String[] args) {
+        int total = 0;
+        for (int size = 20; size <= 160; size *= 2) {
+            for (int i = 0; i < 50000; i++) {
+                int[] array = new int[size];
+                array[i % size] = i;
+                total += array[i % size];
+            }
+            System.out.println(total);
+        }
+    }
+}
@@ -0,0 +1,15 @@
+/**
+ * Copies an array into a shorter one, in a loop that starts past the end of the shorter
+ * one, which the optimizer turns into the copy kernel.
+ */
+public class CopyStartPastEnd {
+    public static void main(String[] args) {
+        int[] from = new int[8];
+        int[] to = new int[5];
+        System.out.println(to.length);
+        for (int i = 6; i < 8; i++) {
+            to[i] = from[i];
+        }
+        System.out.println(to[0]);
+    }
+}
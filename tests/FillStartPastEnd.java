@@ -0,0 +1,14 @@
+/**
+ * Fills an array in a loop that starts past its end, which the optimizer turns into
+ * the fill kernel, so the exception has to report the loop's first index.
+ */
+public class FillStartPastEnd {
+    public static void main(String[] args) {
+        int[] threes = new int[5];
+        System.out.println(threes.length);
+        for (int i = 7; i < 10; i++) {
+            threes[i] = 3;
+        }
+        System.out.println(threes[0]);
+    }
+}
@@ -0,0 +1,18 @@
+/**
+ * Looks for the first element two arrays differ at, in a loop that starts past their
+ * ends, which the optimizer turns into the mismatch kernel.
+ */
+public class MismatchStartPastEnd {
+    public static void main(String[] args) {
+        int[] a = new int[5];
+        int[] b = new int[5];
+        System.out.println(a.length);
+        int i;
+        for (i = 6; i < 8; i++) {
+            if (a[i] != b[i]) {
+                break;
+            }
+        }
+        System.out.println(i);
+    }
+}
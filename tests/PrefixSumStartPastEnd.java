@@ -0,0 +1,16 @@
+/**
+ * Replaces an array's elements with their running sum in a loop that starts past its
+ * end, which the optimizer turns into the prefix sum kernel.
+ */
+public class PrefixSumStartPastEnd {
+    public static void main(String[] args) {
+        int[] sums = new int[5];
+        System.out.println(sums.length);
+        int sum = 0;
+        for (int i = 6; i < 9; i++) {
+            sum += sums[i];
+            sums[i] = sum;
+        }
+        System.out.println(sum);
+    }
+}
@@ -0,0 +1,25 @@
+/**
+ * Loops forever without calling anything, so a run of spin() only stops if the
+ * loop itself polls for preemptions, compiled or not. count() loops a given
+ * number of times, so a run of it ends after about as long as it is asked to.
+ */
+public class Spin {
+    static int count(int n) {
+        int total = 0;
+        for (int i = 0; i < n; i++) {
+            total += i;
+        }
+        return total;
+    }
+
+    static int spin(int step) {
+        int total = 0;
+        while (true) {
+            total += step;
+        }
+    }
+
+    public static void main(String[] args) {
+        System.out.println(spin(1));
+    }
+}
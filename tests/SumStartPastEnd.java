@@ -0,0 +1,15 @@
+/**
+ * Sums an array in a loop that starts past its end, which the optimizer turns into the
+ * sum kernel.
+ */
+public class SumStartPastEnd {
+    public static void main(String[] args) {
+        int[] zeros = new int[5];
+        System.out.println(zeros.length);
+        int sum = 0;
+        for (int i = 9; i < 12; i++) {
+            sum += zeros[i];
+        }
+        System.out.println(sum);
+    }
+}
@@ -0,0 +1,94 @@
+/**
+ * Switches on the keys at the edges of their cases and of the int range, where a
+ * tableswitch's index wraps around and a lookupswitch's search ends, in methods that are
+ * called often enough to be compiled.
+ */
+public class SwitchEdgeKeys {
+    /** A tableswitch from -1 to 3 */
+    static int small(int key) {
+        switch (key) {
+            case -1:
+                return 10;
+            case 0:
+                return 11;
+            case 1:
+                return 12;
+            case 2:
+                return 13;
+            case 3:
+                return 14;
+            default:
+                return 0;
+        }
+    }
+
+    /** A tableswitch whose cases end at the largest int */
+    static int top(int key) {
+        switch (key) {
+            case Integer.MAX_VALUE - 2:
+                return 20;
+            case Integer.MAX_VALUE - 1:
+                return 21;
+            case Integer.MAX_VALUE:
+                return 22;
+            default:
+                return 0;
+        }
+    }
+
+    /** A tableswitch whose cases start at the smallest int */
+    static int bottom(int key) {
+        switch (key) {
+            case Integer.MIN_VALUE:
+                return 30;
+            case Integer.MIN_VALUE + 1:
+                return 31;
+            case Integer.MIN_VALUE + 2:
+                return 32;
+            default:
+                return 0;
+        }
+    }
+
+    /** A lookupswitch with both ends of the int range among its keys */
+    static int sparse(int key) {
+        switch (key) {
+            case Integer.MIN_VALUE:
+                return 40;
+            case -1000:
+                return 41;
+            case 0:
+                return 42;
+            case 7:
+                return 43;
+            case 1000:
+                return 44;
+            case Integer.MAX_VALUE:
+                return 45;
+            default:
+                return 0;
+        }
+    }
+
+    public static void main(String[] args) {
+        int[] keys = {
+            Integer.MIN_VALUE, Integer.MIN_VALUE + 1, Integer.MIN_VALUE + 2,
+            Integer.MIN_VALUE + 3, -1001, -1000, -999, -2, -1, 0, 1, 3, 4, 6, 7, 8, 999,
+            1000, 1001, Integer.MAX_VALUE - 3, Integer.MAX_VALUE - 2, Integer.MAX_VALUE - 1,
+            Integer.MAX_VALUE
+        };
+        for (int i = 0; i < keys.length; i++) {
+            System.out.println(small(keys[i]));
+            System.out.println(top(keys[i]));
+            System.out.println(bottom(keys[i]));
+            System.out.println(sparse(keys[i]));
+        }
+        int total = 0;
+        for (int round = 0; round < 100; round++) {
+            for (int i = 0; i < keys.length; i++) {
+                total += small(keys[i]) + top(keys[i]) + bottom(keys[i]) + sparse(keys[i]);
+            }
+        }
+        System.out.println(total);
+    }
+}
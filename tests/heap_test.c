@@ -0,0 +1,81 @@
+#include "exception.h"
+#include "heap.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+/** The limit the tests run the heap under, which gives it a 32 KiB nursery */
+#define LIMIT ((size_t) 64 << 10)
+/** How many arrays are promoted before the nursery is filled again */
+#define OLD_ARRAYS 1000
+/** How many arrays are in the nursery when it is collected */
+#define YOUNG_ARRAYS 1200
+
+static int32_t roots[OLD_ARRAYS + YOUNG_ARRAYS];
+static size_t root_count;
+
+static void scan_roots(void *context, heap_t *heap) {
+    (void) context;
+    for (size_t i = 0; i < root_count; i++) {
+        heap_mark(heap, roots[i]);
+    }
+}
+
+/**
+ * Promotes OLD_ARRAYS arrays of 4 ints, keeping them live if `keep_old`,
+ * then fills the nursery with YOUNG_ARRAYS live ones and collects it.
+ * Each array takes 24 bytes in the nursery but 32 in the old space, so
+ * promoting them all would go past the limit.
+ */
+static void fill_heap(heap_t *heap, bool keep_old) {
+    heap_set_limit(heap, LIMIT);
+    heap_set_root_scanner(heap, scan_roots, NULL);
+    root_count = 0;
+    for (size_t i = 0; i < OLD_ARRAYS; i++) {
+        roots[root_count++] = heap_new_array(heap, 4);
+    }
+    heap_collect_minor(heap);
+    if (!keep_old) {
+        root_count = 0;
+    }
+    for (size_t i = 0; i < YOUNG_ARRAYS; i++) {
+        roots[root_count++] = heap_new_array(heap, 4);
+    }
+    heap_collect_minor(heap);
+}
+
+/** Promotion that needs the old space's garbage gone runs a major collection first */
+static void test_promotion_collects_old_space(void) {
+    heap_t *heap = heap_init();
+    fill_heap(heap, false);
+    heap_stats_t stats = heap_get_stats(heap);
+    assert(stats.peak_bytes <= LIMIT && "Promotion went past the heap limit");
+    assert(stats.collections == 1 && "Promotion didn't fall back to a major collection");
+    assert(stats.arrays_promoted == OLD_ARRAYS + YOUNG_ARRAYS && "Survivors weren't promoted");
+    assert(stats.used_bytes == YOUNG_ARRAYS * 32 && "Old garbage wasn't freed");
+    heap_free(heap);
+}
+
+/** Promotion that doesn't fit even after a major collection runs out of memory */
+static void test_promotion_out_of_memory(void) {
+    heap_t *heap = heap_init();
+    jmp_buf target;
+    jmp_buf *previous = exception_set_target(&target);
+    static volatile bool thrown;
+    thrown = false;
+    if (setjmp(target) == 0) {
+        fill_heap(heap, true);
+    }
+    else {
+        thrown = true;
+    }
+    exception_set_target(previous);
+    heap_free(heap);
+    assert(thrown && "Promotion past the heap limit didn't throw OutOfMemoryError");
+}
+
+int main(void) {
+    test_promotion_collects_old_space();
+    test_promotion_out_of_memory();
+    return 0;
+}
@@ -0,0 +1,140 @@
+#include "minijvm.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decode.h"
+
+/** A class with a hot loop over arrays, which the JIT compiles while main() runs */
+#define CLASS "tests/CompressedChurn.class"
+/** What it prints */
+#define OUTPUT "1249975000\n-1795017296\n-545042296\n704932704\n"
+
+/**
+ * Runs a class's main() in a new context, resuming it until it returns.
+ *
+ * @param preempt whether to preempt the run before it starts
+ * @param stops set to how many times the run stopped
+ * @param output set to what it printed
+ */
+static void run_main(class_file_t *class, bool compressed_refs, bool preempt, int *stops,
+                     char *output, size_t output_size) {
+    FILE *file = tmpfile();
+    assert(file != NULL && "Failed to create the output file");
+    jvm_context_options_t options = jvm_default_context_options();
+    options.compressed_refs = compressed_refs;
+    options.output_fd = fileno(file);
+    jvm_context_t *context = jvm_context_create(&options);
+    assert(context != NULL && "Failed to create context");
+    if (preempt) {
+        jvm_context_preempt(context);
+    }
+    *stops = 0;
+    jvm_status_t status = jvm_run_main(context, class);
+    for (; status == JVM_STOPPED; status = jvm_resume(context, NULL)) {
+        ++*stops;
+    }
+    assert(status == JVM_OK && "main() didn't return");
+    jvm_context_free(context);
+
+    rewind(file);
+    size_t length = fread(output, 1, output_size - 1, file);
+    output[length] = '\0';
+    fclose(file);
+}
+
+/** Compiled code runs in contexts with either encoding of references, one after the other */
+static void test_jit_encodings(void) {
+    jvm_class_options_t options = jvm_default_class_options();
+    options.jit_calls = 1;
+    options.jit_backedges = 1;
+    class_file_t *class = jvm_load_class(CLASS, &options);
+    assert(class != NULL && "Failed to load class");
+    char output[256];
+    int stops;
+    for (int i = 0; i < 4; i++) {
+        run_main(class, i % 2 == 0, false, &stops, output, sizeof(output));
+        assert(strcmp(output, OUTPUT) == 0 && "Compiled code ran with the wrong references");
+    }
+    jvm_free_class(class);
+}
+
+/** A thread of test_shared_class(), which runs main() in each encoding of references */
+static void *run_shared(void *class) {
+    char output[256];
+    int stops;
+    for (int i = 0; i < 4; i++) {
+        run_main(class, i % 2 == 0, false, &stops, output, sizeof(output));
+        assert(strcmp(output, OUTPUT) == 0 && "A shared class printed the wrong output");
+    }
+    return NULL;
+}
+
+/**
+ * A class with the JIT and memoization is never written to as it runs, so
+ * threads can run it at once, each compiling it in contexts of its own
+ */
+static void test_shared_class(void) {
+    jvm_class_options_t options = jvm_default_class_options();
+    options.jit_calls = 1;
+    options.jit_backedges = 1;
+    options.memo_entries = 64;
+    class_file_t *class = jvm_load_class(CLASS, &options);
+    assert(class != NULL && "Failed to load class");
+    size_t method_count = 0;
+    while (class->methods[method_count].name != NULL) {
+        method_count++;
+    }
+    insn_t **before = malloc(sizeof(insn_t *[method_count]));
+    assert(before != NULL && "Failed to allocate copies");
+    for (size_t i = 0; i < method_count; i++) {
+        const method_t *method = &class->methods[i];
+        before[i] = malloc(sizeof(insn_t[method->insn_count + 1]));
+        assert(before[i] != NULL && "Failed to allocate copies");
+        memcpy(before[i], method->insns, sizeof(insn_t[method->insn_count]));
+    }
+
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++) {
+        int error = pthread_create(&threads[i], NULL, run_shared, class);
+        assert(error == 0 && "Failed to start thread");
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (size_t i = 0; i < method_count; i++) {
+        const method_t *method = &class->methods[i];
+        assert(memcmp(before[i], method->insns, sizeof(insn_t[method->insn_count])) == 0 &&
+               "Running the class changed its instructions");
+        free(before[i]);
+    }
+    free(before);
+    jvm_free_class(class);
+}
+
+/** A preemption that comes before a run starts stops it, and isn't lost */
+static void test_early_preemption(void) {
+    jvm_class_options_t options = jvm_default_class_options();
+    options.jit = false;
+    class_file_t *class = jvm_load_class(CLASS, &options);
+    assert(class != NULL && "Failed to load class");
+    char output[256];
+    int stops;
+    run_main(class, false, true, &stops, output, sizeof(output));
+    assert(stops == 1 && "A preemption before the run didn't stop it");
+    assert(strcmp(output, OUTPUT) == 0 && "The resumed run printed the wrong output");
+    run_main(class, false, false, &stops, output, sizeof(output));
+    assert(stops == 0 && "A preemption carried over to the next run");
+    jvm_free_class(class);
+}
+
+int main(void) {
+    jvm_init(true);
+    test_jit_encodings();
+    test_shared_class();
+    test_early_preemption();
+    return 0;
+}
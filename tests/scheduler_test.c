@@ -0,0 +1,103 @@
+#include "scheduler.h"
+
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+/** A class whose spin(I)I loops forever without calling anything, and whose count(I)I
+    loops as many times as it is told */
+#define CLASS "tests/Spin.class"
+/** The time budget of each guest (20 ms) */
+#define BUDGET_NS ((uint64_t) 20 * 1000 * 1000)
+/** How far past its budget a guest may run before the test fails (1 s) */
+#define LATENESS_NS ((uint64_t) 1000 * 1000 * 1000)
+/** The time slice of the guests that end around when their turns do (20 us) */
+#define SLICE_NS ((uint64_t) 20 * 1000)
+/** How many of them run: a guest ends within a few instructions of being preempted only
+    now and then, so it takes thousands of them for the test to catch that most runs */
+#define NEAR_SLICE_GUESTS 20000
+
+/**
+ * Reads the monotonic clock.
+ */
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000 + (uint64_t) time.tv_nsec;
+}
+
+/**
+ * Runs spin() as a guest with a time budget, and checks that the budget stops
+ * it on time.
+ */
+static void run_spin(bool jit) {
+    jvm_class_options_t class_options = jvm_default_class_options();
+    class_options.jit = jit;
+    class_options.jit_calls = 1;
+    class_options.jit_backedges = 1;
+    class_file_t *class = jvm_load_class(CLASS, &class_options);
+    assert(class != NULL && "Failed to load class");
+    jvm_context_options_t options = jvm_default_context_options();
+    jvm_context_t *context = jvm_context_create(&options);
+    assert(context != NULL && "Failed to create context");
+
+    scheduler_t *scheduler = scheduler_create(1, BUDGET_NS / 4);
+    int32_t step = 1;
+    guest_t *guest =
+        scheduler_spawn(scheduler, context, class, "spin", "(I)I", &step, BUDGET_NS);
+    uint64_t run_time_ns;
+    jvm_status_t status = scheduler_join(scheduler, guest, NULL, &run_time_ns);
+    assert(status == JVM_STOPPED && "The loop ended before its budget did");
+    assert(run_time_ns < BUDGET_NS + LATENESS_NS && "The loop ran long past its budget");
+    scheduler_free(scheduler);
+    jvm_context_free(context);
+    jvm_free_class(class);
+}
+
+/**
+ * Runs guests of count() that take about a time slice, so some end just as the
+ * ticker preempts them, and checks that the next run in the same context still
+ * runs to the end.
+ */
+static void run_count_near_slice_end(void) {
+    jvm_class_options_t class_options = jvm_default_class_options();
+    class_file_t *class = jvm_load_class(CLASS, &class_options);
+    assert(class != NULL && "Failed to load class");
+    jvm_context_options_t options = jvm_default_context_options();
+    jvm_context_t *context = jvm_context_create(&options);
+    assert(context != NULL && "Failed to create context");
+
+    // Time a long run to find how many iterations take about a slice
+    int32_t calibration = 1 << 22;
+    uint64_t start = now_ns();
+    jvm_status_t status = jvm_invoke(context, class, "count", "(I)I", &calibration, NULL);
+    assert(status == JVM_OK && "Failed to run count()");
+    uint64_t elapsed = now_ns() - start;
+    int32_t slice = (int32_t) ((uint64_t) calibration * SLICE_NS / (elapsed > 0 ? elapsed : 1));
+
+    scheduler_t *scheduler = scheduler_create(1, SLICE_NS);
+    for (int32_t i = 0; i < NEAR_SLICE_GUESTS; i++) {
+        // From 0.8 to 1.2 slices long
+        int32_t count = slice / 10 * (8 + i % 5) + 1;
+        guest_t *guest = scheduler_spawn(scheduler, context, class, "count", "(I)I", &count, 0);
+        status = scheduler_join(scheduler, guest, NULL, NULL);
+        assert(status == JVM_OK && "A guest without a budget didn't run to the end");
+        int32_t one = 1;
+        status = jvm_invoke(context, class, "count", "(I)I", &one, NULL);
+        assert(status == JVM_OK && "A preemption of an ended guest stopped the next run");
+    }
+    scheduler_free(scheduler);
+    jvm_context_free(context);
+    jvm_free_class(class);
+}
+
+int main(void) {
+    jvm_init(true);
+    // A loop that never stops fails the test instead of hanging it
+    alarm(10);
+    run_spin(false);
+    // With every backward branch hot, spin() runs compiled almost from the start
+    run_spin(true);
+    run_count_near_slice_end();
+    return 0;
+}